@@ -75,11 +75,19 @@ uint32_t mount_compress_force = 0;
 uint32_t mount_compress_type = 0;
 uint32_t mount_zlib_level = 3;
 uint32_t mount_zstd_level = 3;
+uint32_t mount_zstd_adaptive = 0;
+uint32_t mount_zstd_min_level = 1;
+uint32_t mount_zstd_max_level = 9;
 uint32_t mount_flush_interval = 30;
+uint32_t mount_flush_fcb_threshold = 16384;
+uint32_t mount_flush_tree_threshold = 256;
+uint32_t mount_flush_extent_threshold = 65536;
+uint32_t mount_fcb_cache_size = 4096;
 uint32_t mount_max_inline = 2048;
 uint32_t mount_skip_balance = 0;
 uint32_t mount_no_barrier = 0;
 uint32_t mount_no_trim = 0;
+uint32_t mount_discard = DISCARD_MODE_SYNC;
 uint32_t mount_clear_cache = 0;
 uint32_t mount_allow_degraded = 0;
 uint32_t mount_readonly = 0;
@@ -110,6 +118,8 @@ KEVENT mountmgr_thread_event;
 bool shutting_down = false;
 ERESOURCE boot_lock;
 bool is_windows_8;
+PKEVENT low_memory_event = NULL;
+HANDLE low_memory_handle = NULL;
 extern uint64_t boot_subvol;
 
 #ifdef _DEBUG
@@ -340,21 +350,7 @@ static void __stdcall DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
     IoDeleteSymbolicLink(&dosdevice_nameW);
     IoDeleteDevice(DriverObject->DeviceObject);
 
-    while (!IsListEmpty(&uid_map_list)) {
-        LIST_ENTRY* le = RemoveHeadList(&uid_map_list);
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
-
-        ExFreePool(um->sid);
-
-        ExFreePool(um);
-    }
-
-    while (!IsListEmpty(&gid_map_list)) {
-        gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
-
-        ExFreePool(gm->sid);
-        ExFreePool(gm);
-    }
+    free_mapping_tables();
 
     // FIXME - free volumes and their devpaths
 
@@ -378,6 +374,9 @@ static void __stdcall DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
     if (registry_path.Buffer)
         ExFreePool(registry_path.Buffer);
 
+    if (low_memory_handle)
+        ZwClose(low_memory_handle);
+
 #ifdef _DEBUG
     ExDeleteResourceLite(&log_lock);
 #endif
@@ -426,7 +425,7 @@ static bool get_last_inode(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock
 }
 
 _Success_(return)
-static bool extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ uint8_t** data, _Out_ uint16_t* datalen) {
+bool extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ uint8_t** data, _Out_ uint16_t* datalen) {
     DIR_ITEM* xa = (DIR_ITEM*)item;
     USHORT xasize;
 
@@ -602,6 +601,15 @@ static NTSTATUS __stdcall drv_flush_buffers(_In_ PDEVICE_OBJECT DeviceObject, _I
         }
 
         Status = Irp->IoStatus.Status;
+
+        // CcFlushCache will have left the data in memory for delayed allocation - get it onto the disk
+        if (NT_SUCCESS(Status)) {
+            Status = flush_fcb_delalloc(fcb, Irp);
+            if (!NT_SUCCESS(Status))
+                ERR("flush_fcb_delalloc returned %08lx\n", Status);
+
+            Irp->IoStatus.Status = Status;
+        }
     }
 
 end:
@@ -617,8 +625,8 @@ end:
     return Status;
 }
 
-static void calculate_total_space(_In_ device_extension* Vcb, _Out_ uint64_t* totalsize, _Out_ uint64_t* freespace) {
-    uint64_t nfactor, dfactor, sectors_used;
+void calculate_total_space(_In_ device_extension* Vcb, _Out_ uint64_t* totalsize, _Out_ uint64_t* freespace) {
+    uint64_t nfactor, dfactor, sectors_used, sectors_reserved;
 
     if (Vcb->data_flags & BLOCK_FLAG_DUPLICATE || Vcb->data_flags & BLOCK_FLAG_RAID1 || Vcb->data_flags & BLOCK_FLAG_RAID10) {
         nfactor = 1;
@@ -644,6 +652,10 @@ static void calculate_total_space(_In_ device_extension* Vcb, _Out_ uint64_t* to
 
     *totalsize = (Vcb->superblock.total_bytes >> Vcb->sector_shift) * nfactor / dfactor;
     *freespace = sectors_used > *totalsize ? 0 : (*totalsize - sectors_used);
+
+    // take off what delalloc.c has promised to writes which haven't been allocated yet
+    sectors_reserved = (uint64_t)Vcb->delalloc_bytes >> Vcb->sector_shift;
+    *freespace = sectors_reserved > *freespace ? 0 : (*freespace - sectors_reserved);
 }
 
 // simplified version of FsRtlAreNamesEqual, which can be a bottleneck!
@@ -806,193 +818,6 @@ static bool lie_about_fs_type() {
     return false;
 }
 
-// version of RtlUTF8ToUnicodeN for Vista and below
-NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len) {
-    NTSTATUS Status = STATUS_SUCCESS;
-    uint8_t* in = (uint8_t*)src;
-    uint16_t* out = (uint16_t*)dest;
-    ULONG needed = 0, left = dest_max / sizeof(uint16_t);
-
-    for (ULONG i = 0; i < src_len; i++) {
-        uint32_t cp;
-
-        if (!(in[i] & 0x80))
-            cp = in[i];
-        else if ((in[i] & 0xe0) == 0xc0) {
-            if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = ((in[i] & 0x1f) << 6) | (in[i+1] & 0x3f);
-                i++;
-            }
-        } else if ((in[i] & 0xf0) == 0xe0) {
-            if (i >= src_len - 2 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = ((in[i] & 0xf) << 12) | ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
-                i += 2;
-            }
-        } else if ((in[i] & 0xf8) == 0xf0) {
-            if (i >= src_len - 3 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80 || (in[i+3] & 0xc0) != 0x80) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = ((in[i] & 0x7) << 18) | ((in[i+1] & 0x3f) << 12) | ((in[i+2] & 0x3f) << 6) | (in[i+3] & 0x3f);
-                i += 3;
-            }
-        } else {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (cp > 0x10ffff) {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (dest) {
-            if (cp <= 0xffff) {
-                if (left < 1)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = (uint16_t)cp;
-                out++;
-
-                left--;
-            } else {
-                if (left < 2)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                cp -= 0x10000;
-
-                *out = 0xd800 | ((cp & 0xffc00) >> 10);
-                out++;
-
-                *out = 0xdc00 | (cp & 0x3ff);
-                out++;
-
-                left -= 2;
-            }
-        }
-
-        if (cp <= 0xffff)
-            needed += sizeof(uint16_t);
-        else
-            needed += 2 * sizeof(uint16_t);
-    }
-
-    if (dest_len)
-        *dest_len = needed;
-
-    return Status;
-}
-
-// version of RtlUnicodeToUTF8N for Vista and below
-NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len) {
-    NTSTATUS Status = STATUS_SUCCESS;
-    uint16_t* in = (uint16_t*)src;
-    uint8_t* out = (uint8_t*)dest;
-    ULONG in_len = src_len / sizeof(uint16_t);
-    ULONG needed = 0, left = dest_max;
-
-    for (ULONG i = 0; i < in_len; i++) {
-        uint32_t cp = *in;
-        in++;
-
-        if ((cp & 0xfc00) == 0xd800) {
-            if (i == in_len - 1 || (*in & 0xfc00) != 0xdc00) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = (cp & 0x3ff) << 10;
-                cp |= *in & 0x3ff;
-                cp += 0x10000;
-
-                in++;
-                i++;
-            }
-        } else if ((cp & 0xfc00) == 0xdc00) {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (cp > 0x10ffff) {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (dest) {
-            if (cp < 0x80) {
-                if (left < 1)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = (uint8_t)cp;
-                out++;
-
-                left--;
-            } else if (cp < 0x800) {
-                if (left < 2)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = 0xc0 | ((cp & 0x7c0) >> 6);
-                out++;
-
-                *out = 0x80 | (cp & 0x3f);
-                out++;
-
-                left -= 2;
-            } else if (cp < 0x10000) {
-                if (left < 3)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = 0xe0 | ((cp & 0xf000) >> 12);
-                out++;
-
-                *out = 0x80 | ((cp & 0xfc0) >> 6);
-                out++;
-
-                *out = 0x80 | (cp & 0x3f);
-                out++;
-
-                left -= 3;
-            } else {
-                if (left < 4)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = 0xf0 | ((cp & 0x1c0000) >> 18);
-                out++;
-
-                *out = 0x80 | ((cp & 0x3f000) >> 12);
-                out++;
-
-                *out = 0x80 | ((cp & 0xfc0) >> 6);
-                out++;
-
-                *out = 0x80 | (cp & 0x3f);
-                out++;
-
-                left -= 4;
-            }
-        }
-
-        if (cp < 0x80)
-            needed++;
-        else if (cp < 0x800)
-            needed += 2;
-        else if (cp < 0x10000)
-            needed += 3;
-        else
-            needed += 4;
-    }
-
-    if (dest_len)
-        *dest_len = needed;
-
-    return Status;
-}
-
 _Dispatch_type_(IRP_MJ_QUERY_VOLUME_INFORMATION)
 _Function_class_(DRIVER_DISPATCH)
 static NTSTATUS __stdcall drv_query_volume_information(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
@@ -1258,6 +1083,10 @@ static NTSTATUS __stdcall read_completion(_In_ PDEVICE_OBJECT DeviceObject, _In_
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+static uint32_t fcb_get_hash(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, fcb, list_entry_hash)->hash;
+}
+
 NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ uint64_t id,
                      _Out_ root** rootptr, _In_ bool no_tree, _In_ uint64_t offset, _In_opt_ PIRP Irp) {
     NTSTATUS Status;
@@ -1278,10 +1107,20 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    hash_table_init(&r->fcbs_hash, fcb_get_hash);
+
+    Status = hash_table_alloc(&r->fcbs_hash);
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(r->nonpaged);
+        ExFreePool(r);
+        return Status;
+    }
+
     ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
     if (!ri) {
         ERR("out of memory\n");
 
+        hash_table_free(&r->fcbs_hash);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
         return STATUS_INSUFFICIENT_RESOURCES;
@@ -1299,11 +1138,9 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
     r->send_ops = 0;
     RtlZeroMemory(&r->root_item, sizeof(ROOT_ITEM));
     r->root_item.num_references = 1;
-    r->fcbs_version = 0;
     r->checked_for_orphans = true;
     r->dropped = false;
     InitializeListHead(&r->fcbs);
-    RtlZeroMemory(r->fcbs_ptrs, sizeof(LIST_ENTRY*) * 256);
 
     RtlCopyMemory(ri, &r->root_item, sizeof(ROOT_ITEM));
 
@@ -1314,6 +1151,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
     if (!NT_SUCCESS(Status)) {
         ERR("insert_tree_item returned %08lx\n", Status);
         ExFreePool(ri);
+        hash_table_free(&r->fcbs_hash);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
         return Status;
@@ -1330,6 +1168,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
 
             delete_tree_item(Vcb, &tp);
 
+            hash_table_free(&r->fcbs_hash);
             ExFreePool(r->nonpaged);
             ExFreePool(r);
             ExFreePool(ri);
@@ -1368,6 +1207,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
         t->updated_extents = false;
 
         InsertTailList(&Vcb->trees, &t->list_entry);
+        InterlockedIncrement(&Vcb->tree_count);
         t->list_entry_hash.Flink = NULL;
 
         t->write = true;
@@ -1699,6 +1539,9 @@ void mark_fcb_dirty(_In_ fcb* fcb) {
         ExAcquireResourceExclusiveLite(&fcb->Vcb->dirty_fcbs_lock, true);
         InsertTailList(&fcb->Vcb->dirty_fcbs, &fcb->list_entry_dirty);
         ExReleaseResourceLite(&fcb->Vcb->dirty_fcbs_lock);
+
+        InterlockedIncrement(&fcb->Vcb->dirty_fcb_count);
+        check_dirty_thresholds(fcb->Vcb);
     }
 
     fcb->Vcb->need_write = true;
@@ -1731,20 +1574,12 @@ void free_fcb(_Inout_ fcb* fcb) {
 }
 
 void reap_fcb(fcb* fcb) {
-    uint8_t c = fcb->hash >> 24;
-
-    if (fcb->subvol && fcb->subvol->fcbs_ptrs[c] == &fcb->list_entry) {
-        if (fcb->list_entry.Flink != &fcb->subvol->fcbs && (CONTAINING_RECORD(fcb->list_entry.Flink, struct _fcb, list_entry)->hash >> 24) == c)
-            fcb->subvol->fcbs_ptrs[c] = fcb->list_entry.Flink;
-        else
-            fcb->subvol->fcbs_ptrs[c] = NULL;
-    }
-
     if (fcb->list_entry.Flink) {
-        RemoveEntryList(&fcb->list_entry);
+        remove_fcb_from_subvol(fcb);
 
         if (fcb->subvol && fcb->subvol->dropped && IsListEmpty(&fcb->subvol->fcbs)) {
             ExDeleteResourceLite(&fcb->subvol->nonpaged->load_tree_lock);
+            hash_table_free(&fcb->subvol->fcbs_hash);
             ExFreePool(fcb->subvol->nonpaged);
             ExFreePool(fcb->subvol);
         }
@@ -1759,8 +1594,10 @@ void reap_fcb(fcb* fcb) {
 
     ExFreeToNPagedLookasideList(&fcb->Vcb->fcb_np_lookaside, fcb->nonpaged);
 
+    neg_cache_free(fcb);
+
     if (fcb->sd)
-        ExFreePool(fcb->sd);
+        release_sd(fcb->Vcb, fcb->sd);
 
     if (fcb->adsxattr.Buffer)
         ExFreePool(fcb->adsxattr.Buffer);
@@ -1784,6 +1621,8 @@ void reap_fcb(fcb* fcb) {
         ExFreePool(ext);
     }
 
+    free_delalloc(fcb);
+
     while (!IsListEmpty(&fcb->hardlinks)) {
         LIST_ENTRY* le = RemoveHeadList(&fcb->hardlinks);
         hardlink* hl = CONTAINING_RECORD(le, hardlink, list_entry);
@@ -1808,16 +1647,13 @@ void reap_fcb(fcb* fcb) {
         dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_index);
 
         ExFreePool(dc->utf8.Buffer);
+        free_dir_child_name_uc(dc);
         ExFreePool(dc->name.Buffer);
-        ExFreePool(dc->name_uc.Buffer);
         ExFreePool(dc);
     }
 
-    if (fcb->hash_ptrs)
-        ExFreePool(fcb->hash_ptrs);
-
-    if (fcb->hash_ptrs_uc)
-        ExFreePool(fcb->hash_ptrs_uc);
+    hash_table_free(&fcb->dir_children_hash);
+    hash_table_free(&fcb->dir_children_hash_uc);
 
     FsRtlUninitializeFileLock(&fcb->lock);
     FsRtlUninitializeOplock(fcb_oplock(fcb));
@@ -1844,6 +1680,10 @@ void reap_fcbs(device_extension* Vcb) {
 }
 
 void free_fileref(_Inout_ file_ref* fr) {
+    // Stamp this while we've still got our reference - once the count reaches 0, the
+    // fileref can be reaped from under us.
+    fr->last_used = KeQueryInterruptTime();
+
 #if defined(_DEBUG) || defined(DEBUG_FCB_REFCOUNTS)
     LONG rc = InterlockedDecrement(&fr->refcount);
 
@@ -1893,7 +1733,23 @@ void reap_fileref(device_extension* Vcb, file_ref* fr) {
     ExFreeToPagedLookasideList(&Vcb->fileref_lookaside, fr);
 }
 
-void reap_filerefs(device_extension* Vcb, file_ref* fr) {
+// Unreferenced filerefs, and the fcbs they hold on to, are kept around after each flush so that
+// opening the same files over and over doesn't mean reading in their inodes, xattrs and extents
+// each time. Up to FcbCacheSize of them are kept, the least recently used going first, and all of
+// them go if the system is short of memory.
+
+static bool fileref_cacheable(file_ref* fr) {
+    if (fr->deleted || fr->fcb->deleted)
+        return false;
+
+    if (fr->fcb->subvol && fr->fcb->subvol->dropped)
+        return false;
+
+    return true;
+}
+
+// Reaps unreferenced filerefs which were last used before cutoff, and any which aren't worth keeping.
+void reap_filerefs(device_extension* Vcb, file_ref* fr, uint64_t cutoff) {
     LIST_ENTRY* le;
 
     // FIXME - recursion is a bad idea in kernel mode
@@ -1903,13 +1759,129 @@ void reap_filerefs(device_extension* Vcb, file_ref* fr) {
         file_ref* c = CONTAINING_RECORD(le, file_ref, list_entry);
         LIST_ENTRY* le2 = le->Flink;
 
-        reap_filerefs(Vcb, c);
+        reap_filerefs(Vcb, c, cutoff);
 
         le = le2;
     }
 
-    if (fr->refcount == 0)
-        reap_fileref(Vcb, fr);
+    if (fr->refcount == 0) {
+        if (fr->last_used < cutoff || !fileref_cacheable(fr)) {
+            reap_fileref(Vcb, fr);
+            InterlockedIncrement64(&Vcb->fcb_cache_stats.trimmed);
+        } else
+            fr->cached = true;
+    }
+}
+
+static ULONG get_cached_filerefs(file_ref* fr, uint64_t* times, ULONG num_times) {
+    LIST_ENTRY* le;
+    ULONG num = 0;
+
+    le = fr->children.Flink;
+    while (le != &fr->children) {
+        file_ref* c = CONTAINING_RECORD(le, file_ref, list_entry);
+
+        num += get_cached_filerefs(c, times ? &times[num] : NULL, num_times - num);
+
+        le = le->Flink;
+    }
+
+    if (fr->refcount == 0 && fileref_cacheable(fr)) {
+        if (times && num < num_times)
+            times[num] = fr->last_used;
+
+        num++;
+    }
+
+    return num;
+}
+
+// returns the kth smallest entry of v, shuffling it around as it goes
+static uint64_t select_kth(uint64_t* v, ULONG n, ULONG k) {
+    ULONG lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        uint64_t pivot = v[lo + ((hi - lo) / 2)];
+        ULONG i = lo, j = hi;
+
+        while (i <= j) {
+            while (v[i] < pivot) {
+                i++;
+            }
+
+            while (v[j] > pivot) {
+                j--;
+            }
+
+            if (i <= j) {
+                uint64_t t = v[i];
+
+                v[i] = v[j];
+                v[j] = t;
+
+                i++;
+
+                if (j == 0)
+                    break;
+
+                j--;
+            }
+        }
+
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+
+    return v[k];
+}
+
+void trim_fileref_cache(device_extension* Vcb) {
+    ULONG limit = Vcb->options.fcb_cache_size, num;
+    uint64_t cutoff = 0;
+
+    // Nothing gets cached once the volume is going away, or while it's locked - whoever's
+    // locked it may be about to write to the disk directly.
+    if (Vcb->removing || Vcb->locked)
+        limit = 0;
+    else if (low_memory_event && KeReadStateEvent(low_memory_event))
+        limit = 0;
+
+    num = get_cached_filerefs(Vcb->root_fileref, NULL, 0);
+
+    if (num > limit) {
+        if (limit == 0)
+            cutoff = 0xffffffffffffffff;
+        else {
+            uint64_t* times = ExAllocatePoolWithTag(PagedPool, sizeof(uint64_t) * num, ALLOC_TAG);
+
+            if (!times) {
+                WARN("out of memory\n");
+                cutoff = 0xffffffffffffffff;
+            } else {
+                get_cached_filerefs(Vcb->root_fileref, times, num);
+
+                cutoff = select_kth(times, num, num - limit - 1) + 1;
+
+                ExFreePool(times);
+            }
+        }
+    }
+
+    reap_filerefs(Vcb, Vcb->root_fileref, cutoff);
+    reap_fcbs(Vcb);
+
+    Vcb->fcb_cache_stats.cached = get_cached_filerefs(Vcb->root_fileref, NULL, 0);
+}
+
+void empty_fileref_cache(device_extension* Vcb) {
+    reap_filerefs(Vcb, Vcb->root_fileref, 0xffffffffffffffff);
+    reap_fcbs(Vcb);
+
+    Vcb->fcb_cache_stats.cached = 0;
 }
 
 static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp) {
@@ -2079,12 +2051,25 @@ void uninit(_In_ device_extension* Vcb) {
     KeSetTimer(&Vcb->flush_thread_timer, time, NULL); // trigger the timer early
     KeWaitForSingleObject(&Vcb->flush_thread_finished, Executive, KernelMode, false, NULL);
 
+    if (Vcb->discard.thread) {
+        Vcb->discard.quit = true;
+        KeSetEvent(&Vcb->discard.event, 0, false);
+        KeWaitForSingleObject(&Vcb->discard.finished, Executive, KernelMode, false, NULL);
+
+        ZwClose(Vcb->discard.thread);
+    }
+
     reap_fcb(Vcb->volume_fcb);
     reap_fcb(Vcb->dummy_fcb);
 
     if (Vcb->root_file)
         ObDereferenceObject(Vcb->root_file);
 
+    // The cached filerefs and fcbs point to roots we're about to free, and have to be gone
+    // before we delete the lookaside lists they came from.
+    if (Vcb->root_fileref)
+        empty_fileref_cache(Vcb);
+
     le = Vcb->chunks.Flink;
     while (le != &Vcb->chunks) {
         chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
@@ -2116,6 +2101,7 @@ void uninit(_In_ device_extension* Vcb) {
         root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->roots), root, list_entry);
 
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+        hash_table_free(&r->fcbs_hash);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
     }
@@ -2140,6 +2126,9 @@ void uninit(_In_ device_extension* Vcb) {
         if (c->devices)
             ExFreePool(c->devices);
 
+        free_chunk_discards(c);
+        free_chunk_unique_cache(c);
+
         if (c->cache)
             reap_fcb(c->cache);
 
@@ -2193,6 +2182,8 @@ void uninit(_In_ device_extension* Vcb) {
     ExDeleteNPagedLookasideList(&Vcb->range_lock_lookaside);
     ExDeleteNPagedLookasideList(&Vcb->fcb_np_lookaside);
 
+    free_sd_cache(Vcb);
+
     ZwClose(Vcb->flush_thread_handle);
 
     if (Vcb->devobj->AttachedDevice)
@@ -2208,7 +2199,7 @@ static NTSTATUS delete_fileref_fcb(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT
     // excise extents
 
     if (fileref->fcb->type != BTRFS_TYPE_DIRECTORY && fileref->fcb->inode_item.st_size > 0) {
-        Status = excise_extents(fileref->fcb->Vcb, fileref->fcb, 0, sector_align(fileref->fcb->inode_item.st_size, fileref->fcb->Vcb->superblock.sector_size), Irp, rollback);
+        Status = excise_extents(fileref->fcb->Vcb, fileref->fcb, 0, get_extents_end(fileref->fcb), Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("excise_extents returned %08lx\n", Status);
             return Status;
@@ -2278,6 +2269,14 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
         return STATUS_ACCESS_DENIED;
     }
 
+    if (fileref->dc && !fileref->fcb->ads) {
+        Status = complete_dir_children(fileref->fcb->Vcb, fileref->parent->fcb, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ExReleaseResourceLite(fileref->fcb->Header.Resource);
+            return Status;
+        }
+    }
+
     fileref->deleted = true;
     mark_fileref_dirty(fileref);
 
@@ -2382,8 +2381,8 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
 
         fileref->oldindex = fileref->dc->index;
 
+        free_dir_child_name_uc(fileref->dc);
         ExFreePool(fileref->dc->name.Buffer);
-        ExFreePool(fileref->dc->name_uc.Buffer);
         ExFreePool(fileref->dc);
 
         fileref->dc = NULL;
@@ -2516,6 +2515,10 @@ static NTSTATUS __stdcall drv_cleanup(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIR
 
             if (oc == 0 || (fileref->delete_on_close && fileref->posix_delete)) {
                 if (!fcb->Vcb->removing) {
+                    // give back any space we preallocated past EOF that didn't get used
+                    if (oc == 0 && fcb->spec_prealloc && !fcb->Vcb->readonly)
+                        trim_speculative_prealloc(fcb, Irp);
+
                     if (oc == 0 && fileref->fcb->inode_item.st_nlink == 0 && fileref != fcb->Vcb->root_fileref &&
                         fcb != fcb->Vcb->volume_fcb && !fcb->ads) { // last handle closed on POSIX-deleted file
                         LIST_ENTRY rollback;
@@ -2651,37 +2654,29 @@ bool get_file_attributes_from_xattr(_In_reads_bytes_(len) char* val, _In_ uint16
     return false;
 }
 
-ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ uint64_t inode,
-                          _In_ uint8_t type, _In_ bool dotfile, _In_ bool ignore_xa, _In_opt_ PIRP Irp) {
+// dosnum is the value of the DOSATTRIB xattr, or NULL if there isn't one
+ULONG calc_file_attributes(_In_ root* r, _In_ uint64_t inode, _In_ uint8_t type, _In_ bool dotfile, _In_opt_ ULONG* dosnum) {
     ULONG att;
-    char* eaval;
-    uint16_t ealen;
-
-    if (!ignore_xa && get_xattr(Vcb, r, inode, EA_DOSATTRIB, EA_DOSATTRIB_HASH, (uint8_t**)&eaval, &ealen, Irp)) {
-        ULONG dosnum = 0;
-
-        if (get_file_attributes_from_xattr(eaval, ealen, &dosnum)) {
-            ExFreePool(eaval);
 
-            if (type == BTRFS_TYPE_DIRECTORY)
-                dosnum |= FILE_ATTRIBUTE_DIRECTORY;
-            else if (type == BTRFS_TYPE_SYMLINK)
-                dosnum |= FILE_ATTRIBUTE_REPARSE_POINT;
+    if (dosnum) {
+        att = *dosnum;
 
-            if (type != BTRFS_TYPE_DIRECTORY)
-                dosnum &= ~FILE_ATTRIBUTE_DIRECTORY;
+        if (type == BTRFS_TYPE_DIRECTORY)
+            att |= FILE_ATTRIBUTE_DIRECTORY;
+        else if (type == BTRFS_TYPE_SYMLINK)
+            att |= FILE_ATTRIBUTE_REPARSE_POINT;
 
-            if (inode == SUBVOL_ROOT_INODE) {
-                if (r->root_item.flags & BTRFS_SUBVOL_READONLY)
-                    dosnum |= FILE_ATTRIBUTE_READONLY;
-                else
-                    dosnum &= ~FILE_ATTRIBUTE_READONLY;
-            }
+        if (type != BTRFS_TYPE_DIRECTORY)
+            att &= ~FILE_ATTRIBUTE_DIRECTORY;
 
-            return dosnum;
+        if (inode == SUBVOL_ROOT_INODE) {
+            if (r->root_item.flags & BTRFS_SUBVOL_READONLY)
+                att |= FILE_ATTRIBUTE_READONLY;
+            else
+                att &= ~FILE_ATTRIBUTE_READONLY;
         }
 
-        ExFreePool(eaval);
+        return att;
     }
 
     switch (type) {
@@ -2719,6 +2714,26 @@ ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
     return att;
 }
 
+ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ uint64_t inode,
+                          _In_ uint8_t type, _In_ bool dotfile, _In_ bool ignore_xa, _In_opt_ PIRP Irp) {
+    char* eaval;
+    uint16_t ealen;
+
+    if (!ignore_xa && get_xattr(Vcb, r, inode, EA_DOSATTRIB, EA_DOSATTRIB_HASH, (uint8_t**)&eaval, &ealen, Irp)) {
+        ULONG dosnum = 0;
+
+        if (get_file_attributes_from_xattr(eaval, ealen, &dosnum)) {
+            ExFreePool(eaval);
+
+            return calc_file_attributes(r, inode, type, dotfile, &dosnum);
+        }
+
+        ExFreePool(eaval);
+    }
+
+    return calc_file_attributes(r, inode, type, dotfile, NULL);
+}
+
 NTSTATUS sync_read_phys(_In_ PDEVICE_OBJECT DeviceObject, _In_ PFILE_OBJECT FileObject, _In_ uint64_t StartingOffset, _In_ ULONG Length,
                         _Out_writes_bytes_(Length) PUCHAR Buffer, _In_ bool override) {
     IO_STATUS_BLOCK IoStatus;
@@ -2982,6 +2997,7 @@ NTSTATUS dev_ioctl(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG ControlCode, _In
 _Requires_exclusive_lock_held_(Vcb->tree_lock)
 static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ uint64_t addr,
                          _In_ uint64_t generation, _In_opt_ traverse_ptr* tp) {
+    NTSTATUS Status;
     root* r = ExAllocatePoolWithTag(PagedPool, sizeof(root), ALLOC_TAG);
     if (!r) {
         ERR("out of memory\n");
@@ -2997,11 +3013,10 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ u
     r->treeholder.generation = generation;
     r->parent = 0;
     r->send_ops = 0;
-    r->fcbs_version = 0;
     r->checked_for_orphans = false;
     r->dropped = false;
     InitializeListHead(&r->fcbs);
-    RtlZeroMemory(r->fcbs_ptrs, sizeof(LIST_ENTRY*) * 256);
+    hash_table_init(&r->fcbs_hash, fcb_get_hash);
 
     r->nonpaged = ExAllocatePoolWithTag(NonPagedPool, sizeof(root_nonpaged), ALLOC_TAG);
     if (!r->nonpaged) {
@@ -3010,6 +3025,13 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ u
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    Status = hash_table_alloc(&r->fcbs_hash);
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(r->nonpaged);
+        ExFreePool(r);
+        return Status;
+    }
+
     ExInitializeResourceLite(&r->nonpaged->load_tree_lock);
 
     r->lastinode = 0;
@@ -3349,6 +3371,8 @@ device* find_device_from_uuid(_In_ device_extension* Vcb, _In_ BTRFS_UUID* uuid)
                 dev->part_num = vc->part_num;
                 dev->num_trim_entries = 0;
                 InitializeListHead(&dev->trim_list);
+                dev->num_discard_entries = 0;
+                InitializeListHead(&dev->discard_list);
 
                 add_device_to_list(Vcb, dev);
                 Vcb->devices_loaded++;
@@ -3436,8 +3460,10 @@ void init_device(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ bool get_
     dev->readonly = dev->seeding;
     dev->reloc = false;
     dev->num_trim_entries = 0;
+    dev->num_discard_entries = 0;
     dev->stats_changed = false;
     InitializeListHead(&dev->trim_list);
+    InitializeListHead(&dev->discard_list);
 
     if (!dev->readonly) {
         Status = dev_ioctl(dev->devobj, IOCTL_DISK_IS_WRITABLE, NULL, 0,
@@ -3621,6 +3647,7 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
                                 // Missing device, so we keep dev->devobj as NULL
                                 RtlCopyMemory(&dev->devitem, di, min(tp.item->size, sizeof(DEV_ITEM)));
                                 InitializeListHead(&dev->trim_list);
+                                InitializeListHead(&dev->discard_list);
 
                                 add_device_to_list(Vcb, dev);
                                 Vcb->devices_loaded++;
@@ -3721,13 +3748,13 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
                 ExInitializeResourceLite(&c->changed_extents_lock);
 
                 InitializeListHead(&c->space);
-                InitializeListHead(&c->space_size);
+                space_index_init(&c->space_index);
                 InitializeListHead(&c->deleting);
                 InitializeListHead(&c->changed_extents);
 
-                InitializeListHead(&c->range_locks);
-                ExInitializeResourceLite(&c->range_locks_lock);
-                KeInitializeEvent(&c->range_locks_event, NotificationEvent, false);
+                init_chunk_range_locks(c);
+                init_chunk_discards(c);
+                init_chunk_unique_cache(c);
 
                 InitializeListHead(&c->partial_stripes);
                 ExInitializeResourceLite(&c->partial_stripes_lock);
@@ -3736,7 +3763,7 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
 
                 c->last_stripe = 0;
 
-                InsertTailList(&Vcb->chunks, &c->list_entry);
+                chunk_index_insert(Vcb, c);
 
                 c->list_entry_balance.Flink = NULL;
             }
@@ -4595,6 +4622,13 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    init_adaptive_compression(Vcb);
+
+    KeInitializeSpinLock(&Vcb->range_lock_stats.lock);
+
+    KeInitializeEvent(&Vcb->discard.event, SynchronizationEvent, false);
+    KeInitializeEvent(&Vcb->discard.finished, NotificationEvent, false);
+
     if (pdode) {
         if (RtlCompareMemory(&boot_uuid, &pdode->uuid, sizeof(BTRFS_UUID)) == sizeof(BTRFS_UUID) && boot_subvol != 0)
             Vcb->options.subvol_id = boot_subvol;
@@ -4722,6 +4756,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     }
 
     InitializeListHead(&Vcb->chunks);
+    Vcb->chunks_by_address.root = NULL;
+    Vcb->chunks_by_address.augment = NULL;
     InitializeListHead(&Vcb->trees);
     InitializeListHead(&Vcb->trees_hash);
     InitializeListHead(&Vcb->all_fcbs);
@@ -4732,6 +4768,9 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     ExInitializeFastMutex(&Vcb->trees_list_mutex);
 
+    KeInitializeEvent(&Vcb->flush_kick, SynchronizationEvent, false);
+    KeInitializeEvent(&Vcb->flush_done, NotificationEvent, false);
+
     InitializeListHead(&Vcb->DirNotifyList);
     InitializeListHead(&Vcb->scrub.errors);
 
@@ -4747,6 +4786,12 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeNPagedLookasideList(&Vcb->fcb_np_lookaside, NULL, NULL, 0, sizeof(fcb_nonpaged), ALLOC_TAG, 0);
     init_lookaside = true;
 
+    Status = init_sd_cache(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_sd_cache returned %08lx\n", Status);
+        goto exit;
+    }
+
     Vcb->Vpb = IrpSp->Parameters.MountVolume.Vpb;
 
     Status = load_chunk_root(Vcb, Irp);
@@ -4868,23 +4913,13 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     Vcb->dummy_fcb->inode_item.st_nlink = 1;
     Vcb->dummy_fcb->inode_item.st_mode = __S_IFDIR;
 
-    Vcb->dummy_fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!Vcb->dummy_fcb->hash_ptrs) {
-        ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
+    Status = hash_table_alloc(&Vcb->dummy_fcb->dir_children_hash);
+    if (!NT_SUCCESS(Status))
         goto exit;
-    }
-
-    RtlZeroMemory(Vcb->dummy_fcb->hash_ptrs, sizeof(LIST_ENTRY*) * 256);
 
-    Vcb->dummy_fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!Vcb->dummy_fcb->hash_ptrs_uc) {
-        ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
+    Status = hash_table_alloc(&Vcb->dummy_fcb->dir_children_hash_uc);
+    if (!NT_SUCCESS(Status))
         goto exit;
-    }
-
-    RtlZeroMemory(Vcb->dummy_fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
 
     root_fcb = create_fcb(Vcb, NonPagedPool);
     if (!root_fcb) {
@@ -4951,11 +4986,9 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     }
 
     Vcb->root_fileref->fcb = root_fcb;
-    InsertTailList(&root_fcb->subvol->fcbs, &root_fcb->list_entry);
+    add_fcb_to_subvol(root_fcb);
     InsertTailList(&Vcb->all_fcbs, &root_fcb->list_entry_all);
 
-    root_fcb->subvol->fcbs_ptrs[root_fcb->hash >> 24] = &root_fcb->list_entry;
-
     root_fcb->fileref = Vcb->root_fileref;
 
     root_ccb = ExAllocatePoolWithTag(PagedPool, sizeof(ccb), ALLOC_TAG);
@@ -5018,6 +5051,15 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    if (Vcb->options.discard == DISCARD_MODE_ASYNC) {
+        Status = PsCreateSystemThread(&Vcb->discard.thread, 0, &oa, NULL, NULL, discard_thread, NewDeviceObject);
+        if (!NT_SUCCESS(Status)) {
+            WARN("PsCreateSystemThread returned %08lx, falling back to synchronous discard\n", Status);
+            Vcb->discard.thread = NULL;
+            Vcb->options.discard = DISCARD_MODE_SYNC;
+        }
+    }
+
     Status = create_calc_threads(NewDeviceObject);
     if (!NT_SUCCESS(Status)) {
         ERR("create_calc_threads returned %08lx\n", Status);
@@ -5073,6 +5115,8 @@ exit:
             if (Vcb->volume_fcb)
                 reap_fcb(Vcb->volume_fcb);
 
+            free_sd_cache(Vcb);
+
             ExDeleteResourceLite(&Vcb->tree_lock);
             ExDeleteResourceLite(&Vcb->load_lock);
             ExDeleteResourceLite(&Vcb->fcb_lock);
@@ -5840,10 +5884,87 @@ NTSTATUS check_file_name_valid(_In_ PUNICODE_STRING us, _In_ bool posix, _In_ bo
     return STATUS_SUCCESS;
 }
 
+// A chunk's range locks are kept in an interval tree: an rb-tree sorted by start, with each node
+// caching the furthest end of any range in its subtree, which lets us skip whole subtrees when
+// looking for overlaps. Threads waiting for a range each have their own event, so that
+// chunk_unlock_range only wakes up those it could have unblocked.
+
+static void range_lock_augment(rb_node* node) {
+    range_lock* rl = CONTAINING_RECORD(node, range_lock, node);
+
+    rl->max_end = rl->start + rl->length;
+
+    if (node->left) {
+        range_lock* rl2 = CONTAINING_RECORD(node->left, range_lock, node);
+
+        if (rl2->max_end > rl->max_end)
+            rl->max_end = rl2->max_end;
+    }
+
+    if (node->right) {
+        range_lock* rl2 = CONTAINING_RECORD(node->right, range_lock, node);
+
+        if (rl2->max_end > rl->max_end)
+            rl->max_end = rl2->max_end;
+    }
+}
+
+void init_chunk_range_locks(_In_ chunk* c) {
+    c->range_locks.root = NULL;
+    c->range_locks.augment = range_lock_augment;
+    InitializeListHead(&c->range_lock_waiters);
+    ExInitializeResourceLite(&c->range_locks_lock);
+}
+
+// Returns true if something other than thread has locked part of [start, end).
+static bool range_lock_conflict(rb_node* node, uint64_t start, uint64_t end, PETHREAD thread) {
+    while (node) {
+        range_lock* rl = CONTAINING_RECORD(node, range_lock, node);
+
+        if (rl->max_end <= start)
+            return false;
+
+        if (node->left && range_lock_conflict(node->left, start, end, thread))
+            return true;
+
+        if (rl->start >= end)
+            return false;
+
+        if (rl->start + rl->length > start && rl->thread != thread)
+            return true;
+
+        node = node->right;
+    }
+
+    return false;
+}
+
+static void add_range_lock_wait(device_extension* Vcb, LARGE_INTEGER time1) {
+    LARGE_INTEGER time2 = KeQueryPerformanceCounter(NULL);
+    uint64_t t = time2.QuadPart - time1.QuadPart;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Vcb->range_lock_stats.lock, &irql);
+
+    Vcb->range_lock_stats.waits++;
+    Vcb->range_lock_stats.wait_time += t;
+
+    if (t > Vcb->range_lock_stats.max_wait_time)
+        Vcb->range_lock_stats.max_wait_time = t;
+
+    KeReleaseSpinLock(&Vcb->range_lock_stats.lock, irql);
+}
+
 void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length) {
-    LIST_ENTRY* le;
-    bool locked;
     range_lock* rl;
+    range_lock_waiter rlw;
+    PETHREAD thread = PsGetCurrentThread();
+    rb_node* parent;
+    rb_node** link;
+    bool waited = false;
+    LARGE_INTEGER time1;
+
+    time1.QuadPart = 0;
 
     rl = ExAllocateFromNPagedLookasideList(&Vcb->range_lock_lookaside);
     if (!rl) {
@@ -5853,61 +5974,118 @@ void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t s
 
     rl->start = start;
     rl->length = length;
-    rl->thread = PsGetCurrentThread();
+    rl->thread = thread;
 
-    while (true) {
-        locked = false;
+    rlw.start = start;
+    rlw.length = length;
+    KeInitializeEvent(&rlw.event, NotificationEvent, false);
 
+    while (true) {
         ExAcquireResourceExclusiveLite(&c->range_locks_lock, true);
 
-        le = c->range_locks.Flink;
-        while (le != &c->range_locks) {
-            range_lock* rl2 = CONTAINING_RECORD(le, range_lock, list_entry);
-
-            if (rl2->start < start + length && rl2->start + rl2->length > start && rl2->thread != PsGetCurrentThread()) {
-                locked = true;
-                break;
-            }
+        if (!range_lock_conflict(c->range_locks.root, start, start + length, thread))
+            break;
 
-            le = le->Flink;
+        if (!waited) {
+            time1 = KeQueryPerformanceCounter(NULL);
+            waited = true;
         }
 
-        if (!locked) {
-            InsertTailList(&c->range_locks, &rl->list_entry);
+        KeClearEvent(&rlw.event);
+        InsertTailList(&c->range_lock_waiters, &rlw.list_entry);
 
-            ExReleaseResourceLite(&c->range_locks_lock);
-            return;
-        }
+        ExReleaseResourceLite(&c->range_locks_lock);
 
-        KeClearEvent(&c->range_locks_event);
+        KeWaitForSingleObject(&rlw.event, UserRequest, KernelMode, false, NULL);
+    }
 
-        ExReleaseResourceLite(&c->range_locks_lock);
+    parent = NULL;
+    link = &c->range_locks.root;
+
+    while (*link) {
+        range_lock* rl2 = CONTAINING_RECORD(*link, range_lock, node);
 
-        KeWaitForSingleObject(&c->range_locks_event, UserRequest, KernelMode, false, NULL);
+        parent = *link;
+
+        if (start < rl2->start)
+            link = &parent->left;
+        else
+            link = &parent->right;
     }
+
+    rb_insert(&c->range_locks, parent, link, &rl->node);
+
+    ExReleaseResourceLite(&c->range_locks_lock);
+
+    InterlockedIncrement64(&Vcb->range_lock_stats.locks);
+
+    if (waited)
+        add_range_lock_wait(Vcb, time1);
 }
 
 void chunk_unlock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length) {
     LIST_ENTRY* le;
+    rb_node* n;
+    rb_node* found = NULL;
+    ULONG woken = 0;
 
     ExAcquireResourceExclusiveLite(&c->range_locks_lock, true);
 
-    le = c->range_locks.Flink;
-    while (le != &c->range_locks) {
-        range_lock* rl = CONTAINING_RECORD(le, range_lock, list_entry);
+    // find the leftmost lock starting at start
 
-        if (rl->start == start && rl->length == length) {
-            RemoveEntryList(&rl->list_entry);
-            ExFreeToNPagedLookasideList(&Vcb->range_lock_lookaside, rl);
+    n = c->range_locks.root;
+    while (n) {
+        range_lock* rl = CONTAINING_RECORD(n, range_lock, node);
+
+        if (start <= rl->start) {
+            if (rl->start == start)
+                found = n;
+
+            n = n->left;
+        } else
+            n = n->right;
+    }
+
+    while (found) {
+        range_lock* rl = CONTAINING_RECORD(found, range_lock, node);
+
+        if (rl->start != start) {
+            found = NULL;
             break;
         }
 
-        le = le->Flink;
+        if (rl->length == length)
+            break;
+
+        found = rb_next(found);
     }
 
-    KeSetEvent(&c->range_locks_event, 0, false);
+    if (found) {
+        rb_remove(&c->range_locks, found);
+        ExFreeToNPagedLookasideList(&Vcb->range_lock_lookaside, CONTAINING_RECORD(found, range_lock, node));
+    }
+
+    // Wake anybody whose range overlaps ours. They'll check again for themselves, as something
+    // else might still be in the way.
+
+    le = c->range_lock_waiters.Flink;
+    while (le != &c->range_lock_waiters) {
+        range_lock_waiter* rlw = CONTAINING_RECORD(le, range_lock_waiter, list_entry);
+        LIST_ENTRY* le2 = le->Flink;
+
+        if (rlw->start < start + length && rlw->start + rlw->length > start) {
+            RemoveEntryList(&rlw->list_entry);
+            KeSetEvent(&rlw->event, 0, false);
+            woken++;
+        }
+
+        le = le2;
+    }
 
     ExReleaseResourceLite(&c->range_locks_lock);
+
+    if (woken > 0)
+        InterlockedExchangeAdd64(&Vcb->range_lock_stats.wakeups, woken);
 }
 
 void log_device_error(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ int error) {
@@ -6279,6 +6457,18 @@ end:
     return Status;
 }
 
+static void init_low_memory_event() {
+    UNICODE_STRING name;
+
+    // not fatal if this fails - we just won't know to empty the fileref cache when memory's short
+
+    RtlInitUnicodeString(&name, L"\\KernelObjects\\LowMemoryCondition");
+
+    low_memory_event = IoCreateNotificationEvent(&name, &low_memory_handle);
+    if (!low_memory_event)
+        WARN("IoCreateNotificationEvent failed\n");
+}
+
 _Function_class_(DRIVER_INITIALIZE)
 NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath) {
     NTSTATUS Status;
@@ -6307,6 +6497,12 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
     InitializeListHead(&uid_map_list);
     InitializeListHead(&gid_map_list);
 
+    Status = init_mapping_tables();
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_mapping_tables returned %08lx\n", Status);
+        return Status;
+    }
+
 #ifdef _DEBUG
     ExInitializeResourceLite(&log_lock);
 #endif
@@ -6472,6 +6668,8 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
 
     init_cache();
 
+    init_low_memory_event();
+
     InitializeListHead(&VcbList);
     ExInitializeResourceLite(&global_loading_lock);
     ExInitializeResourceLite(&pdo_list_lock);
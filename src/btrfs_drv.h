@@ -94,6 +94,9 @@
 #define EA_PROP_COMPRESSION "btrfs.compression"
 #define EA_PROP_COMPRESSION_HASH 0x20ccdf69
 
+#define EA_PROP_EXTSIZE "btrfs.extsize"
+#define EA_PROP_EXTSIZE_HASH 0xeb80d76a
+
 #define MAX_EXTENT_SIZE 0x8000000 // 128 MB
 #define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
 
@@ -194,6 +197,7 @@ typedef struct _fcb_nonpaged {
     ERESOURCE resource;
     ERESOURCE paging_resource;
     ERESOURCE dir_children_lock;
+    FAST_MUTEX neg_cache_mutex;
 } fcb_nonpaged;
 
 struct _root;
@@ -219,6 +223,18 @@ typedef struct {
     LIST_ENTRY list_entry;
 } hardlink;
 
+// Intrusive hash table which resizes itself as entries come and go - see hashtable.c
+typedef struct {
+    LIST_ENTRY* buckets;
+    ULONG num_buckets; // always a power of two
+    ULONG count;
+    uint32_t (*get_hash)(LIST_ENTRY* le);
+} hash_table;
+
+static __inline LIST_ENTRY* hash_table_bucket(hash_table* ht, uint32_t hash) {
+    return &ht->buckets[hash & (ht->num_buckets - 1)];
+}
+
 struct _file_ref;
 
 typedef struct {
@@ -229,7 +245,7 @@ typedef struct {
     uint32_t hash;
     UNICODE_STRING name;
     uint32_t hash_uc;
-    UNICODE_STRING name_uc;
+    UNICODE_STRING name_uc; // may share name's buffer, see set_dir_child_name_uc
     ULONG size;
     struct _file_ref* fileref;
     bool root_dir;
@@ -253,6 +269,22 @@ typedef struct {
     char data[1];
 } xattr;
 
+// Data written back by the cache manager which we haven't allocated space for yet - see delalloc.c
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+    uint8_t* buf;
+    uint8_t* data; // where in buf start is
+    struct _fcb* fcb; // only set once written, while on a rollback list
+    LIST_ENTRY list_entry;
+} delalloc_range;
+
+typedef struct {
+    uint32_t hash;
+    bool case_sensitive;
+    UNICODE_STRING name;
+} neg_cache_entry;
+
 typedef struct _fcb {
     FSRTL_ADVANCED_FCB_HEADER Header;
     struct _fcb_nonpaged* nonpaged;
@@ -272,6 +304,7 @@ typedef struct _fcb {
     SHARE_ACCESS share_access;
     bool csum_loaded;
     LIST_ENTRY extents;
+    LIST_ENTRY delalloc;
     ANSI_STRING reparse_xattr;
     ANSI_STRING ea_xattr;
     ULONG ealen;
@@ -279,6 +312,9 @@ typedef struct _fcb {
     struct _file_ref* fileref;
     bool inode_item_changed;
     enum prop_compression_type prop_compression;
+    uint8_t prop_compression_level;
+    uint32_t extent_size_hint;
+    bool spec_prealloc;
     LIST_ENTRY xattrs;
     bool marked_as_orphan;
     bool case_sensitive;
@@ -286,10 +322,11 @@ typedef struct _fcb {
     OPLOCK oplock;
 
     LIST_ENTRY dir_children_index;
-    LIST_ENTRY dir_children_hash;
-    LIST_ENTRY dir_children_hash_uc;
-    LIST_ENTRY** hash_ptrs;
-    LIST_ENTRY** hash_ptrs_uc;
+    hash_table dir_children_hash;
+    hash_table dir_children_hash_uc;
+    bool dir_children_partial;
+    uint64_t dir_index_loaded;
+    neg_cache_entry* neg_cache;
 
     bool dirty;
     bool sd_dirty, sd_deleted;
@@ -298,6 +335,7 @@ typedef struct _fcb {
     bool reparse_xattr_changed;
     bool ea_changed;
     bool prop_compression_changed;
+    bool extent_size_hint_changed;
     bool xattrs_changed;
     bool created;
 
@@ -308,6 +346,7 @@ typedef struct _fcb {
     ANSI_STRING adsdata;
 
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_all;
     LIST_ENTRY list_entry_dirty;
 } fcb;
@@ -325,6 +364,8 @@ typedef struct _file_ref {
     LONG open_count;
     struct _file_ref* parent;
     dir_child* dc;
+    uint64_t last_used; // interrupt time when refcount was last released
+    bool cached; // unreferenced, and kept by trim_fileref_cache when it would otherwise have gone
 
     bool dirty;
 
@@ -432,11 +473,10 @@ typedef struct _root {
     PEPROCESS reserved;
     uint64_t parent;
     LONG send_ops;
-    uint64_t fcbs_version;
     bool checked_for_orphans;
     bool dropped;
     LIST_ENTRY fcbs;
-    LIST_ENTRY* fcbs_ptrs[256];
+    hash_table fcbs_hash;
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_dirty;
 } root;
@@ -488,13 +528,32 @@ typedef struct _root_cache {
     struct _root_cache* next;
 } root_cache;
 
+typedef struct _rb_node {
+    struct _rb_node* parent;
+    struct _rb_node* left;
+    struct _rb_node* right;
+    bool red;
+} rb_node;
+
+typedef struct {
+    rb_node* root;
+    void (*augment)(rb_node* node); // optional, recomputes data a node caches about its subtree
+} rb_tree;
+
 typedef struct {
     uint64_t address;
     uint64_t size;
     LIST_ENTRY list_entry;
-    LIST_ENTRY list_entry_size;
+    rb_node node_address;
+    rb_node node_size;
 } space;
 
+// Indexes a chunk's free-space list by address and by size, so we don't have to walk it
+typedef struct {
+    rb_tree by_address;
+    rb_tree by_size;
+} space_index;
+
 typedef struct {
     PDEVICE_OBJECT devobj;
     PFILE_OBJECT fileobj;
@@ -514,15 +573,70 @@ typedef struct {
     LIST_ENTRY list_entry;
     ULONG num_trim_entries;
     LIST_ENTRY trim_list;
+    ULONG num_discard_entries; // the discard thread's, see discard.c
+    LIST_ENTRY discard_list;
 } device;
 
 typedef struct {
     uint64_t start;
     uint64_t length;
+    uint64_t max_end; // highest start + length in this node's subtree
     PETHREAD thread;
-    LIST_ENTRY list_entry;
+    rb_node node;
 } range_lock;
 
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+    KEVENT event;
+    LIST_ENTRY list_entry;
+} range_lock_waiter;
+
+typedef struct {
+    LONG64 locks;
+    LONG64 wakeups;
+    KSPIN_LOCK lock; // protects the rest
+    uint64_t waits;
+    uint64_t wait_time; // in performance counter ticks
+    uint64_t max_wait_time;
+} range_lock_stats;
+
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    uint64_t queued; // interrupt time
+    rb_node node;
+    LIST_ENTRY list_entry;
+} discard_range;
+
+// Freed space waiting for the discard thread, protected by the chunk's lock - see discard.c
+typedef struct {
+    rb_tree tree; // by address
+    LIST_ENTRY list; // oldest first
+    uint64_t bytes;
+    uint64_t reused; // not yet added to Vcb->discard.reused_bytes
+    LONG inflight; // TRIMs are being sent for somewhere in [inflight_start, inflight_end)
+    uint64_t inflight_start;
+    uint64_t inflight_end;
+    KEVENT inflight_done;
+} discard_queue;
+
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    uint64_t generation; // when uniqueness was determined, or 0 if it hasn't been
+    uint64_t changed; // last generation in which the refs changed
+    bool unique;
+    rb_node node;
+} unique_extent;
+
+// Cached results of is_extent_unique, protected by the chunk's changed_extents_lock - see extent-tree.c
+typedef struct {
+    rb_tree tree;
+    uint32_t count;
+    uint64_t changed; // last generation in which refs changed that we couldn't keep track of
+} unique_cache;
+
 typedef struct {
     uint64_t address;
     ULONG* bmparr;
@@ -542,12 +656,12 @@ typedef struct {
     fcb* cache;
     fcb* old_cache;
     LIST_ENTRY space;
-    LIST_ENTRY space_size;
+    space_index space_index;
     LIST_ENTRY deleting;
     LIST_ENTRY changed_extents;
-    LIST_ENTRY range_locks;
+    rb_tree range_locks;
+    LIST_ENTRY range_lock_waiters;
     ERESOURCE range_locks_lock;
-    KEVENT range_locks_event;
     ERESOURCE lock;
     ERESOURCE changed_extents_lock;
     bool created;
@@ -562,6 +676,9 @@ typedef struct {
     LIST_ENTRY partial_stripes;
     ERESOURCE partial_stripes_lock;
     ULONG balance_num;
+    rb_node node_address;
+    discard_queue discard;
+    unique_cache unique;
 
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_balance;
@@ -616,6 +733,7 @@ typedef struct {
     void* in;
     void* out;
     unsigned int inlen, outlen, off, space_left;
+    unsigned int level;
     LONG left, not_started;
     KEVENT event;
     enum calc_thread_type type;
@@ -646,18 +764,30 @@ typedef struct {
     bool readonly;
     uint32_t zlib_level;
     uint32_t zstd_level;
+    bool zstd_adaptive;
+    uint32_t zstd_min_level;
+    uint32_t zstd_max_level;
     uint32_t flush_interval;
+    uint32_t flush_fcb_threshold;
+    uint32_t flush_tree_threshold;
+    uint32_t flush_extent_threshold;
+    uint32_t fcb_cache_size;
     uint32_t max_inline;
     uint64_t subvol_id;
     bool skip_balance;
     bool no_barrier;
     bool no_trim;
+    uint32_t discard;
     bool clear_cache;
     bool allow_degraded;
     bool no_root_dir;
     bool nodatacow;
 } mount_options;
 
+#define DISCARD_MODE_OFF    0
+#define DISCARD_MODE_SYNC   1
+#define DISCARD_MODE_ASYNC  2
+
 #define VCB_TYPE_FS         1
 #define VCB_TYPE_CONTROL    2
 #define VCB_TYPE_VOLUME     3
@@ -727,6 +857,48 @@ typedef struct {
     LIST_ENTRY errors;
 } scrub_info;
 
+typedef struct {
+    KSPIN_LOCK lock;
+    uint32_t zstd_level;
+    LARGE_INTEGER last_adjusted;
+    uint64_t comp_in;
+    uint64_t comp_out;
+    uint64_t comp_time;
+    uint64_t write_bytes;
+    uint64_t write_time;
+    uint64_t comp_rate;
+    uint64_t write_rate;
+    ULONG steps_up;
+    ULONG steps_down;
+} adaptive_compression;
+
+typedef struct {
+    HANDLE thread;
+    KEVENT event;
+    KEVENT finished;
+    bool quit;
+    LONG64 queued_bytes; // as of the thread's last pass
+    LONG64 ranges;
+    LONG64 bytes;
+    LONG64 ioctls;
+    LONG64 reused_bytes;
+    LONG64 skipped_bytes;
+} discard_info;
+
+typedef struct {
+    LONG64 lookups;
+    LONG64 hits;
+    LONG64 added;
+    LONG64 invalidations;
+} neg_cache_stats;
+
+typedef struct {
+    LONG64 hits;
+    LONG64 misses;
+    LONG64 trimmed;
+    LONG64 cached;
+} fcb_cache_stats;
+
 struct _volume_device_extension;
 
 typedef struct _device_extension {
@@ -781,6 +953,7 @@ typedef struct _device_extension {
     bool chunk_usage_found;
     LIST_ENTRY sys_chunks;
     LIST_ENTRY chunks;
+    rb_tree chunks_by_address;
     LIST_ENTRY trees;
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
@@ -796,7 +969,15 @@ typedef struct _device_extension {
     HANDLE flush_thread_handle;
     KTIMER flush_thread_timer;
     KEVENT flush_thread_finished;
+    KEVENT flush_kick;
+    KEVENT flush_done;
+    LONG dirty_fcb_count;
+    LONG tree_count;
+    LONG changed_extent_count;
+    uint64_t unique_epoch; // generation in which a snapshot was last taken
     drv_calc_threads calcthreads;
+    adaptive_compression adaptive_comp;
+    discard_info discard;
     balance_info balance;
     scrub_info scrub;
     ERESOURCE send_load_lock;
@@ -810,6 +991,12 @@ typedef struct _device_extension {
     PAGED_LOOKASIDE_LIST fcb_lookaside;
     PAGED_LOOKASIDE_LIST name_bit_lookaside;
     NPAGED_LOOKASIDE_LIST range_lock_lookaside;
+    range_lock_stats range_lock_stats;
+    neg_cache_stats neg_cache_stats;
+    fcb_cache_stats fcb_cache_stats;
+    hash_table sd_cache;
+    FAST_MUTEX sd_cache_mutex;
+    LONG64 delalloc_bytes;
     NPAGED_LOOKASIDE_LIST fcb_np_lookaside;
     LIST_ENTRY list_entry;
 } device_extension;
@@ -876,13 +1063,18 @@ typedef struct pdo_device_extension {
 
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY list_entry_uid;
+    LIST_ENTRY list_entry_sid;
     PSID sid;
+    uint32_t sid_hash;
     uint32_t uid;
 } uid_map;
 
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY list_entry_sid;
     PSID sid;
+    uint32_t sid_hash;
     uint32_t gid;
 } gid_map;
 
@@ -913,6 +1105,7 @@ typedef struct _write_data_context {
     LIST_ENTRY stripes;
     LONG stripes_left;
     bool need_wait;
+    LARGE_INTEGER end_time;
     uint8_t *parity1, *parity2, *scratch;
     PMDL mdl, parity1_mdl, parity2_mdl;
 } write_data_context;
@@ -1083,6 +1276,10 @@ bool get_file_attributes_from_xattr(_In_reads_bytes_(len) char* val, _In_ uint16
 
 ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ uint64_t inode,
                           _In_ uint8_t type, _In_ bool dotfile, _In_ bool ignore_xa, _In_opt_ PIRP Irp);
+ULONG calc_file_attributes(_In_ root* r, _In_ uint64_t inode, _In_ uint8_t type, _In_ bool dotfile, _In_opt_ ULONG* dosnum);
+
+_Success_(return)
+bool extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ uint8_t** data, _Out_ uint16_t* datalen);
 
 _Success_(return)
 bool get_xattr(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* subvol, _In_ uint64_t inode, _In_z_ char* name, _In_ uint32_t crc32,
@@ -1109,15 +1306,18 @@ extern xor_func do_xor;
 
 #ifdef DEBUG_CHUNK_LOCKS
 #define acquire_chunk_lock(c, Vcb) { ExAcquireResourceExclusiveLite(&c->lock, true); InterlockedIncrement(&Vcb->chunk_locks_held); }
+#define try_acquire_chunk_lock(c, Vcb) (ExAcquireResourceExclusiveLite(&(c)->lock, false) ? (InterlockedIncrement(&(Vcb)->chunk_locks_held), true) : false)
 #define release_chunk_lock(c, Vcb) { InterlockedDecrement(&Vcb->chunk_locks_held); ExReleaseResourceLite(&c->lock); }
 #else
 #define acquire_chunk_lock(c, Vcb) ExAcquireResourceExclusiveLite(&(c)->lock, true)
+#define try_acquire_chunk_lock(c, Vcb) ExAcquireResourceExclusiveLite(&(c)->lock, false)
 #define release_chunk_lock(c, Vcb) ExReleaseResourceLite(&(c)->lock)
 #endif
 
 void mark_fcb_dirty(_In_ fcb* fcb);
 void mark_fileref_dirty(_In_ file_ref* fileref);
 NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject, _In_ bool make_orphan, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback);
+void init_chunk_range_locks(_In_ chunk* c);
 void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length);
 void chunk_unlock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ uint64_t start, _In_ uint64_t length);
 void init_device(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ bool get_nums);
@@ -1134,10 +1334,11 @@ NTSTATUS __stdcall AddDevice(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT Physica
 void reap_fcb(fcb* fcb);
 void reap_fcbs(device_extension* Vcb);
 void reap_fileref(device_extension* Vcb, file_ref* fr);
-void reap_filerefs(device_extension* Vcb, file_ref* fr);
-NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len);
-NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len);
+void reap_filerefs(device_extension* Vcb, file_ref* fr, uint64_t cutoff);
+void trim_fileref_cache(device_extension* Vcb);
+void empty_fileref_cache(device_extension* Vcb);
 uint32_t get_num_of_processors();
+void calculate_total_space(_In_ device_extension* Vcb, _Out_ uint64_t* totalsize, _Out_ uint64_t* freespace);
 
 _Ret_maybenull_
 root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp);
@@ -1156,11 +1357,19 @@ extern uint32_t mount_compress_force;
 extern uint32_t mount_compress_type;
 extern uint32_t mount_zlib_level;
 extern uint32_t mount_zstd_level;
+extern uint32_t mount_zstd_adaptive;
+extern uint32_t mount_zstd_min_level;
+extern uint32_t mount_zstd_max_level;
 extern uint32_t mount_flush_interval;
+extern uint32_t mount_flush_fcb_threshold;
+extern uint32_t mount_flush_tree_threshold;
+extern uint32_t mount_flush_extent_threshold;
+extern uint32_t mount_fcb_cache_size;
 extern uint32_t mount_max_inline;
 extern uint32_t mount_skip_balance;
 extern uint32_t mount_no_barrier;
 extern uint32_t mount_no_trim;
+extern uint32_t mount_discard;
 extern uint32_t mount_clear_cache;
 extern uint32_t mount_allow_degraded;
 extern uint32_t mount_readonly;
@@ -1228,7 +1437,7 @@ void blake2b(void *out, size_t outlen, const void* in, size_t inlen);
 
 typedef struct {
     LIST_ENTRY* list;
-    LIST_ENTRY* list_size;
+    space_index* index;
     uint64_t address;
     uint64_t length;
     chunk* chunk;
@@ -1243,7 +1452,8 @@ enum rollback_type {
     ROLLBACK_INSERT_EXTENT,
     ROLLBACK_DELETE_EXTENT,
     ROLLBACK_ADD_SPACE,
-    ROLLBACK_SUBTRACT_SPACE
+    ROLLBACK_SUBTRACT_SPACE,
+    ROLLBACK_DELALLOC
 };
 
 typedef struct {
@@ -1323,12 +1533,19 @@ NTSTATUS truncate_file(fcb* fcb, uint64_t end, PIRP Irp, LIST_ENTRY* rollback) _
 NTSTATUS extend_file(fcb* fcb, file_ref* fileref, uint64_t end, bool prealloc, PIRP Irp, LIST_ENTRY* rollback) __attribute__((nonnull(1,6)));
 NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t end_data, PIRP Irp, LIST_ENTRY* rollback) __attribute__((nonnull(1,2,6)));
 chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) __attribute__((nonnull(1)));
+void chunk_index_insert(device_extension* Vcb, chunk* c) __attribute__((nonnull(1,2)));
+void chunk_index_remove(device_extension* Vcb, chunk* c) __attribute__((nonnull(1,2)));
 NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool full_size) __attribute__((nonnull(1,3)));
 NTSTATUS write_data(_In_ device_extension* Vcb, _In_ uint64_t address, _In_reads_bytes_(length) void* data, _In_ uint32_t length, _In_ write_data_context* wtc,
                     _In_opt_ PIRP Irp, _In_opt_ chunk* c, _In_ bool file_write, _In_ uint64_t irp_offset, _In_ ULONG priority) __attribute__((nonnull(1,3,5)));
 NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data, uint32_t length, PIRP Irp, chunk* c, bool file_write,
                              uint64_t irp_offset, ULONG priority) __attribute__((nonnull(1,3)));
 void free_write_data_stripes(write_data_context* wtc) __attribute__((nonnull(1)));
+uint64_t get_extents_end(fcb* fcb) __attribute__((nonnull(1)));
+void trim_speculative_prealloc(fcb* fcb, PIRP Irp) __attribute__((nonnull(1)));
+bool valid_extent_size_hint(device_extension* Vcb, uint64_t hint) __attribute__((nonnull(1)));
+bool parse_prop_extsize(device_extension* Vcb, const char* val, uint16_t len, uint32_t* hint) __attribute__((nonnull(1,2,4)));
+uint16_t get_prop_extsize_string(uint32_t hint, char* buf) __attribute__((nonnull(2)));
 
 _Dispatch_type_(IRP_MJ_WRITE)
 _Function_class_(DRIVER_DISPATCH)
@@ -1369,10 +1586,19 @@ NTSTATUS __stdcall drv_set_security(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp);
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t uid);
 void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t gid);
+NTSTATUS init_mapping_tables();
+void free_mapping_tables();
+void clear_user_mappings();
+void clear_group_mappings();
 uint32_t sid_to_uid(PSID sid);
 NTSTATUS uid_to_sid(uint32_t uid, PSID* sid);
 NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as);
 void find_gid(struct _fcb* fcb, struct _fcb* parfcb, PSECURITY_SUBJECT_CONTEXT subjcont);
+NTSTATUS init_sd_cache(_In_ device_extension* Vcb);
+void free_sd_cache(_In_ device_extension* Vcb);
+void share_sd(_In_ device_extension* Vcb, _Inout_ SECURITY_DESCRIPTOR** sd);
+SECURITY_DESCRIPTOR* dup_sd(_In_ device_extension* Vcb, _In_ SECURITY_DESCRIPTOR* sd);
+void release_sd(_In_ device_extension* Vcb, _In_ SECURITY_DESCRIPTOR* sd);
 
 // in fileinfo.c
 
@@ -1419,12 +1645,15 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
                   root* subvol, uint64_t inode, uint8_t type, PANSI_STRING utf8, bool always_add_hl, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp);
 NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp);
 NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp);
-NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8, PUNICODE_STRING name, uint8_t type, dir_child** pdc);
+NTSTATUS load_dir_children_batch(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb,
+                                 _Requires_exclusive_lock_held_(_Curr_->nonpaged->dir_children_lock) fcb* fcb, PIRP Irp);
+NTSTATUS complete_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp);
+NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8, PUNICODE_STRING name, uint8_t type, dir_child** pdc, PIRP Irp);
 NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb,
                             _In_ file_ref* sf, _In_ PUNICODE_STRING name, _In_ bool case_sensitive, _In_ bool lastpart, _In_ bool streampart,
                             _In_ POOL_TYPE pooltype, _Out_ file_ref** psf2, _In_opt_ PIRP Irp);
 fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type);
-NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uint64_t* inode, dir_child** pdc, bool case_sensitive);
+NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uint64_t* inode, dir_child** pdc, bool case_sensitive, PIRP Irp);
 uint32_t inherit_mode(fcb* parfcb, bool is_dir);
 file_ref* create_fileref(device_extension* Vcb);
 NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, root* subvol, uint64_t inode, file_ref** pfr, PIRP Irp);
@@ -1452,9 +1681,14 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
 void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, void* csum, PIRP Irp);
 bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* address);
 void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, uint64_t address, uint64_t size);
+void add_chunk_trim_entries(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, bool async);
+void send_device_trims(device_extension* Vcb, device** devs, ULONG num_devs, bool async);
+void send_trims(device_extension* Vcb);
 NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* ps);
 NTSTATUS update_dev_item(device_extension* Vcb, device* device, PIRP Irp);
 void calc_tree_checksum(device_extension* Vcb, tree_header* th);
+void check_dirty_thresholds(device_extension* Vcb);
+void throttle_writer(device_extension* Vcb);
 
 // in read.c
 
@@ -1484,20 +1718,90 @@ NTSTATUS __stdcall drv_pnp(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS pnp_surprise_removal(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS pnp_query_remove_device(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
+// in delalloc.c
+void free_delalloc(_In_ fcb* fcb);
+NTSTATUS delalloc_drop(_In_ fcb* fcb, _In_ uint64_t start, _In_ uint64_t end);
+void delalloc_read(_In_ fcb* fcb, _Out_writes_bytes_(length) uint8_t* data, _In_ uint64_t start, _In_ uint64_t length);
+void free_written_delalloc(_In_ delalloc_range* dr);
+void requeue_delalloc(_In_ delalloc_range* dr);
+NTSTATUS flush_delalloc(_In_ fcb* fcb, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback);
+NTSTATUS flush_fcb_delalloc(_In_ fcb* fcb, _In_opt_ PIRP Irp);
+NTSTATUS flush_all_delalloc(_In_ device_extension* Vcb, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback);
+NTSTATUS delalloc_write(_In_ fcb* fcb, _In_ uint64_t start, _In_ uint64_t length, _In_reads_bytes_(length) uint8_t* data,
+                        _Out_ bool* buffered, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback);
+
+// in defrag.c
+NTSTATUS defrag_file(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG length, ULONG outlength, ULONG_PTR* retlen, PIRP Irp);
+
+// in discard.c
+void init_chunk_discards(_In_ chunk* c);
+void free_chunk_discards(_In_ chunk* c);
+void queue_discard(_In_ chunk* c, _In_ uint64_t address, _In_ uint64_t size);
+void cancel_discard(_In_ chunk* c, _In_ uint64_t address, _In_ uint64_t size);
+void wait_for_chunk_discards(_In_ chunk* c);
+
+_Function_class_(KSTART_ROUTINE)
+void __stdcall discard_thread(void* context);
+
 // in free-space.c
 NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp);
 NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp);
 NTSTATUS allocate_cache(device_extension* Vcb, bool* changed, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS update_chunk_caches_tree(device_extension* Vcb, PIRP Irp);
-NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offset, uint64_t size);
+NTSTATUS add_space_entry(LIST_ENTRY* list, space_index* index, uint64_t offset, uint64_t size);
 void space_list_add(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY* rollback);
-void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
+void space_list_add2(LIST_ENTRY* list, space_index* index, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
 void space_list_subtract(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY* rollback);
-void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
-void space_list_merge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting);
+void space_list_subtract2(LIST_ENTRY* list, space_index* index, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
+void space_list_merge(LIST_ENTRY* spacelist, space_index* index, LIST_ENTRY* deleting);
+void space_index_init(space_index* index);
+void space_index_insert(space_index* index, space* s);
+void space_index_remove(space_index* index, space* s);
+void space_index_resize(space_index* index, space* s);
+space* space_index_find(space_index* index, uint64_t address);
+space* space_index_best_fit(space_index* index, uint64_t length);
+space* space_index_largest(space_index* index);
 NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load_only, PIRP Irp);
 
+// in hashtable.c
+void hash_table_init(_Out_ hash_table* ht, _In_ uint32_t (*get_hash)(LIST_ENTRY* le));
+NTSTATUS hash_table_alloc(_Inout_ hash_table* ht);
+void hash_table_free(_Inout_ hash_table* ht);
+void hash_table_move(_Inout_ hash_table* dest, _Inout_ hash_table* src);
+void hash_table_insert(_Inout_ hash_table* ht, _In_ LIST_ENTRY* le);
+void hash_table_remove(_Inout_ hash_table* ht, _In_ LIST_ENTRY* le);
+
+// in negcache.c
+_Requires_lock_held_(fcb->nonpaged->dir_children_lock)
+bool neg_cache_lookup(_In_ fcb* fcb, _In_ PUNICODE_STRING name, _In_ uint32_t hash, _In_ bool case_sensitive);
+
+_Requires_lock_held_(fcb->nonpaged->dir_children_lock)
+void neg_cache_add(_In_ fcb* fcb, _In_ PUNICODE_STRING name, _In_ uint32_t hash, _In_ bool case_sensitive);
+
+void neg_cache_free(_In_ fcb* fcb);
+
+_Requires_exclusive_lock_held_(fcb->nonpaged->dir_children_lock)
+void neg_cache_invalidate(_In_ fcb* fcb);
+
+// in upcase.c
+uint32_t calc_crc32c_uc(_In_ PUNICODE_STRING name);
+bool name_equal_uc(_In_ PUNICODE_STRING name_uc, _In_ PUNICODE_STRING name);
+NTSTATUS set_dir_child_name_uc(_Inout_ dir_child* dc);
+void free_dir_child_name_uc(_Inout_ dir_child* dc);
+
+// in rbtree.c
+void rb_insert(rb_tree* tree, rb_node* parent, rb_node** link, rb_node* node);
+void rb_remove(rb_tree* tree, rb_node* node);
+rb_node* rb_first(rb_tree* tree);
+rb_node* rb_last(rb_tree* tree);
+rb_node* rb_next(rb_node* node);
+rb_node* rb_prev(rb_node* node);
+
+// in utf.c
+NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len);
+NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len);
+
 // in extent-tree.c
 NTSTATUS increase_extent_refcount_data(device_extension* Vcb, uint64_t address, uint64_t size, uint64_t root, uint64_t inode, uint64_t offset, uint32_t refcount, PIRP Irp);
 NTSTATUS decrease_extent_refcount_data(device_extension* Vcb, uint64_t address, uint64_t size, uint64_t root, uint64_t inode, uint64_t offset,
@@ -1510,12 +1814,14 @@ uint64_t get_extent_flags(device_extension* Vcb, uint64_t address, PIRP Irp);
 void update_extent_flags(device_extension* Vcb, uint64_t address, uint64_t flags, PIRP Irp);
 NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset,
                                    int32_t count, bool no_csum, bool superseded, PIRP Irp);
-void add_changed_extent_ref(chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset, uint32_t count, bool no_csum);
+void add_changed_extent_ref(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset, uint32_t count, bool no_csum);
 uint64_t find_extent_shared_tree_refcount(device_extension* Vcb, uint64_t address, uint64_t parent, PIRP Irp);
 uint32_t find_extent_shared_data_refcount(device_extension* Vcb, uint64_t address, uint64_t parent, PIRP Irp);
 NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
                                   uint8_t level, uint64_t parent, bool superseded, PIRP Irp);
 uint64_t get_extent_data_ref_hash2(uint64_t root, uint64_t objid, uint64_t offset);
+void init_chunk_unique_cache(_In_ chunk* c);
+void free_chunk_unique_cache(_In_ chunk* c);
 
 // in worker-thread.c
 NTSTATUS do_read_job(PIRP Irp);
@@ -1534,9 +1840,15 @@ NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32
 NTSTATUS lzo_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t inpageoff);
 NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen);
 NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS write_compressed_type(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, uint8_t type, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left);
 NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left);
 NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left);
+void init_adaptive_compression(device_extension* Vcb);
+uint32_t get_zstd_level(device_extension* Vcb);
+void add_zstd_comp_sample(device_extension* Vcb, unsigned int inlen, unsigned int outlen, uint64_t time);
+void parse_prop_compression(const char* val, uint16_t len, enum prop_compression_type* type, uint8_t* level);
+uint16_t get_prop_compression_string(enum prop_compression_type type, uint8_t level, char* buf);
 
 // in galois.c
 void galois_double(uint8_t* data, uint32_t len);
@@ -1557,9 +1869,11 @@ _Function_class_(KSTART_ROUTINE)
 void __stdcall calc_thread(void* context);
 
 void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum);
+NTSTATUS add_calc_job_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum, calc_job** pcj);
+void finish_calc_job(device_extension* Vcb, calc_job* cj);
 NTSTATUS add_calc_job_decomp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
                              void* out, unsigned int outlen, unsigned int off, calc_job** pcj);
-NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
+NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, unsigned int level, void* in, unsigned int inlen,
                            void* out, unsigned int outlen, calc_job** pcj);
 void calc_thread_main(device_extension* Vcb, calc_job* cj);
 
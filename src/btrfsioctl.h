@@ -38,6 +38,12 @@
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_BTRFS_UNLOAD CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_GET_CSUM_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84a, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define FSCTL_BTRFS_GET_COMPRESSION_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84b, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_RANGE_LOCK_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84c, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_DISCARD_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84d, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_DEFRAGMENT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84e, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_NEG_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84f, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_FCB_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x850, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 typedef struct {
     uint64_t subvol;
@@ -84,6 +90,7 @@ typedef struct {
     uint64_t disk_size_zstd;
     uint64_t sparse_size;
     uint32_t num_extents;
+    uint32_t extent_size_hint;
 } btrfs_inode_info;
 
 typedef struct {
@@ -97,6 +104,8 @@ typedef struct {
     BOOL mode_changed;
     uint8_t compression_type;
     BOOL compression_type_changed;
+    uint32_t extent_size_hint;
+    BOOL extent_size_hint_changed;
 } btrfs_set_inode_info;
 
 typedef struct {
@@ -287,3 +296,64 @@ typedef struct {
     uint64_t num_sectors;
     uint8_t data[1];
 } btrfs_csum_info;
+
+typedef struct {
+    BOOL zstd_adaptive;
+    uint32_t zlib_level;
+    uint32_t zstd_level;
+    uint32_t zstd_min_level;
+    uint32_t zstd_max_level;
+    uint32_t num_threads;
+    uint64_t comp_throughput;
+    uint64_t write_throughput;
+    uint32_t steps_up;
+    uint32_t steps_down;
+} btrfs_compression_stats;
+
+typedef struct {
+    uint64_t locks;
+    uint64_t waits;
+    uint64_t wakeups;
+    uint64_t wait_time; // in microseconds
+    uint64_t max_wait_time; // in microseconds
+} btrfs_range_lock_stats;
+
+typedef struct {
+    uint32_t mode; // 0 = off, 1 = sync, 2 = async
+    uint64_t queued_bytes;
+    uint64_t ranges;
+    uint64_t bytes;
+    uint64_t ioctls;
+    uint64_t reused_bytes; // freed, but reallocated before we got round to discarding it
+    uint64_t skipped_bytes; // in ranges too small to be worth discarding
+} btrfs_discard_stats;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits; // lookups of names already known not to exist
+    uint64_t added;
+    uint64_t invalidations; // directories whose entries were thrown away when something was added to them
+} btrfs_neg_cache_stats;
+
+typedef struct {
+    uint64_t hits; // opens of files which were only still in memory because of the cache
+    uint64_t misses;
+    uint64_t trimmed;
+    uint64_t cached; // unreferenced files kept after the last flush
+} btrfs_fcb_cache_stats;
+
+#define BTRFS_DEFRAG_COMPRESS       0x1 // rewrite with compression_type, even if not fragmented
+#define BTRFS_DEFRAG_SKIP_SHARED    0x2 // leave alone extents shared with snapshots or reflinked copies
+
+typedef struct {
+    uint64_t start;
+    uint64_t length; // 0 = to end of file
+    uint32_t flags;
+    uint32_t extent_threshold; // extents at least this big aren't rewritten; 0 = default
+    uint8_t compression_type;
+} btrfs_defrag;
+
+typedef struct {
+    uint64_t bytes_rewritten;
+    uint64_t bytes_shared; // skipped because of BTRFS_DEFRAG_SKIP_SHARED
+} btrfs_defrag_result;
@@ -109,7 +109,8 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
             break;
 
             case calc_thread_comp_zlib:
-                cj2->Status = zlib_compress(src, cj2->inlen, dest, cj2->outlen, Vcb->options.zlib_level, &cj2->space_left);
+                cj2->Status = zlib_compress(src, cj2->inlen, dest, cj2->outlen, cj2->level != 0 ? cj2->level : Vcb->options.zlib_level,
+                                            &cj2->space_left);
 
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("zlib_compress returned %08lx\n", cj2->Status);
@@ -123,11 +124,23 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
             break;
 
             case calc_thread_comp_zstd:
-                cj2->Status = zstd_compress(src, cj2->inlen, dest, cj2->outlen, Vcb->options.zstd_level, &cj2->space_left);
+            {
+                LARGE_INTEGER time1, time2;
+
+                time1 = KeQueryPerformanceCounter(NULL);
+
+                cj2->Status = zstd_compress(src, cj2->inlen, dest, cj2->outlen, cj2->level != 0 ? cj2->level : get_zstd_level(Vcb),
+                                            &cj2->space_left);
+
+                time2 = KeQueryPerformanceCounter(NULL);
 
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("zstd_compress returned %08lx\n", cj2->Status);
-            break;
+                else if (cj2->level == 0) // files with their own level don't tell us anything about the volume-wide one
+                    add_zstd_comp_sample(Vcb, cj2->inlen, cj2->inlen - cj2->space_left, time2.QuadPart - time1.QuadPart);
+
+                break;
+            }
         }
 
         if (InterlockedDecrement(&cj2->left) == 0)
@@ -138,6 +151,22 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
     }
 }
 
+static enum calc_thread_type get_csum_job_type(device_extension* Vcb) {
+    switch (Vcb->superblock.csum_type) {
+        case CSUM_TYPE_XXHASH:
+            return calc_thread_xxhash;
+
+        case CSUM_TYPE_SHA256:
+            return calc_thread_sha256;
+
+        case CSUM_TYPE_BLAKE2:
+            return calc_thread_blake2;
+
+        default:
+            return calc_thread_crc32c;
+    }
+}
+
 void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum) {
     KIRQL irql;
     calc_job cj;
@@ -145,39 +174,66 @@ void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* c
     cj.in = data;
     cj.out = csum;
     cj.left = cj.not_started = sectors;
+    cj.type = get_csum_job_type(Vcb);
 
-    switch (Vcb->superblock.csum_type) {
-        case CSUM_TYPE_CRC32C:
-            cj.type = calc_thread_crc32c;
-        break;
+    KeInitializeEvent(&cj.event, NotificationEvent, false);
 
-        case CSUM_TYPE_XXHASH:
-            cj.type = calc_thread_xxhash;
-        break;
+    KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
 
-        case CSUM_TYPE_SHA256:
-            cj.type = calc_thread_sha256;
-        break;
+    InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
 
-        case CSUM_TYPE_BLAKE2:
-            cj.type = calc_thread_blake2;
-        break;
+    KeSetEvent(&Vcb->calcthreads.event, 0, false);
+    KeClearEvent(&Vcb->calcthreads.event);
+
+    KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
+
+    calc_thread_main(Vcb, &cj);
+
+    KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+}
+
+// Like do_calc_job, but returns as soon as the job is queued, so the caller can get on with
+// something else - typically the device writes for the same data. The caller has to keep data
+// and csum around until it's called finish_calc_job.
+NTSTATUS add_calc_job_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum, calc_job** pcj) {
+    calc_job* cj;
+    KIRQL irql;
+
+    cj = ExAllocatePoolWithTag(NonPagedPool, sizeof(calc_job), ALLOC_TAG);
+    if (!cj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    KeInitializeEvent(&cj.event, NotificationEvent, false);
+    cj->in = data;
+    cj->out = csum;
+    cj->left = cj->not_started = sectors;
+    cj->type = get_csum_job_type(Vcb);
+    cj->Status = STATUS_SUCCESS;
+
+    KeInitializeEvent(&cj->event, NotificationEvent, false);
 
     KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
 
-    InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
+    InsertTailList(&Vcb->calcthreads.job_list, &cj->list_entry);
 
     KeSetEvent(&Vcb->calcthreads.event, 0, false);
     KeClearEvent(&Vcb->calcthreads.event);
 
     KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
 
-    calc_thread_main(Vcb, &cj);
+    *pcj = cj;
 
-    KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+    return STATUS_SUCCESS;
+}
+
+// Helps with whatever is left of the job, waits for the calc threads to finish the rest, then frees it.
+void finish_calc_job(device_extension* Vcb, calc_job* cj) {
+    calc_thread_main(Vcb, cj);
+
+    KeWaitForSingleObject(&cj->event, Executive, KernelMode, false, NULL);
+
+    ExFreePool(cj);
 }
 
 NTSTATUS add_calc_job_decomp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
@@ -234,7 +290,7 @@ NTSTATUS add_calc_job_decomp(device_extension* Vcb, uint8_t compression, void* i
     return STATUS_SUCCESS;
 }
 
-NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
+NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, unsigned int level, void* in, unsigned int inlen,
                            void* out, unsigned int outlen, calc_job** pcj) {
     calc_job* cj;
     KIRQL irql;
@@ -249,6 +305,7 @@ NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in,
     cj->inlen = inlen;
     cj->out = out;
     cj->outlen = outlen;
+    cj->level = level;
     cj->left = cj->not_started = 1;
     cj->Status = STATUS_SUCCESS;
 
@@ -48,40 +48,34 @@ typedef struct {
     uint8_t* out;
     uint32_t outlen;
     uint32_t outpos;
-    bool error;
     void* wrkmem;
 } lzo_stream;
 
-#define LZO1X_MEM_COMPRESS ((uint32_t) (16384L * sizeof(uint8_t*)))
+// The compressor's dictionary holds 16-bit offsets into the current page, as in Linux's lzo1x_1_do_compress
+#define LZO_D_BITS 13
+#define LZO_D_SIZE (1 << LZO_D_BITS)
+#define LZO_D_MASK (LZO_D_SIZE - 1)
+
+#define LZO1X_MEM_COMPRESS ((uint32_t) (LZO_D_SIZE * sizeof(uint16_t)))
 
-#define M1_MAX_OFFSET 0x0400
 #define M2_MAX_OFFSET 0x0800
 #define M3_MAX_OFFSET 0x4000
 #define M4_MAX_OFFSET 0xbfff
 
-#define MX_MAX_OFFSET (M1_MAX_OFFSET + M2_MAX_OFFSET)
+#define M2_MAX_LEN 8
+#define M3_MAX_LEN 33
+#define M4_MAX_LEN 9
 
 #define M1_MARKER 0
 #define M2_MARKER 64
 #define M3_MARKER 32
 #define M4_MARKER 16
 
-#define _DV2(p, shift1, shift2) (((( (uint32_t)(p[2]) << shift1) ^ p[1]) << shift2) ^ p[0])
-#define DVAL_NEXT(dv, p) dv ^= p[-1]; dv = (((dv) >> 5) ^ ((uint32_t)(p[2]) << (2*5)))
-#define _DV(p, shift) _DV2(p, shift, shift)
-#define DVAL_FIRST(dv, p) dv = _DV((p), 5)
-#define _DINDEX(dv, p) ((40799u * (dv)) >> 5)
-#define DINDEX(dv, p) (((_DINDEX(dv, p)) & 0x3fff) << 0)
-#define UPDATE_D(dict, cycle, dv, p) dict[DINDEX(dv, p)] = (p)
-#define UPDATE_I(dict, cycle, index, p) dict[index] = (p)
-
-#define LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, max_offset) \
-    ((void*) m_pos < (void*) in || \
-    (m_off = (uint8_t*) ip - (uint8_t*) m_pos) <= 0 || \
-    m_off > max_offset)
-
 #define LZO_BYTE(x) ((unsigned char) (x))
 
+// Headroom the wide-copy paths need past the end of a copy, as they may over-read or over-write by up to 7 bytes
+#define LZO_COPY_SLACK 8
+
 #define ZSTD_ALLOC_TAG 0x6474737a // "zstd"
 
 // needs to be the same as Linux (fs/btrfs/zstd.c)
@@ -92,178 +86,225 @@ static void zstd_free(void* opaque, void* address);
 
 static const ZSTD_customMem zstd_mem = { .customAlloc = zstd_malloc, .customFree = zstd_free, .opaque = NULL };
 
-static uint8_t lzo_nextbyte(lzo_stream* stream) {
-    uint8_t c;
+static __inline uint32_t lzo_read32(const uint8_t* p) {
+    uint32_t v;
 
-    if (stream->inpos >= stream->inlen) {
-        stream->error = true;
-        return 0;
-    }
+    RtlCopyMemory(&v, p, sizeof(uint32_t));
+
+    return v;
+}
 
-    c = stream->in[stream->inpos];
-    stream->inpos++;
+static __inline uint64_t lzo_read64(const uint8_t* p) {
+    uint64_t v;
 
-    return c;
+    RtlCopyMemory(&v, p, sizeof(uint64_t));
+
+    return v;
+}
+
+static __inline void lzo_copy8(uint8_t* dst, const uint8_t* src) {
+    RtlCopyMemory(dst, src, 8);
 }
 
-static int lzo_len(lzo_stream* stream, int byte, int mask) {
-    int len = byte & mask;
+static __inline bool lzo_len(const uint8_t** ipp, const uint8_t* ip_end, uint32_t byte, uint32_t mask, uint32_t* len) {
+    const uint8_t* ip = *ipp;
+    const uint8_t* start;
 
-    if (len == 0) {
-        while (!(byte = lzo_nextbyte(stream))) {
-            if (stream->error) return 0;
+    *len = byte & mask;
 
-            len += 255;
-        }
+    if (*len != 0)
+        return true;
 
-        len += mask + byte;
+    start = ip;
+
+    while (ip < ip_end && *ip == 0) {
+        ip++;
     }
 
-    return len;
+    if (ip == ip_end)
+        return false;
+
+    // guard against overflow on malicious input
+    if ((size_t)(ip - start) > (0xffffffff - 255 - mask) / 255)
+        return false;
+
+    *len = ((uint32_t)(ip - start) * 255) + mask + *ip;
+    *ipp = ip + 1;
+
+    return true;
 }
 
-static void lzo_copy(lzo_stream* stream, int len) {
-    if (stream->inpos + len > stream->inlen) {
-        stream->error = true;
-        return;
-    }
+// Copies len literal bytes, truncated to the space left in the output.
+static __inline bool lzo_copy(const uint8_t** ipp, const uint8_t* ip_end, uint8_t** opp, const uint8_t* op_end, uint32_t len) {
+    const uint8_t* ip = *ipp;
+    uint8_t* op = *opp;
+    uint8_t* end;
 
-    if (stream->outpos + len > stream->outlen) {
-        stream->error = true;
-        return;
+    len = min(len, (uint32_t)(op_end - op));
+
+    if ((uint32_t)(ip_end - ip) < len)
+        return false;
+
+    end = op + len;
+
+    if ((uint32_t)(ip_end - ip) >= len + LZO_COPY_SLACK && (uint32_t)(op_end - op) >= len + LZO_COPY_SLACK) {
+        // Anything we write past end is either overwritten later, or zeroed by lzo_decompress.
+        while (op < end) {
+            lzo_copy8(op, ip);
+            op += 8;
+            ip += 8;
+        }
+    } else {
+        while (op < end) {
+            *op++ = *ip++;
+        }
     }
 
-    do {
-        stream->out[stream->outpos] = stream->in[stream->inpos];
-        stream->inpos++;
-        stream->outpos++;
-        len--;
-    } while (len > 0);
+    *ipp = *ipp + len;
+    *opp = end;
+
+    return true;
 }
 
-static void lzo_copyback(lzo_stream* stream, uint32_t back, int len) {
-    if (stream->outpos < back) {
-        stream->error = true;
-        return;
+// Copies len bytes from back bytes behind the output cursor, truncated to the space left in the output.
+static __inline bool lzo_copyback(uint8_t** opp, const uint8_t* out, const uint8_t* op_end, uint32_t back, uint32_t len) {
+    uint8_t* op = *opp;
+    const uint8_t* m_pos;
+    uint8_t* end;
+
+    if ((uint32_t)(op - out) < back)
+        return false;
+
+    len = min(len, (uint32_t)(op_end - op));
+    end = op + len;
+    m_pos = op - back;
+
+    // The source and destination of each 8-byte copy can't overlap if back >= 8, and each reads only what has already been written.
+    if (back >= 8 && (uint32_t)(op_end - op) >= len + LZO_COPY_SLACK) {
+        while (op < end) {
+            lzo_copy8(op, m_pos);
+            op += 8;
+            m_pos += 8;
+        }
+    } else {
+        while (op < end) {
+            *op++ = *m_pos++;
+        }
     }
 
-    if (stream->outpos + len > stream->outlen) {
-        stream->error = true;
-        return;
-    }
+    *opp = end;
 
-    do {
-        stream->out[stream->outpos] = stream->out[stream->outpos - back];
-        stream->outpos++;
-        len--;
-    } while (len > 0);
+    return true;
 }
 
+// Bounds are checked once per instruction rather than once per byte. The state
+// variable follows Linux's lzo1x_decompress_safe: 0 after a match with no trailing
+// literals, 1-3 after a match with that many trailing literals, and 4 after a
+// literal run.
 static NTSTATUS do_lzo_decompress(lzo_stream* stream) {
-    uint8_t byte;
-    uint32_t len, back;
-    bool backcopy = false;
+    const uint8_t* ip = stream->in;
+    const uint8_t* ip_end = stream->in + stream->inlen;
+    uint8_t* op = stream->out;
+    const uint8_t* op_end = stream->out + stream->outlen;
+    uint32_t byte, len, back, state;
 
-    stream->error = false;
+    if (ip == ip_end)
+        return STATUS_INTERNAL_ERROR;
 
-    byte = lzo_nextbyte(stream);
-    if (stream->error) return STATUS_INTERNAL_ERROR;
+    if (*ip > 17) {
+        len = *ip - 17;
+        ip++;
 
-    if (byte > 17) {
-        lzo_copy(stream, min((uint8_t)(byte - 17), (uint32_t)(stream->outlen - stream->outpos)));
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        if (!lzo_copy(&ip, ip_end, &op, op_end, len))
+            return STATUS_INTERNAL_ERROR;
 
-        if (stream->outlen == stream->outpos)
-            return STATUS_SUCCESS;
+        state = len < 4 ? len : 4;
+    } else
+        state = 0;
 
-        byte = lzo_nextbyte(stream);
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+    while (op < op_end) {
+        if (ip == ip_end)
+            return STATUS_INTERNAL_ERROR;
 
-        if (byte < 16) return STATUS_INTERNAL_ERROR;
-    }
+        byte = *ip++;
 
-    while (1) {
-        if (byte >> 4) {
-            backcopy = true;
-            if (byte >> 6) {
-                len = (byte >> 5) - 1;
-                back = (lzo_nextbyte(stream) << 3) + ((byte >> 2) & 7) + 1;
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-            } else if (byte >> 5) {
-                len = lzo_len(stream, byte, 31);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                byte = lzo_nextbyte(stream);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                back = (lzo_nextbyte(stream) << 6) + (byte >> 2) + 1;
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-            } else {
-                len = lzo_len(stream, byte, 7);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+        if (byte < M4_MARKER) {
+            if (state == 0) { // literal run
+                if (!lzo_len(&ip, ip_end, byte, 15, &len))
+                    return STATUS_INTERNAL_ERROR;
 
-                back = (1 << 14) + ((byte & 8) << 11);
+                if (!lzo_copy(&ip, ip_end, &op, op_end, len + 3))
+                    return STATUS_INTERNAL_ERROR;
 
-                byte = lzo_nextbyte(stream);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+                state = 4;
+                continue;
+            }
 
-                back += (lzo_nextbyte(stream) << 6) + (byte >> 2);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
 
-                if (back == (1 << 14)) {
-                    if (len != 1)
-                        return STATUS_INTERNAL_ERROR;
-                    break;
-                }
+            if (state == 4) { // three-byte match following a literal run
+                len = 3;
+                back = M2_MAX_OFFSET + 1 + (*ip << 2) + (byte >> 2);
+            } else {
+                len = 2;
+                back = (*ip << 2) + (byte >> 2) + 1;
             }
-        } else if (backcopy) {
-            len = 0;
-            back = (lzo_nextbyte(stream) << 2) + (byte >> 2) + 1;
-            if (stream->error) return STATUS_INTERNAL_ERROR;
-        } else {
-            len = lzo_len(stream, byte, 15);
-            if (stream->error) return STATUS_INTERNAL_ERROR;
 
-            lzo_copy(stream, min(len + 3, stream->outlen - stream->outpos));
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            ip++;
+        } else if (byte >= M2_MARKER) {
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
 
-            if (stream->outlen == stream->outpos)
-                return STATUS_SUCCESS;
+            len = (byte >> 5) + 1;
+            back = (*ip << 3) + ((byte >> 2) & 7) + 1;
+            ip++;
+        } else if (byte >= M3_MARKER) {
+            if (!lzo_len(&ip, ip_end, byte, 31, &len))
+                return STATUS_INTERNAL_ERROR;
 
-            byte = lzo_nextbyte(stream);
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (ip_end - ip < 2)
+                return STATUS_INTERNAL_ERROR;
 
-            if (byte >> 4)
-                continue;
+            len += 2;
+            back = (ip[1] << 6) + (ip[0] >> 2) + 1;
+            byte = ip[0];
+            ip += 2;
+        } else {
+            if (!lzo_len(&ip, ip_end, byte, 7, &len))
+                return STATUS_INTERNAL_ERROR;
 
-            len = 1;
-            back = (1 << 11) + (lzo_nextbyte(stream) << 2) + (byte >> 2) + 1;
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (ip_end - ip < 2)
+                return STATUS_INTERNAL_ERROR;
 
-            break;
-        }
+            back = (1 << 14) + ((byte & 8) << 11) + (ip[1] << 6) + (ip[0] >> 2);
+            byte = ip[0];
+            ip += 2;
 
-        lzo_copyback(stream, back, min(len + 2, stream->outlen - stream->outpos));
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (back == (1 << 14)) { // end of stream
+                if (len != 1)
+                    return STATUS_INTERNAL_ERROR;
 
-        if (stream->outlen == stream->outpos)
-            return STATUS_SUCCESS;
+                break;
+            }
 
-        len = byte & 3;
+            len += 2;
+        }
 
-        if (len) {
-            lzo_copy(stream, min(len, stream->outlen - stream->outpos));
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+        if (!lzo_copyback(&op, stream->out, op_end, back, len))
+            return STATUS_INTERNAL_ERROR;
 
-            if (stream->outlen == stream->outpos)
-                return STATUS_SUCCESS;
-        } else
-            backcopy = !backcopy;
+        state = byte & 3;
 
-        byte = lzo_nextbyte(stream);
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        if (state != 0 && op < op_end) {
+            if (!lzo_copy(&ip, ip_end, &op, op_end, state))
+                return STATUS_INTERNAL_ERROR;
+        }
     }
 
+    stream->inpos = (uint32_t)(ip - stream->in);
+    stream->outpos = (uint32_t)(op - stream->out);
+
     return STATUS_SUCCESS;
 }
 
@@ -276,15 +317,20 @@ NTSTATUS lzo_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_
     outoff = 0;
 
     do {
-        partlen = *(uint32_t*)&inbuf[inoff];
-
-        if (partlen + inoff > inlen) {
-            ERR("overflow: %x + %x > %x\n", partlen, inoff, inlen);
+        if (inlen - inoff < sizeof(uint32_t)) {
+            ERR("segment header at %x truncated (inlen %x)\n", inoff, inlen);
             return STATUS_INTERNAL_ERROR;
         }
 
+        partlen = lzo_read32(&inbuf[inoff]);
+
         inoff += sizeof(uint32_t);
 
+        if (partlen > inlen - inoff) {
+            ERR("overflow: %x + %x > %x\n", partlen, inoff, inlen);
+            return STATUS_INTERNAL_ERROR;
+        }
+
         stream.in = &inbuf[inoff];
         stream.inlen = partlen;
         stream.inpos = 0;
@@ -412,241 +458,154 @@ NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS lzo_do_compress(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t* out_len, void* wrkmem) {
-    const uint8_t* ip;
-    uint32_t dv;
-    uint8_t* op;
-    const uint8_t* in_end = in + in_len;
-    const uint8_t* ip_end = in + in_len - 9 - 4;
-    const uint8_t* ii;
-    const uint8_t** dict = (const uint8_t**)wrkmem;
-
-    op = out;
-    ip = in;
-    ii = ip;
-
-    DVAL_FIRST(dv, ip); UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-
-    while (1) {
-        const uint8_t* m_pos;
-        uint32_t m_len;
-        ptrdiff_t m_off;
-        uint32_t lit, dindex;
-
-        dindex = DINDEX(dv, ip);
-        m_pos = dict[dindex];
-        UPDATE_I(dict, cycle, dindex, ip);
-
-        if (!LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, M4_MAX_OFFSET) && m_pos[0] == ip[0] && m_pos[1] == ip[1] && m_pos[2] == ip[2]) {
-            lit = (uint32_t)(ip - ii);
-            m_pos += 3;
-            if (m_off <= M2_MAX_OFFSET)
-                goto match;
-
-            if (lit == 3) { /* better compression, but slower */
-                if (op - 2 <= out)
-                    return STATUS_INTERNAL_ERROR;
-
-                op[-2] |= LZO_BYTE(3);
-                *op++ = *ii++; *op++ = *ii++; *op++ = *ii++;
-                goto code_match;
-            }
+static __inline uint8_t* lzo_literal_header(uint8_t* op, uint32_t t) {
+    if (t <= 3)
+        op[-2] |= LZO_BYTE(t);
+    else if (t <= 18)
+        *op++ = LZO_BYTE(t - 3);
+    else {
+        uint32_t tt = t - 18;
 
-            if (*m_pos == ip[3])
-                goto match;
+        *op++ = 0;
+        while (tt > 255) {
+            tt -= 255;
+            *op++ = 0;
         }
 
-        /* a literal */
-        ++ip;
-        if (ip >= ip_end)
-            break;
-        DVAL_NEXT(dv, ip);
-        continue;
+        *op++ = LZO_BYTE(tt);
+    }
+
+    return op;
+}
 
-        /* a match */
-match:
-        /* store current literal run */
-        if (lit > 0) {
-            uint32_t t = lit;
+// This follows Linux's lzo1x_1_do_compress, so our output matches what the kernel
+// produces in the common case. The dictionary isn't cleared between pages: stale
+// entries are rejected by the range check, and any candidate is verified before use.
+// The output can be overrun by up to 15 bytes, which lzo_max_outlen allows for.
+static uint32_t lzo_do_compress(const uint8_t* in, uint32_t in_len, uint8_t* out, void* wrkmem) {
+    const uint8_t* ip = in;
+    const uint8_t* ii = in;
+    const uint8_t* in_end = in + in_len;
+    uint8_t* op = out;
+    uint16_t* dict = (uint16_t*)wrkmem;
+    uint32_t t;
 
-            if (t <= 3) {
-                if (op - 2 <= out)
-                    return STATUS_INTERNAL_ERROR;
+    if (in_len > 20) {
+        const uint8_t* ip_end = in_end - 20;
 
-                op[-2] |= LZO_BYTE(t);
-            } else if (t <= 18)
-                *op++ = LZO_BYTE(t - 3);
-            else {
-                uint32_t tt = t - 18;
+        // start far enough in that the first literal run never has to be folded into a previous instruction
+        ip += 4;
 
-                *op++ = 0;
-                while (tt > 255) {
-                    tt -= 255;
-                    *op++ = 0;
-                }
+        while (ip < ip_end) {
+            const uint8_t* m_pos;
+            uint32_t dv, dindex, pos, m_off, m_len;
 
-                if (tt <= 0)
-                    return STATUS_INTERNAL_ERROR;
+            dv = lzo_read32(ip);
+            dindex = ((dv * 0x1824429d) >> (32 - LZO_D_BITS)) & LZO_D_MASK;
+            pos = (uint32_t)(ip - in);
+            m_off = pos - dict[dindex];
+            dict[dindex] = (uint16_t)pos;
 
-                *op++ = LZO_BYTE(tt);
+            if (m_off == 0 || m_off > pos || m_off > M4_MAX_OFFSET || lzo_read32(ip - m_off) != dv) {
+                // skip ahead faster the longer we go without finding a match
+                ip += 1 + ((ip - ii) >> 5);
+                continue;
             }
 
-            do {
-                *op++ = *ii++;
-            } while (--t > 0);
-        }
+            m_pos = ip - m_off;
 
+            t = (uint32_t)(ip - ii);
+            if (t > 0) {
+                op = lzo_literal_header(op, t);
 
-        /* code the match */
-code_match:
-        if (ii != ip)
-            return STATUS_INTERNAL_ERROR;
+                if (t <= 16) {
+                    lzo_copy8(op, ii);
+                    lzo_copy8(op + 8, ii + 8);
+                } else
+                    RtlCopyMemory(op, ii, t);
 
-        ip += 3;
-        if (*m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++ ||
-            *m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++) {
-            --ip;
-            m_len = (uint32_t)(ip - ii);
+                op += t;
+            }
 
-            if (m_len < 3 || m_len > 8)
-                return STATUS_INTERNAL_ERROR;
+            // compare eight bytes at a time, then find where the mismatch was
+            m_len = 4;
+            while (ip + m_len < ip_end && lzo_read64(ip + m_len) == lzo_read64(m_pos + m_len)) {
+                m_len += 8;
+            }
+
+            while (ip + m_len < in_end && ip[m_len] == m_pos[m_len]) {
+                m_len++;
+            }
+
+            ip += m_len;
+            ii = ip;
 
-            if (m_off <= M2_MAX_OFFSET) {
+            if (m_len <= M2_MAX_LEN && m_off <= M2_MAX_OFFSET) {
                 m_off -= 1;
                 *op++ = LZO_BYTE(((m_len - 1) << 5) | ((m_off & 7) << 2));
                 *op++ = LZO_BYTE(m_off >> 3);
+                continue;
             } else if (m_off <= M3_MAX_OFFSET) {
                 m_off -= 1;
-                *op++ = LZO_BYTE(M3_MARKER | (m_len - 2));
-                goto m3_m4_offset;
-            } else {
-                m_off -= 0x4000;
 
-                if (m_off <= 0 || m_off > 0x7fff)
-                    return STATUS_INTERNAL_ERROR;
-
-                *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11) | (m_len - 2));
-                goto m3_m4_offset;
-            }
-        } else {
-            const uint8_t* end;
-            end = in_end;
-            while (ip < end && *m_pos == *ip)
-                m_pos++, ip++;
-            m_len = (uint32_t)(ip - ii);
-
-            if (m_len < 3)
-                return STATUS_INTERNAL_ERROR;
-
-            if (m_off <= M3_MAX_OFFSET) {
-                m_off -= 1;
-                if (m_len <= 33)
+                if (m_len <= M3_MAX_LEN)
                     *op++ = LZO_BYTE(M3_MARKER | (m_len - 2));
                 else {
-                    m_len -= 33;
+                    m_len -= M3_MAX_LEN;
                     *op++ = M3_MARKER | 0;
-                    goto m3_m4_len;
+                    goto long_len;
                 }
             } else {
                 m_off -= 0x4000;
 
-                if (m_off <= 0 || m_off > 0x7fff)
-                    return STATUS_INTERNAL_ERROR;
-
-                if (m_len <= 9)
-                    *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11) | (m_len - 2));
+                if (m_len <= M4_MAX_LEN)
+                    *op++ = LZO_BYTE(M4_MARKER | ((m_off >> 11) & 8) | (m_len - 2));
                 else {
-                    m_len -= 9;
-                    *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11));
-m3_m4_len:
+                    m_len -= M4_MAX_LEN;
+                    *op++ = LZO_BYTE(M4_MARKER | ((m_off >> 11) & 8));
+long_len:
                     while (m_len > 255) {
                         m_len -= 255;
                         *op++ = 0;
                     }
 
-                    if (m_len <= 0)
-                        return STATUS_INTERNAL_ERROR;
-
                     *op++ = LZO_BYTE(m_len);
                 }
             }
 
-m3_m4_offset:
-            *op++ = LZO_BYTE((m_off & 63) << 2);
+            *op++ = LZO_BYTE(m_off << 2);
             *op++ = LZO_BYTE(m_off >> 6);
         }
-
-        ii = ip;
-        if (ip >= ip_end)
-            break;
-        DVAL_FIRST(dv, ip);
     }
 
     /* store final literal run */
-    if (in_end - ii > 0) {
-        uint32_t t = (uint32_t)(in_end - ii);
-
+    t = (uint32_t)(in_end - ii);
+    if (t > 0) {
         if (op == out && t <= 238)
             *op++ = LZO_BYTE(17 + t);
-        else if (t <= 3)
-            op[-2] |= LZO_BYTE(t);
-        else if (t <= 18)
-            *op++ = LZO_BYTE(t - 3);
-        else {
-            uint32_t tt = t - 18;
-
-            *op++ = 0;
-            while (tt > 255) {
-                tt -= 255;
-                *op++ = 0;
-            }
-
-            if (tt <= 0)
-                return STATUS_INTERNAL_ERROR;
-
-            *op++ = LZO_BYTE(tt);
-        }
+        else
+            op = lzo_literal_header(op, t);
 
-        do {
-            *op++ = *ii++;
-        } while (--t > 0);
+        RtlCopyMemory(op, ii, t);
+        op += t;
     }
 
-    *out_len = (uint32_t)(op - out);
-
-    return STATUS_SUCCESS;
+    return (uint32_t)(op - out);
 }
 
-static NTSTATUS lzo1x_1_compress(lzo_stream* stream) {
-    uint8_t *op = stream->out;
-    NTSTATUS Status = STATUS_SUCCESS;
+static void lzo1x_1_compress(lzo_stream* stream) {
+    uint8_t* op;
 
-    if (stream->inlen <= 0)
+    if (stream->inlen == 0)
         stream->outlen = 0;
-    else if (stream->inlen <= 9 + 4) {
-        *op++ = LZO_BYTE(17 + stream->inlen);
-
-        stream->inpos = 0;
-        do {
-            *op++ = stream->in[stream->inpos];
-            stream->inpos++;
-        } while (stream->inlen < stream->inpos);
-        stream->outlen = (uint32_t)(op - stream->out);
-    } else
-        Status = lzo_do_compress(stream->in, stream->inlen, stream->out, &stream->outlen, stream->wrkmem);
-
-    if (Status == STATUS_SUCCESS) {
-        op = stream->out + stream->outlen;
-        *op++ = M4_MARKER | 1;
-        *op++ = 0;
-        *op++ = 0;
-        stream->outlen += 3;
-    }
+    else
+        stream->outlen = lzo_do_compress(stream->in, stream->inlen, stream->out, stream->wrkmem);
 
-    return Status;
+    op = stream->out + stream->outlen;
+    *op++ = M4_MARKER | 1;
+    *op++ = 0;
+    *op++ = 0;
+    stream->outlen += 3;
 }
 
 static __inline uint32_t lzo_max_outlen(uint32_t inlen) {
@@ -717,7 +676,6 @@ end:
 }
 
 NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left) {
-    NTSTATUS Status;
     unsigned int num_pages;
     unsigned int comp_data_len;
     uint8_t* comp_data;
@@ -747,6 +705,8 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    RtlZeroMemory(stream.wrkmem, LZO1X_MEM_COMPRESS);
+
     out_size = (uint32_t*)comp_data;
     *out_size = sizeof(uint32_t);
 
@@ -758,12 +718,7 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
 
         stream.inlen = (uint32_t)min(LZO_PAGE_SIZE, outlen - (i * LZO_PAGE_SIZE));
 
-        Status = lzo1x_1_compress(&stream);
-        if (!NT_SUCCESS(Status)) {
-            ERR("lzo1x_1_compress returned %08lx\n", Status);
-            ExFreePool(comp_data);
-            return Status;
-        }
+        lzo1x_1_compress(&stream);
 
         *pagelen = stream.outlen;
         *out_size += stream.outlen + sizeof(uint32_t);
@@ -777,6 +732,10 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
             stream.out += LZO_PAGE_SIZE - (*out_size % LZO_PAGE_SIZE);
             *out_size += LZO_PAGE_SIZE - (*out_size % LZO_PAGE_SIZE);
         }
+
+        // no point carrying on if the data is already incompressible
+        if (*out_size >= outlen)
+            break;
     }
 
     ExFreePool(stream.wrkmem);
@@ -856,171 +815,229 @@ NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
     return STATUS_SUCCESS;
 }
 
-typedef struct {
-    uint8_t buf[COMPRESSED_EXTENT_SIZE];
-    uint8_t compression_type;
-    unsigned int inlen;
-    unsigned int outlen;
-    calc_job* cj;
-} comp_part;
+#define COMP_WRITE_MAX_COMPRESSING 8
+#define COMP_WRITE_MAX_WRITING 8
 
-NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    uint64_t i;
-    unsigned int num_parts = (unsigned int)sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE;
-    uint8_t type;
-    comp_part* parts;
-    unsigned int buflen = 0;
-    uint8_t* buf;
-    chunk* c = NULL;
-    LIST_ENTRY* le;
-    uint64_t address, extaddr;
-    void* csum = NULL;
+#define ADAPTIVE_ZSTD_MIN_SAMPLE 0x800000 // 8 MB
 
-    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
-        type = fcb->Vcb->options.compress_type;
-    else {
-        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
-            type = BTRFS_COMPRESSION_LZO;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
-            type = BTRFS_COMPRESSION_LZO;
-        else
-            type = BTRFS_COMPRESSION_ZLIB;
+// Parses the value of the btrfs.compression property, which is the same as the
+// compress mount option on Linux: the algorithm, optionally followed by a colon
+// and the level, e.g. "zstd:9". A level of 0 means use the volume default.
+void parse_prop_compression(const char* val, uint16_t len, enum prop_compression_type* type, uint8_t* level) {
+    static const char lzo[] = "lzo";
+    static const char zlib[] = "zlib";
+    static const char zstd[] = "zstd";
+    uint16_t namelen = 0;
+    uint32_t lvl = 0;
+
+    while (namelen < len && val[namelen] != ':') {
+        namelen++;
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08lx\n", Status);
-        return Status;
+    if (namelen == sizeof(lzo) - 1 && RtlCompareMemory(val, lzo, namelen) == namelen)
+        *type = PropCompression_LZO;
+    else if (namelen == sizeof(zlib) - 1 && RtlCompareMemory(val, zlib, namelen) == namelen)
+        *type = PropCompression_Zlib;
+    else if (namelen == sizeof(zstd) - 1 && RtlCompareMemory(val, zstd, namelen) == namelen)
+        *type = PropCompression_ZSTD;
+    else {
+        *type = PropCompression_None;
+        *level = 0;
+        return;
     }
 
-    parts = ExAllocatePoolWithTag(PagedPool, sizeof(comp_part) * num_parts, ALLOC_TAG);
-    if (!parts) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+    for (uint16_t i = namelen + 1; i < len; i++) {
+        if (val[i] < '0' || val[i] > '9' || lvl > 255) {
+            lvl = 0;
+            break;
+        }
+
+        lvl = (lvl * 10) + val[i] - '0';
     }
 
-    for (i = 0; i < num_parts; i++) {
-        if (i == num_parts - 1)
-            parts[i].inlen = ((unsigned int)(end_data - start_data) - ((num_parts - 1) * COMPRESSED_EXTENT_SIZE));
-        else
-            parts[i].inlen = COMPRESSED_EXTENT_SIZE;
+    if (*type == PropCompression_Zlib && lvl > 9)
+        lvl = 9;
+    else if (*type == PropCompression_ZSTD && lvl > (uint32_t)ZSTD_maxCLevel())
+        lvl = ZSTD_maxCLevel();
+    else if (*type == PropCompression_LZO)
+        lvl = 0;
 
-        Status = add_calc_job_comp(fcb->Vcb, type, (uint8_t*)data + (i * COMPRESSED_EXTENT_SIZE), parts[i].inlen,
-                                   parts[i].buf, parts[i].inlen, &parts[i].cj);
-        if (!NT_SUCCESS(Status)) {
-            ERR("add_calc_job_comp returned %08lx\n", Status);
+    *level = (uint8_t)lvl;
+}
 
-            for (unsigned int j = 0; j < i; j++) {
-                KeWaitForSingleObject(&parts[j].cj->event, Executive, KernelMode, false, NULL);
-                ExFreePool(parts[j].cj);
-            }
+// buf needs to be at least 9 bytes long
+uint16_t get_prop_compression_string(enum prop_compression_type type, uint8_t level, char* buf) {
+    uint16_t len;
 
-            ExFreePool(parts);
-            return Status;
-        }
+    switch (type) {
+        case PropCompression_Zlib:
+            RtlCopyMemory(buf, "zlib", 4);
+            len = 4;
+            break;
+
+        case PropCompression_LZO:
+            RtlCopyMemory(buf, "lzo", 3);
+            return 3;
+
+        case PropCompression_ZSTD:
+            RtlCopyMemory(buf, "zstd", 4);
+            len = 4;
+            break;
+
+        default:
+            return 0;
     }
 
-    Status = STATUS_SUCCESS;
+    if (level != 0) {
+        buf[len] = ':';
+        len++;
 
-    for (int i = num_parts - 1; i >= 0; i--) {
-        calc_thread_main(fcb->Vcb, parts[i].cj);
+        if (level >= 100) {
+            buf[len] = '0' + (level / 100);
+            len++;
+        }
 
-        KeWaitForSingleObject(&parts[i].cj->event, Executive, KernelMode, false, NULL);
+        if (level >= 10) {
+            buf[len] = '0' + ((level / 10) % 10);
+            len++;
+        }
 
-        if (!NT_SUCCESS(parts[i].cj->Status))
-            Status = parts[i].cj->Status;
+        buf[len] = '0' + (level % 10);
+        len++;
     }
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("calc job returned %08lx\n", Status);
+    return len;
+}
 
-        for (unsigned int i = 0; i < num_parts; i++) {
-            ExFreePool(parts[i].cj);
-        }
+void init_adaptive_compression(device_extension* Vcb) {
+    adaptive_compression* ac = &Vcb->adaptive_comp;
 
-        ExFreePool(parts);
-        return Status;
+    KeInitializeSpinLock(&ac->lock);
+
+    ac->zstd_level = Vcb->options.zstd_level;
+
+    if (Vcb->options.zstd_adaptive) {
+        if (ac->zstd_level < Vcb->options.zstd_min_level)
+            ac->zstd_level = Vcb->options.zstd_min_level;
+        else if (ac->zstd_level > Vcb->options.zstd_max_level)
+            ac->zstd_level = Vcb->options.zstd_max_level;
     }
 
-    for (unsigned int i = 0; i < num_parts; i++) {
-        if (parts[i].cj->space_left >= fcb->Vcb->superblock.sector_size) {
-            parts[i].compression_type = type;
-            parts[i].outlen = parts[i].inlen - parts[i].cj->space_left;
+    ac->last_adjusted = KeQueryPerformanceCounter(NULL);
+    ac->comp_in = ac->comp_out = ac->comp_time = 0;
+    ac->write_bytes = ac->write_time = 0;
+    ac->comp_rate = ac->write_rate = 0;
+    ac->steps_up = ac->steps_down = 0;
+}
 
-            if (type == BTRFS_COMPRESSION_LZO)
-                fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
-            else if (type == BTRFS_COMPRESSION_ZSTD)
-                fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+uint32_t get_zstd_level(device_extension* Vcb) {
+    if (Vcb->options.zstd_adaptive)
+        return *(volatile uint32_t*)&Vcb->adaptive_comp.zstd_level;
+    else
+        return Vcb->options.zstd_level;
+}
 
-            if ((parts[i].outlen & (fcb->Vcb->superblock.sector_size - 1)) != 0) {
-                unsigned int newlen = (unsigned int)sector_align(parts[i].outlen, fcb->Vcb->superblock.sector_size);
+void add_zstd_comp_sample(device_extension* Vcb, unsigned int inlen, unsigned int outlen, uint64_t time) {
+    adaptive_compression* ac = &Vcb->adaptive_comp;
+    KIRQL irql;
 
-                RtlZeroMemory(parts[i].buf + parts[i].outlen, newlen - parts[i].outlen);
+    KeAcquireSpinLock(&ac->lock, &irql);
 
-                parts[i].outlen = newlen;
-            }
-        } else {
-            parts[i].compression_type = BTRFS_COMPRESSION_NONE;
-            parts[i].outlen = (unsigned int)sector_align(parts[i].inlen, fcb->Vcb->superblock.sector_size);
-        }
+    ac->comp_in += inlen;
+    ac->comp_out += outlen;
+    ac->comp_time += time;
 
-        buflen += parts[i].outlen;
-        ExFreePool(parts[i].cj);
-    }
+    KeReleaseSpinLock(&ac->lock, irql);
+}
 
-    // check if first 128 KB of file is incompressible
+static void add_zstd_write_sample(device_extension* Vcb, uint64_t bytes, uint64_t time) {
+    adaptive_compression* ac = &Vcb->adaptive_comp;
+    LARGE_INTEGER now, freq;
+    KIRQL irql;
 
-    if (start_data == 0 && parts[0].compression_type == BTRFS_COMPRESSION_NONE && !fcb->Vcb->options.compress_force) {
-        TRACE("adding nocompress flag to subvol %I64x, inode %I64x\n", fcb->subvol->id, fcb->inode);
+    now = KeQueryPerformanceCounter(&freq);
 
-        fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
-        fcb->inode_item_changed = true;
-        mark_fcb_dirty(fcb);
-    }
+    KeAcquireSpinLock(&ac->lock, &irql);
 
-    // join together into continuous buffer
+    ac->write_bytes += bytes;
+    ac->write_time += time;
 
-    buf = ExAllocatePoolWithTag(PagedPool, buflen, ALLOC_TAG);
-    if (!buf) {
-        ERR("out of memory\n");
-        ExFreePool(parts);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    // re-evaluate at most once a second, and only once we've seen enough data for the rates to mean something
 
-    {
-        uint8_t* buf2 = buf;
+    if (now.QuadPart - ac->last_adjusted.QuadPart >= freq.QuadPart && ac->comp_in >= ADAPTIVE_ZSTD_MIN_SAMPLE &&
+        ac->comp_time > 0 && ac->comp_out > 0 && ac->write_time > 0) {
+        uint64_t ratio, comp_capacity, write_capacity;
 
-        for (i = 0; i < num_parts; i++) {
-            if (parts[i].compression_type == BTRFS_COMPRESSION_NONE)
-                RtlCopyMemory(buf2, (uint8_t*)data + (i * COMPRESSED_EXTENT_SIZE), parts[i].outlen);
-            else
-                RtlCopyMemory(buf2, parts[i].buf, parts[i].outlen);
+        ac->comp_rate = ac->comp_in * freq.QuadPart / ac->comp_time;
+        ac->write_rate = ac->write_bytes * freq.QuadPart / ac->write_time;
+
+        // Compare how much uncompressed data all the calc threads together can get through
+        // with how much the devices can take at the current compression ratio.
+
+        ratio = max(ac->comp_out * 1024 / ac->comp_in, 1);
+
+        comp_capacity = ac->comp_rate * Vcb->calcthreads.num_threads;
+        write_capacity = ac->write_rate * 1024 / ratio;
 
-            buf2 += parts[i].outlen;
+        if (Vcb->options.zstd_adaptive) {
+            if (comp_capacity < write_capacity && ac->zstd_level > Vcb->options.zstd_min_level) {
+                ac->zstd_level--;
+                ac->steps_down++;
+            } else if (comp_capacity > write_capacity * 2 && ac->zstd_level < Vcb->options.zstd_max_level) {
+                ac->zstd_level++;
+                ac->steps_up++;
+            }
         }
+
+        ac->comp_in = ac->comp_out = ac->comp_time = 0;
+        ac->write_bytes = ac->write_time = 0;
+        ac->last_adjusted = now;
     }
 
-    // find an address
+    KeReleaseSpinLock(&ac->lock, irql);
+}
+
+typedef struct {
+    uint8_t* buf;
+    uint8_t compression_type;
+    unsigned int inlen;
+    unsigned int outlen;
+    calc_job* cj;
+    chunk* c;
+    uint64_t address;
+    bool writing;
+    bool range_locked;
+    uint64_t lockaddr;
+    uint64_t locklen;
+    LARGE_INTEGER submit_time;
+    write_data_context wtc;
+} comp_part;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t time;
+    LONGLONG last_end;
+} comp_write_timing;
+
+static NTSTATUS alloc_comp_part(fcb* fcb, comp_part* part, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    chunk* c2;
 
     ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, true);
 
     le = fcb->Vcb->chunks.Flink;
     while (le != &fcb->Vcb->chunks) {
-        chunk* c2 = CONTAINING_RECORD(le, chunk, list_entry);
+        c2 = CONTAINING_RECORD(le, chunk, list_entry);
 
         if (!c2->readonly && !c2->reloc) {
             acquire_chunk_lock(c2, fcb->Vcb);
 
-            if (c2->chunk_item->type == fcb->Vcb->data_flags && (c2->chunk_item->size - c2->used) >= buflen) {
-                if (find_data_address_in_chunk(fcb->Vcb, c2, buflen, &address)) {
-                    c = c2;
-                    c->used += buflen;
-                    space_list_subtract(c, address, buflen, rollback);
+            if (c2->chunk_item->type == fcb->Vcb->data_flags && (c2->chunk_item->size - c2->used) >= part->outlen) {
+                if (find_data_address_in_chunk(fcb->Vcb, c2, part->outlen, &part->address)) {
+                    part->c = c2;
+                    c2->used += part->outlen;
+                    space_list_subtract(c2, part->address, part->outlen, rollback);
                     release_chunk_lock(c2, fcb->Vcb);
                     break;
                 }
@@ -1034,164 +1051,456 @@ NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void
 
     ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
 
-    if (!c) {
-        chunk* c2;
-
-        ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, true);
+    if (part->c)
+        return STATUS_SUCCESS;
 
-        Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c2, false);
+    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, true);
 
-        ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c2, false);
 
-        if (!NT_SUCCESS(Status)) {
-            ERR("alloc_chunk returned %08lx\n", Status);
-            ExFreePool(buf);
-            ExFreePool(parts);
-            return Status;
-        }
+    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
 
-        acquire_chunk_lock(c2, fcb->Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("alloc_chunk returned %08lx\n", Status);
+        return Status;
+    }
 
-        if (find_data_address_in_chunk(fcb->Vcb, c2, buflen, &address)) {
-            c = c2;
-            c->used += buflen;
-            space_list_subtract(c, address, buflen, rollback);
-        }
+    acquire_chunk_lock(c2, fcb->Vcb);
 
-        release_chunk_lock(c2, fcb->Vcb);
+    if (find_data_address_in_chunk(fcb->Vcb, c2, part->outlen, &part->address)) {
+        part->c = c2;
+        c2->used += part->outlen;
+        space_list_subtract(c2, part->address, part->outlen, rollback);
     }
 
-    if (!c) {
-        WARN("couldn't find any data chunks with %x bytes free\n", buflen);
-        ExFreePool(buf);
-        ExFreePool(parts);
+    release_chunk_lock(c2, fcb->Vcb);
+
+    if (!part->c) {
+        WARN("couldn't find any data chunks with %x bytes free\n", part->outlen);
         return STATUS_DISK_FULL;
     }
 
-    // write to disk
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS submit_comp_part(fcb* fcb, comp_part* part, uint8_t* buf, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    KeInitializeEvent(&part->wtc.Event, NotificationEvent, false);
+    InitializeListHead(&part->wtc.stripes);
+    part->wtc.need_wait = false;
+    part->wtc.stripes_left = 0;
+    part->wtc.parity1 = part->wtc.parity2 = part->wtc.scratch = NULL;
+    part->wtc.mdl = part->wtc.parity1_mdl = part->wtc.parity2_mdl = NULL;
+
+    if (part->c->chunk_item->type & BLOCK_FLAG_RAID5 || part->c->chunk_item->type & BLOCK_FLAG_RAID6) {
+        get_raid56_lock_range(part->c, part->address, part->outlen, &part->lockaddr, &part->locklen);
+        chunk_lock_range(fcb->Vcb, part->c, part->lockaddr, part->locklen);
+        part->range_locked = true;
+    }
 
-    TRACE("writing %x bytes to %I64x\n", buflen, address);
+    TRACE("writing %x bytes to %I64x\n", part->outlen, part->address);
+
+    try {
+        Status = write_data(fcb->Vcb, part->address, buf, part->outlen, &part->wtc, Irp, part->c, false, 0,
+                            fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        Status = GetExceptionCode();
+    }
 
-    Status = write_data_complete(fcb->Vcb, address, buf, buflen, Irp, NULL, false, 0,
-                                 fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_data_complete returned %08lx\n", Status);
-        ExFreePool(buf);
-        ExFreePool(parts);
+        ERR("write_data returned %08lx\n", Status);
+
+        if (part->range_locked) {
+            chunk_unlock_range(fcb->Vcb, part->c, part->lockaddr, part->locklen);
+            part->range_locked = false;
+        }
+
+        free_write_data_stripes(&part->wtc);
         return Status;
     }
 
-    // FIXME - do rest of the function while we're waiting for I/O to finish?
+    part->writing = true;
+    part->submit_time = KeQueryPerformanceCounter(NULL);
 
-    // calculate csums if necessary
+    le = part->wtc.stripes.Flink;
+    while (le != &part->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore) {
+            part->wtc.need_wait = true;
+            IoCallDriver(stripe->device->devobj, stripe->Irp);
+        }
+
+        le = le->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS retire_comp_part(device_extension* Vcb, comp_part* part, comp_write_timing* timing) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+
+    if (part->cj) {
+        calc_thread_main(Vcb, part->cj);
+        KeWaitForSingleObject(&part->cj->event, Executive, KernelMode, false, NULL);
+        ExFreePool(part->cj);
+        part->cj = NULL;
+    }
+
+    if (!part->writing)
+        return STATUS_SUCCESS;
+
+    if (part->wtc.need_wait) {
+        KeWaitForSingleObject(&part->wtc.Event, Executive, KernelMode, false, NULL);
+
+        // count the time during which at least one of our writes was outstanding
+
+        if (part->wtc.end_time.QuadPart > timing->last_end) {
+            timing->time += part->wtc.end_time.QuadPart - max(part->submit_time.QuadPart, timing->last_end);
+            timing->last_end = part->wtc.end_time.QuadPart;
+        }
+
+        timing->bytes += part->outlen;
+    }
+
+    le = part->wtc.stripes.Flink;
+    while (le != &part->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+            Status = stripe->iosb.Status;
+            log_device_error(Vcb, stripe->device, BTRFS_DEV_STAT_WRITE_ERRORS);
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    free_write_data_stripes(&part->wtc);
+    part->writing = false;
+
+    if (part->range_locked) {
+        chunk_unlock_range(Vcb, part->c, part->lockaddr, part->locklen);
+        part->range_locked = false;
+    }
+
+    return Status;
+}
+
+static NTSTATUS add_comp_part_extent(fcb* fcb, comp_part* part, uint64_t start, uint8_t* buf, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    EXTENT_DATA* ed;
+    EXTENT_DATA2* ed2;
+    void* csum = NULL;
+
+    // calculate csums while the write is in flight
 
     if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
-        unsigned int sl = buflen >> fcb->Vcb->sector_shift;
+        unsigned int sl = part->outlen >> fcb->Vcb->sector_shift;
 
         csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
         if (!csum) {
             ERR("out of memory\n");
-            ExFreePool(buf);
-            ExFreePool(parts);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         do_calc_job(fcb->Vcb, buf, sl, csum);
     }
 
-    ExFreePool(buf);
+    ed = ExAllocatePoolWithTag(PagedPool, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2), ALLOC_TAG);
+    if (!ed) {
+        ERR("out of memory\n");
 
-    // add extents to fcb
+        if (csum)
+            ExFreePool(csum);
 
-    extaddr = address;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    for (i = 0; i < num_parts; i++) {
-        EXTENT_DATA* ed;
-        EXTENT_DATA2* ed2;
-        void* csum2;
+    ed->generation = fcb->Vcb->superblock.generation;
+    ed->decoded_size = part->inlen;
+    ed->compression = part->compression_type;
+    ed->encryption = BTRFS_ENCRYPTION_NONE;
+    ed->encoding = BTRFS_ENCODING_NONE;
+    ed->type = EXTENT_TYPE_REGULAR;
 
-        ed = ExAllocatePoolWithTag(PagedPool, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2), ALLOC_TAG);
-        if (!ed) {
-            ERR("out of memory\n");
-            ExFreePool(parts);
+    ed2 = (EXTENT_DATA2*)ed->data;
+    ed2->address = part->address;
+    ed2->size = part->outlen;
+    ed2->offset = 0;
+    ed2->num_bytes = part->inlen;
 
-            if (csum)
-                ExFreePool(csum);
+    Status = add_extent_to_fcb(fcb, start, ed, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2), true, csum, rollback);
 
-            return STATUS_INSUFFICIENT_RESOURCES;
+    ExFreePool(ed);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_extent_to_fcb returned %08lx\n", Status);
+
+        if (csum)
+            ExFreePool(csum);
+
+        return Status;
+    }
+
+    fcb->inode_item.st_blocks += part->inlen;
+
+    ExAcquireResourceExclusiveLite(&part->c->changed_extents_lock, true);
+    add_changed_extent_ref(fcb->Vcb, part->c, part->address, part->outlen, fcb->subvol->id, fcb->inode, start, 1,
+                           fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
+    ExReleaseResourceLite(&part->c->changed_extents_lock);
+
+    return STATUS_SUCCESS;
+}
+
+/* Each 128 KB part is compressed on the calc threads, then allocated and written
+ * on its own as soon as it is ready, straight from its compression buffer. At most
+ * COMP_WRITE_MAX_COMPRESSING parts are queued for compression ahead of the one
+ * we're working on, and at most COMP_WRITE_MAX_WRITING writes are left in flight.
+ * Part n lives in slot n % num_slots, which is reused once the part before it in
+ * that slot has been retired. */
+NTSTATUS write_compressed_type(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, uint8_t type, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status, Status2;
+    unsigned int num_parts = (unsigned int)sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE;
+    unsigned int num_slots, next_queue = 0, next_retire = 0;
+    comp_part* parts;
+    uint8_t* bufs;
+    comp_write_timing timing;
+    unsigned int level = 0;
+
+    // use the file's own level if it has one for the algorithm we're using
+
+    if (fcb->prop_compression_level != 0) {
+        if ((type == BTRFS_COMPRESSION_ZLIB && fcb->prop_compression == PropCompression_Zlib) ||
+            (type == BTRFS_COMPRESSION_ZSTD && fcb->prop_compression == PropCompression_ZSTD))
+            level = fcb->prop_compression_level;
+    }
+
+    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08lx\n", Status);
+        return Status;
+    }
+
+    num_slots = min(num_parts, COMP_WRITE_MAX_COMPRESSING + COMP_WRITE_MAX_WRITING);
+
+    // parts contain KEVENTs, so need to be non-paged
+
+    parts = ExAllocatePoolWithTag(NonPagedPool, sizeof(comp_part) * num_slots, ALLOC_TAG);
+    if (!parts) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(parts, sizeof(comp_part) * num_slots);
+
+    timing.bytes = timing.time = 0;
+    timing.last_end = 0;
+
+    bufs = ExAllocatePoolWithTag(PagedPool, num_slots * COMPRESSED_EXTENT_SIZE, ALLOC_TAG);
+    if (!bufs) {
+        ERR("out of memory\n");
+        ExFreePool(parts);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (unsigned int i = 0; i < num_slots; i++)
+        parts[i].buf = bufs + (i * COMPRESSED_EXTENT_SIZE);
+
+    for (unsigned int i = 0; i < num_parts; i++) {
+        comp_part* part = &parts[i % num_slots];
+        uint8_t* buf;
+
+        // keep the calc threads busy with the parts after this one, retiring old writes to free up their buffers
+
+        while (next_queue < num_parts && next_queue < i + COMP_WRITE_MAX_COMPRESSING) {
+            comp_part* qpart = &parts[next_queue % num_slots];
+            uint8_t* qbuf;
+
+            if (next_queue - next_retire >= num_slots) {
+                Status = retire_comp_part(fcb->Vcb, &parts[next_retire % num_slots], &timing);
+                next_retire++;
+
+                if (!NT_SUCCESS(Status)) {
+                    ERR("write returned %08lx\n", Status);
+                    goto end;
+                }
+            }
+
+            qbuf = qpart->buf;
+            RtlZeroMemory(qpart, sizeof(comp_part));
+            qpart->buf = qbuf;
+
+            if (next_queue == num_parts - 1)
+                qpart->inlen = ((unsigned int)(end_data - start_data) - ((num_parts - 1) * COMPRESSED_EXTENT_SIZE));
+            else
+                qpart->inlen = COMPRESSED_EXTENT_SIZE;
+
+            Status = add_calc_job_comp(fcb->Vcb, type, level, (uint8_t*)data + (next_queue * COMPRESSED_EXTENT_SIZE), qpart->inlen,
+                                       qpart->buf, qpart->inlen, &qpart->cj);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_calc_job_comp returned %08lx\n", Status);
+                goto end;
+            }
+
+            next_queue++;
         }
 
-        ed->generation = fcb->Vcb->superblock.generation;
-        ed->decoded_size = parts[i].inlen;
-        ed->compression = parts[i].compression_type;
-        ed->encryption = BTRFS_ENCRYPTION_NONE;
-        ed->encoding = BTRFS_ENCODING_NONE;
-        ed->type = EXTENT_TYPE_REGULAR;
-
-        ed2 = (EXTENT_DATA2*)ed->data;
-        ed2->address = extaddr;
-        ed2->size = parts[i].outlen;
-        ed2->offset = 0;
-        ed2->num_bytes = parts[i].inlen;
-
-        if (csum) {
-            csum2 = ExAllocatePoolWithTag(PagedPool, (parts[i].outlen * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift, ALLOC_TAG);
-            if (!csum2) {
-                ERR("out of memory\n");
-                ExFreePool(ed);
-                ExFreePool(parts);
-                ExFreePool(csum);
-                return STATUS_INSUFFICIENT_RESOURCES;
+        calc_thread_main(fcb->Vcb, part->cj);
+
+        KeWaitForSingleObject(&part->cj->event, Executive, KernelMode, false, NULL);
+
+        Status = part->cj->Status;
+
+        if (NT_SUCCESS(Status) && part->cj->space_left >= fcb->Vcb->superblock.sector_size) {
+            part->compression_type = type;
+            part->outlen = part->inlen - part->cj->space_left;
+
+            if (type == BTRFS_COMPRESSION_LZO)
+                fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+            else if (type == BTRFS_COMPRESSION_ZSTD)
+                fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+
+            if ((part->outlen & (fcb->Vcb->superblock.sector_size - 1)) != 0) {
+                unsigned int newlen = (unsigned int)sector_align(part->outlen, fcb->Vcb->superblock.sector_size);
+
+                RtlZeroMemory(part->buf + part->outlen, newlen - part->outlen);
+
+                part->outlen = newlen;
             }
+        } else {
+            part->compression_type = BTRFS_COMPRESSION_NONE;
+            part->outlen = (unsigned int)sector_align(part->inlen, fcb->Vcb->superblock.sector_size);
+        }
 
-            RtlCopyMemory(csum2, (uint8_t*)csum + (((extaddr - address) * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift),
-                          (parts[i].outlen * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift);
-        } else
-            csum2 = NULL;
+        ExFreePool(part->cj);
+        part->cj = NULL;
 
-        Status = add_extent_to_fcb(fcb, start_data + (i * COMPRESSED_EXTENT_SIZE), ed, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2),
-                                   true, csum2, rollback);
         if (!NT_SUCCESS(Status)) {
-            ERR("add_extent_to_fcb returned %08lx\n", Status);
-            ExFreePool(ed);
-            ExFreePool(parts);
+            ERR("calc job returned %08lx\n", Status);
+            goto end;
+        }
 
-            if (csum)
-                ExFreePool(csum);
+        // check if first 128 KB of file is incompressible
 
-            return Status;
+        if (i == 0 && start_data == 0 && part->compression_type == BTRFS_COMPRESSION_NONE && !fcb->Vcb->options.compress_force) {
+            TRACE("adding nocompress flag to subvol %I64x, inode %I64x\n", fcb->subvol->id, fcb->inode);
+
+            fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
+            fcb->inode_item_changed = true;
+            mark_fcb_dirty(fcb);
         }
 
-        ExFreePool(ed);
+        if (part->compression_type == BTRFS_COMPRESSION_NONE)
+            buf = (uint8_t*)data + (i * COMPRESSED_EXTENT_SIZE);
+        else
+            buf = part->buf;
 
-        fcb->inode_item.st_blocks += parts[i].inlen;
+        Status = alloc_comp_part(fcb, part, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("alloc_comp_part returned %08lx\n", Status);
+            goto end;
+        }
 
-        extaddr += parts[i].outlen;
-    }
+        // RAID5/6 writes hold the stripe range lock until they complete, so we can't
+        // have one in flight when we try to lock a range which might overlap it
 
-    if (csum)
-        ExFreePool(csum);
+        if (part->c->chunk_item->type & BLOCK_FLAG_RAID5 || part->c->chunk_item->type & BLOCK_FLAG_RAID6) {
+            while (next_retire < i) {
+                Status = retire_comp_part(fcb->Vcb, &parts[next_retire % num_slots], &timing);
+                next_retire++;
 
-    // update extent refcounts
+                if (!NT_SUCCESS(Status)) {
+                    ERR("write returned %08lx\n", Status);
+                    goto end;
+                }
+            }
+        }
 
-    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+        Status = submit_comp_part(fcb, part, buf, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("submit_comp_part returned %08lx\n", Status);
+            goto end;
+        }
 
-    extaddr = address;
+        Status = add_comp_part_extent(fcb, part, start_data + (i * COMPRESSED_EXTENT_SIZE), buf, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_comp_part_extent returned %08lx\n", Status);
+            goto end;
+        }
 
-    for (i = 0; i < num_parts; i++) {
-        add_changed_extent_ref(c, extaddr, parts[i].outlen, fcb->subvol->id, fcb->inode,
-                               start_data + (i * COMPRESSED_EXTENT_SIZE), 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
+        while (i + 1 - next_retire > COMP_WRITE_MAX_WRITING) {
+            Status = retire_comp_part(fcb->Vcb, &parts[next_retire % num_slots], &timing);
+            next_retire++;
 
-        extaddr += parts[i].outlen;
+            if (!NT_SUCCESS(Status)) {
+                ERR("write returned %08lx\n", Status);
+                goto end;
+            }
+        }
     }
 
-    ExReleaseResourceLite(&c->changed_extents_lock);
+    Status = STATUS_SUCCESS;
+
+end:
+    // wait for anything still outstanding, so we don't free buffers which are in use
+
+    while (next_retire < next_queue) {
+        Status2 = retire_comp_part(fcb->Vcb, &parts[next_retire % num_slots], &timing);
+
+        if (NT_SUCCESS(Status) && !NT_SUCCESS(Status2)) {
+            ERR("write returned %08lx\n", Status2);
+            Status = Status2;
+        }
+
+        next_retire++;
+    }
+
+    ExFreePool(bufs);
+    ExFreePool(parts);
+
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if (type == BTRFS_COMPRESSION_ZSTD && timing.bytes > 0)
+        add_zstd_write_sample(fcb->Vcb, timing.bytes, timing.time);
 
     fcb->extents_changed = true;
     fcb->inode_item_changed = true;
     mark_fcb_dirty(fcb);
 
-    ExFreePool(parts);
-
     return STATUS_SUCCESS;
 }
+
+NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
+    uint8_t type;
+
+    // whatever we're writing is newer than any delayed data we're holding for this range
+    if (!IsListEmpty(&fcb->delalloc)) {
+        NTSTATUS Status = delalloc_drop(fcb, start_data, end_data);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_drop returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
+    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
+        type = fcb->Vcb->options.compress_type;
+    else {
+        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
+            type = BTRFS_COMPRESSION_LZO;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
+            type = BTRFS_COMPRESSION_LZO;
+        else
+            type = BTRFS_COMPRESSION_ZLIB;
+    }
+
+    return write_compressed_type(fcb, start_data, end_data, data, type, Irp, rollback);
+}
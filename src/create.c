@@ -86,6 +86,14 @@ typedef struct {
     KEVENT event;
 } oplock_context;
 
+static uint32_t dir_child_get_hash(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, dir_child, list_entry_hash)->hash;
+}
+
+static uint32_t dir_child_get_hash_uc(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, dir_child, list_entry_hash_uc)->hash_uc;
+}
+
 fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type) {
     fcb* fcb;
 
@@ -129,6 +137,7 @@ fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type) {
     fcb->Header.PagingIoResource = &fcb->nonpaged->paging_resource;
 
     ExInitializeFastMutex(&fcb->nonpaged->HeaderMutex);
+    ExInitializeFastMutex(&fcb->nonpaged->neg_cache_mutex);
     FsRtlSetupAdvancedHeader(&fcb->Header, &fcb->nonpaged->HeaderMutex);
 
     fcb->refcount = 1;
@@ -145,12 +154,13 @@ fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type) {
     FsRtlInitializeOplock(fcb_oplock(fcb));
 
     InitializeListHead(&fcb->extents);
+    InitializeListHead(&fcb->delalloc);
     InitializeListHead(&fcb->hardlinks);
     InitializeListHead(&fcb->xattrs);
 
     InitializeListHead(&fcb->dir_children_index);
-    InitializeListHead(&fcb->dir_children_hash);
-    InitializeListHead(&fcb->dir_children_hash_uc);
+    hash_table_init(&fcb->dir_children_hash, dir_child_get_hash);
+    hash_table_init(&fcb->dir_children_hash_uc, dir_child_get_hash_uc);
 
     return fcb;
 }
@@ -177,142 +187,477 @@ file_ref* create_fileref(device_extension* Vcb) {
     return fr;
 }
 
-NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uint64_t* inode, dir_child** pdc, bool case_sensitive) {
+// Directories whose names come to more than this aren't read in when they're opened, so that
+// opening one file in a huge directory doesn't mean building a dir_child for every entry in it.
+// Instead lookups go to the DIR_ITEM for the name, enumeration reads the DIR_INDEX items a batch
+// at a time, and anything which changes the directory reads in the rest of it first.
+// dir_index_loaded is the index below which everything has been read in.
+
+#define DIR_CHILDREN_LAZY_SIZE  0x20000 // st_size is twice the total length of the names
+#define DIR_CHILDREN_BATCH      256
+
+static NTSTATUS create_dir_child(DIR_ITEM* di, uint64_t index, dir_child** pdc) {
+    NTSTATUS Status;
+    dir_child* dc;
+    ULONG utf16len;
+
+    Status = utf8_to_utf16(NULL, 0, &utf16len, di->name, di->n);
+    if (!NT_SUCCESS(Status)) {
+        ERR("utf8_to_utf16 1 returned %08lx\n", Status);
+        return Status;
+    }
+
+    dc = ExAllocatePoolWithTag(PagedPool, sizeof(dir_child), ALLOC_TAG);
+    if (!dc) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    dc->key = di->key;
+    dc->index = index;
+    dc->type = di->type;
+    dc->fileref = NULL;
+    dc->root_dir = false;
+
+    dc->utf8.MaximumLength = dc->utf8.Length = di->n;
+    dc->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, di->n, ALLOC_TAG);
+    if (!dc->utf8.Buffer) {
+        ERR("out of memory\n");
+        ExFreePool(dc);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(dc->utf8.Buffer, di->name, di->n);
+
+    dc->name.MaximumLength = dc->name.Length = (uint16_t)utf16len;
+    dc->name.Buffer = ExAllocatePoolWithTag(PagedPool, dc->name.MaximumLength, ALLOC_TAG);
+    if (!dc->name.Buffer) {
+        ERR("out of memory\n");
+        ExFreePool(dc->utf8.Buffer);
+        ExFreePool(dc);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = utf8_to_utf16(dc->name.Buffer, utf16len, &utf16len, di->name, di->n);
+    if (!NT_SUCCESS(Status)) {
+        ERR("utf8_to_utf16 2 returned %08lx\n", Status);
+        ExFreePool(dc->utf8.Buffer);
+        ExFreePool(dc->name.Buffer);
+        ExFreePool(dc);
+        return Status;
+    }
+
+    Status = set_dir_child_name_uc(dc);
+    if (!NT_SUCCESS(Status)) {
+        ERR("set_dir_child_name_uc returned %08lx\n", Status);
+        ExFreePool(dc->utf8.Buffer);
+        ExFreePool(dc->name.Buffer);
+        ExFreePool(dc);
+        return Status;
+    }
+
+    dc->hash = calc_crc32c(0xffffffff, (uint8_t*)dc->name.Buffer, dc->name.Length);
+
+    *pdc = dc;
+
+    return STATUS_SUCCESS;
+}
+
+// Reads DIR_INDEX items from dir_index_loaded onwards, skipping any which have already been looked up
+// by name. If max_entries is 0, we carry on to the end of the directory.
+static NTSTATUS load_dir_index(device_extension* Vcb, fcb* fcb, ULONG max_entries, PIRP Irp) {
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
     NTSTATUS Status;
-    UNICODE_STRING fnus;
-    uint32_t hash;
     LIST_ENTRY* le;
-    uint8_t c;
-    bool locked = false;
+    ULONG num_entries = 0;
+    bool end = false;
+
+    // find the first entry we've already got at or after where we're starting
+    le = fcb->dir_children_index.Blink;
+    while (le != &fcb->dir_children_index) {
+        dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+        if (dc->index < fcb->dir_index_loaded)
+            break;
+
+        le = le->Blink;
+    }
+
+    le = le->Flink;
+
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_DIR_INDEX;
+    searchkey.offset = fcb->dir_index_loaded;
 
-    if (!case_sensitive) {
-        Status = RtlUpcaseUnicodeString(&fnus, filename, true);
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (keycmp(tp.item->key, searchkey) == -1) {
+        if (find_next_item(Vcb, &tp, &next_tp, false, Irp)) {
+            tp = next_tp;
+            TRACE("moving on to %I64x,%x,%I64x\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
+        } else
+            end = true;
+    }
+
+    while (!end && tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
+        DIR_ITEM* di = (DIR_ITEM*)tp.item->data;
+        dir_child* dc;
+
+        if (max_entries != 0 && num_entries == max_entries)
+            return STATUS_SUCCESS;
+
+        num_entries++;
+
+        while (le != &fcb->dir_children_index && CONTAINING_RECORD(le, dir_child, list_entry_index)->index < tp.item->key.offset) {
+            le = le->Flink;
+        }
+
+        if (le != &fcb->dir_children_index && CONTAINING_RECORD(le, dir_child, list_entry_index)->index == tp.item->key.offset)
+            goto cont;
 
+        if (tp.item->size < sizeof(DIR_ITEM)) {
+            WARN("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(DIR_ITEM));
+            goto cont;
+        }
+
+        if (di->n == 0) {
+            WARN("(%I64x,%x,%I64x): DIR_ITEM name length is zero\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
+            goto cont;
+        }
+
+        Status = create_dir_child(di, tp.item->key.offset, &dc);
+        if (Status == STATUS_INSUFFICIENT_RESOURCES)
+            return Status;
+        else if (!NT_SUCCESS(Status))
+            goto cont;
+
+        InsertTailList(le, &dc->list_entry_index);
+
+        insert_dir_child_into_hash_lists(fcb, dc);
+
+cont:
+        fcb->dir_index_loaded = tp.item->key.offset + 1;
+
+        if (find_next_item(Vcb, &tp, &next_tp, false, Irp))
+            tp = next_tp;
+        else
+            break;
+    }
+
+    fcb->dir_children_partial = false;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS find_dir_item_index(device_extension* Vcb, fcb* fcb, DIR_ITEM* di, char* utf8, ULONG utf8len, uint64_t* index, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+
+    if (di->key.obj_type == TYPE_ROOT_ITEM) {
+        searchkey.obj_id = fcb->subvol->id;
+        searchkey.obj_type = TYPE_ROOT_REF;
+        searchkey.offset = di->key.obj_id;
+
+        Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, false, Irp);
         if (!NT_SUCCESS(Status)) {
-            ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+            ERR("find_item returned %08lx\n", Status);
             return Status;
         }
-    } else
-        fnus = *filename;
 
-    Status = check_file_name_valid(filename, false, false);
-    if (!NT_SUCCESS(Status))
+        if (!keycmp(tp.item->key, searchkey) && tp.item->size >= sizeof(ROOT_REF) - 1) {
+            ROOT_REF* rr = (ROOT_REF*)tp.item->data;
+
+            if (tp.item->size >= sizeof(ROOT_REF) - 1 + rr->n && rr->dir == fcb->inode &&
+                rr->n == utf8len && RtlCompareMemory(rr->name, utf8, utf8len) == utf8len) {
+                *index = rr->index;
+                return STATUS_SUCCESS;
+            }
+        }
+
+        return STATUS_NOT_FOUND;
+    }
+
+    searchkey.obj_id = di->key.obj_id;
+    searchkey.obj_type = TYPE_INODE_REF;
+    searchkey.offset = fcb->inode;
+
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
         return Status;
+    }
 
-    hash = calc_crc32c(0xffffffff, (uint8_t*)fnus.Buffer, fnus.Length);
+    if (!keycmp(tp.item->key, searchkey)) {
+        ULONG len = tp.item->size;
+        INODE_REF* ir = (INODE_REF*)tp.item->data;
 
-    c = hash >> 24;
+        while (len >= sizeof(INODE_REF) - 1 && len >= sizeof(INODE_REF) - 1 + ir->n) {
+            if (ir->n == utf8len && RtlCompareMemory(ir->name, utf8, utf8len) == utf8len) {
+                *index = ir->index;
+                return STATUS_SUCCESS;
+            }
 
-    if (!ExIsResourceAcquiredSharedLite(&fcb->nonpaged->dir_children_lock)) {
-        ExAcquireResourceSharedLite(&fcb->nonpaged->dir_children_lock, true);
-        locked = true;
+            len -= sizeof(INODE_REF) - 1 + ir->n;
+            ir = (INODE_REF*)&ir->name[ir->n];
+        }
     }
 
-    if (case_sensitive) {
-        if (!fcb->hash_ptrs[c]) {
-            Status = STATUS_OBJECT_NAME_NOT_FOUND;
-            goto end;
+    searchkey.obj_type = TYPE_INODE_EXTREF;
+    searchkey.offset = calc_crc32c((uint32_t)fcb->inode, (uint8_t*)utf8, utf8len);
+
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (!keycmp(tp.item->key, searchkey)) {
+        ULONG len = tp.item->size;
+        INODE_EXTREF* ier = (INODE_EXTREF*)tp.item->data;
+
+        while (len >= sizeof(INODE_EXTREF) - 1 && len >= sizeof(INODE_EXTREF) - 1 + ier->n) {
+            if (ier->dir == fcb->inode && ier->n == utf8len && RtlCompareMemory(ier->name, utf8, utf8len) == utf8len) {
+                *index = ier->index;
+                return STATUS_SUCCESS;
+            }
+
+            len -= sizeof(INODE_EXTREF) - 1 + ier->n;
+            ier = (INODE_EXTREF*)&ier->name[ier->n];
         }
+    }
 
-        le = fcb->hash_ptrs[c];
-        while (le != &fcb->dir_children_hash) {
-            dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_hash);
+    return STATUS_NOT_FOUND;
+}
 
-            if (dc->hash == hash) {
-                if (dc->name.Length == fnus.Length && RtlCompareMemory(dc->name.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
-                    if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
+// Looks up an exact name in a directory we've not read in full. Returns STATUS_OBJECT_NAME_NOT_FOUND
+// if there's no DIR_ITEM for it, or STATUS_NOT_FOUND if there is but we can't find its index, in
+// which case the caller has to read the rest of the directory.
+static NTSTATUS load_dir_item(device_extension* Vcb, fcb* fcb, PUNICODE_STRING name, dir_child** pdc, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    char* utf8;
+    ULONG utf8len, len;
+    DIR_ITEM *di, *found = NULL;
+    uint64_t index;
+    dir_child *dc, *dc2;
+    LIST_ENTRY* le;
 
-                        *subvol = NULL;
+    Status = utf16_to_utf8(NULL, 0, &utf8len, name->Buffer, name->Length);
+    if (!NT_SUCCESS(Status)) {
+        ERR("utf16_to_utf8 returned %08lx\n", Status);
+        return Status;
+    }
 
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
+    utf8 = ExAllocatePoolWithTag(PagedPool, utf8len, ALLOC_TAG);
+    if (!utf8) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
+    Status = utf16_to_utf8(utf8, utf8len, &utf8len, name->Buffer, name->Length);
+    if (!NT_SUCCESS(Status)) {
+        ERR("utf16_to_utf8 returned %08lx\n", Status);
+        goto end;
+    }
 
-                            le2 = le2->Flink;
-                        }
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_DIR_ITEM;
+    searchkey.offset = calc_crc32c(0xfffffffe, (uint8_t*)utf8, utf8len);
 
-                        *inode = SUBVOL_ROOT_INODE;
-                    } else {
-                        *subvol = fcb->subvol;
-                        *inode = dc->key.obj_id;
-                    }
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        goto end;
+    }
 
-                    *pdc = dc;
+    if (!keycmp(tp.item->key, searchkey)) {
+        len = tp.item->size;
+        di = (DIR_ITEM*)tp.item->data;
 
-                    Status = STATUS_SUCCESS;
-                    goto end;
-                }
-            } else if (dc->hash > hash) {
-                Status = STATUS_OBJECT_NAME_NOT_FOUND;
-                goto end;
+        while (len >= sizeof(DIR_ITEM) - 1 && len >= sizeof(DIR_ITEM) - 1 + di->m + di->n) {
+            if (di->n == utf8len && RtlCompareMemory(di->name, utf8, utf8len) == utf8len) {
+                found = di;
+                break;
             }
 
+            len -= sizeof(DIR_ITEM) - 1 + di->m + di->n;
+            di = (DIR_ITEM*)&di->name[di->m + di->n];
+        }
+    }
+
+    if (!found) {
+        Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto end;
+    }
+
+    Status = find_dir_item_index(Vcb, fcb, found, utf8, utf8len, &index, Irp);
+    if (!NT_SUCCESS(Status))
+        goto end;
+
+    Status = create_dir_child(found, index, &dc);
+    if (!NT_SUCCESS(Status))
+        goto end;
+
+    // keep the list in index order
+    le = fcb->dir_children_index.Blink;
+    while (le != &fcb->dir_children_index) {
+        dc2 = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+        if (dc2->index < index)
+            break;
+
+        le = le->Blink;
+    }
+
+    InsertHeadList(le, &dc->list_entry_index);
+
+    insert_dir_child_into_hash_lists(fcb, dc);
+
+    *pdc = dc;
+
+end:
+    ExFreePool(utf8);
+
+    return Status;
+}
+
+static dir_child* find_dir_child(fcb* fcb, PUNICODE_STRING name, uint32_t hash, bool case_sensitive) {
+    LIST_ENTRY *le, *head;
+
+    if (case_sensitive) {
+        head = hash_table_bucket(&fcb->dir_children_hash, hash);
+
+        le = head->Flink;
+        while (le != head) {
+            dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_hash);
+
+            if (dc->hash == hash && dc->name.Length == name->Length && RtlCompareMemory(dc->name.Buffer, name->Buffer, name->Length) == name->Length)
+                return dc;
+
             le = le->Flink;
         }
     } else {
-        if (!fcb->hash_ptrs_uc[c]) {
-            Status = STATUS_OBJECT_NAME_NOT_FOUND;
-            goto end;
-        }
+        head = hash_table_bucket(&fcb->dir_children_hash_uc, hash);
 
-        le = fcb->hash_ptrs_uc[c];
-        while (le != &fcb->dir_children_hash_uc) {
+        le = head->Flink;
+        while (le != head) {
             dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
 
-            if (dc->hash_uc == hash) {
-                if (dc->name_uc.Length == fnus.Length && RtlCompareMemory(dc->name_uc.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
-                    if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
+            if (dc->hash_uc == hash && name_equal_uc(&dc->name_uc, name))
+                return dc;
 
-                        *subvol = NULL;
+            le = le->Flink;
+        }
+    }
 
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
+    return NULL;
+}
 
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
+NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uint64_t* inode, dir_child** pdc, bool case_sensitive, PIRP Irp) {
+    NTSTATUS Status;
+    uint32_t hash, neg_hash;
+    dir_child* dc;
+    bool locked = false;
 
-                            le2 = le2->Flink;
-                        }
+    Status = check_file_name_valid(filename, false, false);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-                        *inode = SUBVOL_ROOT_INODE;
-                    } else {
-                        *subvol = fcb->subvol;
-                        *inode = dc->key.obj_id;
-                    }
+    neg_hash = calc_crc32c(0xffffffff, (uint8_t*)filename->Buffer, filename->Length);
+
+    if (!ExIsResourceAcquiredSharedLite(&fcb->nonpaged->dir_children_lock)) {
+        ExAcquireResourceSharedLite(&fcb->nonpaged->dir_children_lock, true);
+        locked = true;
+    }
+
+    if (neg_cache_lookup(fcb, filename, neg_hash, case_sensitive)) {
+        if (locked)
+            ExReleaseResourceLite(&fcb->nonpaged->dir_children_lock);
 
-                    *pdc = dc;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    hash = case_sensitive ? neg_hash : calc_crc32c_uc(filename);
+
+    dc = find_dir_child(fcb, filename, hash, case_sensitive);
+
+    // If we've not read the whole directory in yet, try looking the name up in the tree. If it's
+    // not there in that exact case, that's the end of it for a case-sensitive lookup, but otherwise
+    // we've no choice but to read the rest of the directory. Callers which already hold
+    // dir_children_lock have to hold it exclusively if this might happen.
+
+    if (!dc && fcb->dir_children_partial) {
+        if (locked) {
+            ExReleaseResourceLite(&fcb->nonpaged->dir_children_lock);
+            ExAcquireResourceExclusiveLite(&fcb->nonpaged->dir_children_lock, true);
 
-                    Status = STATUS_SUCCESS;
+            dc = find_dir_child(fcb, filename, hash, case_sensitive);
+        }
+
+        if (!dc && fcb->dir_children_partial) {
+            Status = load_dir_item(fcb->Vcb, fcb, filename, &dc, Irp);
+
+            if (Status == STATUS_OBJECT_NAME_NOT_FOUND && case_sensitive)
+                dc = NULL;
+            else if (Status == STATUS_OBJECT_NAME_NOT_FOUND || Status == STATUS_NOT_FOUND) {
+                Status = load_dir_index(fcb->Vcb, fcb, 0, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("load_dir_index returned %08lx\n", Status);
                     goto end;
                 }
-            } else if (dc->hash_uc > hash) {
-                Status = STATUS_OBJECT_NAME_NOT_FOUND;
+
+                dc = find_dir_child(fcb, filename, hash, case_sensitive);
+            } else if (!NT_SUCCESS(Status)) {
+                ERR("load_dir_item returned %08lx\n", Status);
                 goto end;
             }
+        }
+    }
 
-            le = le->Flink;
+    if (!dc) {
+        neg_cache_add(fcb, filename, neg_hash, case_sensitive);
+        Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto end;
+    }
+
+    if (dc->key.obj_type == TYPE_ROOT_ITEM) {
+        LIST_ENTRY* le2;
+
+        *subvol = NULL;
+
+        le2 = fcb->Vcb->roots.Flink;
+        while (le2 != &fcb->Vcb->roots) {
+            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
+
+            if (r2->id == dc->key.obj_id) {
+                *subvol = r2;
+                break;
+            }
+
+            le2 = le2->Flink;
         }
+
+        *inode = SUBVOL_ROOT_INODE;
+    } else {
+        *subvol = fcb->subvol;
+        *inode = dc->key.obj_id;
     }
 
-    Status = STATUS_OBJECT_NAME_NOT_FOUND;
+    *pdc = dc;
+
+    Status = STATUS_SUCCESS;
 
 end:
     if (locked)
         ExReleaseResourceLite(&fcb->nonpaged->dir_children_lock);
 
-    if (!case_sensitive)
-        ExFreePool(fnus.Buffer);
-
     return Status;
 }
 
@@ -466,174 +811,70 @@ NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb
         return Status;
     }
 
-    i = 0;
-    do {
-        if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
-            ULONG readlen;
-
-            if (start < tp.item->key.offset)
-                j = 0;
-            else
-                j = ((start - tp.item->key.offset) >> Vcb->sector_shift) + i;
-
-            if (j * Vcb->csum_size > tp.item->size || tp.item->key.offset > start + (i << Vcb->sector_shift)) {
-                ERR("checksum not found for %I64x\n", start + (i << Vcb->sector_shift));
-                return STATUS_INTERNAL_ERROR;
-            }
-
-            readlen = (ULONG)min((tp.item->size / Vcb->csum_size) - j, length - i);
-            RtlCopyMemory(ptr, tp.item->data + (j * Vcb->csum_size), readlen * Vcb->csum_size);
-
-            ptr = (uint8_t*)ptr + (readlen * Vcb->csum_size);
-            i += readlen;
-
-            if (i == length)
-                break;
-        }
-
-        b = find_next_item(Vcb, &tp, &next_tp, false, Irp);
-
-        if (b)
-            tp = next_tp;
-    } while (b);
-
-    if (i < length) {
-        ERR("could not read checksums: offset %I64x, length %I64x sectors\n", start, length);
-        return STATUS_INTERNAL_ERROR;
-    }
-
-    return STATUS_SUCCESS;
-}
-
-NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp) {
-    KEY searchkey;
-    traverse_ptr tp, next_tp;
-    NTSTATUS Status;
-    ULONG num_children = 0;
-    uint64_t max_index = 2;
-
-    fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!fcb->hash_ptrs) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    RtlZeroMemory(fcb->hash_ptrs, sizeof(LIST_ENTRY*) * 256);
-
-    fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!fcb->hash_ptrs_uc) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    RtlZeroMemory(fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
-
-    if (!ignore_size && fcb->inode_item.st_size == 0)
-        return STATUS_SUCCESS;
-
-    searchkey.obj_id = fcb->inode;
-    searchkey.obj_type = TYPE_DIR_INDEX;
-    searchkey.offset = 2;
-
-    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
-    if (!NT_SUCCESS(Status)) {
-        ERR("find_item returned %08lx\n", Status);
-        return Status;
-    }
-
-    if (keycmp(tp.item->key, searchkey) == -1) {
-        if (find_next_item(Vcb, &tp, &next_tp, false, Irp)) {
-            tp = next_tp;
-            TRACE("moving on to %I64x,%x,%I64x\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-        }
-    }
-
-    while (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
-        DIR_ITEM* di = (DIR_ITEM*)tp.item->data;
-        dir_child* dc;
-        ULONG utf16len;
-
-        if (tp.item->size < sizeof(DIR_ITEM)) {
-            WARN("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(DIR_ITEM));
-            goto cont;
-        }
-
-        if (di->n == 0) {
-            WARN("(%I64x,%x,%I64x): DIR_ITEM name length is zero\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-            goto cont;
-        }
+    i = 0;
+    do {
+        if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
+            ULONG readlen;
 
-        Status = utf8_to_utf16(NULL, 0, &utf16len, di->name, di->n);
-        if (!NT_SUCCESS(Status)) {
-            ERR("utf8_to_utf16 1 returned %08lx\n", Status);
-            goto cont;
-        }
+            if (start < tp.item->key.offset)
+                j = 0;
+            else
+                j = ((start - tp.item->key.offset) >> Vcb->sector_shift) + i;
 
-        dc = ExAllocatePoolWithTag(PagedPool, sizeof(dir_child), ALLOC_TAG);
-        if (!dc) {
-            ERR("out of memory\n");
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+            if (j * Vcb->csum_size > tp.item->size || tp.item->key.offset > start + (i << Vcb->sector_shift)) {
+                ERR("checksum not found for %I64x\n", start + (i << Vcb->sector_shift));
+                return STATUS_INTERNAL_ERROR;
+            }
 
-        dc->key = di->key;
-        dc->index = tp.item->key.offset;
-        dc->type = di->type;
-        dc->fileref = NULL;
-        dc->root_dir = false;
+            readlen = (ULONG)min((tp.item->size / Vcb->csum_size) - j, length - i);
+            RtlCopyMemory(ptr, tp.item->data + (j * Vcb->csum_size), readlen * Vcb->csum_size);
 
-        max_index = dc->index;
+            ptr = (uint8_t*)ptr + (readlen * Vcb->csum_size);
+            i += readlen;
 
-        dc->utf8.MaximumLength = dc->utf8.Length = di->n;
-        dc->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, di->n, ALLOC_TAG);
-        if (!dc->utf8.Buffer) {
-            ERR("out of memory\n");
-            ExFreePool(dc);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            if (i == length)
+                break;
         }
 
-        RtlCopyMemory(dc->utf8.Buffer, di->name, di->n);
+        b = find_next_item(Vcb, &tp, &next_tp, false, Irp);
 
-        dc->name.MaximumLength = dc->name.Length = (uint16_t)utf16len;
-        dc->name.Buffer = ExAllocatePoolWithTag(PagedPool, dc->name.MaximumLength, ALLOC_TAG);
-        if (!dc->name.Buffer) {
-            ERR("out of memory\n");
-            ExFreePool(dc->utf8.Buffer);
-            ExFreePool(dc);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+        if (b)
+            tp = next_tp;
+    } while (b);
 
-        Status = utf8_to_utf16(dc->name.Buffer, utf16len, &utf16len, di->name, di->n);
-        if (!NT_SUCCESS(Status)) {
-            ERR("utf8_to_utf16 2 returned %08lx\n", Status);
-            ExFreePool(dc->utf8.Buffer);
-            ExFreePool(dc->name.Buffer);
-            ExFreePool(dc);
-            goto cont;
-        }
+    if (i < length) {
+        ERR("could not read checksums: offset %I64x, length %I64x sectors\n", start, length);
+        return STATUS_INTERNAL_ERROR;
+    }
 
-        Status = RtlUpcaseUnicodeString(&dc->name_uc, &dc->name, true);
-        if (!NT_SUCCESS(Status)) {
-            ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-            ExFreePool(dc->utf8.Buffer);
-            ExFreePool(dc->name.Buffer);
-            ExFreePool(dc);
-            goto cont;
-        }
+    return STATUS_SUCCESS;
+}
 
-        dc->hash = calc_crc32c(0xffffffff, (uint8_t*)dc->name.Buffer, dc->name.Length);
-        dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)dc->name_uc.Buffer, dc->name_uc.Length);
+NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp) {
+    NTSTATUS Status;
 
-        InsertTailList(&fcb->dir_children_index, &dc->list_entry_index);
+    Status = hash_table_alloc(&fcb->dir_children_hash);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-        insert_dir_child_into_hash_lists(fcb, dc);
+    Status = hash_table_alloc(&fcb->dir_children_hash_uc);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-        num_children++;
+    if (!ignore_size && fcb->inode_item.st_size == 0)
+        return STATUS_SUCCESS;
 
-cont:
-        if (find_next_item(Vcb, &tp, &next_tp, false, Irp))
-            tp = next_tp;
-        else
-            break;
+    fcb->dir_children_partial = true;
+    fcb->dir_index_loaded = 2;
+
+    // not for subvol roots which might need $Root adding to the end
+    if (!ignore_size && fcb->inode_item.st_size >= DIR_CHILDREN_LAZY_SIZE && (fcb->inode != SUBVOL_ROOT_INODE || Vcb->options.no_root_dir))
+        return STATUS_SUCCESS;
+
+    Status = load_dir_index(Vcb, fcb, 0, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_dir_index returned %08lx\n", Status);
+        return Status;
     }
 
     if (!Vcb->options.no_root_dir && fcb->inode == SUBVOL_ROOT_INODE) {
@@ -654,7 +895,7 @@ cont:
             dc->key.obj_id = BTRFS_ROOT_FSTREE;
             dc->key.obj_type = TYPE_ROOT_ITEM;
             dc->key.offset = 0;
-            dc->index = max_index + 1;
+            dc->index = max(3, fcb->dir_index_loaded);
             dc->type = BTRFS_TYPE_DIRECTORY;
             dc->fileref = NULL;
             dc->root_dir = true;
@@ -680,17 +921,16 @@ cont:
 
             RtlCopyMemory(dc->name.Buffer, root_dir_utf16, sizeof(root_dir_utf16) - sizeof(WCHAR));
 
-            Status = RtlUpcaseUnicodeString(&dc->name_uc, &dc->name, true);
+            Status = set_dir_child_name_uc(dc);
             if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+                ERR("set_dir_child_name_uc returned %08lx\n", Status);
                 ExFreePool(dc->utf8.Buffer);
                 ExFreePool(dc->name.Buffer);
                 ExFreePool(dc);
-                goto cont;
+                return Status;
             }
 
             dc->hash = calc_crc32c(0xffffffff, (uint8_t*)dc->name.Buffer, dc->name.Length);
-            dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)dc->name_uc.Buffer, dc->name_uc.Length);
 
             InsertTailList(&fcb->dir_children_index, &dc->list_entry_index);
 
@@ -701,72 +941,92 @@ cont:
     return STATUS_SUCCESS;
 }
 
+NTSTATUS load_dir_children_batch(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb,
+                                 _Requires_exclusive_lock_held_(_Curr_->nonpaged->dir_children_lock) fcb* fcb, PIRP Irp) {
+    return load_dir_index(Vcb, fcb, DIR_CHILDREN_BATCH, Irp);
+}
+
+// Anything which changes a directory's entries has to call this first: until the next flush
+// the tree won't match what we've got in memory, so we can't go back to it for the rest.
+NTSTATUS complete_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    bool locked;
+
+    if (!fcb->dir_children_partial)
+        return STATUS_SUCCESS;
+
+    locked = ExIsResourceAcquiredExclusiveLite(&fcb->nonpaged->dir_children_lock);
+
+    if (!locked)
+        ExAcquireResourceExclusiveLite(&fcb->nonpaged->dir_children_lock, true);
+
+    if (fcb->dir_children_partial) {
+        Status = load_dir_index(Vcb, fcb, 0, Irp);
+        if (!NT_SUCCESS(Status))
+            ERR("load_dir_index returned %08lx\n", Status);
+    }
+
+    if (!locked)
+        ExReleaseResourceLite(&fcb->nonpaged->dir_children_lock);
+
+    return Status;
+}
+
+// Returns the open fcb for the inode, preferring one that hasn't been deleted. Streams aren't
+// returned, though they share their file's hash.
+static fcb* find_fcb_in_subvol(root* subvol, uint64_t inode, uint32_t hash) {
+    LIST_ENTRY* bucket = hash_table_bucket(&subvol->fcbs_hash, hash);
+    LIST_ENTRY* le;
+    fcb* deleted_fcb = NULL;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
+
+        if (fcb->inode == inode && !fcb->ads) {
+            if (!fcb->deleted)
+                return fcb;
+
+            deleted_fcb = fcb;
+        }
+
+        le = le->Flink;
+    }
+
+    return deleted_fcb;
+}
+
 NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb,
                   root* subvol, uint64_t inode, uint8_t type, PANSI_STRING utf8, bool always_add_hl, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
-    fcb *fcb, *deleted_fcb = NULL;
+    fcb *fcb, *fcb2;
     bool atts_set = false, sd_set = false, no_data;
-    LIST_ENTRY* lastle = NULL;
     EXTENT_DATA* ed = NULL;
-    uint64_t fcbs_version = 0;
     uint32_t hash;
 
     hash = calc_crc32c(0xffffffff, (uint8_t*)&inode, sizeof(uint64_t));
 
     acquire_fcb_lock_shared(Vcb);
 
-    if (subvol->fcbs_ptrs[hash >> 24]) {
-        LIST_ENTRY* le = subvol->fcbs_ptrs[hash >> 24];
-
-        while (le != &subvol->fcbs) {
-            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-            if (fcb->inode == inode) {
-                if (!fcb->ads) {
-                    if (fcb->deleted)
-                        deleted_fcb = fcb;
-                    else {
+    fcb = find_fcb_in_subvol(subvol, inode, hash);
+    if (fcb) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                        LONG rc = InterlockedIncrement(&fcb->refcount);
+        LONG rc = InterlockedIncrement(&fcb->refcount);
 
-                        WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb, rc, fcb->subvol->id, fcb->inode);
+        WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb, rc, fcb->subvol->id, fcb->inode);
 #else
-                        InterlockedIncrement(&fcb->refcount);
+        InterlockedIncrement(&fcb->refcount);
 #endif
 
-                        *pfcb = fcb;
-                        release_fcb_lock(Vcb);
-                        return STATUS_SUCCESS;
-                    }
-                }
-            } else if (fcb->hash > hash) {
-                if (deleted_fcb) {
-                    InterlockedIncrement(&deleted_fcb->refcount);
-                    *pfcb = deleted_fcb;
-                    release_fcb_lock(Vcb);
-                    return STATUS_SUCCESS;
-                }
-
-                lastle = le->Blink;
-                fcbs_version = subvol->fcbs_version;
-
-                break;
-            }
-
-            le = le->Flink;
-        }
+        *pfcb = fcb;
+        release_fcb_lock(Vcb);
+        return STATUS_SUCCESS;
     }
 
     release_fcb_lock(Vcb);
 
-    if (deleted_fcb) {
-        InterlockedIncrement(&deleted_fcb->refcount);
-        *pfcb = deleted_fcb;
-        return STATUS_SUCCESS;
-    }
-
     fcb = create_fcb(Vcb, pooltype);
     if (!fcb) {
         ERR("out of memory\n");
@@ -1060,26 +1320,20 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
 
                         // We have to test against our copy rather than the source, as RtlValidRelativeSecurityDescriptor
                         // will fail if the ACLs aren't 32-bit aligned.
-                        if (!RtlValidRelativeSecurityDescriptor(fcb->sd, di->m, 0))
+                        if (!RtlValidRelativeSecurityDescriptor(fcb->sd, di->m, 0)) {
                             ExFreePool(fcb->sd);
-                        else
+                            fcb->sd = NULL;
+                        } else {
+                            share_sd(Vcb, &fcb->sd);
                             sd_set = true;
+                        }
                     }
                 } else if (tp.item->key.offset == EA_PROP_COMPRESSION_HASH && di->n == sizeof(EA_PROP_COMPRESSION) - 1 && RtlCompareMemory(EA_PROP_COMPRESSION, di->name, di->n) == di->n) {
-                    if (di->m > 0) {
-                        static const char lzo[] = "lzo";
-                        static const char zlib[] = "zlib";
-                        static const char zstd[] = "zstd";
-
-                        if (di->m == sizeof(lzo) - 1 && RtlCompareMemory(&di->name[di->n], lzo, di->m) == di->m)
-                            fcb->prop_compression = PropCompression_LZO;
-                        else if (di->m == sizeof(zlib) - 1 && RtlCompareMemory(&di->name[di->n], zlib, di->m) == di->m)
-                            fcb->prop_compression = PropCompression_Zlib;
-                        else if (di->m == sizeof(zstd) - 1 && RtlCompareMemory(&di->name[di->n], zstd, di->m) == di->m)
-                            fcb->prop_compression = PropCompression_ZSTD;
-                        else
-                            fcb->prop_compression = PropCompression_None;
-                    }
+                    if (di->m > 0)
+                        parse_prop_compression(&di->name[di->n], di->m, &fcb->prop_compression, &fcb->prop_compression_level);
+                } else if (tp.item->key.offset == EA_PROP_EXTSIZE_HASH && di->n == sizeof(EA_PROP_EXTSIZE) - 1 && RtlCompareMemory(EA_PROP_EXTSIZE, di->name, di->n) == di->n) {
+                    if (di->m > 0 && !parse_prop_extsize(Vcb, &di->name[di->n], di->m, &fcb->extent_size_hint))
+                        WARN("ignoring invalid btrfs.extsize property on inode %I64x\n", fcb->inode);
                 } else if (tp.item->key.offset == EA_CASE_SENSITIVE_HASH && di->n == sizeof(EA_CASE_SENSITIVE) - 1 && RtlCompareMemory(EA_CASE_SENSITIVE, di->name, di->n) == di->n) {
                     if (di->m > 0) {
                         fcb->case_sensitive = di->m == 1 && di->name[di->n] == '1';
@@ -1136,9 +1390,9 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
                         return Status;
                     }
 
-                    Status = RtlUpcaseUnicodeString(&dc->name_uc, &dc->name, true);
+                    Status = set_dir_child_name_uc(dc);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+                        ERR("set_dir_child_name_uc returned %08lx\n", Status);
                         ExFreePool(dc->utf8.Buffer);
                         ExFreePool(dc->name.Buffer);
                         ExFreePool(dc);
@@ -1256,100 +1510,37 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
 
     acquire_fcb_lock_exclusive(Vcb);
 
-    if (lastle && subvol->fcbs_version == fcbs_version) {
-        InsertHeadList(lastle, &fcb->list_entry);
-
-        if (!subvol->fcbs_ptrs[hash >> 24] || CONTAINING_RECORD(subvol->fcbs_ptrs[hash >> 24], struct _fcb, list_entry)->hash > hash)
-            subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-    } else {
-        lastle = NULL;
-
-        if (subvol->fcbs_ptrs[hash >> 24]) {
-            LIST_ENTRY* le = subvol->fcbs_ptrs[hash >> 24];
-
-            while (le != &subvol->fcbs) {
-                struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-                if (fcb2->inode == inode) {
-                    if (!fcb2->ads) {
-                        if (fcb2->deleted)
-                            deleted_fcb = fcb2;
-                        else {
+    // someone else might have opened the inode while we weren't holding the lock
+    fcb2 = find_fcb_in_subvol(subvol, inode, hash);
+    if (fcb2) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                            LONG rc = InterlockedIncrement(&fcb2->refcount);
+        LONG rc = InterlockedIncrement(&fcb2->refcount);
 
-                            WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb2, rc, fcb2->subvol->id, fcb2->inode);
+        WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb2, rc, fcb2->subvol->id, fcb2->inode);
 #else
-                            InterlockedIncrement(&fcb2->refcount);
+        InterlockedIncrement(&fcb2->refcount);
 #endif
 
-                            *pfcb = fcb2;
-                            reap_fcb(fcb);
-                            release_fcb_lock(Vcb);
-                            return STATUS_SUCCESS;
-                        }
-                    }
-                } else if (fcb2->hash > hash) {
-                    if (deleted_fcb) {
-                        InterlockedIncrement(&deleted_fcb->refcount);
-                        *pfcb = deleted_fcb;
-                        reap_fcb(fcb);
-                        release_fcb_lock(Vcb);
-                        return STATUS_SUCCESS;
-                    }
-
-                    lastle = le->Blink;
-                    break;
-                }
-
-                le = le->Flink;
-            }
-        }
-
-        if (fcb->type == BTRFS_TYPE_DIRECTORY && fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT && fcb->reparse_xattr.Length == 0) {
-            fcb->atts &= ~FILE_ATTRIBUTE_REPARSE_POINT;
-
-            if (!Vcb->readonly && !is_subvol_readonly(subvol, Irp)) {
-                fcb->atts_changed = true;
-                mark_fcb_dirty(fcb);
-            }
-        }
-
-        if (!lastle) {
-            uint8_t c = hash >> 24;
-
-            if (c != 0xff) {
-                uint8_t d = c + 1;
-
-                do {
-                    if (subvol->fcbs_ptrs[d]) {
-                        lastle = subvol->fcbs_ptrs[d]->Blink;
-                        break;
-                    }
-
-                    d++;
-                } while (d != 0);
-            }
-        }
-
-        if (lastle) {
-            InsertHeadList(lastle, &fcb->list_entry);
+        *pfcb = fcb2;
+        reap_fcb(fcb);
+        release_fcb_lock(Vcb);
+        return STATUS_SUCCESS;
+    }
 
-            if (lastle == &subvol->fcbs || (CONTAINING_RECORD(lastle, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-                subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-        } else {
-            InsertTailList(&subvol->fcbs, &fcb->list_entry);
+    if (fcb->type == BTRFS_TYPE_DIRECTORY && fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT && fcb->reparse_xattr.Length == 0) {
+        fcb->atts &= ~FILE_ATTRIBUTE_REPARSE_POINT;
 
-            if (fcb->list_entry.Blink == &subvol->fcbs || (CONTAINING_RECORD(fcb->list_entry.Blink, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-                subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
+        if (!Vcb->readonly && !is_subvol_readonly(subvol, Irp)) {
+            fcb->atts_changed = true;
+            mark_fcb_dirty(fcb);
         }
     }
 
+    add_fcb_to_subvol(fcb);
+
     if (fcb->inode == SUBVOL_ROOT_INODE && fcb->subvol->id == BTRFS_ROOT_FSTREE && fcb->subvol != Vcb->root_fileref->fcb->subvol)
         fcb->atts |= FILE_ATTRIBUTE_HIDDEN;
 
-    subvol->fcbs_version++;
-
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
     release_fcb_lock(Vcb);
@@ -1465,21 +1656,12 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
 
     if (streampart) {
         bool locked = false;
-        LIST_ENTRY* le;
-        UNICODE_STRING name_uc;
+        LIST_ENTRY *le, *bucket;
         dir_child* dc = NULL;
         fcb* fcb;
         struct _fcb* duff_fcb = NULL;
         file_ref* duff_fr = NULL;
 
-        if (!case_sensitive) {
-            Status = RtlUpcaseUnicodeString(&name_uc, name, true);
-            if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-                return Status;
-            }
-        }
-
         if (!ExIsResourceAcquiredSharedLite(&sf->fcb->nonpaged->dir_children_lock)) {
             ExAcquireResourceSharedLite(&sf->fcb->nonpaged->dir_children_lock, true);
             locked = true;
@@ -1491,7 +1673,7 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
 
             if (dc2->index == 0) {
                 if ((case_sensitive && dc2->name.Length == name->Length && RtlCompareMemory(dc2->name.Buffer, name->Buffer, dc2->name.Length) == dc2->name.Length) ||
-                    (!case_sensitive && dc2->name_uc.Length == name_uc.Length && RtlCompareMemory(dc2->name_uc.Buffer, name_uc.Buffer, dc2->name_uc.Length) == dc2->name_uc.Length)
+                    (!case_sensitive && name_equal_uc(&dc2->name_uc, name))
                 ) {
                     dc = dc2;
                     break;
@@ -1506,9 +1688,6 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
             if (locked)
                 ExReleaseResourceLite(&sf->fcb->nonpaged->dir_children_lock);
 
-            if (!case_sensitive)
-                ExFreePool(name_uc.Buffer);
-
             return STATUS_OBJECT_NAME_NOT_FOUND;
         }
 
@@ -1516,9 +1695,6 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
             if (locked)
                 ExReleaseResourceLite(&sf->fcb->nonpaged->dir_children_lock);
 
-            if (!case_sensitive)
-                ExFreePool(name_uc.Buffer);
-
             increase_fileref_refcount(dc->fileref);
             *psf2 = dc->fileref;
             return STATUS_SUCCESS;
@@ -1527,9 +1703,6 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
         if (locked)
             ExReleaseResourceLite(&sf->fcb->nonpaged->dir_children_lock);
 
-        if (!case_sensitive)
-            ExFreePool(name_uc.Buffer);
-
         Status = open_fcb_stream(Vcb, dc, sf->fcb, &fcb, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("open_fcb_stream returned %08lx\n", Status);
@@ -1540,29 +1713,24 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
 
         acquire_fcb_lock_exclusive(Vcb);
 
-        if (sf->fcb->subvol->fcbs_ptrs[fcb->hash >> 24]) {
-            le = sf->fcb->subvol->fcbs_ptrs[fcb->hash >> 24];
+        bucket = hash_table_bucket(&sf->fcb->subvol->fcbs_hash, fcb->hash);
 
-            while (le != &sf->fcb->subvol->fcbs) {
-                struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-                if (fcb2->inode == fcb->inode) {
-                    if (fcb2->ads && fcb2->adshash == fcb->adshash) { // FIXME - handle hash collisions
-                        duff_fcb = fcb;
-                        fcb = fcb2;
-                        break;
-                    }
-                } else if (fcb2->hash > fcb->hash)
-                    break;
+        le = bucket->Flink;
+        while (le != bucket) {
+            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
 
-                le = le->Flink;
+            if (fcb2->inode == fcb->inode && fcb2->ads && fcb2->adshash == fcb->adshash) { // FIXME - handle hash collisions
+                duff_fcb = fcb;
+                fcb = fcb2;
+                break;
             }
+
+            le = le->Flink;
         }
 
         if (!duff_fcb) {
-            InsertHeadList(&sf->fcb->list_entry, &fcb->list_entry);
+            add_fcb_to_subvol(fcb);
             InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-            fcb->subvol->fcbs_version++;
         }
 
         release_fcb_lock(Vcb);
@@ -1603,7 +1771,7 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
         uint64_t inode;
         dir_child* dc;
 
-        Status = find_file_in_dir(name, sf->fcb, &subvol, &inode, &dc, case_sensitive);
+        Status = find_file_in_dir(name, sf->fcb, &subvol, &inode, &dc, case_sensitive, Irp);
         if (Status == STATUS_OBJECT_NAME_NOT_FOUND) {
             TRACE("could not find %.*S\n", (int)(name->Length / sizeof(WCHAR)), name->Buffer);
 
@@ -1624,11 +1792,18 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
                     return STATUS_OBJECT_PATH_NOT_FOUND;
                 }
 
-                InterlockedIncrement(&dc->fileref->refcount);
+                // only counts as a hit if it's only in memory because of the fileref cache
+                if (InterlockedIncrement(&dc->fileref->refcount) == 1 && dc->fileref->cached) {
+                    dc->fileref->cached = false;
+                    InterlockedIncrement64(&Vcb->fcb_cache_stats.hits);
+                }
+
                 *psf2 = dc->fileref;
                 return STATUS_SUCCESS;
             }
 
+            InterlockedIncrement64(&Vcb->fcb_cache_stats.misses);
+
             if (!subvol || (subvol != Vcb->root_fileref->fcb->subvol && inode == SUBVOL_ROOT_INODE && subvol->parent != sf->fcb->subvol->id && !dc->root_dir)) {
                 fcb = Vcb->dummy_fcb;
                 InterlockedIncrement(&fcb->refcount);
@@ -1866,11 +2041,16 @@ end2:
     return Status;
 }
 
-NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8, PUNICODE_STRING name, uint8_t type, dir_child** pdc) {
+NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8, PUNICODE_STRING name, uint8_t type, dir_child** pdc, PIRP Irp) {
     NTSTATUS Status;
     dir_child* dc;
     bool locked;
 
+    // the new entry's index has to come after everything already in the directory
+    Status = complete_dir_children(fcb->Vcb, fcb, Irp);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
     dc = ExAllocatePoolWithTag(PagedPool, sizeof(dir_child), ALLOC_TAG);
     if (!dc) {
         ERR("out of memory\n");
@@ -1906,9 +2086,9 @@ NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8,
     dc->name.Length = dc->name.MaximumLength = name->Length;
     RtlCopyMemory(dc->name.Buffer, name->Buffer, name->Length);
 
-    Status = RtlUpcaseUnicodeString(&dc->name_uc, name, true);
+    Status = set_dir_child_name_uc(dc);
     if (!NT_SUCCESS(Status)) {
-        ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+        ERR("set_dir_child_name_uc returned %08lx\n", Status);
         ExFreePool(dc->utf8.Buffer);
         ExFreePool(dc->name.Buffer);
         ExFreePool(dc);
@@ -1916,7 +2096,6 @@ NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8,
     }
 
     dc->hash = calc_crc32c(0xffffffff, (uint8_t*)dc->name.Buffer, dc->name.Length);
-    dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)dc->name_uc.Buffer, dc->name_uc.Length);
 
     locked = ExIsResourceAcquiredExclusive(&fcb->nonpaged->dir_children_lock);
 
@@ -1934,6 +2113,7 @@ NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8,
     InsertTailList(&fcb->dir_children_index, &dc->list_entry_index);
 
     insert_dir_child_into_hash_lists(fcb, dc);
+    neg_cache_invalidate(fcb);
 
     if (!locked)
         ExReleaseResourceLite(&fcb->nonpaged->dir_children_lock);
@@ -2194,7 +2374,6 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
     file_ref* fileref;
     dir_child* dc;
     ANSI_STRING utf8as;
-    LIST_ENTRY* lastle = NULL;
     file_ref* existing_fileref = NULL;
 #ifdef DEBUG_FCB_REFCOUNTS
     LONG rc;
@@ -2332,10 +2511,14 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
 
     if (!(fcb->inode_item.flags & BTRFS_INODE_NODATACOW)) {
         fcb->prop_compression = parfileref->fcb->prop_compression;
+        fcb->prop_compression_level = parfileref->fcb->prop_compression_level;
         fcb->prop_compression_changed = fcb->prop_compression != PropCompression_None;
     } else
         fcb->prop_compression = PropCompression_None;
 
+    fcb->extent_size_hint = parfileref->fcb->extent_size_hint;
+    fcb->extent_size_hint_changed = fcb->extent_size_hint != 0;
+
     fcb->inode_item_changed = true;
 
     fcb->Header.IsFastIoPossible = fast_io_possible(fcb);
@@ -2361,55 +2544,8 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
     fcb->hash = calc_crc32c(0xffffffff, (uint8_t*)&inode, sizeof(uint64_t));
 
     acquire_fcb_lock_exclusive(Vcb);
-
-    if (fcb->subvol->fcbs_ptrs[fcb->hash >> 24]) {
-        LIST_ENTRY* le = fcb->subvol->fcbs_ptrs[fcb->hash >> 24];
-
-        while (le != &fcb->subvol->fcbs) {
-            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-            if (fcb2->hash > fcb->hash) {
-                lastle = le->Blink;
-                break;
-            }
-
-            le = le->Flink;
-        }
-    }
-
-    if (!lastle) {
-        uint8_t c = fcb->hash >> 24;
-
-        if (c != 0xff) {
-            uint8_t d = c + 1;
-
-            do {
-                if (fcb->subvol->fcbs_ptrs[d]) {
-                    lastle = fcb->subvol->fcbs_ptrs[d]->Blink;
-                    break;
-                }
-
-                d++;
-            } while (d != 0);
-        }
-    }
-
-    if (lastle) {
-        InsertHeadList(lastle, &fcb->list_entry);
-
-        if (lastle == &fcb->subvol->fcbs || (CONTAINING_RECORD(lastle, struct _fcb, list_entry)->hash >> 24) != (fcb->hash >> 24))
-            fcb->subvol->fcbs_ptrs[fcb->hash >> 24] = &fcb->list_entry;
-    } else {
-        InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
-
-        if (fcb->list_entry.Blink == &fcb->subvol->fcbs || (CONTAINING_RECORD(fcb->list_entry.Blink, struct _fcb, list_entry)->hash >> 24) != (fcb->hash >> 24))
-            fcb->subvol->fcbs_ptrs[fcb->hash >> 24] = &fcb->list_entry;
-    }
-
+    add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-
-    fcb->subvol->fcbs_version++;
-
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(fcb);
@@ -2481,25 +2617,12 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
     }
 
     if (fcb->type == BTRFS_TYPE_DIRECTORY) {
-        fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-        if (!fcb->hash_ptrs) {
-            ERR("out of memory\n");
-            reap_fileref(Vcb, fileref);
-
-            ExAcquireResourceExclusiveLite(parfileref->fcb->Header.Resource, true);
-            parfileref->fcb->inode_item.st_size -= utf8len * 2;
-            ExReleaseResourceLite(parfileref->fcb->Header.Resource);
-
-            ExFreePool(utf8);
-
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+        Status = hash_table_alloc(&fcb->dir_children_hash);
 
-        RtlZeroMemory(fcb->hash_ptrs, sizeof(LIST_ENTRY*) * 256);
+        if (NT_SUCCESS(Status))
+            Status = hash_table_alloc(&fcb->dir_children_hash_uc);
 
-        fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-        if (!fcb->hash_ptrs_uc) {
-            ERR("out of memory\n");
+        if (!NT_SUCCESS(Status)) {
             reap_fileref(Vcb, fileref);
 
             ExAcquireResourceExclusiveLite(parfileref->fcb->Header.Resource, true);
@@ -2508,10 +2631,8 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
 
             ExFreePool(utf8);
 
-            return STATUS_INSUFFICIENT_RESOURCES;
+            return Status;
         }
-
-        RtlZeroMemory(fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
     }
 
     fcb->deleted = false;
@@ -2529,57 +2650,34 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
     // check again doesn't already exist
     if (case_sensitive) {
         uint32_t dc_hash = calc_crc32c(0xffffffff, (uint8_t*)fpus->Buffer, fpus->Length);
+        LIST_ENTRY* head = hash_table_bucket(&parfileref->fcb->dir_children_hash, dc_hash);
+        LIST_ENTRY* le = head->Flink;
 
-        if (parfileref->fcb->hash_ptrs[dc_hash >> 24]) {
-            LIST_ENTRY* le = parfileref->fcb->hash_ptrs[dc_hash >> 24];
-            while (le != &parfileref->fcb->dir_children_hash) {
-                dc = CONTAINING_RECORD(le, dir_child, list_entry_hash);
-
-                if (dc->hash == dc_hash && dc->name.Length == fpus->Length && RtlCompareMemory(dc->name.Buffer, fpus->Buffer, fpus->Length) == fpus->Length) {
-                    existing_fileref = dc->fileref;
-                    break;
-                } else if (dc->hash > dc_hash)
-                    break;
+        while (le != head) {
+            dc = CONTAINING_RECORD(le, dir_child, list_entry_hash);
 
-                le = le->Flink;
+            if (dc->hash == dc_hash && dc->name.Length == fpus->Length && RtlCompareMemory(dc->name.Buffer, fpus->Buffer, fpus->Length) == fpus->Length) {
+                existing_fileref = dc->fileref;
+                break;
             }
-        }
-    } else {
-        UNICODE_STRING fpusuc;
-
-        Status = RtlUpcaseUnicodeString(&fpusuc, fpus, true);
-        if (!NT_SUCCESS(Status)) {
-            ExReleaseResourceLite(&parfileref->fcb->nonpaged->dir_children_lock);
-            ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-            reap_fileref(Vcb, fileref);
-
-            ExAcquireResourceExclusiveLite(parfileref->fcb->Header.Resource, true);
-            parfileref->fcb->inode_item.st_size -= utf8len * 2;
-            ExReleaseResourceLite(parfileref->fcb->Header.Resource);
-
-            ExFreePool(utf8);
 
-            return Status;
+            le = le->Flink;
         }
+    } else {
+        uint32_t dc_hash = calc_crc32c_uc(fpus);
+        LIST_ENTRY* head = hash_table_bucket(&parfileref->fcb->dir_children_hash_uc, dc_hash);
+        LIST_ENTRY* le = head->Flink;
 
-        uint32_t dc_hash = calc_crc32c(0xffffffff, (uint8_t*)fpusuc.Buffer, fpusuc.Length);
-
-        if (parfileref->fcb->hash_ptrs_uc[dc_hash >> 24]) {
-            LIST_ENTRY* le = parfileref->fcb->hash_ptrs_uc[dc_hash >> 24];
-            while (le != &parfileref->fcb->dir_children_hash_uc) {
-                dc = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
-
-                if (dc->hash_uc == dc_hash && dc->name.Length == fpusuc.Length && RtlCompareMemory(dc->name.Buffer, fpusuc.Buffer, fpusuc.Length) == fpusuc.Length) {
-                    existing_fileref = dc->fileref;
-                    break;
-                } else if (dc->hash_uc > dc_hash)
-                    break;
+        while (le != head) {
+            dc = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
 
-                le = le->Flink;
+            if (dc->hash_uc == dc_hash && name_equal_uc(&dc->name_uc, fpus)) {
+                existing_fileref = dc->fileref;
+                break;
             }
-        }
 
-        ExFreePool(fpusuc.Buffer);
+            le = le->Flink;
+        }
     }
 
     if (existing_fileref) {
@@ -2598,7 +2696,7 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
         return STATUS_OBJECT_NAME_COLLISION;
     }
 
-    Status = add_dir_child(parfileref->fcb, fcb->inode, false, &utf8as, fpus, fcb->type, &dc);
+    Status = add_dir_child(parfileref->fcb, fcb->inode, false, &utf8as, fpus, fcb->type, &dc, Irp);
     if (!NT_SUCCESS(Status)) {
         ExReleaseResourceLite(&parfileref->fcb->nonpaged->dir_children_lock);
         ERR("add_dir_child returned %08lx\n", Status);
@@ -2852,9 +2950,8 @@ static NTSTATUS create_stream(_Requires_lock_held_(_Curr_->tree_lock) _Requires_
     fcb->deleted = true;
 
     acquire_fcb_lock_exclusive(Vcb);
-    InsertHeadList(&parfileref->fcb->list_entry, &fcb->list_entry); // insert in list after parent fcb
+    add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-    parfileref->fcb->subvol->fcbs_version++;
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(fcb);
@@ -2904,9 +3001,9 @@ static NTSTATUS create_stream(_Requires_lock_held_(_Curr_->tree_lock) _Requires_
 
     RtlCopyMemory(dc->name.Buffer, stream->Buffer, stream->Length);
 
-    Status = RtlUpcaseUnicodeString(&dc->name_uc, &dc->name, true);
+    Status = set_dir_child_name_uc(dc);
     if (!NT_SUCCESS(Status)) {
-        ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+        ERR("set_dir_child_name_uc returned %08lx\n", Status);
         ExFreePool(dc->utf8.Buffer);
         ExFreePool(dc->name.Buffer);
         ExFreePool(dc);
@@ -2939,6 +3036,7 @@ static NTSTATUS create_stream(_Requires_lock_held_(_Curr_->tree_lock) _Requires_
 
     if (existing_dc) {
         ExFreePool(dc->utf8.Buffer);
+        free_dir_child_name_uc(dc);
         ExFreePool(dc->name.Buffer);
         ExFreePool(dc);
         reap_fileref(Vcb, fileref);
@@ -4865,6 +4963,10 @@ NTSTATUS __stdcall drv_create(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
         goto exit;
     }
 
+    // Anything which might create a file has to wait if the flush thread's fallen behind.
+    if (top_level && !Vcb->readonly && ((IoGetCurrentIrpStackLocation(Irp)->Parameters.Create.Options >> 24) & 0xff) != FILE_OPEN)
+        throttle_writer(Vcb);
+
     ExAcquireResourceSharedLite(&Vcb->load_lock, true);
     locked = true;
 
@@ -0,0 +1,339 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+#include "btrfsioctl.h"
+
+// Online defragmentation. We walk the file's extents looking for runs of small extents
+// which are logically contiguous but not physically so, then read each run back and write
+// it out again through the normal CoW path, which puts it in one place. With
+// BTRFS_DEFRAG_COMPRESS we also rewrite anything not already compressed with the requested
+// algorithm.
+//
+// Holes, prealloc and inline extents are left as they are, and so are compressed extents
+// unless we're recompressing - they're never more than 128 KB anyway. Rewriting a shared
+// extent gives this file its own copy, so BTRFS_DEFRAG_SKIP_SHARED treats those as holes too.
+//
+// Each run is done in its own short hold of the locks, so that the flush thread and other
+// users of the file can get in between; and we throttle ourselves like any other writer.
+
+#define DEFRAG_MAX_RUN              0x1000000   // 16 MB
+#define DEFRAG_DEFAULT_THRESHOLD    DEFRAG_MAX_RUN
+
+typedef struct {
+    uint64_t threshold;
+    uint8_t compression; // BTRFS_COMPRESSION_NONE if not recompressing
+    bool skip_shared;
+    uint64_t shared;
+} defrag_context;
+
+static bool defrag_candidate(defrag_context* ctx, extent* ext, uint64_t len) {
+    EXTENT_DATA* ed = &ext->extent_data;
+
+    if (ed->type != EXTENT_TYPE_REGULAR || ((EXTENT_DATA2*)ed->data)->size == 0)
+        return false;
+
+    if (ctx->compression != BTRFS_COMPRESSION_NONE)
+        return ed->compression != ctx->compression;
+
+    return ed->compression == BTRFS_COMPRESSION_NONE && len < ctx->threshold;
+}
+
+// Finds the next run at or after *start which is worth rewriting, returning false if there isn't one.
+_Requires_lock_held_(fcb->Header.Resource)
+static bool find_defrag_run(defrag_context* ctx, fcb* fcb, uint64_t* start, uint64_t* end, uint64_t limit) {
+    LIST_ENTRY* le;
+    uint64_t run_start = 0, run_end = 0, phys_end = 0;
+    unsigned int frags = 0;
+    bool in_run = false, recompress = false;
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        le = le->Flink;
+
+        if (!ext->ignore && ext->extent_data.type != EXTENT_TYPE_INLINE) {
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
+            uint64_t ext_start = ext->offset, ext_end = ext->offset + ed2->num_bytes;
+
+            if (ext_end <= *start)
+                continue;
+
+            if (ext_start < *start) // user asked for a range starting partway through this extent
+                ext_start = *start;
+
+            if (ext_start >= limit)
+                break;
+
+            if (ext_end > limit)
+                ext_end = limit;
+
+            if (in_run && ext_start != run_end) { // gap
+                if (frags > 1 || recompress)
+                    break;
+
+                in_run = false;
+            }
+
+            if (!defrag_candidate(ctx, ext, ed2->num_bytes)) {
+                if (in_run && (frags > 1 || recompress))
+                    break;
+
+                in_run = false;
+                continue;
+            }
+
+            if (ctx->skip_shared && !ext->unique) {
+                if (in_run && (frags > 1 || recompress))
+                    break;
+
+                ctx->shared += ext_end - ext_start;
+                in_run = false;
+                continue;
+            }
+
+            if (!in_run) {
+                in_run = true;
+                run_start = ext_start;
+                run_end = ext_start;
+                frags = 0;
+                recompress = false;
+                phys_end = 0;
+            }
+
+            if (ext_end - run_start > DEFRAG_MAX_RUN)
+                ext_end = run_start + DEFRAG_MAX_RUN;
+
+            if (ext->extent_data.compression != BTRFS_COMPRESSION_NONE ||
+                ed2->address + ed2->offset + ext_start - ext->offset != phys_end) {
+                frags++;
+            }
+
+            if (ctx->compression != BTRFS_COMPRESSION_NONE)
+                recompress = true;
+
+            phys_end = ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->address + ed2->offset + ext_end - ext->offset : 0;
+            run_end = ext_end;
+
+            if (run_end - run_start == DEFRAG_MAX_RUN) {
+                if (frags > 1 || recompress)
+                    break;
+
+                in_run = false;
+            }
+        }
+    }
+
+    if (!in_run || (frags <= 1 && !recompress)) {
+        *start = limit;
+        return false;
+    }
+
+    *start = run_start;
+    *end = run_end;
+
+    return true;
+}
+
+_Requires_exclusive_lock_held_(fcb->Header.Resource)
+static NTSTATUS defrag_run(defrag_context* ctx, fcb* fcb, uint64_t start, uint64_t end, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    uint8_t* data;
+
+    data = ExAllocatePoolWithTag(PagedPool, (ULONG)(end - start), ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(data, (ULONG)(end - start)); // in case the last extent runs past EOF
+
+    Status = read_file(fcb, data, start, end - start, NULL, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_file returned %08lx\n", Status);
+        ExFreePool(data);
+        return Status;
+    }
+
+    if (ctx->compression != BTRFS_COMPRESSION_NONE) {
+        Status = write_compressed_type(fcb, start, end, data, ctx->compression, Irp, rollback);
+        if (!NT_SUCCESS(Status))
+            ERR("write_compressed_type returned %08lx\n", Status);
+    } else {
+        // excise first, otherwise do_write_file would write nocow extents back in place
+        Status = excise_extents(fcb->Vcb, fcb, start, end, Irp, rollback);
+        if (!NT_SUCCESS(Status))
+            ERR("excise_extents returned %08lx\n", Status);
+        else {
+            Status = do_write_file(fcb, start, end, data, Irp, false, 0, rollback);
+            if (!NT_SUCCESS(Status))
+                ERR("do_write_file returned %08lx\n", Status);
+        }
+    }
+
+    ExFreePool(data);
+
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    fcb->extents_changed = true;
+    fcb->inode_item_changed = true;
+    mark_fcb_dirty(fcb);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS defrag_file(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG length, ULONG outlength, ULONG_PTR* retlen, PIRP Irp) {
+    btrfs_defrag* bd = data;
+    btrfs_defrag_result bdr;
+    defrag_context ctx;
+    NTSTATUS Status;
+    fcb* fcb;
+    ccb* ccb;
+    uint64_t pos, limit;
+    IO_STATUS_BLOCK iosb;
+
+    if (!data || length < sizeof(btrfs_defrag))
+        return STATUS_INVALID_PARAMETER;
+
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    if (!FileObject)
+        return STATUS_INVALID_PARAMETER;
+
+    fcb = FileObject->FsContext;
+    ccb = FileObject->FsContext2;
+
+    if (!fcb || !ccb || fcb == Vcb->volume_fcb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (Irp->RequestorMode == UserMode && (!(ccb->access & FILE_READ_DATA) || !(ccb->access & FILE_WRITE_DATA))) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (fcb->ads || fcb->type != BTRFS_TYPE_FILE || fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)
+        return STATUS_INVALID_PARAMETER;
+
+    if (bd->flags & ~(BTRFS_DEFRAG_COMPRESS | BTRFS_DEFRAG_SKIP_SHARED))
+        return STATUS_INVALID_PARAMETER;
+
+    if (bd->flags & BTRFS_DEFRAG_COMPRESS) {
+        if (bd->compression_type == BTRFS_COMPRESSION_ANY || bd->compression_type > BTRFS_COMPRESSION_ZSTD)
+            return STATUS_INVALID_PARAMETER;
+
+        // nocow extents can't be compressed
+        if (fcb->inode_item.flags & BTRFS_INODE_NODATACOW)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_ACCESS_DENIED;
+
+    ctx.threshold = bd->extent_threshold != 0 ? bd->extent_threshold : DEFRAG_DEFAULT_THRESHOLD;
+    ctx.compression = bd->flags & BTRFS_DEFRAG_COMPRESS ? bd->compression_type : BTRFS_COMPRESSION_NONE;
+    ctx.skip_shared = bd->flags & BTRFS_DEFRAG_SKIP_SHARED;
+    ctx.shared = 0;
+
+    bdr.bytes_rewritten = 0;
+
+    // get anything in the cache into the extent list, so it gets defragmented too
+
+    CcFlushCache(FileObject->SectionObjectPointer, NULL, 0, &iosb);
+
+    pos = bd->start & ~(uint64_t)(Vcb->superblock.sector_size - 1);
+
+    if (bd->length == 0 || bd->start + bd->length < bd->start)
+        limit = 0xffffffffffffffff;
+    else
+        limit = sector_align(bd->start + bd->length, Vcb->superblock.sector_size);
+
+    while (true) {
+        LIST_ENTRY rollback;
+        uint64_t end;
+        bool found;
+
+        if (Irp->Cancel) {
+            Status = STATUS_CANCELLED;
+            goto end;
+        }
+
+        InitializeListHead(&rollback);
+
+        ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+        if (fcb->deleted) {
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            Status = STATUS_FILE_DELETED;
+            goto end;
+        }
+
+        // Delayed writes are dropped by excise_extents, so need to be on the disk before we start.
+        // This is also what makes sure we see the file's latest extents.
+        if (!IsListEmpty(&fcb->delalloc)) {
+            Status = flush_delalloc(fcb, Irp, &rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("flush_delalloc returned %08lx\n", Status);
+                do_rollback(Vcb, &rollback);
+                ExReleaseResourceLite(fcb->Header.Resource);
+                ExReleaseResourceLite(&Vcb->tree_lock);
+                goto end;
+            }
+        }
+
+        found = find_defrag_run(&ctx, fcb, &pos, &end, min(limit, sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size)));
+
+        if (found) {
+            Status = defrag_run(&ctx, fcb, pos, end, Irp, &rollback);
+
+            if (NT_SUCCESS(Status)) {
+                bdr.bytes_rewritten += end - pos;
+                pos = end;
+            }
+        } else
+            Status = STATUS_SUCCESS;
+
+        if (NT_SUCCESS(Status))
+            clear_rollback(&rollback);
+        else
+            do_rollback(Vcb, &rollback);
+
+        ExReleaseResourceLite(fcb->Header.Resource);
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
+        if (!found || !NT_SUCCESS(Status))
+            break;
+
+        throttle_writer(Vcb);
+    }
+
+end:
+    TRACE("rewrote %I64x bytes of inode %I64x\n", bdr.bytes_rewritten, fcb->inode);
+
+    if (NT_SUCCESS(Status) && outlength >= sizeof(btrfs_defrag_result)) {
+        bdr.bytes_shared = ctx.shared;
+
+        RtlCopyMemory(data, &bdr, sizeof(btrfs_defrag_result));
+        *retlen = sizeof(btrfs_defrag_result);
+    }
+
+    return Status;
+}
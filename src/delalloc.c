@@ -0,0 +1,466 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Delayed allocation. When the cache manager writes back a file, rather than allocating
+// extents there and then we copy the data into fcb->delalloc, and only reserve the space.
+// The extents get allocated when the transaction is committed, by which point adjacent
+// writes can be merged - so a file written in lots of small appends ends up as a few
+// large extents, rather than one per lazy-writer flush.
+//
+// fcb->delalloc is sorted by offset, and its ranges never overlap. It's protected by
+// fcb->Header.Resource: writers and the flush thread hold it exclusively, readers shared.
+// Anything which writes a file's extents - do_write_file, write_compressed, and anything
+// which goes through excise_extents - first drops whatever delayed data it overlaps, so
+// we never write stale data over newer extents. This includes the prealloc and nocow
+// paths, which overwrite extents in place without excising them.
+//
+// Once flush_delalloc has written a range, it goes on the caller's rollback list rather than
+// being freed: if the transaction fails, the extents we wrote for it get rolled back, and
+// the data goes back on the fcb to be written next time.
+
+#define DELALLOC_MAX_PENDING 0x4000000 // 64 MB, across the whole volume
+
+static void free_delalloc_range(device_extension* Vcb, delalloc_range* dr) {
+    InterlockedExchangeAdd64(&Vcb->delalloc_bytes, -(LONG64)dr->length);
+
+    ExFreePool(dr->buf);
+    ExFreePool(dr);
+}
+
+void free_delalloc(_In_ fcb* fcb) {
+    while (!IsListEmpty(&fcb->delalloc)) {
+        delalloc_range* dr = CONTAINING_RECORD(RemoveHeadList(&fcb->delalloc), delalloc_range, list_entry);
+
+        free_delalloc_range(fcb->Vcb, dr);
+    }
+}
+
+_Requires_exclusive_lock_held_(fcb->Header.Resource)
+NTSTATUS delalloc_drop(_In_ fcb* fcb, _In_ uint64_t start, _In_ uint64_t end) {
+    LIST_ENTRY* le;
+
+    // Ranges are sorted and don't overlap, so their ends are sorted too. Go backwards,
+    // as most of the time we're being called for an append and there's nothing to do.
+
+    le = fcb->delalloc.Blink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        LIST_ENTRY* le2 = le->Blink;
+        uint64_t dr_end = dr->start + dr->length;
+
+        if (dr_end <= start)
+            break;
+
+        if (dr->start < end) {
+            if (dr->start >= start && dr_end <= end) {
+                RemoveEntryList(&dr->list_entry);
+                free_delalloc_range(fcb->Vcb, dr);
+            } else if (dr->start < start && dr_end > end) { // split in two
+                delalloc_range* dr2;
+
+                dr2 = ExAllocatePoolWithTag(PagedPool, sizeof(delalloc_range), ALLOC_TAG);
+                if (!dr2) {
+                    ERR("out of memory\n");
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                dr2->buf = ExAllocatePoolWithTag(PagedPool, (ULONG)(dr_end - end), ALLOC_TAG);
+                if (!dr2->buf) {
+                    ERR("out of memory\n");
+                    ExFreePool(dr2);
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                RtlCopyMemory(dr2->buf, dr->data + end - dr->start, (ULONG)(dr_end - end));
+
+                dr2->data = dr2->buf;
+                dr2->start = end;
+                dr2->length = dr_end - end;
+
+                InsertHeadList(&dr->list_entry, &dr2->list_entry);
+
+                dr->length = start - dr->start;
+
+                InterlockedExchangeAdd64(&fcb->Vcb->delalloc_bytes, -(LONG64)(end - start));
+            } else if (dr->start < start) { // lose the end
+                InterlockedExchangeAdd64(&fcb->Vcb->delalloc_bytes, -(LONG64)(dr_end - start));
+
+                dr->length = start - dr->start;
+            } else { // lose the beginning
+                InterlockedExchangeAdd64(&fcb->Vcb->delalloc_bytes, -(LONG64)(end - dr->start));
+
+                dr->data += end - dr->start;
+                dr->length = dr_end - end;
+                dr->start = end;
+            }
+        }
+
+        le = le2;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Copies any delayed data over what read_file has read from the extents.
+_Requires_lock_held_(fcb->Header.Resource)
+void delalloc_read(_In_ fcb* fcb, _Out_writes_bytes_(length) uint8_t* data, _In_ uint64_t start, _In_ uint64_t length) {
+    LIST_ENTRY* le;
+
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+        if (dr->start >= start + length)
+            break;
+
+        if (dr->start + dr->length > start) {
+            uint64_t off = max(dr->start, start);
+            uint64_t end = min(dr->start + dr->length, start + length);
+
+            RtlCopyMemory(data + off - start, dr->data + off - dr->start, (ULONG)(end - off));
+        }
+
+        le = le->Flink;
+    }
+}
+
+// Called by clear_rollback - the extents for dr are there to stay, so we don't need its data any more.
+void free_written_delalloc(_In_ delalloc_range* dr) {
+    free_fcb(dr->fcb);
+
+    ExFreePool(dr->buf);
+    ExFreePool(dr);
+}
+
+// Called by do_rollback - the extents for dr have gone, so put its data back on the fcb. Anything
+// queued since is newer than what we've got, so takes precedence.
+void requeue_delalloc(_In_ delalloc_range* dr) {
+    fcb* fcb = dr->fcb;
+    LIST_ENTRY* le;
+
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+    if (fcb->deleted)
+        goto drop;
+
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        LIST_ENTRY* le2 = le->Flink;
+        uint64_t dr_end = dr->start + dr->length, dr2_end = dr2->start + dr2->length;
+
+        if (dr2->start >= dr_end)
+            break;
+
+        if (dr2_end > dr->start) {
+            if (dr2->start <= dr->start && dr2_end >= dr_end) // nothing of ours left
+                goto drop;
+            else if (dr2->start <= dr->start) { // lose our beginning
+                dr->data += dr2_end - dr->start;
+                dr->length = dr_end - dr2_end;
+                dr->start = dr2_end;
+            } else if (dr2_end >= dr_end) { // lose our end, and go in front of dr2
+                dr->length = dr2->start - dr->start;
+                break;
+            } else { // in our middle - copy it over our data, and take its place
+                RtlCopyMemory(dr->data + dr2->start - dr->start, dr2->data, (ULONG)dr2->length);
+
+                RemoveEntryList(&dr2->list_entry);
+                free_delalloc_range(fcb->Vcb, dr2);
+            }
+        }
+
+        le = le2;
+    }
+
+    InsertTailList(le, &dr->list_entry);
+
+    InterlockedExchangeAdd64(&fcb->Vcb->delalloc_bytes, dr->length);
+
+    mark_fcb_dirty(fcb);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+    free_fcb(fcb);
+
+    return;
+
+drop:
+    ExReleaseResourceLite(fcb->Header.Resource);
+    free_fcb(fcb);
+
+    ExFreePool(dr->buf);
+    ExFreePool(dr);
+}
+
+_Requires_exclusive_lock_held_(fcb->Header.Resource)
+NTSTATUS flush_delalloc(_In_ fcb* fcb, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY ranges;
+    bool compress = write_fcb_compressed(fcb);
+
+    if (IsListEmpty(&fcb->delalloc))
+        return STATUS_SUCCESS;
+
+    // Take the ranges off the fcb first - otherwise excise_extents would throw them away
+    // as we wrote them.
+
+    InitializeListHead(&ranges);
+
+    while (!IsListEmpty(&fcb->delalloc)) {
+        InsertTailList(&ranges, RemoveHeadList(&fcb->delalloc));
+    }
+
+    while (!IsListEmpty(&ranges)) {
+        delalloc_range* dr = CONTAINING_RECORD(ranges.Flink, delalloc_range, list_entry);
+        uint64_t run_start = dr->start, run_end = dr->start + dr->length;
+        unsigned int num_ranges = 1;
+        LIST_ENTRY* le = dr->list_entry.Flink;
+        uint8_t* data;
+
+        // merge adjacent ranges, so that they become one extent
+
+        while (le != &ranges) {
+            delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+            if (dr2->start != run_end || dr2->start + dr2->length - run_start > MAX_EXTENT_SIZE)
+                break;
+
+            run_end += dr2->length;
+            num_ranges++;
+
+            le = le->Flink;
+        }
+
+        if (num_ranges == 1)
+            data = dr->data;
+        else {
+            data = ExAllocatePoolWithTag(PagedPool, (ULONG)(run_end - run_start), ALLOC_TAG);
+
+            if (data) {
+                le = ranges.Flink;
+                for (unsigned int i = 0; i < num_ranges; i++) {
+                    delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+                    RtlCopyMemory(data + dr2->start - run_start, dr2->data, (ULONG)dr2->length);
+
+                    le = le->Flink;
+                }
+            } else { // if we can't merge them, write them one at a time
+                data = dr->data;
+                run_end = dr->start + dr->length;
+                num_ranges = 1;
+            }
+        }
+
+        TRACE("writing delayed range %I64x-%I64x of inode %I64x (%u writes)\n", run_start, run_end, fcb->inode, num_ranges);
+
+        if (compress)
+            Status = write_compressed(fcb, run_start, run_end, data, Irp, rollback);
+        else
+            Status = do_write_file(fcb, run_start, run_end, data, Irp, false, 0, rollback);
+
+        if (num_ranges > 1)
+            ExFreePool(data);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("%s returned %08lx\n", compress ? "write_compressed" : "do_write_file", Status);
+            break;
+        }
+
+        // Hang on to what we've written until the caller's finished with the transaction - if
+        // it gets rolled back, so do the extents we've just written.
+
+        for (unsigned int i = 0; i < num_ranges; i++) {
+            delalloc_range* dr2 = CONTAINING_RECORD(RemoveHeadList(&ranges), delalloc_range, list_entry);
+
+            dr2->fcb = fcb;
+            InterlockedIncrement(&fcb->refcount);
+
+            InterlockedExchangeAdd64(&fcb->Vcb->delalloc_bytes, -(LONG64)dr2->length);
+
+            add_rollback(rollback, ROLLBACK_DELALLOC, dr2);
+        }
+    }
+
+    // If we failed, put back what we haven't written, so it's there for the next attempt. We've
+    // held the fcb exclusively throughout, so nothing else can have been queued. What we have
+    // written goes back when the caller rolls back.
+
+    while (!IsListEmpty(&ranges)) {
+        InsertTailList(&fcb->delalloc, RemoveHeadList(&ranges));
+    }
+
+    return Status;
+}
+
+// For callers which need a file's extents to be up to date, but don't already hold the locks.
+NTSTATUS flush_fcb_delalloc(_In_ fcb* fcb, _In_opt_ PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY rollback;
+
+    InitializeListHead(&rollback);
+
+    ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, true);
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+    Status = flush_delalloc(fcb, Irp, &rollback);
+
+    if (NT_SUCCESS(Status))
+        clear_rollback(&rollback);
+    else {
+        ERR("flush_delalloc returned %08lx\n", Status);
+        do_rollback(fcb->Vcb, &rollback);
+    }
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+    ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
+    return Status;
+}
+
+// Called at the start of a commit, so that all our delayed data makes it into this transaction.
+_Requires_exclusive_lock_held_(Vcb->tree_lock)
+NTSTATUS flush_all_delalloc(_In_ device_extension* Vcb, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    if (Vcb->delalloc_bytes == 0)
+        return STATUS_SUCCESS;
+
+    ExAcquireResourceExclusiveLite(&Vcb->dirty_fcbs_lock, true);
+
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+        if (fcb->deleted) {
+            free_delalloc(fcb);
+            Status = STATUS_SUCCESS;
+        } else
+            Status = flush_delalloc(fcb, Irp, rollback);
+
+        ExReleaseResourceLite(fcb->Header.Resource);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_delalloc returned %08lx\n", Status);
+            ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+            return Status;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+
+    return STATUS_SUCCESS;
+}
+
+// Takes a copy of data, to be written at the next commit. If it doesn't fit in our budget,
+// or there isn't the space on the disk for it, buffered is set to false and the caller
+// should write it out now as normal.
+_Requires_exclusive_lock_held_(fcb->Header.Resource)
+NTSTATUS delalloc_write(_In_ fcb* fcb, _In_ uint64_t start, _In_ uint64_t length, _In_reads_bytes_(length) uint8_t* data,
+                        _Out_ bool* buffered, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback) {
+    device_extension* Vcb = fcb->Vcb;
+    NTSTATUS Status;
+    delalloc_range* dr;
+    LIST_ENTRY* le;
+    uint64_t total_space, free_space;
+
+    *buffered = false;
+
+    // If we're holding too much already, write out what we've got for this file. At
+    // least that way it'll end up as one big extent.
+
+    if ((uint64_t)Vcb->delalloc_bytes + length > DELALLOC_MAX_PENDING) {
+        Status = flush_delalloc(fcb, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_delalloc returned %08lx\n", Status);
+            return Status;
+        }
+
+        if ((uint64_t)Vcb->delalloc_bytes + length > DELALLOC_MAX_PENDING)
+            return STATUS_SUCCESS;
+    }
+
+    // Make sure we'll have somewhere to put it at commit time. This doesn't include what
+    // we're already holding, as calculate_total_space takes that off.
+
+    calculate_total_space(Vcb, &total_space, &free_space);
+
+    if (length > free_space << Vcb->sector_shift)
+        return STATUS_SUCCESS;
+
+    dr = ExAllocatePoolWithTag(PagedPool, sizeof(delalloc_range), ALLOC_TAG);
+    if (!dr) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    dr->buf = ExAllocatePoolWithTag(PagedPool, (ULONG)length, ALLOC_TAG);
+    if (!dr->buf) {
+        ERR("out of memory\n");
+        ExFreePool(dr);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(dr->buf, data, (ULONG)length);
+
+    dr->data = dr->buf;
+    dr->start = start;
+    dr->length = length;
+
+    // get rid of any older data we're overwriting
+
+    Status = delalloc_drop(fcb, start, start + length);
+    if (!NT_SUCCESS(Status)) {
+        ERR("delalloc_drop returned %08lx\n", Status);
+        ExFreePool(dr->buf);
+        ExFreePool(dr);
+        return Status;
+    }
+
+    // usually we're appending, so look from the end
+
+    le = fcb->delalloc.Blink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+
+        if (dr2->start < start)
+            break;
+
+        le = le->Blink;
+    }
+
+    InsertHeadList(le, &dr->list_entry);
+
+    InterlockedExchangeAdd64(&Vcb->delalloc_bytes, length);
+
+    // start the commit early, rather than waiting for the budget to run out
+    if ((uint64_t)Vcb->delalloc_bytes > DELALLOC_MAX_PENDING / 2)
+        KeSetEvent(&Vcb->flush_kick, 0, false);
+
+    mark_fcb_dirty(fcb);
+
+    *buffered = true;
+
+    return STATUS_SUCCESS;
+}
@@ -75,6 +75,26 @@ typedef struct {
     dir_child* dc;
 } dir_entry;
 
+// When listing a directory, rather than searching for each entry's INODE_ITEM and xattrs
+// individually, we read them for the next INODE_PREFETCH_BATCH entries in one go. Doing them
+// in inode order means neighbouring inodes come out of the same leaf, which we only walk once.
+
+#define INODE_PREFETCH_BATCH 64
+
+typedef struct {
+    bool found;
+    bool has_dosnum;
+    ULONG dosnum;
+    ULONG ealen;
+    INODE_ITEM inode_item;
+} inode_prefetch_entry;
+
+typedef struct {
+    ULONG num_entries;
+    uint64_t inodes[INODE_PREFETCH_BATCH];
+    inode_prefetch_entry entries[INODE_PREFETCH_BATCH];
+} inode_prefetch;
+
 ULONG get_reparse_tag_fcb(fcb* fcb) {
     ULONG tag;
 
@@ -140,44 +160,200 @@ ULONG get_reparse_tag(device_extension* Vcb, root* subvol, uint64_t inode, uint8
     return tag;
 }
 
+static ULONG get_ea_len_from_xattr(uint8_t* eadata, uint16_t len) {
+    ULONG offset;
+    NTSTATUS Status;
+    FILE_FULL_EA_INFORMATION* eainfo;
+    ULONG ealen;
+
+    if (!eadata)
+        return 0;
+
+    Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+
+    if (!NT_SUCCESS(Status)) {
+        WARN("IoCheckEaBufferValidity returned %08lx (error at offset %lu)\n", Status, offset);
+        return 0;
+    }
+
+    ealen = 4;
+    eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
+    do {
+        ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+
+        if (eainfo->NextEntryOffset == 0)
+            break;
+
+        eainfo = (FILE_FULL_EA_INFORMATION*)(((uint8_t*)eainfo) + eainfo->NextEntryOffset);
+    } while (true);
+
+    return ealen;
+}
+
 static ULONG get_ea_len(device_extension* Vcb, root* subvol, uint64_t inode, PIRP Irp) {
     uint8_t* eadata;
     uint16_t len;
+    ULONG ealen;
 
-    if (get_xattr(Vcb, subvol, inode, EA_EA, EA_EA_HASH, &eadata, &len, Irp)) {
-        ULONG offset;
-        NTSTATUS Status;
+    if (!get_xattr(Vcb, subvol, inode, EA_EA, EA_EA_HASH, &eadata, &len, Irp))
+        return 0;
 
-        Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+    ealen = get_ea_len_from_xattr(eadata, len);
 
-        if (!NT_SUCCESS(Status)) {
-            WARN("IoCheckEaBufferValidity returned %08lx (error at offset %lu)\n", Status, offset);
-            ExFreePool(eadata);
-            return 0;
-        } else {
-            FILE_FULL_EA_INFORMATION* eainfo;
-            ULONG ealen;
+    if (eadata)
+        ExFreePool(eadata);
+
+    return ealen;
+}
+
+static void prefetch_xattr(inode_prefetch_entry* ipe, traverse_ptr* tp) {
+    uint8_t* data;
+    uint16_t len;
 
-            ealen = 4;
-            eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
-            do {
-                ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+    if (tp->item->size < sizeof(DIR_ITEM))
+        return;
 
-                if (eainfo->NextEntryOffset == 0)
+    if (tp->item->key.offset == EA_DOSATTRIB_HASH && extract_xattr(tp->item->data, tp->item->size, EA_DOSATTRIB, &data, &len)) {
+        if (data) {
+            ipe->has_dosnum = get_file_attributes_from_xattr((char*)data, len, &ipe->dosnum);
+            ExFreePool(data);
+        }
+    } else if (tp->item->key.offset == EA_EA_HASH && extract_xattr(tp->item->data, tp->item->size, EA_EA, &data, &len)) {
+        if (data) {
+            ipe->ealen = get_ea_len_from_xattr(data, len);
+            ExFreePool(data);
+        }
+    }
+}
+
+static NTSTATUS prefetch_inodes(fcb* fcb, inode_prefetch* ip, dir_child* dc, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    traverse_ptr tp, next_tp;
+    bool have_tp = false;
+
+    ip->num_entries = 0;
+
+    // gather the inodes of the next batch of entries, sorted and without duplicates
+
+    le = &dc->list_entry_index;
+    while (le != &fcb->dir_children_index && ip->num_entries < INODE_PREFETCH_BATCH) {
+        dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+        // past dir_index_loaded are the entries which were looked up by name, which we won't get to yet
+        if (fcb->dir_children_partial && dc2->index >= fcb->dir_index_loaded)
+            break;
+
+        if (dc2->key.obj_type == TYPE_INODE_ITEM && !(dc2->fileref && dc2->fileref->fcb)) {
+            ULONG i = ip->num_entries;
+
+            while (i > 0 && ip->inodes[i - 1] > dc2->key.obj_id) {
+                i--;
+            }
+
+            if (i == 0 || ip->inodes[i - 1] != dc2->key.obj_id) {
+                RtlMoveMemory(&ip->inodes[i + 1], &ip->inodes[i], (ip->num_entries - i) * sizeof(uint64_t));
+                ip->inodes[i] = dc2->key.obj_id;
+                ip->num_entries++;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    for (ULONG i = 0; i < ip->num_entries; i++) {
+        inode_prefetch_entry* ipe = &ip->entries[i];
+        KEY searchkey;
+
+        ipe->found = false;
+        ipe->has_dosnum = false;
+        ipe->ealen = 0;
+
+        searchkey.obj_id = ip->inodes[i];
+        searchkey.obj_type = TYPE_INODE_ITEM;
+        searchkey.offset = 0;
+
+        // if the inode's in the leaf we're already in, walk forward to it rather than searching again
+        if (have_tp) {
+            while (keycmp(tp.item->key, searchkey) == -1) {
+                if (!find_next_item(fcb->Vcb, &tp, &next_tp, false, Irp) || next_tp.tree != tp.tree) {
+                    have_tp = false;
                     break;
+                }
 
-                eainfo = (FILE_FULL_EA_INFORMATION*)(((uint8_t*)eainfo) + eainfo->NextEntryOffset);
-            } while (true);
+                tp = next_tp;
+            }
+        }
 
-            ExFreePool(eadata);
+        if (!have_tp) {
+            Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("find_item returned %08lx\n", Status);
+                return Status;
+            }
 
-            return ealen;
+            have_tp = true;
         }
-    } else
-        return 0;
+
+        // if it's not there, query_dir_item will complain about it
+        if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type)
+            continue;
+
+        RtlZeroMemory(&ipe->inode_item, sizeof(INODE_ITEM));
+
+        if (tp.item->size > 0)
+            RtlCopyMemory(&ipe->inode_item, tp.item->data, min(sizeof(INODE_ITEM), tp.item->size));
+
+        ipe->found = true;
+
+        // the xattrs come straight after the INODE_ITEM and INODE_REFs
+        while (find_next_item(fcb->Vcb, &tp, &next_tp, false, Irp)) {
+            if (next_tp.item->key.obj_id != searchkey.obj_id || next_tp.item->key.obj_type > TYPE_XATTR_ITEM)
+                break;
+
+            tp = next_tp;
+
+            if (tp.item->key.obj_type == TYPE_XATTR_ITEM)
+                prefetch_xattr(ipe, &tp);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_prefetched_inode(fcb* fcb, inode_prefetch* ip, dir_child* dc, uint64_t inode, inode_prefetch_entry** pipe, PIRP Irp) {
+    NTSTATUS Status;
+    bool prefetched = false;
+
+    while (true) {
+        ULONG lo = 0, hi = ip->num_entries;
+
+        while (lo < hi) {
+            ULONG mid = (lo + hi) / 2;
+
+            if (ip->inodes[mid] == inode) {
+                *pipe = ip->entries[mid].found ? &ip->entries[mid] : NULL;
+                return STATUS_SUCCESS;
+            } else if (ip->inodes[mid] < inode)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (prefetched) {
+            *pipe = NULL;
+            return STATUS_SUCCESS;
+        }
+
+        Status = prefetch_inodes(fcb, ip, dc, Irp);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        prefetched = true;
+    }
 }
 
-static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Irp, dir_entry* de, root* r) {
+static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Irp, dir_entry* de, root* r, inode_prefetch* ip) {
     PIO_STACK_LOCATION IrpSp;
     LONG needed;
     uint64_t inode;
@@ -238,28 +414,42 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
                     }
 
                     if (!found) {
-                        KEY searchkey;
-                        traverse_ptr tp;
+                        inode_prefetch_entry* ipe = NULL;
+
+                        if (ip && de->dc && de->key.obj_type == TYPE_INODE_ITEM && r == fcb->subvol) {
+                            Status = get_prefetched_inode(fcb, ip, de->dc, inode, &ipe, Irp);
+                            if (!NT_SUCCESS(Status)) {
+                                ERR("get_prefetched_inode returned %08lx\n", Status);
+                                return Status;
+                            }
+                        }
 
-                        searchkey.obj_id = inode;
-                        searchkey.obj_type = TYPE_INODE_ITEM;
-                        searchkey.offset = 0xffffffffffffffff;
+                        if (ipe)
+                            ii = ipe->inode_item;
+                        else {
+                            KEY searchkey;
+                            traverse_ptr tp;
 
-                        Status = find_item(fcb->Vcb, r, &tp, &searchkey, false, Irp);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("error - find_item returned %08lx\n", Status);
-                            return Status;
-                        }
+                            searchkey.obj_id = inode;
+                            searchkey.obj_type = TYPE_INODE_ITEM;
+                            searchkey.offset = 0xffffffffffffffff;
 
-                        if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                            ERR("could not find inode item for inode %I64x in root %I64x\n", inode, r->id);
-                            return STATUS_INTERNAL_ERROR;
-                        }
+                            Status = find_item(fcb->Vcb, r, &tp, &searchkey, false, Irp);
+                            if (!NT_SUCCESS(Status)) {
+                                ERR("error - find_item returned %08lx\n", Status);
+                                return Status;
+                            }
 
-                        RtlZeroMemory(&ii, sizeof(INODE_ITEM));
+                            if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                                ERR("could not find inode item for inode %I64x in root %I64x\n", inode, r->id);
+                                return STATUS_INTERNAL_ERROR;
+                            }
 
-                        if (tp.item->size > 0)
-                            RtlCopyMemory(&ii, tp.item->data, min(sizeof(INODE_ITEM), tp.item->size));
+                            RtlZeroMemory(&ii, sizeof(INODE_ITEM));
+
+                            if (tp.item->size > 0)
+                                RtlCopyMemory(&ii, tp.item->data, min(sizeof(INODE_ITEM), tp.item->size));
+                        }
 
                         if (IrpSp->Parameters.QueryDirectory.FileInformationClass == FileBothDirectoryInformation ||
                             IrpSp->Parameters.QueryDirectory.FileInformationClass == FileDirectoryInformation ||
@@ -271,7 +461,10 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
 
                             bool dotfile = de->name.Length > sizeof(WCHAR) && de->name.Buffer[0] == '.';
 
-                            atts = get_file_attributes(fcb->Vcb, r, inode, de->type, dotfile, false, Irp);
+                            if (ipe)
+                                atts = calc_file_attributes(r, inode, de->type, dotfile, ipe->has_dosnum ? &ipe->dosnum : NULL);
+                            else
+                                atts = get_file_attributes(fcb->Vcb, r, inode, de->type, dotfile, false, Irp);
                         }
 
                         if (IrpSp->Parameters.QueryDirectory.FileInformationClass == FileBothDirectoryInformation ||
@@ -280,7 +473,7 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
                             IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdFullDirectoryInformation ||
                             IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdExtdDirectoryInformation ||
                             IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdExtdBothDirectoryInformation) {
-                            ealen = get_ea_len(fcb->Vcb, r, inode, Irp);
+                            ealen = ipe ? ipe->ealen : get_ea_len(fcb->Vcb, r, inode, Irp);
                         }
                     }
                 }
@@ -641,7 +834,7 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
     return STATUS_NO_MORE_FILES;
 }
 
-static NTSTATUS next_dir_entry(file_ref* fileref, uint64_t* offset, dir_entry* de, dir_child** pdc) {
+static NTSTATUS next_dir_entry(file_ref* fileref, uint64_t* offset, dir_entry* de, dir_child** pdc, PIRP Irp) {
     LIST_ENTRY* le;
     dir_child* dc;
 
@@ -653,7 +846,9 @@ static NTSTATUS next_dir_entry(file_ref* fileref, uint64_t* offset, dir_entry* d
         else
             dc = NULL;
 
-        goto next;
+        // past dir_index_loaded, we've only got the entries which have been looked up by name
+        if (!fileref->fcb->dir_children_partial || (dc && dc->index < fileref->fcb->dir_index_loaded))
+            goto next;
     }
 
     if (fileref->parent) { // don't return . and .. if root directory
@@ -690,18 +885,53 @@ static NTSTATUS next_dir_entry(file_ref* fileref, uint64_t* offset, dir_entry* d
         *offset = 2;
 
     dc = NULL;
-    le = fileref->fcb->dir_children_index.Flink;
 
-    // skip entries before offset
-    while (le != &fileref->fcb->dir_children_index) {
-        dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_index);
+    if (fileref->fcb->dir_children_partial) {
+        while (true) {
+            while (fileref->fcb->dir_children_partial && *offset >= fileref->fcb->dir_index_loaded) {
+                NTSTATUS Status = load_dir_children_batch(fileref->fcb->Vcb, fileref->fcb, Irp);
 
-        if (dc2->index >= *offset) {
-            dc = dc2;
-            break;
+                if (!NT_SUCCESS(Status)) {
+                    ERR("load_dir_children_batch returned %08lx\n", Status);
+                    return Status;
+                }
+            }
+
+            // we'll be somewhere near the end, so search backwards
+            dc = NULL;
+            le = fileref->fcb->dir_children_index.Blink;
+
+            while (le != &fileref->fcb->dir_children_index) {
+                dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+                if (dc2->index < *offset)
+                    break;
+
+                dc = dc2;
+
+                le = le->Blink;
+            }
+
+            // if all we've got is an entry which was looked up by name, there may be others before it
+            if (!fileref->fcb->dir_children_partial || (dc && dc->index < fileref->fcb->dir_index_loaded))
+                break;
+
+            *offset = fileref->fcb->dir_index_loaded;
         }
+    } else {
+        le = fileref->fcb->dir_children_index.Flink;
 
-        le = le->Flink;
+        // skip entries before offset
+        while (le != &fileref->fcb->dir_children_index) {
+            dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+            if (dc2->index >= *offset) {
+                dc = dc2;
+                break;
+            }
+
+            le = le->Flink;
+        }
     }
 
 next:
@@ -742,6 +972,7 @@ static NTSTATUS query_directory(PIRP Irp) {
     dir_entry de;
     uint64_t newoffset;
     dir_child* dc = NULL;
+    inode_prefetch* ip = NULL;
 
     TRACE("query directory\n");
 
@@ -869,9 +1100,13 @@ static NTSTATUS query_directory(PIRP Irp) {
 
     ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
 
-    ExAcquireResourceSharedLite(&fileref->fcb->nonpaged->dir_children_lock, true);
+    // we need the lock exclusively if we might be reading more of the directory in
+    if (fileref->fcb->dir_children_partial)
+        ExAcquireResourceExclusiveLite(&fileref->fcb->nonpaged->dir_children_lock, true);
+    else
+        ExAcquireResourceSharedLite(&fileref->fcb->nonpaged->dir_children_lock, true);
 
-    Status = next_dir_entry(fileref, &newoffset, &de, &dc);
+    Status = next_dir_entry(fileref, &newoffset, &de, &dc, Irp);
 
     if (!NT_SUCCESS(Status)) {
         if (Status == STATUS_NO_MORE_FILES && initial)
@@ -893,78 +1128,80 @@ static NTSTATUS query_directory(PIRP Irp) {
 
     if (specific_file) {
         bool found = false;
-        UNICODE_STRING us;
         LIST_ENTRY* le;
         uint32_t hash;
-        uint8_t c;
-
-        us.Buffer = NULL;
 
-        if (!ccb->case_sensitive) {
-            Status = RtlUpcaseUnicodeString(&us, &ccb->query_string, true);
-            if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-                goto end;
-            }
-
-            hash = calc_crc32c(0xffffffff, (uint8_t*)us.Buffer, us.Length);
-        } else
+        if (!ccb->case_sensitive)
+            hash = calc_crc32c_uc(&ccb->query_string);
+        else
             hash = calc_crc32c(0xffffffff, (uint8_t*)ccb->query_string.Buffer, ccb->query_string.Length);
 
-        c = hash >> 24;
-
         if (ccb->case_sensitive) {
-            if (fileref->fcb->hash_ptrs[c]) {
-                le = fileref->fcb->hash_ptrs[c];
-                while (le != &fileref->fcb->dir_children_hash) {
-                    dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash);
+            LIST_ENTRY* head = hash_table_bucket(&fileref->fcb->dir_children_hash, hash);
 
-                    if (dc2->hash == hash) {
-                        if (dc2->name.Length == ccb->query_string.Length && RtlCompareMemory(dc2->name.Buffer, ccb->query_string.Buffer, ccb->query_string.Length) == ccb->query_string.Length) {
-                            found = true;
+            le = head->Flink;
+            while (le != head) {
+                dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash);
 
-                            de.key = dc2->key;
-                            de.name = dc2->name;
-                            de.type = dc2->type;
-                            de.dir_entry_type = DirEntryType_File;
-                            de.dc = dc2;
+                if (dc2->hash == hash && dc2->name.Length == ccb->query_string.Length &&
+                    RtlCompareMemory(dc2->name.Buffer, ccb->query_string.Buffer, ccb->query_string.Length) == ccb->query_string.Length) {
+                    found = true;
 
-                            break;
-                        }
-                    } else if (dc2->hash > hash)
-                        break;
+                    de.key = dc2->key;
+                    de.name = dc2->name;
+                    de.type = dc2->type;
+                    de.dir_entry_type = DirEntryType_File;
+                    de.dc = dc2;
 
-                    le = le->Flink;
+                    break;
                 }
+
+                le = le->Flink;
             }
         } else {
-            if (fileref->fcb->hash_ptrs_uc[c]) {
-                le = fileref->fcb->hash_ptrs_uc[c];
-                while (le != &fileref->fcb->dir_children_hash_uc) {
-                    dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
+            LIST_ENTRY* head = hash_table_bucket(&fileref->fcb->dir_children_hash_uc, hash);
 
-                    if (dc2->hash_uc == hash) {
-                        if (dc2->name_uc.Length == us.Length && RtlCompareMemory(dc2->name_uc.Buffer, us.Buffer, us.Length) == us.Length) {
-                            found = true;
+            le = head->Flink;
+            while (le != head) {
+                dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
 
-                            de.key = dc2->key;
-                            de.name = dc2->name;
-                            de.type = dc2->type;
-                            de.dir_entry_type = DirEntryType_File;
-                            de.dc = dc2;
+                if (dc2->hash_uc == hash && name_equal_uc(&dc2->name_uc, &ccb->query_string)) {
+                    found = true;
 
-                            break;
-                        }
-                    } else if (dc2->hash_uc > hash)
-                        break;
+                    de.key = dc2->key;
+                    de.name = dc2->name;
+                    de.type = dc2->type;
+                    de.dir_entry_type = DirEntryType_File;
+                    de.dc = dc2;
 
-                    le = le->Flink;
+                    break;
                 }
+
+                le = le->Flink;
             }
         }
 
-        if (us.Buffer)
-            ExFreePool(us.Buffer);
+        if (!found && fileref->fcb->dir_children_partial) {
+            root* subvol;
+            uint64_t inode;
+            dir_child* dc2;
+
+            // not read in yet, so look it up in the tree
+            Status = find_file_in_dir(&ccb->query_string, fileref->fcb, &subvol, &inode, &dc2, ccb->case_sensitive, Irp);
+
+            if (NT_SUCCESS(Status)) {
+                found = true;
+
+                de.key = dc2->key;
+                de.name = dc2->name;
+                de.type = dc2->type;
+                de.dir_entry_type = DirEntryType_File;
+                de.dc = dc2;
+            } else if (Status != STATUS_OBJECT_NAME_NOT_FOUND && Status != STATUS_OBJECT_NAME_INVALID) {
+                ERR("find_file_in_dir returned %08lx\n", Status);
+                goto end;
+            }
+        }
 
         if (!found) {
             Status = STATUS_NO_SUCH_FILE;
@@ -973,7 +1210,7 @@ static NTSTATUS query_directory(PIRP Irp) {
     } else if (has_wildcard) {
         while (!FsRtlIsNameInExpression(&ccb->query_string, &de.name, !ccb->case_sensitive, NULL)) {
             newoffset = ccb->query_dir_offset;
-            Status = next_dir_entry(fileref, &newoffset, &de, &dc);
+            Status = next_dir_entry(fileref, &newoffset, &de, &dc, Irp);
 
             if (NT_SUCCESS(Status))
                 ccb->query_dir_offset = newoffset;
@@ -989,7 +1226,17 @@ static NTSTATUS query_directory(PIRP Irp) {
     TRACE("file(0) = %.*S\n", (int)(de.name.Length / sizeof(WCHAR)), de.name.Buffer);
     TRACE("offset = %I64u\n", ccb->query_dir_offset - 1);
 
-    Status = query_dir_item(fcb, ccb, buf, &length, Irp, &de, fcb->subvol);
+    // only worth prefetching if we're returning more than one entry, and they need more than the name
+    if (!(IrpSp->Flags & SL_RETURN_SINGLE_ENTRY) && !specific_file && !has_wildcard &&
+        IrpSp->Parameters.QueryDirectory.FileInformationClass != FileNamesInformation) {
+        ip = ExAllocatePoolWithTag(PagedPool, sizeof(inode_prefetch), ALLOC_TAG);
+        if (!ip)
+            ERR("out of memory\n"); // not fatal - we just look up each entry individually
+        else
+            ip->num_entries = 0;
+    }
+
+    Status = query_dir_item(fcb, ccb, buf, &length, Irp, &de, fcb->subvol, ip);
 
     count = 0;
     if (NT_SUCCESS(Status) && !(IrpSp->Flags & SL_RETURN_SINGLE_ENTRY) && !specific_file) {
@@ -1025,7 +1272,7 @@ static NTSTATUS query_directory(PIRP Irp) {
 
             if (length > 0) {
                 newoffset = ccb->query_dir_offset;
-                Status = next_dir_entry(fileref, &newoffset, &de, &dc);
+                Status = next_dir_entry(fileref, &newoffset, &de, &dc, Irp);
                 if (NT_SUCCESS(Status)) {
                     if (!has_wildcard || FsRtlIsNameInExpression(&ccb->query_string, &de.name, !ccb->case_sensitive, NULL)) {
                         curitem = (uint8_t*)buf + IrpSp->Parameters.QueryDirectory.Length - length;
@@ -1034,7 +1281,7 @@ static NTSTATUS query_directory(PIRP Irp) {
                         TRACE("file(%lu) %Iu = %.*S\n", count, curitem - (uint8_t*)buf, (int)(de.name.Length / sizeof(WCHAR)), de.name.Buffer);
                         TRACE("offset = %I64u\n", ccb->query_dir_offset - 1);
 
-                        status2 = query_dir_item(fcb, ccb, curitem, &length, Irp, &de, fcb->subvol);
+                        status2 = query_dir_item(fcb, ccb, curitem, &length, Irp, &de, fcb->subvol, ip);
 
                         if (NT_SUCCESS(status2)) {
                             ULONG* lastoffset = (ULONG*)lastitem;
@@ -1065,6 +1312,9 @@ end:
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
+    if (ip)
+        ExFreePool(ip);
+
     TRACE("returning %08lx\n", Status);
 
     return Status;
@@ -0,0 +1,426 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Asynchronous discard. With the Discard option set to 2, the TRIM for space freed in a
+// transaction isn't sent at the end of the commit, but queued on the chunk. A background
+// thread sends it once the space has been free for DISCARD_DELAY, a batch at a time - so
+// space which gets reused straight away never gets discarded at all, and what does get
+// sent is kept off the commit.
+//
+// Queued ranges are logical addresses, and are protected by the chunk's lock. Allocations
+// all go through space_list_subtract, which cancels whatever they overlap.
+//
+// The thread picks its batch with the locks held, but lets go of them all before sending the
+// TRIMs, so that a slow device doesn't hold up the commit or anything allocating. While they're
+// being sent, the chunk is marked as having discards in flight: anything which allocates from
+// that part of the chunk waits for them to finish before it goes on to write there, as does
+// drop_chunk, so the chunk and its devices stay around until we're done with them. So that we
+// never wait for a chunk lock while somebody else might be waiting for us, once we've marked
+// one chunk we only try for the others.
+
+#define DISCARD_DELAY       30          // seconds
+#define DISCARD_INTERVAL    100         // milliseconds between batches
+#define DISCARD_BATCH       64          // ranges per batch
+#define DISCARD_MIN_SIZE    0x8000      // 32 KB
+#define DISCARD_MAX_SIZE    0x4000000   // 64 MB
+
+#define DISCARD_DELAY_TICKS ((uint64_t)DISCARD_DELAY * 10000000)
+
+void init_chunk_discards(_In_ chunk* c) {
+    c->discard.tree.root = NULL;
+    c->discard.tree.augment = NULL;
+    InitializeListHead(&c->discard.list);
+    c->discard.bytes = 0;
+    c->discard.reused = 0;
+    c->discard.inflight = 0;
+    KeInitializeEvent(&c->discard.inflight_done, NotificationEvent, true);
+}
+
+void free_chunk_discards(_In_ chunk* c) {
+    while (!IsListEmpty(&c->discard.list)) {
+        discard_range* dr = CONTAINING_RECORD(RemoveHeadList(&c->discard.list), discard_range, list_entry);
+
+        ExFreePool(dr);
+    }
+
+    c->discard.tree.root = NULL;
+    c->discard.bytes = 0;
+}
+
+static void remove_discard_range(chunk* c, discard_range* dr) {
+    rb_remove(&c->discard.tree, &dr->node);
+    RemoveEntryList(&dr->list_entry);
+    c->discard.bytes -= dr->size;
+
+    ExFreePool(dr);
+}
+
+static void insert_discard_range(chunk* c, discard_range* dr) {
+    rb_node* parent = NULL;
+    rb_node** link = &c->discard.tree.root;
+
+    while (*link) {
+        parent = *link;
+
+        if (dr->address < CONTAINING_RECORD(parent, discard_range, node)->address)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    rb_insert(&c->discard.tree, parent, link, &dr->node);
+}
+
+// returns the last range starting at or before address
+static discard_range* find_discard_range(chunk* c, uint64_t address) {
+    rb_node* n = c->discard.tree.root;
+    discard_range* ret = NULL;
+
+    while (n) {
+        discard_range* dr = CONTAINING_RECORD(n, discard_range, node);
+
+        if (dr->address <= address) {
+            ret = dr;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
+_Requires_exclusive_lock_held_(c->lock)
+void queue_discard(_In_ chunk* c, _In_ uint64_t address, _In_ uint64_t size) {
+    discard_range *dr, *prev;
+    rb_node* n;
+
+    // Merge with our neighbours, and restart the clock - if something next to us has
+    // just been freed, this bit of the disk is still busy. Ranges stop growing once
+    // they reach DISCARD_MAX_SIZE, so that they do get sent eventually.
+
+    prev = find_discard_range(c, address);
+
+    if (prev && prev->address + prev->size == address && prev->size + size <= DISCARD_MAX_SIZE) {
+        dr = prev;
+        dr->size += size;
+
+        RemoveEntryList(&dr->list_entry);
+    } else {
+        dr = ExAllocatePoolWithTag(PagedPool, sizeof(discard_range), ALLOC_TAG);
+        if (!dr) {
+            ERR("out of memory\n"); // not fatal - the space just doesn't get discarded
+            return;
+        }
+
+        dr->address = address;
+        dr->size = size;
+
+        insert_discard_range(c, dr);
+    }
+
+    c->discard.bytes += size;
+
+    n = rb_next(&dr->node);
+    if (n) {
+        discard_range* next = CONTAINING_RECORD(n, discard_range, node);
+
+        if (next->address == dr->address + dr->size && dr->size + next->size <= DISCARD_MAX_SIZE) {
+            uint64_t next_size = next->size;
+
+            remove_discard_range(c, next);
+
+            dr->size += next_size;
+            c->discard.bytes += next_size;
+        }
+    }
+
+    dr->queued = KeQueryInterruptTime();
+    InsertTailList(&c->discard.list, &dr->list_entry);
+}
+
+// Called when space is allocated - it's about to be written to, so mustn't be discarded.
+_Requires_exclusive_lock_held_(c->lock)
+void cancel_discard(_In_ chunk* c, _In_ uint64_t address, _In_ uint64_t size) {
+    discard_range* dr;
+    rb_node* n;
+    uint64_t end = address + size;
+
+    if (c->discard.inflight && address < c->discard.inflight_end && end > c->discard.inflight_start)
+        KeWaitForSingleObject(&c->discard.inflight_done, Executive, KernelMode, false, NULL);
+
+    if (IsListEmpty(&c->discard.list))
+        return;
+
+    dr = find_discard_range(c, address);
+
+    if (!dr)
+        n = rb_first(&c->discard.tree);
+    else if (dr->address + dr->size <= address)
+        n = rb_next(&dr->node);
+    else
+        n = &dr->node;
+
+    while (n) {
+        uint64_t dr_end, overlap;
+
+        dr = CONTAINING_RECORD(n, discard_range, node);
+
+        if (dr->address >= end)
+            break;
+
+        n = rb_next(n);
+
+        dr_end = dr->address + dr->size;
+        overlap = min(dr_end, end) - max(dr->address, address);
+
+        c->discard.reused += overlap;
+
+        if (dr->address >= address && dr_end <= end) // remove entirely
+            remove_discard_range(c, dr);
+        else if (dr->address < address && dr_end > end) { // cut out hole
+            discard_range* dr2 = ExAllocatePoolWithTag(PagedPool, sizeof(discard_range), ALLOC_TAG);
+
+            if (dr2) {
+                dr2->address = end;
+                dr2->size = dr_end - end;
+                dr2->queued = dr->queued;
+
+                insert_discard_range(c, dr2);
+                InsertHeadList(&dr->list_entry, &dr2->list_entry);
+            } else {
+                ERR("out of memory\n");
+                c->discard.bytes -= dr_end - end;
+            }
+
+            dr->size = address - dr->address;
+            c->discard.bytes -= overlap;
+        } else if (dr->address < address) { // remove end
+            dr->size = address - dr->address;
+            c->discard.bytes -= overlap;
+        } else { // remove start
+            dr->address = end;
+            dr->size = dr_end - end;
+            c->discard.bytes -= overlap;
+        }
+    }
+}
+
+// Called before the chunk is freed.
+void wait_for_chunk_discards(_In_ chunk* c) {
+    if (c->discard.inflight)
+        KeWaitForSingleObject(&c->discard.inflight_done, Executive, KernelMode, false, NULL);
+}
+
+// Moves the ranges which are ready from the queue onto the devices' discard lists, and
+// returns true if there were any.
+_Requires_exclusive_lock_held_(c->lock)
+static bool discard_chunk(device_extension* Vcb, chunk* c, uint64_t now, unsigned int* budget) {
+    LIST_ENTRY* le;
+    bool sending = false;
+
+    le = c->discard.list.Flink;
+    while (le != &c->discard.list && *budget > 0) {
+        discard_range* dr = CONTAINING_RECORD(le, discard_range, list_entry);
+        uint64_t len;
+
+        if (now - dr->queued < DISCARD_DELAY_TICKS)
+            break;
+
+        le = le->Flink;
+
+        if (dr->size < DISCARD_MIN_SIZE) {
+            InterlockedExchangeAdd64(&Vcb->discard.skipped_bytes, dr->size);
+            remove_discard_range(c, dr);
+            continue;
+        }
+
+        len = min(dr->size, DISCARD_MAX_SIZE);
+
+        add_chunk_trim_entries(Vcb, c, dr->address, len, true);
+
+        if (!sending) {
+            c->discard.inflight_start = dr->address;
+            c->discard.inflight_end = dr->address + len;
+            KeClearEvent(&c->discard.inflight_done);
+            InterlockedExchange(&c->discard.inflight, 1);
+            sending = true;
+        } else {
+            c->discard.inflight_start = min(c->discard.inflight_start, dr->address);
+            c->discard.inflight_end = max(c->discard.inflight_end, dr->address + len);
+        }
+
+        (*budget)--;
+
+        if (len == dr->size)
+            remove_discard_range(c, dr);
+        else {
+            dr->address += len;
+            dr->size -= len;
+            c->discard.bytes -= len;
+
+            le = &dr->list_entry;
+        }
+    }
+
+    return sending;
+}
+
+// Returns the interrupt time at which the next range will be ready, or 0 if there's nothing queued.
+static uint64_t discard_pass(device_extension* Vcb) {
+    LIST_ENTRY* le;
+    uint64_t now = KeQueryInterruptTime(), next = 0, queued = 0;
+    unsigned int budget = DISCARD_BATCH;
+    chunk* sent[DISCARD_BATCH];
+    ULONG num_sent = 0, num_devs = 0, i;
+    device** devs;
+
+    // Holding tree_lock keeps out the commit, which is the only thing which adds or frees
+    // chunks and devices.
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        num_devs++;
+        le = le->Flink;
+    }
+
+    devs = ExAllocatePoolWithTag(PagedPool, sizeof(device*) * max(num_devs, 1), ALLOC_TAG);
+    if (!devs) {
+        ERR("out of memory\n");
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return now;
+    }
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        // only a hint - anything we miss will get picked up next time
+        if (!IsListEmpty(&c->discard.list) || c->discard.reused != 0) {
+            if (num_sent == 0)
+                acquire_chunk_lock(c, Vcb);
+            else if (!try_acquire_chunk_lock(c, Vcb)) {
+                if (next == 0 || now < next)
+                    next = now;
+
+                le = le->Flink;
+                continue;
+            }
+
+            if (c->discard.reused != 0) {
+                InterlockedExchangeAdd64(&Vcb->discard.reused_bytes, c->discard.reused);
+                c->discard.reused = 0;
+            }
+
+            if (budget > 0 && discard_chunk(Vcb, c, now, &budget)) {
+                sent[num_sent] = c;
+                num_sent++;
+            }
+
+            if (!IsListEmpty(&c->discard.list)) {
+                discard_range* dr = CONTAINING_RECORD(c->discard.list.Flink, discard_range, list_entry);
+
+                if (next == 0 || dr->queued + DISCARD_DELAY_TICKS < next)
+                    next = dr->queued + DISCARD_DELAY_TICKS;
+            }
+
+            queued += c->discard.bytes;
+
+            release_chunk_lock(c, Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    num_devs = 0;
+
+    if (num_sent > 0) {
+        le = Vcb->devices.Flink;
+        while (le != &Vcb->devices) {
+            device* dev = CONTAINING_RECORD(le, device, list_entry);
+
+            if (dev->num_discard_entries > 0) {
+                devs[num_devs] = dev;
+                num_devs++;
+            }
+
+            le = le->Flink;
+        }
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    Vcb->discard.queued_bytes = queued;
+
+    if (num_devs > 0)
+        send_device_trims(Vcb, devs, num_devs, true);
+
+    ExFreePool(devs);
+
+    for (i = 0; i < num_sent; i++) {
+        InterlockedExchange(&sent[i]->discard.inflight, 0);
+        KeSetEvent(&sent[i]->discard.inflight_done, 0, false);
+    }
+
+    return next;
+}
+
+_Function_class_(KSTART_ROUTINE)
+void __stdcall discard_thread(void* context) {
+    DEVICE_OBJECT* devobj = context;
+    device_extension* Vcb = devobj->DeviceExtension;
+    uint64_t next = 0;
+
+    ObReferenceObject(devobj);
+
+    while (true) {
+        LARGE_INTEGER timeout;
+
+        if (next != 0) {
+            uint64_t now = KeQueryInterruptTime();
+
+            // rate limit - if there's a backlog, we send DISCARD_BATCH ranges every DISCARD_INTERVAL
+            if (next > now + (DISCARD_INTERVAL * 10000))
+                timeout.QuadPart = -(LONGLONG)(next - now);
+            else
+                timeout.QuadPart = DISCARD_INTERVAL * -10000;
+        }
+
+        KeWaitForSingleObject(&Vcb->discard.event, Executive, KernelMode, false, next != 0 ? &timeout : NULL);
+
+        if (Vcb->discard.quit || !(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
+            break;
+
+        if (Vcb->locked) {
+            next = KeQueryInterruptTime();
+            continue;
+        }
+
+        next = discard_pass(Vcb);
+    }
+
+    ObDereferenceObject(devobj);
+
+    KeSetEvent(&Vcb->discard.finished, 0, false);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
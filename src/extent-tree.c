@@ -1694,7 +1694,109 @@ uint64_t get_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t s
     return ei->refcount;
 }
 
-bool is_extent_unique(device_extension* Vcb, uint64_t address, uint64_t size, PIRP Irp) {
+// Whether a data extent is unique gets looked up for every extent of a file when it's opened,
+// and for NOCOW files decides whether writes can go in place. As it means searching the extent
+// tree and the backrefs, we cache the answer on the chunk.
+//
+// What's in the extent tree doesn't reflect changes to refs until they're flushed at the next
+// commit, so an entry is only good if it was worked out in a later generation than the refs
+// last changed, or a snapshot was last taken. Until then, we say that the extent isn't unique.
+
+#define UNIQUE_CACHE_MAX 16384 // entries per chunk
+
+void init_chunk_unique_cache(_In_ chunk* c) {
+    c->unique.tree.root = NULL;
+    c->unique.tree.augment = NULL;
+    c->unique.count = 0;
+    c->unique.changed = 0;
+}
+
+void free_chunk_unique_cache(_In_ chunk* c) {
+    rb_node* n;
+
+    while ((n = rb_first(&c->unique.tree))) {
+        unique_extent* ue = CONTAINING_RECORD(n, unique_extent, node);
+
+        rb_remove(&c->unique.tree, n);
+        ExFreePool(ue);
+    }
+
+    c->unique.count = 0;
+}
+
+static unique_extent* find_unique_extent(chunk* c, uint64_t address) {
+    rb_node* n = c->unique.tree.root;
+
+    while (n) {
+        unique_extent* ue = CONTAINING_RECORD(n, unique_extent, node);
+
+        if (address < ue->address)
+            n = n->left;
+        else if (address > ue->address)
+            n = n->right;
+        else
+            return ue;
+    }
+
+    return NULL;
+}
+
+static unique_extent* get_unique_extent(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size) {
+    rb_node* parent = NULL;
+    rb_node** link = &c->unique.tree.root;
+    unique_extent* ue;
+
+    while (*link) {
+        parent = *link;
+        ue = CONTAINING_RECORD(parent, unique_extent, node);
+
+        if (address < ue->address)
+            link = &parent->left;
+        else if (address > ue->address)
+            link = &parent->right;
+        else
+            return ue;
+    }
+
+    if (c->unique.count >= UNIQUE_CACHE_MAX) {
+        // Start again - but as we're throwing away what's changed, nothing in the chunk
+        // can be trusted until the next commit.
+        free_chunk_unique_cache(c);
+        c->unique.changed = Vcb->superblock.generation;
+
+        parent = NULL;
+        link = &c->unique.tree.root;
+    }
+
+    ue = ExAllocatePoolWithTag(PagedPool, sizeof(unique_extent), ALLOC_TAG);
+    if (!ue) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    ue->address = address;
+    ue->size = size;
+    ue->generation = 0;
+    ue->changed = 0;
+    ue->unique = false;
+
+    rb_insert(&c->unique.tree, parent, link, &ue->node);
+    c->unique.count++;
+
+    return ue;
+}
+
+_Requires_exclusive_lock_held_(c->changed_extents_lock)
+static void mark_unique_extent_changed(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size) {
+    unique_extent* ue = get_unique_extent(Vcb, c, address, size);
+
+    if (ue)
+        ue->changed = Vcb->superblock.generation;
+    else
+        c->unique.changed = Vcb->superblock.generation;
+}
+
+static bool is_extent_unique2(device_extension* Vcb, uint64_t address, uint64_t size, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
@@ -1832,6 +1934,53 @@ bool is_extent_unique(device_extension* Vcb, uint64_t address, uint64_t size, PI
     return false;
 }
 
+bool is_extent_unique(device_extension* Vcb, uint64_t address, uint64_t size, PIRP Irp) {
+    chunk* c = get_chunk_from_address(Vcb, address);
+    uint64_t gen = Vcb->superblock.generation;
+    unique_extent* ue;
+    bool unique;
+
+    if (!c)
+        return is_extent_unique2(Vcb, address, size, Irp);
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+
+    ue = find_unique_extent(c, address);
+
+    if (Vcb->unique_epoch == gen || c->unique.changed == gen || (ue && ue->changed == gen)) {
+        // the extent tree is out of date
+        ExReleaseResourceLite(&c->changed_extents_lock);
+        return false;
+    }
+
+    if (ue && ue->size == size && ue->generation > ue->changed && ue->generation > c->unique.changed && ue->generation > Vcb->unique_epoch) {
+        unique = ue->unique;
+        ExReleaseResourceLite(&c->changed_extents_lock);
+        return unique;
+    }
+
+    ExReleaseResourceLite(&c->changed_extents_lock);
+
+    unique = is_extent_unique2(Vcb, address, size, Irp);
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+
+    // don't store it if the refs changed while we were looking
+    if (Vcb->unique_epoch != gen && c->unique.changed != gen) {
+        ue = get_unique_extent(Vcb, c, address, size);
+
+        if (ue && ue->changed != gen) {
+            ue->size = size;
+            ue->generation = gen;
+            ue->unique = unique;
+        }
+    }
+
+    ExReleaseResourceLite(&c->changed_extents_lock);
+
+    return unique;
+}
+
 uint64_t get_extent_flags(device_extension* Vcb, uint64_t address, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp;
@@ -1913,7 +2062,7 @@ void update_extent_flags(device_extension* Vcb, uint64_t address, uint64_t flags
     ei->flags = flags;
 }
 
-static changed_extent* get_changed_extent_item(chunk* c, uint64_t address, uint64_t size, bool no_csum) {
+static changed_extent* get_changed_extent_item(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, bool no_csum) {
     LIST_ENTRY* le;
     changed_extent* ce;
 
@@ -1945,6 +2094,11 @@ static changed_extent* get_changed_extent_item(chunk* c, uint64_t address, uint6
 
     InsertTailList(&c->changed_extents, &ce->list_entry);
 
+    mark_unique_extent_changed(Vcb, c, address, size);
+
+    InterlockedIncrement(&Vcb->changed_extent_count);
+    check_dirty_thresholds(Vcb);
+
     return ce;
 }
 
@@ -1960,7 +2114,7 @@ NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, uint64_t add
 
     ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
 
-    ce = get_changed_extent_item(c, address, size, no_csum);
+    ce = get_changed_extent_item(Vcb, c, address, size, no_csum);
 
     if (!ce) {
         ERR("get_changed_extent_item failed\n");
@@ -2073,12 +2227,12 @@ end:
     return Status;
 }
 
-void add_changed_extent_ref(chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset, uint32_t count, bool no_csum) {
+void add_changed_extent_ref(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset, uint32_t count, bool no_csum) {
     changed_extent* ce;
     changed_extent_ref* cer;
     LIST_ENTRY* le;
 
-    ce = get_changed_extent_item(c, address, size, no_csum);
+    ce = get_changed_extent_item(Vcb, c, address, size, no_csum);
 
     if (!ce) {
         ERR("get_changed_extent_item failed\n");
@@ -482,14 +482,12 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
     fcb->inode_item_changed = true;
 
     if (oldfcb->sd && RtlLengthSecurityDescriptor(oldfcb->sd) > 0) {
-        fcb->sd = ExAllocatePoolWithTag(PagedPool, RtlLengthSecurityDescriptor(oldfcb->sd), ALLOC_TAG);
+        fcb->sd = dup_sd(Vcb, oldfcb->sd);
         if (!fcb->sd) {
             ERR("out of memory\n");
             free_fcb(fcb);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
-
-        RtlCopyMemory(fcb->sd, oldfcb->sd, RtlLengthSecurityDescriptor(oldfcb->sd));
     }
 
     fcb->atts = oldfcb->atts;
@@ -617,6 +615,9 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
     }
 
     fcb->prop_compression = oldfcb->prop_compression;
+    fcb->prop_compression_level = oldfcb->prop_compression_level;
+    fcb->extent_size_hint = oldfcb->extent_size_hint;
+    fcb->extent_size_hint_changed = fcb->extent_size_hint != 0;
 
     le = oldfcb->xattrs.Flink;
     while (le != &oldfcb->xattrs) {
@@ -662,6 +663,10 @@ static NTSTATUS add_children_to_move_list(device_extension* Vcb, move_entry* me,
     NTSTATUS Status;
     LIST_ENTRY* le;
 
+    Status = complete_dir_children(Vcb, me->fileref->fcb, Irp);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
     ExAcquireResourceSharedLite(&me->fileref->fcb->nonpaged->dir_children_lock, true);
 
     le = me->fileref->fcb->dir_children_index.Flink;
@@ -702,41 +707,8 @@ static NTSTATUS add_children_to_move_list(device_extension* Vcb, move_entry* me,
 }
 
 void remove_dir_child_from_hash_lists(fcb* fcb, dir_child* dc) {
-    uint8_t c;
-
-    c = dc->hash >> 24;
-
-    if (fcb->hash_ptrs[c] == &dc->list_entry_hash) {
-        if (dc->list_entry_hash.Flink == &fcb->dir_children_hash)
-            fcb->hash_ptrs[c] = NULL;
-        else {
-            dir_child* dc2 = CONTAINING_RECORD(dc->list_entry_hash.Flink, dir_child, list_entry_hash);
-
-            if (dc2->hash >> 24 == c)
-                fcb->hash_ptrs[c] = &dc2->list_entry_hash;
-            else
-                fcb->hash_ptrs[c] = NULL;
-        }
-    }
-
-    RemoveEntryList(&dc->list_entry_hash);
-
-    c = dc->hash_uc >> 24;
-
-    if (fcb->hash_ptrs_uc[c] == &dc->list_entry_hash_uc) {
-        if (dc->list_entry_hash_uc.Flink == &fcb->dir_children_hash_uc)
-            fcb->hash_ptrs_uc[c] = NULL;
-        else {
-            dir_child* dc2 = CONTAINING_RECORD(dc->list_entry_hash_uc.Flink, dir_child, list_entry_hash_uc);
-
-            if (dc2->hash_uc >> 24 == c)
-                fcb->hash_ptrs_uc[c] = &dc2->list_entry_hash_uc;
-            else
-                fcb->hash_ptrs_uc[c] = NULL;
-        }
-    }
-
-    RemoveEntryList(&dc->list_entry_hash_uc);
+    hash_table_remove(&fcb->dir_children_hash, &dc->list_entry_hash);
+    hash_table_remove(&fcb->dir_children_hash_uc, &dc->list_entry_hash_uc);
 }
 
 static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb, fcb** pfcb) {
@@ -789,6 +761,8 @@ static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb
         return STATUS_INTERNAL_ERROR;
     }
 
+    share_sd(Vcb, &fcb->sd);
+
     Status = RtlGetOwnerSecurityDescriptor(fcb->sd, &owner, &defaulted);
     if (!NT_SUCCESS(Status)) {
         ERR("RtlGetOwnerSecurityDescriptor returned %08lx\n", Status);
@@ -814,28 +788,23 @@ static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb
         fcb->inode_item.flags |= BTRFS_INODE_COMPRESS;
 
     fcb->prop_compression = parfcb->prop_compression;
+    fcb->prop_compression_level = parfcb->prop_compression_level;
     fcb->prop_compression_changed = fcb->prop_compression != PropCompression_None;
 
-    fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!fcb->hash_ptrs) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    RtlZeroMemory(fcb->hash_ptrs, sizeof(LIST_ENTRY*) * 256);
+    fcb->extent_size_hint = parfcb->extent_size_hint;
+    fcb->extent_size_hint_changed = fcb->extent_size_hint != 0;
 
-    fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!fcb->hash_ptrs_uc) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    Status = hash_table_alloc(&fcb->dir_children_hash);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-    RtlZeroMemory(fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
+    Status = hash_table_alloc(&fcb->dir_children_hash_uc);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-    r->fcbs_version++;
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(fcb);
@@ -846,64 +815,12 @@ static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb
 }
 
 void add_fcb_to_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb) {
-    LIST_ENTRY* lastle = NULL;
-    uint32_t hash = fcb->hash;
-
-    if (fcb->subvol->fcbs_ptrs[hash >> 24]) {
-        LIST_ENTRY* le = fcb->subvol->fcbs_ptrs[hash >> 24];
-
-        while (le != &fcb->subvol->fcbs) {
-            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-            if (fcb2->hash > hash) {
-                lastle = le->Blink;
-                break;
-            }
-
-            le = le->Flink;
-        }
-    }
-
-    if (!lastle) {
-        uint8_t c = hash >> 24;
-
-        if (c != 0xff) {
-            uint8_t d = c + 1;
-
-            do {
-                if (fcb->subvol->fcbs_ptrs[d]) {
-                    lastle = fcb->subvol->fcbs_ptrs[d]->Blink;
-                    break;
-                }
-
-                d++;
-            } while (d != 0);
-        }
-    }
-
-    if (lastle) {
-        InsertHeadList(lastle, &fcb->list_entry);
-
-        if (lastle == &fcb->subvol->fcbs || (CONTAINING_RECORD(lastle, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-            fcb->subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-    } else {
-        InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
-
-        if (fcb->list_entry.Blink == &fcb->subvol->fcbs || (CONTAINING_RECORD(fcb->list_entry.Blink, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-            fcb->subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-    }
+    hash_table_insert(&fcb->subvol->fcbs_hash, &fcb->list_entry_hash);
+    InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
 }
 
 void remove_fcb_from_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb) {
-    uint8_t c = fcb->hash >> 24;
-
-    if (fcb->subvol->fcbs_ptrs[c] == &fcb->list_entry) {
-        if (fcb->list_entry.Flink != &fcb->subvol->fcbs && (CONTAINING_RECORD(fcb->list_entry.Flink, struct _fcb, list_entry)->hash >> 24) == c)
-            fcb->subvol->fcbs_ptrs[c] = fcb->list_entry.Flink;
-        else
-            fcb->subvol->fcbs_ptrs[c] = NULL;
-    }
-
+    hash_table_remove(&fcb->subvol->fcbs_hash, &fcb->list_entry_hash);
     RemoveEntryList(&fcb->list_entry);
 }
 
@@ -1004,9 +921,13 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
                 if (!me->fileref->fcb->ads) {
                     LIST_ENTRY* le2;
 
+                    remove_fcb_from_subvol(me->fileref->fcb);
+
                     me->fileref->fcb->subvol = destdir->fcb->subvol;
                     me->fileref->fcb->inode = InterlockedIncrement64(&destdir->fcb->subvol->lastinode);
                     me->fileref->fcb->hash = calc_crc32c(0xffffffff, (uint8_t*)&me->fileref->fcb->inode, sizeof(uint64_t));
+
+                    add_fcb_to_subvol(me->fileref->fcb);
                     me->fileref->fcb->inode_item.st_nlink = 1;
 
                     defda = get_file_attributes(me->fileref->fcb->Vcb, me->fileref->fcb->subvol, me->fileref->fcb->inode,
@@ -1068,15 +989,14 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
                     }
 
                     add_fcb_to_subvol(me->dummyfcb);
-                    remove_fcb_from_subvol(me->fileref->fcb);
-                    add_fcb_to_subvol(me->fileref->fcb);
                 } else {
+                    remove_fcb_from_subvol(me->fileref->fcb);
+
                     me->fileref->fcb->subvol = me->parent->fileref->fcb->subvol;
                     me->fileref->fcb->inode = me->parent->fileref->fcb->inode;
                     me->fileref->fcb->hash = me->parent->fileref->fcb->hash;
 
-                    // put stream after parent in FCB list
-                    InsertHeadList(&me->parent->fileref->fcb->list_entry, &me->fileref->fcb->list_entry);
+                    add_fcb_to_subvol(me->fileref->fcb);
                 }
 
                 me->fileref->fcb->created = true;
@@ -1223,8 +1143,8 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
 
                 if (name_changed) {
                     ExFreePool(me->fileref->dc->utf8.Buffer);
+                    free_dir_child_name_uc(me->fileref->dc);
                     ExFreePool(me->fileref->dc->name.Buffer);
-                    ExFreePool(me->fileref->dc->name_uc.Buffer);
 
                     me->fileref->dc->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, utf8->Length, ALLOC_TAG);
                     if (!me->fileref->dc->utf8.Buffer) {
@@ -1246,14 +1166,13 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
                     me->fileref->dc->name.Length = me->fileref->dc->name.MaximumLength = fnus->Length;
                     RtlCopyMemory(me->fileref->dc->name.Buffer, fnus->Buffer, fnus->Length);
 
-                    Status = RtlUpcaseUnicodeString(&fileref->dc->name_uc, &fileref->dc->name, true);
+                    Status = set_dir_child_name_uc(me->fileref->dc);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+                        ERR("set_dir_child_name_uc returned %08lx\n", Status);
                         goto end;
                     }
 
                     me->fileref->dc->hash = calc_crc32c(0xffffffff, (uint8_t*)me->fileref->dc->name.Buffer, me->fileref->dc->name.Length);
-                    me->fileref->dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)me->fileref->dc->name_uc.Buffer, me->fileref->dc->name_uc.Length);
                 }
 
                 if (me->fileref->dc->key.obj_type == TYPE_INODE_ITEM)
@@ -1273,6 +1192,7 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
 
                 InsertTailList(&destdir->fcb->dir_children_index, &me->fileref->dc->list_entry_index);
                 insert_dir_child_into_hash_lists(destdir->fcb, me->fileref->dc);
+                neg_cache_invalidate(destdir->fcb);
                 ExReleaseResourceLite(&destdir->fcb->nonpaged->dir_children_lock);
             }
 
@@ -1320,6 +1240,7 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
 
                     InsertTailList(&me->parent->fileref->fcb->dir_children_index, &me->fileref->dc->list_entry_index);
                     insert_dir_child_into_hash_lists(me->parent->fileref->fcb, me->fileref->dc);
+                    neg_cache_invalidate(me->parent->fileref->fcb);
                 }
 
                 ExReleaseResourceLite(&me->parent->fileref->fcb->nonpaged->dir_children_lock);
@@ -1419,100 +1340,14 @@ end:
         ExFreePool(me);
     }
 
-    destdir->fcb->subvol->fcbs_version++;
-    fileref->fcb->subvol->fcbs_version++;
-
     release_fcb_lock(fileref->fcb->Vcb);
 
     return Status;
 }
 
 void insert_dir_child_into_hash_lists(fcb* fcb, dir_child* dc) {
-    bool inserted;
-    LIST_ENTRY* le;
-    uint8_t c, d;
-
-    c = dc->hash >> 24;
-
-    inserted = false;
-
-    d = c;
-    do {
-        le = fcb->hash_ptrs[d];
-
-        if (d == 0)
-            break;
-
-        d--;
-    } while (!le);
-
-    if (!le)
-        le = fcb->dir_children_hash.Flink;
-
-    while (le != &fcb->dir_children_hash) {
-        dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash);
-
-        if (dc2->hash > dc->hash) {
-            InsertHeadList(le->Blink, &dc->list_entry_hash);
-            inserted = true;
-            break;
-        }
-
-        le = le->Flink;
-    }
-
-    if (!inserted)
-        InsertTailList(&fcb->dir_children_hash, &dc->list_entry_hash);
-
-    if (!fcb->hash_ptrs[c])
-        fcb->hash_ptrs[c] = &dc->list_entry_hash;
-    else {
-        dir_child* dc2 = CONTAINING_RECORD(fcb->hash_ptrs[c], dir_child, list_entry_hash);
-
-        if (dc2->hash > dc->hash)
-            fcb->hash_ptrs[c] = &dc->list_entry_hash;
-    }
-
-    c = dc->hash_uc >> 24;
-
-    inserted = false;
-
-    d = c;
-    do {
-        le = fcb->hash_ptrs_uc[d];
-
-        if (d == 0)
-            break;
-
-        d--;
-    } while (!le);
-
-    if (!le)
-        le = fcb->dir_children_hash_uc.Flink;
-
-    while (le != &fcb->dir_children_hash_uc) {
-        dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
-
-        if (dc2->hash_uc > dc->hash_uc) {
-            InsertHeadList(le->Blink, &dc->list_entry_hash_uc);
-            inserted = true;
-            break;
-        }
-
-        le = le->Flink;
-    }
-
-    if (!inserted)
-        InsertTailList(&fcb->dir_children_hash_uc, &dc->list_entry_hash_uc);
-
-    if (!fcb->hash_ptrs_uc[c])
-        fcb->hash_ptrs_uc[c] = &dc->list_entry_hash_uc;
-    else {
-        dir_child* dc2 = CONTAINING_RECORD(fcb->hash_ptrs_uc[c], dir_child, list_entry_hash_uc);
-
-        if (dc2->hash_uc > dc->hash_uc)
-            fcb->hash_ptrs_uc[c] = &dc->list_entry_hash_uc;
-    }
+    hash_table_insert(&fcb->dir_children_hash, &dc->list_entry_hash);
+    hash_table_insert(&fcb->dir_children_hash_uc, &dc->list_entry_hash_uc);
 }
 
 static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref, ccb* ccb, ULONG flags,
@@ -1589,6 +1424,8 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
 
     fileref->fcb->inode_item_changed = true;
     fileref->fcb->prop_compression = ofr->fcb->prop_compression;
+    fileref->fcb->prop_compression_level = ofr->fcb->prop_compression_level;
+    fileref->fcb->extent_size_hint = ofr->fcb->extent_size_hint;
 
     while (!IsListEmpty(&ofr->fcb->xattrs)) {
         InsertTailList(&fileref->fcb->xattrs, RemoveHeadList(&ofr->fcb->xattrs));
@@ -1602,19 +1439,11 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
         InsertTailList(&fileref->fcb->dir_children_index, RemoveHeadList(&ofr->fcb->dir_children_index));
     }
 
-    while (!IsListEmpty(&ofr->fcb->dir_children_hash)) {
-        InsertTailList(&fileref->fcb->dir_children_hash, RemoveHeadList(&ofr->fcb->dir_children_hash));
-    }
-
-    while (!IsListEmpty(&ofr->fcb->dir_children_hash_uc)) {
-        InsertTailList(&fileref->fcb->dir_children_hash_uc, RemoveHeadList(&ofr->fcb->dir_children_hash_uc));
-    }
+    fileref->fcb->dir_children_partial = ofr->fcb->dir_children_partial;
+    fileref->fcb->dir_index_loaded = ofr->fcb->dir_index_loaded;
 
-    fileref->fcb->hash_ptrs = ofr->fcb->hash_ptrs;
-    fileref->fcb->hash_ptrs_uc = ofr->fcb->hash_ptrs_uc;
-
-    ofr->fcb->hash_ptrs = NULL;
-    ofr->fcb->hash_ptrs_uc = NULL;
+    hash_table_move(&fileref->fcb->dir_children_hash, &ofr->fcb->dir_children_hash);
+    hash_table_move(&fileref->fcb->dir_children_hash_uc, &ofr->fcb->dir_children_hash_uc);
 
     fileref->fcb->sd_dirty = ofr->fcb->sd_dirty;
     fileref->fcb->sd_deleted = ofr->fcb->sd_deleted;
@@ -1624,6 +1453,7 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
     fileref->fcb->reparse_xattr_changed = ofr->fcb->reparse_xattr_changed;
     fileref->fcb->ea_changed = ofr->fcb->ea_changed;
     fileref->fcb->prop_compression_changed = ofr->fcb->prop_compression_changed;
+    fileref->fcb->extent_size_hint_changed = ofr->fcb->extent_size_hint_changed;
     fileref->fcb->xattrs_changed = ofr->fcb->xattrs_changed;
     fileref->fcb->created = ofr->fcb->created;
     fileref->fcb->ads = false;
@@ -1641,13 +1471,7 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
 
     acquire_fcb_lock_exclusive(Vcb);
 
-    RemoveEntryList(&fileref->fcb->list_entry);
-    InsertHeadList(ofr->fcb->list_entry.Blink, &fileref->fcb->list_entry);
-
-    if (fileref->fcb->subvol->fcbs_ptrs[fileref->fcb->hash >> 24] == &ofr->fcb->list_entry)
-        fileref->fcb->subvol->fcbs_ptrs[fileref->fcb->hash >> 24] = &fileref->fcb->list_entry;
-
-    RemoveEntryList(&ofr->fcb->list_entry);
+    remove_fcb_from_subvol(ofr->fcb);
 
     release_fcb_lock(Vcb);
 
@@ -1777,12 +1601,11 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
     if (dc->utf8.Buffer)
         ExFreePool(dc->utf8.Buffer);
 
+    free_dir_child_name_uc(dc);
+
     if (dc->name.Buffer)
         ExFreePool(dc->name.Buffer);
 
-    if (dc->name_uc.Buffer)
-        ExFreePool(dc->name_uc.Buffer);
-
     ExFreePool(dc);
 
     // FIXME - csums?
@@ -1801,7 +1624,6 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(dummyfcb);
     InsertTailList(&Vcb->all_fcbs, &dummyfcb->list_entry_all);
-    dummyfcb->subvol->fcbs_version++;
     release_fcb_lock(Vcb);
 
     // FIXME - dummyfileref as well?
@@ -2025,7 +1847,6 @@ static NTSTATUS rename_stream(device_extension* Vcb, file_ref* fileref, ccb* ccb
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(dummyfcb);
     InsertTailList(&Vcb->all_fcbs, &dummyfcb->list_entry_all);
-    dummyfcb->subvol->fcbs_version++;
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(dummyfcb);
@@ -2373,8 +2194,8 @@ static NTSTATUS rename_file_to_stream(device_extension* Vcb, file_ref* fileref,
         dummyfcb->Header.ValidDataLength.QuadPart = 0;
     }
 
-    dummyfcb->hash_ptrs = fileref->fcb->hash_ptrs;
-    dummyfcb->hash_ptrs_uc = fileref->fcb->hash_ptrs_uc;
+    hash_table_move(&dummyfcb->dir_children_hash, &fileref->fcb->dir_children_hash);
+    hash_table_move(&dummyfcb->dir_children_hash_uc, &fileref->fcb->dir_children_hash_uc);
     dummyfcb->created = fileref->fcb->created;
 
     le = fileref->fcb->extents.Flink;
@@ -2386,26 +2207,22 @@ static NTSTATUS rename_file_to_stream(device_extension* Vcb, file_ref* fileref,
         le = le->Flink;
     }
 
+    // we've already read any delayed data into adsdata
+    free_delalloc(fileref->fcb);
+
     while (!IsListEmpty(&fileref->fcb->dir_children_index)) {
         InsertTailList(&dummyfcb->dir_children_index, RemoveHeadList(&fileref->fcb->dir_children_index));
     }
 
-    while (!IsListEmpty(&fileref->fcb->dir_children_hash)) {
-        InsertTailList(&dummyfcb->dir_children_hash, RemoveHeadList(&fileref->fcb->dir_children_hash));
-    }
-
-    while (!IsListEmpty(&fileref->fcb->dir_children_hash_uc)) {
-        InsertTailList(&dummyfcb->dir_children_hash_uc, RemoveHeadList(&fileref->fcb->dir_children_hash_uc));
-    }
+    dummyfcb->dir_children_partial = fileref->fcb->dir_children_partial;
+    dummyfcb->dir_index_loaded = fileref->fcb->dir_index_loaded;
 
+    acquire_fcb_lock_exclusive(Vcb);
+    add_fcb_to_subvol(dummyfcb);
     InsertTailList(&Vcb->all_fcbs, &dummyfcb->list_entry_all);
+    remove_fcb_from_subvol(fileref->fcb);
+    release_fcb_lock(Vcb);
 
-    InsertHeadList(fileref->fcb->list_entry.Blink, &dummyfcb->list_entry);
-
-    if (fileref->fcb->subvol->fcbs_ptrs[dummyfcb->hash >> 24] == &fileref->fcb->list_entry)
-        fileref->fcb->subvol->fcbs_ptrs[dummyfcb->hash >> 24] = &dummyfcb->list_entry;
-
-    RemoveEntryList(&fileref->fcb->list_entry);
     fileref->fcb->list_entry.Flink = fileref->fcb->list_entry.Blink = NULL;
 
     mark_fcb_dirty(dummyfcb);
@@ -2443,9 +2260,6 @@ static NTSTATUS rename_file_to_stream(device_extension* Vcb, file_ref* fileref,
 
     // change fcb values
 
-    fileref->fcb->hash_ptrs = NULL;
-    fileref->fcb->hash_ptrs_uc = NULL;
-
     fileref->fcb->ads = true;
 
     fileref->oldutf8.Length = fileref->oldutf8.MaximumLength = 0;
@@ -2682,6 +2496,16 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
         goto end;
     }
 
+    if (fileref->parent) {
+        Status = complete_dir_children(Vcb, fileref->parent->fcb, Irp);
+        if (!NT_SUCCESS(Status))
+            goto end;
+    }
+
+    Status = complete_dir_children(Vcb, related->fcb, Irp);
+    if (!NT_SUCCESS(Status))
+        goto end;
+
     if (oldfileref) {
         SeCaptureSubjectContext(&subjcont);
 
@@ -2765,8 +2589,8 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
             ExAcquireResourceExclusiveLite(&fileref->parent->fcb->nonpaged->dir_children_lock, true);
 
             ExFreePool(fileref->dc->utf8.Buffer);
+            free_dir_child_name_uc(fileref->dc);
             ExFreePool(fileref->dc->name.Buffer);
-            ExFreePool(fileref->dc->name_uc.Buffer);
 
             fileref->dc->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, utf8.Length, ALLOC_TAG);
             if (!fileref->dc->utf8.Buffer) {
@@ -2792,9 +2616,9 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
             fileref->dc->name.Length = fileref->dc->name.MaximumLength = fnus.Length;
             RtlCopyMemory(fileref->dc->name.Buffer, fnus.Buffer, fnus.Length);
 
-            Status = RtlUpcaseUnicodeString(&fileref->dc->name_uc, &fileref->dc->name, true);
+            Status = set_dir_child_name_uc(fileref->dc);
             if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+                ERR("set_dir_child_name_uc returned %08lx\n", Status);
                 ExReleaseResourceLite(&fileref->parent->fcb->nonpaged->dir_children_lock);
                 ExFreePool(oldfn.Buffer);
                 goto end;
@@ -2803,9 +2627,9 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
             remove_dir_child_from_hash_lists(fileref->parent->fcb, fileref->dc);
 
             fileref->dc->hash = calc_crc32c(0xffffffff, (uint8_t*)fileref->dc->name.Buffer, fileref->dc->name.Length);
-            fileref->dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)fileref->dc->name_uc.Buffer, fileref->dc->name_uc.Length);
 
             insert_dir_child_into_hash_lists(fileref->parent->fcb, fileref->dc);
+            neg_cache_invalidate(fileref->parent->fcb);
 
             ExReleaseResourceLite(&fileref->parent->fcb->nonpaged->dir_children_lock);
         }
@@ -2939,8 +2763,8 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
             // handle changed name
 
             ExFreePool(fileref->dc->utf8.Buffer);
+            free_dir_child_name_uc(fileref->dc);
             ExFreePool(fileref->dc->name.Buffer);
-            ExFreePool(fileref->dc->name_uc.Buffer);
 
             fileref->dc->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, utf8.Length, ALLOC_TAG);
             if (!fileref->dc->utf8.Buffer) {
@@ -2962,14 +2786,13 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
             fileref->dc->name.Length = fileref->dc->name.MaximumLength = fnus.Length;
             RtlCopyMemory(fileref->dc->name.Buffer, fnus.Buffer, fnus.Length);
 
-            Status = RtlUpcaseUnicodeString(&fileref->dc->name_uc, &fileref->dc->name, true);
+            Status = set_dir_child_name_uc(fileref->dc);
             if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
+                ERR("set_dir_child_name_uc returned %08lx\n", Status);
                 goto end;
             }
 
             fileref->dc->hash = calc_crc32c(0xffffffff, (uint8_t*)fileref->dc->name.Buffer, fileref->dc->name.Length);
-            fileref->dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)fileref->dc->name_uc.Buffer, fileref->dc->name_uc.Length);
         }
 
         // add to new parent
@@ -2985,6 +2808,7 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
 
         InsertTailList(&related->fcb->dir_children_index, &fileref->dc->list_entry_index);
         insert_dir_child_into_hash_lists(related->fcb, fileref->dc);
+        neg_cache_invalidate(related->fcb);
         ExReleaseResourceLite(&related->fcb->nonpaged->dir_children_lock);
     }
 
@@ -3684,6 +3508,13 @@ static NTSTATUS set_link_information(device_extension* Vcb, PIRP Irp, PFILE_OBJE
         goto end;
     }
 
+    // add_dir_child needs the whole directory read in - do it now, while we can still back out
+    Status = complete_dir_children(Vcb, related->fcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("complete_dir_children returned %08lx\n", Status);
+        goto end;
+    }
+
     if (oldfileref) {
         SeCaptureSubjectContext(&subjcont);
 
@@ -3714,12 +3545,16 @@ static NTSTATUS set_link_information(device_extension* Vcb, PIRP Irp, PFILE_OBJE
     fcb->refcount++;
 
     fr2->created = true;
-    fr2->parent = related;
 
-    Status = add_dir_child(related->fcb, fcb->inode, false, &utf8, &fnus, fcb->type, &dc);
-    if (!NT_SUCCESS(Status))
-        WARN("add_dir_child returned %08lx\n", Status);
+    Status = add_dir_child(related->fcb, fcb->inode, false, &utf8, &fnus, fcb->type, &dc, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_dir_child returned %08lx\n", Status);
+        reap_fileref(Vcb, fr2);
+        fr2 = NULL;
+        goto end;
+    }
 
+    fr2->parent = related;
     fr2->dc = dc;
     dc->fileref = fr2;
 
@@ -154,7 +154,9 @@ exit:
     return Status;
 }
 
-static void add_trim_entry(device* dev, uint64_t address, uint64_t size) {
+// Entries for the discard thread go on their own list, as it sends them without holding
+// tree_lock, and so can't share dev->trim_list with the commit.
+static void add_trim_entry(device* dev, uint64_t address, uint64_t size, bool async) {
     space* s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
     if (!s) {
         ERR("out of memory\n");
@@ -163,15 +165,23 @@ static void add_trim_entry(device* dev, uint64_t address, uint64_t size) {
 
     s->address = address;
     s->size = size;
-    dev->num_trim_entries++;
 
-    InsertTailList(&dev->trim_list, &s->list_entry);
+    if (async) {
+        dev->num_discard_entries++;
+        InsertTailList(&dev->discard_list, &s->list_entry);
+    } else {
+        dev->num_trim_entries++;
+        InsertTailList(&dev->trim_list, &s->list_entry);
+    }
 }
 
-static void clean_space_cache_chunk(device_extension* Vcb, chunk* c) {
-    LIST_ENTRY* le;
+// Turns a logical range within c into TRIM entries for each of its devices.
+void add_chunk_trim_entries(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, bool async) {
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
     ULONG type;
 
+    UNUSED(Vcb);
+
     if (c->chunk_item->type & BLOCK_FLAG_DUPLICATE)
         type = BLOCK_FLAG_DUPLICATE;
     else if (c->chunk_item->type & BLOCK_FLAG_RAID0)
@@ -191,89 +201,97 @@ static void clean_space_cache_chunk(device_extension* Vcb, chunk* c) {
     else // SINGLE
         type = BLOCK_FLAG_DUPLICATE;
 
-    le = c->deleting.Flink;
-    while (le != &c->deleting) {
-        space* s = CONTAINING_RECORD(le, space, list_entry);
+    if (type == BLOCK_FLAG_DUPLICATE) {
+        uint16_t i;
 
-        if (!Vcb->options.no_barrier || !(c->chunk_item->type & BLOCK_FLAG_METADATA)) {
-            CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            if (c->devices[i] && c->devices[i]->devobj && !c->devices[i]->readonly && c->devices[i]->trim)
+                add_trim_entry(c->devices[i], address - c->offset + cis[i].offset, size, async);
+        }
+    } else if (type == BLOCK_FLAG_RAID0) {
+        uint64_t startoff, endoff;
+        uint16_t startoffstripe, endoffstripe, i;
 
-            if (type == BLOCK_FLAG_DUPLICATE) {
-                uint16_t i;
+        get_raid0_offset(address - c->offset, c->chunk_item->stripe_length, c->chunk_item->num_stripes, &startoff, &startoffstripe);
+        get_raid0_offset(address - c->offset + size - 1, c->chunk_item->stripe_length, c->chunk_item->num_stripes, &endoff, &endoffstripe);
 
-                for (i = 0; i < c->chunk_item->num_stripes; i++) {
-                    if (c->devices[i] && c->devices[i]->devobj && !c->devices[i]->readonly && c->devices[i]->trim)
-                        add_trim_entry(c->devices[i], s->address - c->offset + cis[i].offset, s->size);
-                }
-            } else if (type == BLOCK_FLAG_RAID0) {
-                uint64_t startoff, endoff;
-                uint16_t startoffstripe, endoffstripe, i;
-
-                get_raid0_offset(s->address - c->offset, c->chunk_item->stripe_length, c->chunk_item->num_stripes, &startoff, &startoffstripe);
-                get_raid0_offset(s->address - c->offset + s->size - 1, c->chunk_item->stripe_length, c->chunk_item->num_stripes, &endoff, &endoffstripe);
-
-                for (i = 0; i < c->chunk_item->num_stripes; i++) {
-                    if (c->devices[i] && c->devices[i]->devobj && !c->devices[i]->readonly && c->devices[i]->trim) {
-                        uint64_t stripestart, stripeend;
-
-                        if (startoffstripe > i)
-                            stripestart = startoff - (startoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
-                        else if (startoffstripe == i)
-                            stripestart = startoff;
-                        else
-                            stripestart = startoff - (startoff % c->chunk_item->stripe_length);
-
-                        if (endoffstripe > i)
-                            stripeend = endoff - (endoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
-                        else if (endoffstripe == i)
-                            stripeend = endoff + 1;
-                        else
-                            stripeend = endoff - (endoff % c->chunk_item->stripe_length);
-
-                        if (stripestart != stripeend)
-                            add_trim_entry(c->devices[i], stripestart + cis[i].offset, stripeend - stripestart);
-                    }
-                }
-            } else if (type == BLOCK_FLAG_RAID10) {
-                uint64_t startoff, endoff;
-                uint16_t sub_stripes, startoffstripe, endoffstripe, i;
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            if (c->devices[i] && c->devices[i]->devobj && !c->devices[i]->readonly && c->devices[i]->trim) {
+                uint64_t stripestart, stripeend;
 
-                sub_stripes = max(1, c->chunk_item->sub_stripes);
+                if (startoffstripe > i)
+                    stripestart = startoff - (startoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
+                else if (startoffstripe == i)
+                    stripestart = startoff;
+                else
+                    stripestart = startoff - (startoff % c->chunk_item->stripe_length);
 
-                get_raid0_offset(s->address - c->offset, c->chunk_item->stripe_length, c->chunk_item->num_stripes / sub_stripes, &startoff, &startoffstripe);
-                get_raid0_offset(s->address - c->offset + s->size - 1, c->chunk_item->stripe_length, c->chunk_item->num_stripes / sub_stripes, &endoff, &endoffstripe);
+                if (endoffstripe > i)
+                    stripeend = endoff - (endoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
+                else if (endoffstripe == i)
+                    stripeend = endoff + 1;
+                else
+                    stripeend = endoff - (endoff % c->chunk_item->stripe_length);
 
-                startoffstripe *= sub_stripes;
-                endoffstripe *= sub_stripes;
+                if (stripestart != stripeend)
+                    add_trim_entry(c->devices[i], stripestart + cis[i].offset, stripeend - stripestart, async);
+            }
+        }
+    } else if (type == BLOCK_FLAG_RAID10) {
+        uint64_t startoff, endoff;
+        uint16_t sub_stripes, startoffstripe, endoffstripe, i;
 
-                for (i = 0; i < c->chunk_item->num_stripes; i += sub_stripes) {
-                    ULONG j;
-                    uint64_t stripestart, stripeend;
+        sub_stripes = max(1, c->chunk_item->sub_stripes);
 
-                    if (startoffstripe > i)
-                        stripestart = startoff - (startoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
-                    else if (startoffstripe == i)
-                        stripestart = startoff;
-                    else
-                        stripestart = startoff - (startoff % c->chunk_item->stripe_length);
+        get_raid0_offset(address - c->offset, c->chunk_item->stripe_length, c->chunk_item->num_stripes / sub_stripes, &startoff, &startoffstripe);
+        get_raid0_offset(address - c->offset + size - 1, c->chunk_item->stripe_length, c->chunk_item->num_stripes / sub_stripes, &endoff, &endoffstripe);
 
-                    if (endoffstripe > i)
-                        stripeend = endoff - (endoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
-                    else if (endoffstripe == i)
-                        stripeend = endoff + 1;
-                    else
-                        stripeend = endoff - (endoff % c->chunk_item->stripe_length);
+        startoffstripe *= sub_stripes;
+        endoffstripe *= sub_stripes;
 
-                    if (stripestart != stripeend) {
-                        for (j = 0; j < sub_stripes; j++) {
-                            if (c->devices[i+j] && c->devices[i+j]->devobj && !c->devices[i+j]->readonly && c->devices[i+j]->trim)
-                                add_trim_entry(c->devices[i+j], stripestart + cis[i+j].offset, stripeend - stripestart);
-                        }
-                    }
+        for (i = 0; i < c->chunk_item->num_stripes; i += sub_stripes) {
+            ULONG j;
+            uint64_t stripestart, stripeend;
+
+            if (startoffstripe > i)
+                stripestart = startoff - (startoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
+            else if (startoffstripe == i)
+                stripestart = startoff;
+            else
+                stripestart = startoff - (startoff % c->chunk_item->stripe_length);
+
+            if (endoffstripe > i)
+                stripeend = endoff - (endoff % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
+            else if (endoffstripe == i)
+                stripeend = endoff + 1;
+            else
+                stripeend = endoff - (endoff % c->chunk_item->stripe_length);
+
+            if (stripestart != stripeend) {
+                for (j = 0; j < sub_stripes; j++) {
+                    if (c->devices[i+j] && c->devices[i+j]->devobj && !c->devices[i+j]->readonly && c->devices[i+j]->trim)
+                        add_trim_entry(c->devices[i+j], stripestart + cis[i+j].offset, stripeend - stripestart, async);
                 }
             }
-            // FIXME - RAID5(?), RAID6(?)
         }
+    }
+    // FIXME - RAID5(?), RAID6(?)
+}
+
+static void clean_space_cache_chunk(device_extension* Vcb, chunk* c) {
+    LIST_ENTRY* le;
+
+    if (Vcb->options.no_barrier && c->chunk_item->type & BLOCK_FLAG_METADATA)
+        return;
+
+    le = c->deleting.Flink;
+    while (le != &c->deleting) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+
+        if (Vcb->options.discard == DISCARD_MODE_ASYNC)
+            queue_discard(c, s->address, s->size);
+        else
+            add_chunk_trim_entries(Vcb, c, s->address, s->size, false);
 
         le = le->Flink;
     }
@@ -311,13 +329,13 @@ static NTSTATUS __stdcall ioctl_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp
 }
 
 #ifdef DEBUG_TRIM_EMULATION
-static void trim_emulation(device* dev) {
+static void trim_emulation(device* dev, LIST_ENTRY* trim_list) {
     LIST_ENTRY* le;
     ioctl_context context;
     unsigned int i = 0, count = 0;
 
-    le = dev->trim_list.Flink;
-    while (le != &dev->trim_list) {
+    le = trim_list->Flink;
+    while (le != trim_list) {
         count++;
         le = le->Flink;
     }
@@ -335,8 +353,8 @@ static void trim_emulation(device* dev) {
     RtlZeroMemory(context.stripes, sizeof(ioctl_context_stripe) * context.left);
 
     i = 0;
-    le = dev->trim_list.Flink;
-    while (le != &dev->trim_list) {
+    le = trim_list->Flink;
+    while (le != trim_list) {
         ioctl_context_stripe* stripe = &context.stripes[i];
         space* s = CONTAINING_RECORD(le, space, list_entry);
 
@@ -400,178 +418,282 @@ static void trim_emulation(device* dev) {
 }
 #endif
 
-static void clean_space_cache(device_extension* Vcb) {
-    LIST_ENTRY* le;
-    chunk* c;
-#ifndef DEBUG_TRIM_EMULATION
-    ULONG num;
-#endif
+// Entries which don't get sent mustn't be left behind for next time, as by then the space
+// could have been reused.
+static void free_device_trims(device** devs, ULONG num_devs, bool async) {
+    for (ULONG d = 0; d < num_devs; d++) {
+        LIST_ENTRY* trim_list = async ? &devs[d]->discard_list : &devs[d]->trim_list;
 
-    TRACE("(%p)\n", Vcb);
+        while (!IsListEmpty(trim_list)) {
+            space* s = CONTAINING_RECORD(RemoveHeadList(trim_list), space, list_entry);
 
-    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+            ExFreePool(s);
+        }
 
-    le = Vcb->chunks.Flink;
-    while (le != &Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
+        if (async)
+            devs[d]->num_discard_entries = 0;
+        else
+            devs[d]->num_trim_entries = 0;
+    }
+}
 
-        if (c->space_changed) {
-            acquire_chunk_lock(c, Vcb);
+// Sends the TRIM entries which have been built up on each of devs, and waits for them to complete.
+// With async set, these are the discard thread's entries, which it sends without holding any locks -
+// which is why it's up to the caller to say which devices to look at, rather than us walking
+// Vcb->devices.
+void send_device_trims(device_extension* Vcb, device** devs, ULONG num_devs, bool async) {
+    ULONG d;
+#ifndef DEBUG_TRIM_EMULATION
+    ioctl_context context;
+    ULONG num, total_num;
 
-            if (c->space_changed) {
-                if (Vcb->trim && !Vcb->options.no_trim)
-                    clean_space_cache_chunk(Vcb, c);
+    context.left = 0;
 
-                space_list_merge(&c->space, &c->space_size, &c->deleting);
+    for (d = 0; d < num_devs; d++) {
+        device* dev = devs[d];
 
-                while (!IsListEmpty(&c->deleting)) {
-                    space* s = CONTAINING_RECORD(RemoveHeadList(&c->deleting), space, list_entry);
+        if (dev->devobj && !dev->readonly && dev->trim && (async ? dev->num_discard_entries : dev->num_trim_entries) > 0)
+            context.left++;
+    }
 
-                    ExFreePool(s);
-                }
-            }
+    if (context.left == 0) {
+        free_device_trims(devs, num_devs, async);
+        return;
+    }
 
-            c->space_changed = false;
+    total_num = context.left;
+    num = 0;
 
-            release_chunk_lock(c, Vcb);
-        }
+    KeInitializeEvent(&context.Event, NotificationEvent, false);
 
-        le = le->Flink;
+    context.stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(ioctl_context_stripe) * context.left, ALLOC_TAG);
+    if (!context.stripes) {
+        ERR("out of memory\n");
+        free_device_trims(devs, num_devs, async);
+        return;
     }
 
-    ExReleaseResourceLite(&Vcb->chunk_lock);
+    RtlZeroMemory(context.stripes, sizeof(ioctl_context_stripe) * context.left);
+#endif
 
-    if (Vcb->trim && !Vcb->options.no_trim) {
-#ifndef DEBUG_TRIM_EMULATION
-        ioctl_context context;
-        ULONG total_num;
+    for (d = 0; d < num_devs; d++) {
+        device* dev = devs[d];
+        LIST_ENTRY* trim_list = async ? &dev->discard_list : &dev->trim_list;
+        ULONG* num_entries = async ? &dev->num_discard_entries : &dev->num_trim_entries;
 
-        context.left = 0;
+        if (dev->devobj && !dev->readonly && dev->trim && *num_entries > 0) {
+            LIST_ENTRY* le2;
+#ifdef DEBUG_TRIM_EMULATION
+            trim_emulation(dev, trim_list);
+#else
+            ioctl_context_stripe* stripe = &context.stripes[num];
+            DEVICE_DATA_SET_RANGE* ranges;
+            ULONG datalen = (ULONG)sector_align(sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), sizeof(uint64_t)) + (*num_entries * sizeof(DEVICE_DATA_SET_RANGE)), i;
+            PIO_STACK_LOCATION IrpSp;
 
-        le = Vcb->devices.Flink;
-        while (le != &Vcb->devices) {
-            device* dev = CONTAINING_RECORD(le, device, list_entry);
+            stripe->dmdsa = ExAllocatePoolWithTag(PagedPool, datalen, ALLOC_TAG);
+            if (!stripe->dmdsa) {
+                ERR("out of memory\n");
+                goto notsent;
+            }
 
-            if (dev->devobj && !dev->readonly && dev->trim && dev->num_trim_entries > 0)
-                context.left++;
+            stripe->dmdsa->Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
+            stripe->dmdsa->Action = DeviceDsmAction_Trim;
+            stripe->dmdsa->Flags = DEVICE_DSM_FLAG_TRIM_NOT_FS_ALLOCATED;
+            stripe->dmdsa->ParameterBlockOffset = 0;
+            stripe->dmdsa->ParameterBlockLength = 0;
+            stripe->dmdsa->DataSetRangesOffset = (ULONG)sector_align(sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), sizeof(uint64_t));
+            stripe->dmdsa->DataSetRangesLength = *num_entries * sizeof(DEVICE_DATA_SET_RANGE);
 
-            le = le->Flink;
-        }
+            ranges = (DEVICE_DATA_SET_RANGE*)((uint8_t*)stripe->dmdsa + stripe->dmdsa->DataSetRangesOffset);
 
-        if (context.left == 0)
-            return;
+            i = 0;
 
-        total_num = context.left;
-        num = 0;
+            le2 = trim_list->Flink;
+            while (le2 != trim_list) {
+                space* s = CONTAINING_RECORD(le2, space, list_entry);
 
-        KeInitializeEvent(&context.Event, NotificationEvent, false);
+                ranges[i].StartingOffset = s->address;
+                ranges[i].LengthInBytes = s->size;
+                i++;
 
-        context.stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(ioctl_context_stripe) * context.left, ALLOC_TAG);
-        if (!context.stripes) {
-            ERR("out of memory\n");
-            return;
-        }
+                le2 = le2->Flink;
+            }
 
-        RtlZeroMemory(context.stripes, sizeof(ioctl_context_stripe) * context.left);
-#endif
+            stripe->Irp = IoAllocateIrp(dev->devobj->StackSize, false);
 
-        le = Vcb->devices.Flink;
-        while (le != &Vcb->devices) {
-            device* dev = CONTAINING_RECORD(le, device, list_entry);
+            if (!stripe->Irp) {
+                ERR("IoAllocateIrp failed\n");
+                goto notsent;
+            }
 
-            if (dev->devobj && !dev->readonly && dev->trim && dev->num_trim_entries > 0) {
-#ifdef DEBUG_TRIM_EMULATION
-                trim_emulation(dev);
-#else
-                LIST_ENTRY* le2;
-                ioctl_context_stripe* stripe = &context.stripes[num];
-                DEVICE_DATA_SET_RANGE* ranges;
-                ULONG datalen = (ULONG)sector_align(sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), sizeof(uint64_t)) + (dev->num_trim_entries * sizeof(DEVICE_DATA_SET_RANGE)), i;
-                PIO_STACK_LOCATION IrpSp;
+            IrpSp = IoGetNextIrpStackLocation(stripe->Irp);
+            IrpSp->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+            IrpSp->FileObject = dev->fileobj;
 
-                stripe->dmdsa = ExAllocatePoolWithTag(PagedPool, datalen, ALLOC_TAG);
-                if (!stripe->dmdsa) {
-                    ERR("out of memory\n");
-                    goto nextdev;
-                }
+            IrpSp->Parameters.DeviceIoControl.IoControlCode = IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES;
+            IrpSp->Parameters.DeviceIoControl.InputBufferLength = datalen;
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength = 0;
 
-                stripe->dmdsa->Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
-                stripe->dmdsa->Action = DeviceDsmAction_Trim;
-                stripe->dmdsa->Flags = DEVICE_DSM_FLAG_TRIM_NOT_FS_ALLOCATED;
-                stripe->dmdsa->ParameterBlockOffset = 0;
-                stripe->dmdsa->ParameterBlockLength = 0;
-                stripe->dmdsa->DataSetRangesOffset = (ULONG)sector_align(sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), sizeof(uint64_t));
-                stripe->dmdsa->DataSetRangesLength = dev->num_trim_entries * sizeof(DEVICE_DATA_SET_RANGE);
+            stripe->Irp->AssociatedIrp.SystemBuffer = stripe->dmdsa;
+            stripe->Irp->Flags |= IRP_BUFFERED_IO;
+            stripe->Irp->UserBuffer = NULL;
+            stripe->Irp->UserIosb = &stripe->iosb;
 
-                ranges = (DEVICE_DATA_SET_RANGE*)((uint8_t*)stripe->dmdsa + stripe->dmdsa->DataSetRangesOffset);
+            IoSetCompletionRoutine(stripe->Irp, ioctl_completion, &context, true, true, true);
+
+            IoCallDriver(dev->devobj, stripe->Irp);
+#endif
 
-                i = 0;
+            // the statistics are only for the discard thread's TRIMs
+            if (async) {
+                InterlockedIncrement64(&Vcb->discard.ioctls);
+                InterlockedExchangeAdd64(&Vcb->discard.ranges, *num_entries);
 
-                le2 = dev->trim_list.Flink;
-                while (le2 != &dev->trim_list) {
+                le2 = trim_list->Flink;
+                while (le2 != trim_list) {
                     space* s = CONTAINING_RECORD(le2, space, list_entry);
 
-                    ranges[i].StartingOffset = s->address;
-                    ranges[i].LengthInBytes = s->size;
-                    i++;
+                    InterlockedExchangeAdd64(&Vcb->discard.bytes, s->size);
 
                     le2 = le2->Flink;
                 }
+            }
 
-                stripe->Irp = IoAllocateIrp(dev->devobj->StackSize, false);
+#ifndef DEBUG_TRIM_EMULATION
+            goto nextdev;
 
-                if (!stripe->Irp) {
-                    ERR("IoAllocateIrp failed\n");
-                    goto nextdev;
-                }
+notsent:
+            // we won't be getting a completion for this one
+            if (InterlockedDecrement(&context.left) == 0)
+                KeSetEvent(&context.Event, 0, false);
 
-                IrpSp = IoGetNextIrpStackLocation(stripe->Irp);
-                IrpSp->MajorFunction = IRP_MJ_DEVICE_CONTROL;
-                IrpSp->FileObject = dev->fileobj;
+nextdev:
+#endif
+            while (!IsListEmpty(trim_list)) {
+                space* s = CONTAINING_RECORD(RemoveHeadList(trim_list), space, list_entry);
 
-                IrpSp->Parameters.DeviceIoControl.IoControlCode = IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES;
-                IrpSp->Parameters.DeviceIoControl.InputBufferLength = datalen;
-                IrpSp->Parameters.DeviceIoControl.OutputBufferLength = 0;
+                ExFreePool(s);
+            }
+
+            *num_entries = 0;
+
+#ifndef DEBUG_TRIM_EMULATION
+            num++;
+#endif
+        }
+    }
 
-                stripe->Irp->AssociatedIrp.SystemBuffer = stripe->dmdsa;
-                stripe->Irp->Flags |= IRP_BUFFERED_IO;
-                stripe->Irp->UserBuffer = NULL;
-                stripe->Irp->UserIosb = &stripe->iosb;
+#ifndef DEBUG_TRIM_EMULATION
+    KeWaitForSingleObject(&context.Event, Executive, KernelMode, false, NULL);
 
-                IoSetCompletionRoutine(stripe->Irp, ioctl_completion, &context, true, true, true);
+    for (num = 0; num < total_num; num++) {
+        if (context.stripes[num].dmdsa)
+            ExFreePool(context.stripes[num].dmdsa);
 
-                IoCallDriver(dev->devobj, stripe->Irp);
+        if (context.stripes[num].Irp)
+            IoFreeIrp(context.stripes[num].Irp);
+    }
 
-nextdev:
+    ExFreePool(context.stripes);
 #endif
-                while (!IsListEmpty(&dev->trim_list)) {
-                    space* s = CONTAINING_RECORD(RemoveHeadList(&dev->trim_list), space, list_entry);
-                    ExFreePool(s);
+
+    free_device_trims(devs, num_devs, async);
+}
+
+// Sends the TRIM entries which the commit has built up on each device.
+_Requires_exclusive_lock_held_(Vcb->tree_lock)
+void send_trims(device_extension* Vcb) {
+    LIST_ENTRY* le;
+    device** devs;
+    ULONG num_devs = 0;
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+
+        if (dev->num_trim_entries > 0)
+            num_devs++;
+
+        le = le->Flink;
+    }
+
+    if (num_devs == 0)
+        return;
+
+    devs = ExAllocatePoolWithTag(PagedPool, sizeof(device*) * num_devs, ALLOC_TAG);
+    if (!devs) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    num_devs = 0;
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+
+        if (dev->num_trim_entries > 0) {
+            devs[num_devs] = dev;
+            num_devs++;
+        }
+
+        le = le->Flink;
+    }
+
+    send_device_trims(Vcb, devs, num_devs, false);
+
+    ExFreePool(devs);
+}
+
+static void clean_space_cache(device_extension* Vcb) {
+    LIST_ENTRY* le;
+    chunk* c;
+    bool queued = false;
+
+    TRACE("(%p)\n", Vcb);
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (c->space_changed) {
+            acquire_chunk_lock(c, Vcb);
+
+            if (c->space_changed) {
+                if (Vcb->trim && !Vcb->options.no_trim) {
+                    clean_space_cache_chunk(Vcb, c);
+
+                    if (!IsListEmpty(&c->discard.list))
+                        queued = true;
                 }
 
-                dev->num_trim_entries = 0;
+                space_list_merge(&c->space, &c->space_index, &c->deleting);
 
-#ifndef DEBUG_TRIM_EMULATION
-                num++;
-#endif
+                while (!IsListEmpty(&c->deleting)) {
+                    space* s = CONTAINING_RECORD(RemoveHeadList(&c->deleting), space, list_entry);
+
+                    ExFreePool(s);
+                }
             }
 
-            le = le->Flink;
+            c->space_changed = false;
+
+            release_chunk_lock(c, Vcb);
         }
 
-#ifndef DEBUG_TRIM_EMULATION
-        KeWaitForSingleObject(&context.Event, Executive, KernelMode, false, NULL);
+        le = le->Flink;
+    }
 
-        for (num = 0; num < total_num; num++) {
-            if (context.stripes[num].dmdsa)
-                ExFreePool(context.stripes[num].dmdsa);
+    ExReleaseResourceLite(&Vcb->chunk_lock);
 
-            if (context.stripes[num].Irp)
-                IoFreeIrp(context.stripes[num].Irp);
-        }
+    if (Vcb->trim && !Vcb->options.no_trim) {
+        send_trims(Vcb);
 
-        ExFreePool(context.stripes);
-#endif
+        if (queued)
+            KeSetEvent(&Vcb->discard.event, 0, false);
     }
 }
 
@@ -742,7 +864,6 @@ static bool insert_tree_extent_skinny(device_extension* Vcb, uint8_t level, uint
 }
 
 bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* address) {
-    LIST_ENTRY* le;
     space* s;
 
     TRACE("(%p, %I64x, %p)\n", Vcb, c->offset, address);
@@ -759,7 +880,7 @@ bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* a
         }
     }
 
-    if (IsListEmpty(&c->space_size))
+    if (IsListEmpty(&c->space))
         return false;
 
     if (!c->last_alloc_set) {
@@ -775,51 +896,23 @@ bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* a
         }
     }
 
-    le = c->space.Flink;
-    while (le != &c->space) {
-        s = CONTAINING_RECORD(le, space, list_entry);
-
-        if (s->address <= c->last_alloc && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
-            *address = c->last_alloc;
-            c->last_alloc += Vcb->superblock.node_size;
-            return true;
-        }
+    s = space_index_find(&c->space_index, c->last_alloc);
 
-        le = le->Flink;
+    if (s && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
+        *address = c->last_alloc;
+        c->last_alloc += Vcb->superblock.node_size;
+        return true;
     }
 
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s->size == Vcb->superblock.node_size) {
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-            return true;
-        } else if (s->size < Vcb->superblock.node_size) {
-            if (le == c->space_size.Flink)
-                return false;
-
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-
-            return true;
-        }
-
-        le = le->Flink;
-    }
+    s = space_index_best_fit(&c->space_index, Vcb->superblock.node_size);
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    if (!s)
+        return false;
 
-    if (s->size > Vcb->superblock.node_size) {
-        *address = s->address;
-        c->last_alloc = s->address + Vcb->superblock.node_size;
-        return true;
-    }
+    *address = s->address;
+    c->last_alloc = s->address + Vcb->superblock.node_size;
 
-    return false;
+    return true;
 }
 
 static bool insert_tree_extent(device_extension* Vcb, uint8_t level, uint64_t root_id, chunk* c, uint64_t* new_address, PIRP Irp, LIST_ENTRY* rollback) {
@@ -2596,6 +2689,8 @@ end:
     RemoveEntryList(&ce->list_entry);
     ExFreePool(ce);
 
+    InterlockedDecrement(&Vcb->changed_extent_count);
+
     return STATUS_SUCCESS;
 }
 
@@ -3048,6 +3143,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     nt->write = true;
 
     InsertTailList(&Vcb->trees, &nt->list_entry);
+    InterlockedIncrement(&Vcb->tree_count);
 
     if (nt->header.level > 0) {
         LIST_ENTRY* le = nt->itemlist.Flink;
@@ -3153,6 +3249,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     InitializeListHead(&pt->itemlist);
 
     InsertTailList(&Vcb->trees, &pt->list_entry);
+    InterlockedIncrement(&Vcb->tree_count);
 
     td = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
     if (!td) {
@@ -4749,7 +4846,7 @@ cont:
                             ed2->address += er->skip_start;
                             ed2->offset -= er->skip_start;
 
-                            add_changed_extent_ref(er->chunk, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset,
+                            add_changed_extent_ref(fcb->Vcb, er->chunk, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset,
                                                    1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
                         }
                     }
@@ -4803,7 +4900,7 @@ cont:
                             ext->extent_data.decoded_size -= er->skip_end;
                             ed2->size -= er->skip_end;
 
-                            add_changed_extent_ref(er->chunk, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset,
+                            add_changed_extent_ref(fcb->Vcb, er->chunk, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset,
                                                    1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
                         }
                     }
@@ -4901,7 +4998,7 @@ cont:
                         ed2->size = er2->length;
                         ext->extent_data.decoded_size = ed2->size;
 
-                        add_changed_extent_ref(er2->chunk, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset,
+                        add_changed_extent_ref(fcb->Vcb, er2->chunk, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset,
                                                1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
 
                         break;
@@ -5384,36 +5481,41 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                 ERR("delete_xattr returned %08lx\n", Status);
                 goto end;
             }
-        } else if (fcb->prop_compression == PropCompression_Zlib) {
-            static const char zlib[] = "zlib";
+        } else {
+            char val[16];
+            uint16_t vallen = get_prop_compression_string(fcb->prop_compression, fcb->prop_compression_level, val);
 
             Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_COMPRESSION, sizeof(EA_PROP_COMPRESSION) - 1,
-                               EA_PROP_COMPRESSION_HASH, (uint8_t*)zlib, sizeof(zlib) - 1);
+                               EA_PROP_COMPRESSION_HASH, (uint8_t*)val, vallen);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
                 goto end;
             }
-        } else if (fcb->prop_compression == PropCompression_LZO) {
-            static const char lzo[] = "lzo";
+        }
 
-            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_COMPRESSION, sizeof(EA_PROP_COMPRESSION) - 1,
-                               EA_PROP_COMPRESSION_HASH, (uint8_t*)lzo, sizeof(lzo) - 1);
+        fcb->prop_compression_changed = false;
+    }
+
+    if (fcb->extent_size_hint_changed) {
+        if (fcb->extent_size_hint == 0) {
+            Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_EXTSIZE, sizeof(EA_PROP_EXTSIZE) - 1, EA_PROP_EXTSIZE_HASH);
             if (!NT_SUCCESS(Status)) {
-                ERR("set_xattr returned %08lx\n", Status);
+                ERR("delete_xattr returned %08lx\n", Status);
                 goto end;
             }
-        } else if (fcb->prop_compression == PropCompression_ZSTD) {
-            static const char zstd[] = "zstd";
+        } else {
+            char val[10];
+            uint16_t vallen = get_prop_extsize_string(fcb->extent_size_hint, val);
 
-            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_COMPRESSION, sizeof(EA_PROP_COMPRESSION) - 1,
-                               EA_PROP_COMPRESSION_HASH, (uint8_t*)zstd, sizeof(zstd) - 1);
+            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_EXTSIZE, sizeof(EA_PROP_EXTSIZE) - 1,
+                               EA_PROP_EXTSIZE_HASH, (uint8_t*)val, vallen);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
                 goto end;
             }
         }
 
-        fcb->prop_compression_changed = false;
+        fcb->extent_size_hint_changed = false;
     }
 
     if (fcb->xattrs_changed) {
@@ -5499,6 +5601,7 @@ end:
         }
 
         RemoveEntryList(&fcb->list_entry_dirty);
+        InterlockedDecrement(&fcb->Vcb->dirty_fcb_count);
 
         if (lock)
             ExReleaseResourceLite(&fcb->Vcb->dirty_fcbs_lock);
@@ -5515,7 +5618,7 @@ void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, uint64_t addres
     while (superblock_addrs[i] != 0) {
         if (superblock_addrs[i] + sblen >= address && superblock_addrs[i] < address + size) {
             if (superblock_addrs[i] > address)
-                add_trim_entry(dev, address, superblock_addrs[i] - address);
+                add_trim_entry(dev, address, superblock_addrs[i] - address, false);
 
             if (size <= superblock_addrs[i] + sblen - address)
                 return;
@@ -5528,7 +5631,7 @@ void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, uint64_t addres
         i++;
     }
 
-    add_trim_entry(dev, address, size);
+    add_trim_entry(dev, address, size, false);
 }
 
 static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
@@ -5540,6 +5643,9 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
 
     TRACE("dropping chunk %I64x\n", c->offset);
 
+    // the discard thread might still be sending TRIMs for part of it
+    wait_for_chunk_discards(c);
+
     if (c->chunk_item->type & BLOCK_FLAG_RAID0)
         factor = c->chunk_item->num_stripes;
     else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
@@ -5757,7 +5863,7 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
     if (c->chunk_item->type & BLOCK_FLAG_SYSTEM)
         remove_from_bootstrap(Vcb, 0x100, TYPE_CHUNK_ITEM, c->offset);
 
-    RemoveEntryList(&c->list_entry);
+    chunk_index_remove(Vcb, c);
 
     // clear raid56 incompat flag if dropping last RAID5/6 chunk
 
@@ -5808,6 +5914,10 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
     ExFreePool(c->chunk_item);
     ExFreePool(c->devices);
 
+    // anything still waiting to be discarded was covered by the TRIM above
+    free_chunk_discards(c);
+    free_chunk_unique_cache(c);
+
     while (!IsListEmpty(&c->space)) {
         space* s = CONTAINING_RECORD(c->space.Flink, space, list_entry);
 
@@ -7413,7 +7523,7 @@ static NTSTATUS check_for_orphans_root(device_extension* Vcb, root* r, PIRP Irp)
             else {
                 if (fcb->inode_item.st_nlink == 0) {
                     if (fcb->type != BTRFS_TYPE_DIRECTORY && fcb->inode_item.st_size > 0) {
-                        Status = excise_extents(Vcb, fcb, 0, sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size), Irp, &rollback);
+                        Status = excise_extents(Vcb, fcb, 0, get_extents_end(fcb), Irp, &rollback);
                         if (!NT_SUCCESS(Status)) {
                             ERR("excise_extents returned %08lx\n", Status);
                             goto end;
@@ -7500,6 +7610,12 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     time1 = KeQueryPerformanceCounter(&freq);
 #endif
 
+    Status = flush_all_delalloc(Vcb, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_all_delalloc returned %08lx\n", Status);
+        return Status;
+    }
+
     Status = check_for_orphans(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("check_for_orphans returned %08lx\n", Status);
@@ -7866,6 +7982,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
         if (IsListEmpty(&r->fcbs)) {
             ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+            hash_table_free(&r->fcbs_hash);
             ExFreePool(r->nonpaged);
             ExFreePool(r);
         } else
@@ -7897,7 +8014,50 @@ NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
     return Status;
 }
 
-static void do_flush(device_extension* Vcb) {
+// The flush thread normally runs every FlushInterval seconds, but we kick it early if too
+// much has built up in memory since the last commit. Past twice the threshold, throttle_writer
+// makes anything which would add more wait for the flush to catch up.
+static bool dirty_over_threshold(device_extension* Vcb, unsigned int factor) {
+    mount_options* options = &Vcb->options;
+
+    if (options->flush_fcb_threshold != 0 && (uint64_t)Vcb->dirty_fcb_count >= (uint64_t)options->flush_fcb_threshold * factor)
+        return true;
+
+    // This counts all the trees we're holding, not just the dirty ones - free_trees gets
+    // rid of them all.
+    if (options->flush_tree_threshold != 0 &&
+        (uint64_t)Vcb->tree_count * Vcb->superblock.node_size >= ((uint64_t)options->flush_tree_threshold << 20) * factor)
+        return true;
+
+    if (options->flush_extent_threshold != 0 && (uint64_t)Vcb->changed_extent_count >= (uint64_t)options->flush_extent_threshold * factor)
+        return true;
+
+    return false;
+}
+
+void check_dirty_thresholds(device_extension* Vcb) {
+    if (dirty_over_threshold(Vcb, 1))
+        KeSetEvent(&Vcb->flush_kick, 0, false);
+}
+
+void throttle_writer(device_extension* Vcb) {
+    LARGE_INTEGER timeout;
+
+    if (!dirty_over_threshold(Vcb, 2))
+        return;
+
+    TRACE("waiting for flush (%li fcbs, %li trees, %li extents)\n", Vcb->dirty_fcb_count, Vcb->tree_count, Vcb->changed_extent_count);
+
+    KeClearEvent(&Vcb->flush_done);
+    KeSetEvent(&Vcb->flush_kick, 0, false);
+
+    // Don't wait forever - the flush thread might not be able to run, e.g. if the volume's locked.
+    timeout.QuadPart = -10000000; // 1 second
+
+    KeWaitForSingleObject(&Vcb->flush_done, Executive, KernelMode, false, &timeout);
+}
+
+static NTSTATUS do_flush(device_extension* Vcb) {
     NTSTATUS Status;
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
@@ -7913,6 +8073,8 @@ static void do_flush(device_extension* Vcb) {
         ERR("do_write returned %08lx\n", Status);
 
     ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return Status;
 }
 
 _Function_class_(KSTART_ROUTINE)
@@ -7920,6 +8082,8 @@ void __stdcall flush_thread(void* context) {
     DEVICE_OBJECT* devobj = context;
     device_extension* Vcb = devobj->DeviceExtension;
     LARGE_INTEGER due_time;
+    void* objects[2];
+    ULONG num_objects = 2;
 
     ObReferenceObject(devobj);
 
@@ -7929,14 +8093,35 @@ void __stdcall flush_thread(void* context) {
 
     KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
 
+    objects[0] = &Vcb->flush_thread_timer;
+    objects[1] = &Vcb->flush_kick;
+
     while (true) {
-        KeWaitForSingleObject(&Vcb->flush_thread_timer, Executive, KernelMode, false, NULL);
+        NTSTATUS Status = STATUS_SUCCESS;
+
+        KeWaitForMultipleObjects(num_objects, objects, WaitAny, Executive, KernelMode, false, NULL, NULL);
 
         if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
             break;
 
         if (!Vcb->locked)
-            do_flush(Vcb);
+            Status = do_flush(Vcb);
+
+        KeSetEvent(&Vcb->flush_done, 0, false);
+
+        // Anything which crossed a threshold while we were flushing will have kicked us again
+        // already, so check whether we really need to go round again.
+        KeClearEvent(&Vcb->flush_kick);
+
+        // If the flush failed, going straight round again would most likely fail the same way -
+        // ignore kicks until the timer next fires.
+        if (NT_SUCCESS(Status)) {
+            num_objects = 2;
+
+            if (!Vcb->locked && !Vcb->readonly)
+                check_dirty_thresholds(Vcb);
+        } else
+            num_objects = 1;
 
         KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
     }
@@ -187,7 +187,107 @@ NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PI
     return Status;
 }
 
-NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offset, uint64_t size) {
+void space_index_init(space_index* index) {
+    index->by_address.root = NULL;
+    index->by_address.augment = NULL;
+    index->by_size.root = NULL;
+    index->by_size.augment = NULL;
+}
+
+static void space_index_insert_size(space_index* index, space* s) {
+    rb_node* parent = NULL;
+    rb_node** link = &index->by_size.root;
+
+    // entries of the same size go to the right, so that the oldest is found first
+    while (*link) {
+        space* s2 = CONTAINING_RECORD(*link, space, node_size);
+
+        parent = *link;
+
+        if (s->size < s2->size)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    rb_insert(&index->by_size, parent, link, &s->node_size);
+}
+
+void space_index_insert(space_index* index, space* s) {
+    rb_node* parent = NULL;
+    rb_node** link = &index->by_address.root;
+
+    while (*link) {
+        space* s2 = CONTAINING_RECORD(*link, space, node_address);
+
+        parent = *link;
+
+        if (s->address < s2->address)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    rb_insert(&index->by_address, parent, link, &s->node_address);
+
+    space_index_insert_size(index, s);
+}
+
+void space_index_remove(space_index* index, space* s) {
+    rb_remove(&index->by_address, &s->node_address);
+    rb_remove(&index->by_size, &s->node_size);
+}
+
+// Called after an entry's size has changed. Entries in a space list never overlap, so
+// changing their addresses doesn't change their order, and by_address stays valid.
+void space_index_resize(space_index* index, space* s) {
+    rb_remove(&index->by_size, &s->node_size);
+    space_index_insert_size(index, s);
+}
+
+// Returns the last entry starting at or before address, or NULL if there isn't one.
+space* space_index_find(space_index* index, uint64_t address) {
+    rb_node* n = index->by_address.root;
+    space* ret = NULL;
+
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, node_address);
+
+        if (s->address <= address) {
+            ret = s;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
+// Returns the smallest entry of at least length bytes, or NULL if there isn't one.
+space* space_index_best_fit(space_index* index, uint64_t length) {
+    rb_node* n = index->by_size.root;
+    space* ret = NULL;
+
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, node_size);
+
+        if (s->size >= length) {
+            ret = s;
+            n = n->left;
+        } else
+            n = n->right;
+    }
+
+    return ret;
+}
+
+space* space_index_largest(space_index* index) {
+    rb_node* n = rb_last(&index->by_size);
+
+    return n ? CONTAINING_RECORD(n, space, node_size) : NULL;
+}
+
+NTSTATUS add_space_entry(LIST_ENTRY* list, space_index* index, uint64_t offset, uint64_t size) {
     space* s;
 
     s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
@@ -200,6 +300,16 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offse
     s->address = offset;
     s->size = size;
 
+    if (index) {
+        space* prev = space_index_find(index, offset);
+
+        InsertHeadList(prev ? &prev->list_entry : list, &s->list_entry);
+
+        space_index_insert(index, s);
+
+        return STATUS_SUCCESS;
+    }
+
     if (IsListEmpty(list))
         InsertTailList(list, &s->list_entry);
     else {
@@ -216,34 +326,6 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offse
 
                 if (s2->address > offset) {
                     InsertTailList(le, &s->list_entry);
-                    goto size;
-                }
-
-                le = le->Flink;
-            }
-        }
-    }
-
-size:
-    if (!list_size)
-        return STATUS_SUCCESS;
-
-    if (IsListEmpty(list_size))
-        InsertTailList(list_size, &s->list_entry_size);
-    else {
-        space* s2 = CONTAINING_RECORD(list_size->Blink, space, list_entry_size);
-
-        if (s2->size >= size)
-            InsertTailList(list_size, &s->list_entry_size);
-        else {
-            LIST_ENTRY* le;
-
-            le = list_size->Flink;
-            while (le != list_size) {
-                s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-                if (s2->size <= size) {
-                    InsertHeadList(le->Blink, &s->list_entry_size);
                     return STATUS_SUCCESS;
                 }
 
@@ -288,7 +370,7 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, uint64_t off
         addr = offset + (index << Vcb->sector_shift);
         length = runlength << Vcb->sector_shift;
 
-        add_space_entry(&c->space, &c->space_size, addr, length);
+        add_space_entry(&c->space, &c->space_index, addr, length);
         index += runlength;
         *total_space += length;
 
@@ -296,30 +378,6 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, uint64_t off
     }
 }
 
-static void order_space_entry(space* s, LIST_ENTRY* list_size) {
-    LIST_ENTRY* le;
-
-    if (IsListEmpty(list_size)) {
-        InsertHeadList(list_size, &s->list_entry_size);
-        return;
-    }
-
-    le = list_size->Flink;
-
-    while (le != list_size) {
-        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s2->size <= s->size) {
-            InsertHeadList(le->Blink, &s->list_entry_size);
-            return;
-        }
-
-        le = le->Flink;
-    }
-
-    InsertTailList(list_size, &s->list_entry_size);
-}
-
 typedef struct {
     uint64_t stripe;
     LIST_ENTRY list_entry;
@@ -607,7 +665,7 @@ NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load
         fse = (FREE_SPACE_ENTRY*)&data[off];
 
         if (fse->type == FREE_SPACE_EXTENT) {
-            Status = add_space_entry(&c->space, &c->space_size, fse->offset, fse->size);
+            Status = add_space_entry(&c->space, &c->space_index, fse->offset, fse->size);
             if (!NT_SUCCESS(Status)) {
                 ERR("add_space_entry returned %08lx\n", Status);
                 ExFreePool(data);
@@ -668,11 +726,10 @@ NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load
                 s->size += s2->size;
 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                space_index_remove(&c->space_index, s2);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
-                order_space_entry(s, &c->space_size);
+                space_index_resize(&c->space_index, s);
 
                 le2 = le;
             }
@@ -717,12 +774,13 @@ clearcache:
         LIST_ENTRY* le2 = le->Flink;
 
         RemoveEntryList(&s->list_entry);
-        RemoveEntryList(&s->list_entry_size);
         ExFreePool(s);
 
         le = le2;
     }
 
+    space_index_init(&c->space_index);
+
     return STATUS_NOT_FOUND;
 }
 
@@ -766,7 +824,7 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
             break;
 
         if (tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT) {
-            Status = add_space_entry(&c->space, &c->space_size, tp.item->key.obj_id, tp.item->key.offset);
+            Status = add_space_entry(&c->space, &c->space_index, tp.item->key.obj_id, tp.item->key.offset);
             if (!NT_SUCCESS(Status)) {
                 ERR("add_space_entry returned %08lx\n", Status);
                 if (bmparr) ExFreePool(bmparr);
@@ -828,7 +886,7 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
                 runend = runstart + (runlength << Vcb->sector_shift);
 
                 if (runstart > lastoff) {
-                    Status = add_space_entry(&c->space, &c->space_size, lastoff, runstart - lastoff);
+                    Status = add_space_entry(&c->space, &c->space_index, lastoff, runstart - lastoff);
                     if (!NT_SUCCESS(Status)) {
                         ERR("add_space_entry returned %08lx\n", Status);
                         if (bmparr) ExFreePool(bmparr);
@@ -842,7 +900,7 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
             }
 
             if (lastoff < tp.item->key.obj_id + tp.item->key.offset) {
-                Status = add_space_entry(&c->space, &c->space_size, lastoff, tp.item->key.obj_id + tp.item->key.offset - lastoff);
+                Status = add_space_entry(&c->space, &c->space_index, lastoff, tp.item->key.obj_id + tp.item->key.offset - lastoff);
                 if (!NT_SUCCESS(Status)) {
                     ERR("add_space_entry returned %08lx\n", Status);
                     if (bmparr) ExFreePool(bmparr);
@@ -867,11 +925,10 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
                 s->size += s2->size;
 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                space_index_remove(&c->space_index, s2);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
-                order_space_entry(s, &c->space_size);
+                space_index_resize(&c->space_index, s);
 
                 le2 = le;
             }
@@ -940,7 +997,7 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
                     s->size = tp.item->key.obj_id - lastaddr;
                     InsertTailList(&c->space, &s->list_entry);
 
-                    order_space_entry(s, &c->space_size);
+                    space_index_insert(&c->space_index, s);
 
                     TRACE("(%I64x,%I64x)\n", s->address, s->size);
                 }
@@ -968,7 +1025,7 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
             s->size = c->offset + c->chunk_item->size - lastaddr;
             InsertTailList(&c->space, &s->list_entry);
 
-            order_space_entry(s, &c->space_size);
+            space_index_insert(&c->space_index, s);
 
             TRACE("(%I64x,%I64x)\n", s->address, s->size);
         }
@@ -1425,7 +1482,7 @@ NTSTATUS allocate_cache(device_extension* Vcb, bool* changed, PIRP Irp, LIST_ENT
     return STATUS_SUCCESS;
 }
 
-static void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c) {
+static void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list, space_index* index, uint64_t address, uint64_t length, chunk* c) {
     rollback_space* rs;
 
     rs = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_space), ALLOC_TAG);
@@ -1435,7 +1492,7 @@ static void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list,
     }
 
     rs->list = list;
-    rs->list_size = list_size;
+    rs->index = index;
     rs->address = address;
     rs->length = length;
     rs->chunk = c;
@@ -1443,7 +1500,38 @@ static void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list,
     add_rollback(rollback, add ? ROLLBACK_ADD_SPACE : ROLLBACK_SUBTRACT_SPACE, rs);
 }
 
-void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback) {
+// Extends s2 so that it reaches end, merging in any entries it now touches. Only the gaps
+// between them were actually added, so only they are recorded for rollback.
+static void space_extend_end(LIST_ENTRY* list, space_index* index, space* s2, uint64_t end, chunk* c, LIST_ENTRY* rollback) {
+    while (s2->list_entry.Flink != list) {
+        space* s3 = CONTAINING_RECORD(s2->list_entry.Flink, space, list_entry);
+
+        if (s3->address > end)
+            break;
+
+        if (rollback && s3->address > s2->address + s2->size)
+            add_rollback_space(rollback, true, list, index, s2->address + s2->size, s3->address - s2->address - s2->size, c);
+
+        s2->size = s3->address + s3->size - s2->address;
+        end = max(end, s2->address + s2->size);
+
+        RemoveEntryList(&s3->list_entry);
+
+        if (index)
+            space_index_remove(index, s3);
+
+        ExFreePool(s3);
+    }
+
+    if (end > s2->address + s2->size) {
+        if (rollback)
+            add_rollback_space(rollback, true, list, index, s2->address + s2->size, end - s2->address - s2->size, c);
+
+        s2->size = end - s2->address;
+    }
+}
+
+void space_list_add2(LIST_ENTRY* list, space_index* index, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
     space *s, *s2;
 
@@ -1459,16 +1547,25 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         s->size = length;
         InsertTailList(list, &s->list_entry);
 
-        if (list_size)
-            InsertTailList(list_size, &s->list_entry_size);
+        if (index)
+            space_index_insert(index, s);
 
         if (rollback)
-            add_rollback_space(rollback, true, list, list_size, address, length, c);
+            add_rollback_space(rollback, true, list, index, address, length, c);
 
         return;
     }
 
     le = list->Flink;
+
+    // Nothing before the entry preceding the one at or before address can touch the new range.
+    if (index) {
+        space* s3 = space_index_find(index, address);
+
+        if (s3)
+            le = s3->list_entry.Blink != list ? s3->list_entry.Blink : &s3->list_entry;
+    }
+
     do {
         s2 = CONTAINING_RECORD(le, space, list_entry);
 
@@ -1480,7 +1577,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         if (address <= s2->address && address + length >= s2->address + s2->size) {
             if (address < s2->address) {
                 if (rollback)
-                    add_rollback_space(rollback, true, list, list_size, address, s2->address - address, c);
+                    add_rollback_space(rollback, true, list, index, address, s2->address - address, c);
 
                 s2->size += s2->address - address;
                 s2->address = address;
@@ -1494,8 +1591,8 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
 
                         RemoveEntryList(&s3->list_entry);
 
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        if (index)
+                            space_index_remove(index, s3);
 
                         ExFreePool(s3);
                     } else
@@ -1503,33 +1600,11 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                 }
             }
 
-            if (length > s2->size) {
-                if (rollback)
-                    add_rollback_space(rollback, true, list, list_size, s2->address + s2->size, address + length - s2->address - s2->size, c);
-
-                s2->size = length;
+            if (address + length > s2->address + s2->size)
+                space_extend_end(list, index, s2, address + length, c, rollback);
 
-                while (s2->list_entry.Flink != list) {
-                    space* s3 = CONTAINING_RECORD(s2->list_entry.Flink, space, list_entry);
-
-                    if (s3->address <= s2->address + s2->size) {
-                        s2->size = max(s2->size, s3->address + s3->size - s2->address);
-
-                        RemoveEntryList(&s3->list_entry);
-
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
-
-                        ExFreePool(s3);
-                    } else
-                        break;
-                }
-            }
-
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (index)
+                space_index_resize(index, s2);
 
             return;
         }
@@ -1537,7 +1612,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         // new entry overlaps start of old one
         if (address < s2->address && address + length >= s2->address) {
             if (rollback)
-                add_rollback_space(rollback, true, list, list_size, address, s2->address - address, c);
+                add_rollback_space(rollback, true, list, index, address, s2->address - address, c);
 
             s2->size += s2->address - address;
             s2->address = address;
@@ -1551,49 +1626,26 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
 
                     RemoveEntryList(&s3->list_entry);
 
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    if (index)
+                        space_index_remove(index, s3);
 
                     ExFreePool(s3);
                 } else
                     break;
             }
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (index)
+                space_index_resize(index, s2);
 
             return;
         }
 
         // new entry overlaps end of old one
         if (address <= s2->address + s2->size && address + length > s2->address + s2->size) {
-            if (rollback)
-                add_rollback_space(rollback, true, list, list_size, address, s2->address + s2->size - address, c);
-
-            s2->size = address + length - s2->address;
-
-            while (s2->list_entry.Flink != list) {
-                space* s3 = CONTAINING_RECORD(s2->list_entry.Flink, space, list_entry);
-
-                if (s3->address <= s2->address + s2->size) {
-                    s2->size = max(s2->size, s3->address + s3->size - s2->address);
-
-                    RemoveEntryList(&s3->list_entry);
-
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
-
-                    ExFreePool(s3);
-                } else
-                    break;
-            }
+            space_extend_end(list, index, s2, address + length, c, rollback);
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (index)
+                space_index_resize(index, s2);
 
             return;
         }
@@ -1608,14 +1660,14 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (rollback)
-                add_rollback_space(rollback, true, list, list_size, address, length, c);
+                add_rollback_space(rollback, true, list, index, address, length, c);
 
             s->address = address;
             s->size = length;
             InsertHeadList(s2->list_entry.Blink, &s->list_entry);
 
-            if (list_size)
-                order_space_entry(s, list_size);
+            if (index)
+                space_index_insert(index, s);
 
             return;
         }
@@ -1627,10 +1679,8 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
     if (s2->address + s2->size == address) {
         s2->size += length;
 
-        if (list_size) {
-            RemoveEntryList(&s2->list_entry_size);
-            order_space_entry(s2, list_size);
-        }
+        if (index)
+            space_index_resize(index, s2);
 
         return;
     }
@@ -1647,20 +1697,20 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
     s->size = length;
     InsertTailList(list, &s->list_entry);
 
-    if (list_size)
-        order_space_entry(s, list_size);
+    if (index)
+        space_index_insert(index, s);
 
     if (rollback)
-        add_rollback_space(rollback, true, list, list_size, address, length, c);
+        add_rollback_space(rollback, true, list, index, address, length, c);
 }
 
-void space_list_merge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting) {
+void space_list_merge(LIST_ENTRY* spacelist, space_index* index, LIST_ENTRY* deleting) {
     LIST_ENTRY* le = deleting->Flink;
 
     while (le != deleting) {
         space* s = CONTAINING_RECORD(le, space, list_entry);
 
-        space_list_add2(spacelist, spacelist_size, s->address, s->size, NULL, NULL);
+        space_list_add2(spacelist, index, s->address, s->size, NULL, NULL);
 
         le = le->Flink;
     }
@@ -2152,7 +2202,7 @@ void space_list_add(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY* rol
     space_list_add2(&c->deleting, NULL, address, length, c, rollback);
 }
 
-void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback) {
+void space_list_subtract2(LIST_ENTRY* list, space_index* index, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback) {
     LIST_ENTRY *le, *le2;
     space *s, *s2;
 
@@ -2160,6 +2210,15 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
         return;
 
     le = list->Flink;
+
+    // skip the entries which end before address
+    if (index) {
+        space* s3 = space_index_find(index, address);
+
+        if (s3)
+            le = &s3->list_entry;
+    }
+
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         le2 = le->Flink;
@@ -2169,18 +2228,18 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
 
         if (s2->address >= address && s2->address + s2->size <= address + length) { // remove entry entirely
             if (rollback)
-                add_rollback_space(rollback, false, list, list_size, s2->address, s2->size, c);
+                add_rollback_space(rollback, false, list, index, s2->address, s2->size, c);
 
             RemoveEntryList(&s2->list_entry);
 
-            if (list_size)
-                RemoveEntryList(&s2->list_entry_size);
+            if (index)
+                space_index_remove(index, s2);
 
             ExFreePool(s2);
         } else if (address + length > s2->address && address + length < s2->address + s2->size) {
             if (address > s2->address) { // cut out hole
                 if (rollback)
-                    add_rollback_space(rollback, false, list, list_size, address, length, c);
+                    add_rollback_space(rollback, false, list, index, address, length, c);
 
                 s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
 
@@ -2196,35 +2255,30 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
                 s2->size = s2->address + s2->size - address - length;
                 s2->address = address + length;
 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
-                    order_space_entry(s2, list_size);
-                    order_space_entry(s, list_size);
+                if (index) {
+                    space_index_resize(index, s2);
+                    space_index_insert(index, s);
                 }
 
                 return;
             } else { // remove start of entry
                 if (rollback)
-                    add_rollback_space(rollback, false, list, list_size, s2->address, address + length - s2->address, c);
+                    add_rollback_space(rollback, false, list, index, s2->address, address + length - s2->address, c);
 
                 s2->size -= address + length - s2->address;
                 s2->address = address + length;
 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
-                    order_space_entry(s2, list_size);
-                }
+                if (index)
+                    space_index_resize(index, s2);
             }
         } else if (address > s2->address && address < s2->address + s2->size) { // remove end of entry
             if (rollback)
-                add_rollback_space(rollback, false, list, list_size, address, s2->address + s2->size - address, c);
+                add_rollback_space(rollback, false, list, index, address, s2->address + s2->size - address, c);
 
             s2->size = address - s2->address;
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (index)
+                space_index_resize(index, s2);
         }
 
         le = le2;
@@ -2235,7 +2289,9 @@ void space_list_subtract(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY
     c->changed = true;
     c->space_changed = true;
 
-    space_list_subtract2(&c->space, &c->space_size, address, length, c, rollback);
+    space_list_subtract2(&c->space, &c->space_index, address, length, c, rollback);
+
+    cancel_discard(c, address, length);
 
     space_list_subtract2(&c->deleting, NULL, address, length, c, rollback);
 }
@@ -306,6 +306,13 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
 
     InitializeListHead(&rollback);
 
+    // read in the rest of the parent directory before we change anything, as add_dir_child will need it
+    Status = complete_dir_children(Vcb, fileref->fcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("complete_dir_children returned %08lx\n", Status);
+        goto end;
+    }
+
     // create new root
 
     id = InterlockedIncrement64(&Vcb->root_root->lastinode);
@@ -437,12 +444,14 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
         goto end;
     }
 
-    fr->parent = fileref;
-
-    Status = add_dir_child(fileref->fcb, r->id, true, utf8, name, BTRFS_TYPE_DIRECTORY, &dc);
-    if (!NT_SUCCESS(Status))
-        WARN("add_dir_child returned %08lx\n", Status);
+    Status = add_dir_child(fileref->fcb, r->id, true, utf8, name, BTRFS_TYPE_DIRECTORY, &dc, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_dir_child returned %08lx\n", Status);
+        reap_fileref(Vcb, fr);
+        goto end;
+    }
 
+    fr->parent = fileref;
     fr->dc = dc;
     dc->fileref = fr;
 
@@ -483,6 +492,9 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
     send_notification_fileref(fr, FILE_NOTIFY_CHANGE_DIR_NAME, FILE_ACTION_ADDED, NULL);
     send_notification_fileref(fr->parent, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, NULL);
 
+    // invalidate the uniqueness cache - see is_extent_unique
+    Vcb->unique_epoch = Vcb->superblock.generation;
+
     le = subvol->fcbs.Flink;
     while (le != &subvol->fcbs) {
         struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
@@ -876,6 +888,13 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
         goto end;
     }
 
+    // make sure add_dir_child won't have to read the directory in once we've started
+    Status = complete_dir_children(Vcb, fileref->fcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("complete_dir_children returned %08lx\n", Status);
+        goto end;
+    }
+
     id = InterlockedIncrement64(&Vcb->root_root->lastinode);
     Status = create_root(Vcb, id, &r, false, 0, Irp);
 
@@ -990,6 +1009,8 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
         goto end;
     }
 
+    share_sd(Vcb, &rootfcb->sd);
+
     Status = RtlGetOwnerSecurityDescriptor(rootfcb->sd, &owner, &defaulted);
     if (!NT_SUCCESS(Status)) {
         ERR("RtlGetOwnerSecurityDescriptor returned %08lx\n", Status);
@@ -1007,7 +1028,6 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(rootfcb);
     InsertTailList(&Vcb->all_fcbs, &rootfcb->list_entry_all);
-    r->fcbs_version++;
     release_fcb_lock(Vcb);
 
     rootfcb->Header.IsFastIoPossible = fast_io_possible(rootfcb);
@@ -1021,8 +1041,12 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
         rootfcb->inode_item.flags |= BTRFS_INODE_COMPRESS;
 
     rootfcb->prop_compression = fileref->fcb->prop_compression;
+    rootfcb->prop_compression_level = fileref->fcb->prop_compression_level;
     rootfcb->prop_compression_changed = rootfcb->prop_compression != PropCompression_None;
 
+    rootfcb->extent_size_hint = fileref->fcb->extent_size_hint;
+    rootfcb->extent_size_hint_changed = rootfcb->extent_size_hint != 0;
+
     r->lastinode = rootfcb->inode;
 
     // add INODE_REF
@@ -1062,35 +1086,31 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
 
     mark_fcb_dirty(rootfcb);
 
-    fr->parent = fileref;
+    Status = add_dir_child(fileref->fcb, r->id, true, &utf8, &nameus, BTRFS_TYPE_DIRECTORY, &dc, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_dir_child returned %08lx\n", Status);
 
-    Status = add_dir_child(fileref->fcb, r->id, true, &utf8, &nameus, BTRFS_TYPE_DIRECTORY, &dc);
-    if (!NT_SUCCESS(Status))
-        WARN("add_dir_child returned %08lx\n", Status);
+        // rootfcb still holds the reference, and gets marked as deleted below
+        ExFreeToPagedLookasideList(&Vcb->fileref_lookaside, fr);
+        fr = NULL;
+
+        goto end;
+    }
 
+    fr->parent = fileref;
     fr->dc = dc;
     dc->fileref = fr;
 
-    fr->fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!fr->fcb->hash_ptrs) {
-        ERR("out of memory\n");
-        free_fileref(fr);
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto end;
-    }
+    Status = hash_table_alloc(&fr->fcb->dir_children_hash);
 
-    RtlZeroMemory(fr->fcb->hash_ptrs, sizeof(LIST_ENTRY*) * 256);
+    if (NT_SUCCESS(Status))
+        Status = hash_table_alloc(&fr->fcb->dir_children_hash_uc);
 
-    fr->fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-    if (!fr->fcb->hash_ptrs_uc) {
-        ERR("out of memory\n");
+    if (!NT_SUCCESS(Status)) {
         free_fileref(fr);
-        Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
 
-    RtlZeroMemory(fr->fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
-
     ExAcquireResourceExclusiveLite(&fileref->fcb->nonpaged->dir_children_lock, true);
     InsertTailList(&fileref->children, &fr->list_entry);
     ExReleaseResourceLite(&fileref->fcb->nonpaged->dir_children_lock);
@@ -1313,6 +1333,9 @@ static NTSTATUS get_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
             break;
     }
 
+    if (length >= offsetof(btrfs_inode_info, extent_size_hint) + sizeof(((btrfs_inode_info*)NULL)->extent_size_hint))
+        bii->extent_size_hint = fcb->extent_size_hint;
+
     ExReleaseResourceLite(fcb->Header.Resource);
 
     return STATUS_SUCCESS;
@@ -1323,10 +1346,13 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
     NTSTATUS Status;
     fcb* fcb;
     ccb* ccb;
+    bool extent_size_hint_changed;
 
-    if (length < sizeof(btrfs_set_inode_info))
+    if (length < offsetof(btrfs_set_inode_info, extent_size_hint))
         return STATUS_INVALID_PARAMETER;
 
+    extent_size_hint_changed = length >= sizeof(btrfs_set_inode_info) && bsii->extent_size_hint_changed;
+
     if (!FileObject)
         return STATUS_INVALID_PARAMETER;
 
@@ -1353,6 +1379,16 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
     if (bsii->compression_type_changed && bsii->compression_type > BTRFS_COMPRESSION_ZSTD)
         return STATUS_INVALID_PARAMETER;
 
+    if (extent_size_hint_changed) {
+        if (!(ccb->access & FILE_WRITE_ATTRIBUTES)) {
+            WARN("insufficient privileges\n");
+            return STATUS_ACCESS_DENIED;
+        }
+
+        if (!valid_extent_size_hint(fcb->Vcb, bsii->extent_size_hint))
+            return STATUS_INVALID_PARAMETER;
+    }
+
     if (fcb->ads)
         fcb = ccb->fileref->parent->fcb;
 
@@ -1405,6 +1441,8 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
         fcb->inode_item.st_gid = bsii->st_gid;
 
     if (bsii->compression_type_changed) {
+        enum prop_compression_type old_prop_compression = fcb->prop_compression;
+
         switch (bsii->compression_type) {
             case BTRFS_COMPRESSION_ANY:
                 fcb->prop_compression = PropCompression_None;
@@ -1423,10 +1461,19 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
             break;
         }
 
+        if (fcb->prop_compression != old_prop_compression)
+            fcb->prop_compression_level = 0;
+
         fcb->prop_compression_changed = true;
     }
 
-    if (bsii->flags_changed || bsii->mode_changed || bsii->uid_changed || bsii->gid_changed || bsii->compression_type_changed) {
+    if (extent_size_hint_changed && fcb->extent_size_hint != bsii->extent_size_hint) {
+        fcb->extent_size_hint = bsii->extent_size_hint;
+        fcb->extent_size_hint_changed = true;
+    }
+
+    if (bsii->flags_changed || bsii->mode_changed || bsii->uid_changed || bsii->gid_changed || bsii->compression_type_changed ||
+        extent_size_hint_changed) {
         fcb->inode_item_changed = true;
         mark_fcb_dirty(fcb);
     }
@@ -2109,6 +2156,12 @@ static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFE
         return STATUS_INVALID_PARAMETER;
     }
 
+    Status = flush_fcb_delalloc(fcb, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_fcb_delalloc returned %08lx\n", Status);
+        return Status;
+    }
+
     ExAcquireResourceSharedLite(fcb->Header.Resource, true);
 
     // If file is not marked as sparse, claim the whole thing as an allocated range
@@ -2286,6 +2339,10 @@ static NTSTATUS lock_volume(device_extension* Vcb, PIRP Irp) {
 
     free_trees(Vcb);
 
+    // whoever's locking the volume may write to the disk directly, so don't hang on to any fcbs
+    if (NT_SUCCESS(Status))
+        empty_fileref_cache(Vcb);
+
     ExReleaseResourceLite(&Vcb->tree_lock);
 
     if (!NT_SUCCESS(Status)) {
@@ -2616,6 +2673,7 @@ NTSTATUS dismount_volume(device_extension* Vcb, bool shutdown, PIRP Irp) {
     free_trees(Vcb);
 
     Vcb->removing = true;
+    empty_fileref_cache(Vcb);
 
     open_files = Vcb->open_files > 0;
 
@@ -3356,6 +3414,13 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
         return STATUS_INVALID_PARAMETER;
     }
 
+    Status = flush_fcb_delalloc(sourcefcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_fcb_delalloc returned %08lx\n", Status);
+        ObDereferenceObject(sourcefo);
+        return Status;
+    }
+
     InitializeListHead(&rollback);
     InitializeListHead(&newexts);
 
@@ -3701,21 +3766,17 @@ static NTSTATUS check_inode_used(_In_ _Requires_exclusive_lock_held_(_Curr_->tre
     KEY searchkey;
     traverse_ptr tp;
     NTSTATUS Status;
-    uint8_t c = hash >> 24;
-
-    if (subvol->fcbs_ptrs[c]) {
-        LIST_ENTRY* le = subvol->fcbs_ptrs[c];
+    LIST_ENTRY* bucket = hash_table_bucket(&subvol->fcbs_hash, hash);
+    LIST_ENTRY* le;
 
-        while (le != &subvol->fcbs) {
-            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
+    le = bucket->Flink;
+    while (le != bucket) {
+        struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
 
-            if (fcb2->inode == inode)
-                return STATUS_SUCCESS;
-            else if (fcb2->hash > hash)
-                break;
+        if (fcb2->inode == inode)
+            return STATUS_SUCCESS;
 
-            le = le->Flink;
-        }
+        le = le->Flink;
     }
 
     searchkey.obj_id = inode;
@@ -3841,7 +3902,7 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
     name.Length = name.MaximumLength = bmn->namelen;
     name.Buffer = bmn->name;
 
-    Status = find_file_in_dir(&name, parfcb, &subvol, &inode, &dc, true);
+    Status = find_file_in_dir(&name, parfcb, &subvol, &inode, &dc, true, Irp);
     if (!NT_SUCCESS(Status) && Status != STATUS_OBJECT_NAME_NOT_FOUND) {
         ERR("find_file_in_dir returned %08lx\n", Status);
         goto end;
@@ -3917,8 +3978,12 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
         fcb->inode_item.flags |= BTRFS_INODE_COMPRESS;
 
     fcb->prop_compression = parfcb->prop_compression;
+    fcb->prop_compression_level = parfcb->prop_compression_level;
     fcb->prop_compression_changed = fcb->prop_compression != PropCompression_None;
 
+    fcb->extent_size_hint = parfcb->extent_size_hint;
+    fcb->extent_size_hint_changed = fcb->extent_size_hint != 0;
+
     fcb->inode_item_changed = true;
 
     fcb->Header.IsFastIoPossible = fast_io_possible(fcb);
@@ -3950,6 +4015,8 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
         goto end;
     }
 
+    share_sd(Vcb, &fcb->sd);
+
     Status = RtlGetOwnerSecurityDescriptor(fcb->sd, &owner, &defaulted);
     if (!NT_SUCCESS(Status)) {
         WARN("RtlGetOwnerSecurityDescriptor returned %08lx\n", Status);
@@ -4011,6 +4078,19 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
 
     fileref->fcb = fcb;
 
+    Status = add_dir_child(parfileref->fcb, fcb->inode, false, &utf8, &name, fcb->type, &dc, Irp);
+    if (!NT_SUCCESS(Status)) {
+        release_fcb_lock(Vcb);
+        ExReleaseResourceLite(&Vcb->fileref_lock);
+
+        ERR("add_dir_child returned %08lx\n", Status);
+
+        // nothing's been marked dirty yet, so we can just throw the new fcb and fileref away
+        ExFreeToPagedLookasideList(&Vcb->fileref_lookaside, fileref);
+        reap_fcb(fcb);
+        goto end;
+    }
+
     fcb->created = true;
     fileref->created = true;
 
@@ -4022,10 +4102,6 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
     mark_fcb_dirty(fcb);
     mark_fileref_dirty(fileref);
 
-    Status = add_dir_child(fileref->parent->fcb, fcb->inode, false, &utf8, &name, fcb->type, &dc);
-    if (!NT_SUCCESS(Status))
-        WARN("add_dir_child returned %08lx\n", Status);
-
     fileref->dc = dc;
     dc->fileref = fileref;
 
@@ -4036,31 +4112,18 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
     increase_fileref_refcount(parfileref);
 
     if (fcb->type == BTRFS_TYPE_DIRECTORY) {
-        fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-        if (!fcb->hash_ptrs) {
-            release_fcb_lock(Vcb);
-            ExReleaseResourceLite(&Vcb->fileref_lock);
-
-            ERR("out of memory\n");
-            free_fileref(fileref);
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
-        }
+        Status = hash_table_alloc(&fcb->dir_children_hash);
 
-        RtlZeroMemory(fcb->hash_ptrs, sizeof(LIST_ENTRY*) * 256);
+        if (NT_SUCCESS(Status))
+            Status = hash_table_alloc(&fcb->dir_children_hash_uc);
 
-        fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-        if (!fcb->hash_ptrs_uc) {
+        if (!NT_SUCCESS(Status)) {
             release_fcb_lock(Vcb);
             ExReleaseResourceLite(&Vcb->fileref_lock);
 
-            ERR("out of memory\n");
             free_fileref(fileref);
-            Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
-
-        RtlZeroMemory(fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
     }
 
     add_fcb_to_subvol(fcb);
@@ -4080,8 +4143,6 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
     if (!parccb->user_set_write_time)
         parfcb->inode_item.st_mtime = now;
 
-    parfcb->subvol->fcbs_version++;
-
     ExReleaseResourceLite(parfcb->Header.Resource);
     release_fcb_lock(Vcb);
     ExReleaseResourceLite(&Vcb->fileref_lock);
@@ -4287,7 +4348,7 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
         }
 
         if (fcb->sd)
-            ExFreePool(fcb->sd);
+            release_sd(Vcb, fcb->sd);
 
         if (bsxa->valuelen > 0 && RtlValidRelativeSecurityDescriptor(bsxa->data + bsxa->namelen, bsxa->valuelen, 0)) {
             fcb->sd = ExAllocatePoolWithTag(PagedPool, bsxa->valuelen, ALLOC_TAG);
@@ -4298,6 +4359,7 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
             }
 
             RtlCopyMemory(fcb->sd, bsxa->data + bsxa->namelen, bsxa->valuelen);
+            share_sd(Vcb, &fcb->sd);
         } else if (fcb->sd)
             fcb->sd = NULL;
 
@@ -4432,18 +4494,7 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
         Status = STATUS_SUCCESS;
         goto end;
     } else if (bsxa->namelen == sizeof(EA_PROP_COMPRESSION) - 1 && RtlCompareMemory(bsxa->data, EA_PROP_COMPRESSION, sizeof(EA_PROP_COMPRESSION) - 1) == sizeof(EA_PROP_COMPRESSION) - 1) {
-        static const char lzo[] = "lzo";
-        static const char zlib[] = "zlib";
-        static const char zstd[] = "zstd";
-
-        if (bsxa->valuelen == sizeof(zstd) - 1 && RtlCompareMemory(bsxa->data + bsxa->namelen, zstd, bsxa->valuelen) == bsxa->valuelen)
-            fcb->prop_compression = PropCompression_ZSTD;
-        else if (bsxa->valuelen == sizeof(lzo) - 1 && RtlCompareMemory(bsxa->data + bsxa->namelen, lzo, bsxa->valuelen) == bsxa->valuelen)
-            fcb->prop_compression = PropCompression_LZO;
-        else if (bsxa->valuelen == sizeof(zlib) - 1 && RtlCompareMemory(bsxa->data + bsxa->namelen, zlib, bsxa->valuelen) == bsxa->valuelen)
-            fcb->prop_compression = PropCompression_Zlib;
-        else
-            fcb->prop_compression = PropCompression_None;
+        parse_prop_compression(bsxa->data + bsxa->namelen, bsxa->valuelen, &fcb->prop_compression, &fcb->prop_compression_level);
 
         if (fcb->prop_compression != PropCompression_None) {
             fcb->inode_item.flags |= BTRFS_INODE_COMPRESS;
@@ -4453,6 +4504,21 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
         fcb->prop_compression_changed = true;
         mark_fcb_dirty(fcb);
 
+        Status = STATUS_SUCCESS;
+        goto end;
+    } else if (bsxa->namelen == sizeof(EA_PROP_EXTSIZE) - 1 && RtlCompareMemory(bsxa->data, EA_PROP_EXTSIZE, sizeof(EA_PROP_EXTSIZE) - 1) == sizeof(EA_PROP_EXTSIZE) - 1) {
+        uint32_t hint = 0;
+
+        // an empty value removes the hint
+        if (bsxa->valuelen > 0 && !parse_prop_extsize(Vcb, bsxa->data + bsxa->namelen, bsxa->valuelen, &hint)) {
+            Status = STATUS_INVALID_PARAMETER;
+            goto end;
+        }
+
+        fcb->extent_size_hint = hint;
+        fcb->extent_size_hint_changed = true;
+        mark_fcb_dirty(fcb);
+
         Status = STATUS_SUCCESS;
         goto end;
     } else if (bsxa->namelen >= (sizeof(stream_pref) - 1) && RtlCompareMemory(bsxa->data, stream_pref, sizeof(stream_pref) - 1) == sizeof(stream_pref) - 1) {
@@ -5007,6 +5073,12 @@ static NTSTATUS get_retrieval_pointers(device_extension* Vcb, PFILE_OBJECT FileO
     if (outlen < offsetof(RETRIEVAL_POINTERS_BUFFER, Extents[0]))
         return STATUS_BUFFER_TOO_SMALL;
 
+    Status = flush_fcb_delalloc(fcb, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_fcb_delalloc returned %08lx\n", Status);
+        return Status;
+    }
+
     ExAcquireResourceSharedLite(fcb->Header.Resource, true);
 
     try {
@@ -5183,6 +5255,115 @@ static NTSTATUS add_csum_sparse_extents(device_extension* Vcb, uint64_t sparse_e
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS get_compression_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_compression_stats* bcs = data;
+    KIRQL irql;
+
+    if (!data || length < sizeof(btrfs_compression_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    bcs->zstd_adaptive = Vcb->options.zstd_adaptive;
+    bcs->zlib_level = Vcb->options.zlib_level;
+    bcs->zstd_min_level = Vcb->options.zstd_min_level;
+    bcs->zstd_max_level = Vcb->options.zstd_max_level;
+    bcs->num_threads = Vcb->calcthreads.num_threads;
+
+    KeAcquireSpinLock(&Vcb->adaptive_comp.lock, &irql);
+
+    bcs->zstd_level = get_zstd_level(Vcb);
+    bcs->comp_throughput = Vcb->adaptive_comp.comp_rate;
+    bcs->write_throughput = Vcb->adaptive_comp.write_rate;
+    bcs->steps_up = Vcb->adaptive_comp.steps_up;
+    bcs->steps_down = Vcb->adaptive_comp.steps_down;
+
+    KeReleaseSpinLock(&Vcb->adaptive_comp.lock, irql);
+
+    *retlen = sizeof(btrfs_compression_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static uint64_t ticks_to_us(uint64_t ticks, uint64_t freq) {
+    return ((ticks / freq) * 1000000) + ((ticks % freq) * 1000000 / freq);
+}
+
+static NTSTATUS get_range_lock_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_range_lock_stats* brls = data;
+    LARGE_INTEGER freq;
+    KIRQL irql;
+
+    if (!data || length < sizeof(btrfs_range_lock_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    KeQueryPerformanceCounter(&freq);
+
+    brls->locks = Vcb->range_lock_stats.locks;
+    brls->wakeups = Vcb->range_lock_stats.wakeups;
+
+    KeAcquireSpinLock(&Vcb->range_lock_stats.lock, &irql);
+
+    brls->waits = Vcb->range_lock_stats.waits;
+    brls->wait_time = ticks_to_us(Vcb->range_lock_stats.wait_time, freq.QuadPart);
+    brls->max_wait_time = ticks_to_us(Vcb->range_lock_stats.max_wait_time, freq.QuadPart);
+
+    KeReleaseSpinLock(&Vcb->range_lock_stats.lock, irql);
+
+    *retlen = sizeof(btrfs_range_lock_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_discard_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_discard_stats* bds = data;
+
+    if (!data || length < sizeof(btrfs_discard_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    bds->mode = Vcb->options.discard;
+    bds->queued_bytes = Vcb->discard.queued_bytes;
+    bds->ranges = Vcb->discard.ranges;
+    bds->bytes = Vcb->discard.bytes;
+    bds->ioctls = Vcb->discard.ioctls;
+    bds->reused_bytes = Vcb->discard.reused_bytes;
+    bds->skipped_bytes = Vcb->discard.skipped_bytes;
+
+    *retlen = sizeof(btrfs_discard_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_neg_cache_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_neg_cache_stats* bncs = data;
+
+    if (!data || length < sizeof(btrfs_neg_cache_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    bncs->lookups = Vcb->neg_cache_stats.lookups;
+    bncs->hits = Vcb->neg_cache_stats.hits;
+    bncs->added = Vcb->neg_cache_stats.added;
+    bncs->invalidations = Vcb->neg_cache_stats.invalidations;
+
+    *retlen = sizeof(btrfs_neg_cache_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_fcb_cache_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_fcb_cache_stats* bfcs = data;
+
+    if (!data || length < sizeof(btrfs_fcb_cache_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    bfcs->hits = Vcb->fcb_cache_stats.hits;
+    bfcs->misses = Vcb->fcb_cache_stats.misses;
+    bfcs->trimmed = Vcb->fcb_cache_stats.trimmed;
+    bfcs->cached = Vcb->fcb_cache_stats.cached;
+
+    *retlen = sizeof(btrfs_fcb_cache_stats);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS get_csum_info(device_extension* Vcb, PFILE_OBJECT FileObject, btrfs_csum_info* buf, ULONG buflen,
                               ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode) {
     NTSTATUS Status;
@@ -5212,6 +5393,12 @@ static NTSTATUS get_csum_info(device_extension* Vcb, PFILE_OBJECT FileObject, bt
         return STATUS_ACCESS_DENIED;
     }
 
+    Status = flush_fcb_delalloc(fcb, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_fcb_delalloc returned %08lx\n", Status);
+        return Status;
+    }
+
     ExAcquireResourceSharedLite(fcb->Header.Resource, true);
 
     try {
@@ -5919,6 +6106,37 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, uint32_t type) {
                                    Irp->RequestorMode);
             break;
 
+        case FSCTL_BTRFS_GET_COMPRESSION_STATS:
+            Status = get_compression_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                           IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_RANGE_LOCK_STATS:
+            Status = get_range_lock_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                          IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_DISCARD_STATS:
+            Status = get_discard_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                       IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_NEG_CACHE_STATS:
+            Status = get_neg_cache_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                         IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_FCB_CACHE_STATS:
+            Status = get_fcb_cache_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                         IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_DEFRAGMENT:
+            Status = defrag_file(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                 IrpSp->Parameters.FileSystemControl.InputBufferLength,
+                                 IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information, Irp);
+            break;
+
         default:
             WARN("unknown control code %lx (DeviceType = %lx, Access = %lx, Function = %lx, Method = %lx)\n",
                           IrpSp->Parameters.FileSystemControl.FsControlCode, (IrpSp->Parameters.FileSystemControl.FsControlCode & 0xff0000) >> 16,
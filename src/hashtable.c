@@ -0,0 +1,120 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Intrusive hash table, with each bucket a list of entries. The table doubles in size once
+// there's more than HASH_TABLE_LOAD entries per bucket, and halves again once it's mostly
+// empty, so a lookup only ever has to look at a couple of entries whatever the size.
+//
+// Entries keep their insertion order within a bucket, including across resizes. There's no
+// locking here - the caller is expected to hold something exclusively while it's modifying
+// the table, and at least shared while it's looking something up.
+//
+// If a resize fails for lack of memory, we just carry on with longer chains.
+
+#define HASH_TABLE_LOAD         2
+#define HASH_TABLE_MIN_BUCKETS  16
+
+void hash_table_init(_Out_ hash_table* ht, _In_ uint32_t (*get_hash)(LIST_ENTRY* le)) {
+    ht->buckets = NULL;
+    ht->num_buckets = 0;
+    ht->count = 0;
+    ht->get_hash = get_hash;
+}
+
+NTSTATUS hash_table_alloc(_Inout_ hash_table* ht) {
+    ht->buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * HASH_TABLE_MIN_BUCKETS, ALLOC_TAG);
+    if (!ht->buckets) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < HASH_TABLE_MIN_BUCKETS; i++) {
+        InitializeListHead(&ht->buckets[i]);
+    }
+
+    ht->num_buckets = HASH_TABLE_MIN_BUCKETS;
+    ht->count = 0;
+
+    return STATUS_SUCCESS;
+}
+
+void hash_table_free(_Inout_ hash_table* ht) {
+    if (ht->buckets) {
+        ExFreePool(ht->buckets);
+        ht->buckets = NULL;
+    }
+
+    ht->num_buckets = 0;
+    ht->count = 0;
+}
+
+// Hands all of src's entries over to dest, which mustn't have a bucket array of its own.
+void hash_table_move(_Inout_ hash_table* dest, _Inout_ hash_table* src) {
+    dest->buckets = src->buckets;
+    dest->num_buckets = src->num_buckets;
+    dest->count = src->count;
+
+    src->buckets = NULL;
+    src->num_buckets = 0;
+    src->count = 0;
+}
+
+static void hash_table_resize(hash_table* ht, ULONG num_buckets) {
+    LIST_ENTRY* buckets;
+
+    buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * num_buckets, ALLOC_TAG);
+    if (!buckets) {
+        WARN("out of memory\n");
+        return;
+    }
+
+    for (ULONG i = 0; i < num_buckets; i++) {
+        InitializeListHead(&buckets[i]);
+    }
+
+    for (ULONG i = 0; i < ht->num_buckets; i++) {
+        while (!IsListEmpty(&ht->buckets[i])) {
+            LIST_ENTRY* le = RemoveHeadList(&ht->buckets[i]);
+
+            InsertTailList(&buckets[ht->get_hash(le) & (num_buckets - 1)], le);
+        }
+    }
+
+    ExFreePool(ht->buckets);
+
+    ht->buckets = buckets;
+    ht->num_buckets = num_buckets;
+}
+
+void hash_table_insert(_Inout_ hash_table* ht, _In_ LIST_ENTRY* le) {
+    if (ht->count >= ht->num_buckets * HASH_TABLE_LOAD && ht->num_buckets < 0x80000000)
+        hash_table_resize(ht, ht->num_buckets * 2);
+
+    InsertTailList(hash_table_bucket(ht, ht->get_hash(le)), le);
+    ht->count++;
+}
+
+void hash_table_remove(_Inout_ hash_table* ht, _In_ LIST_ENTRY* le) {
+    RemoveEntryList(le);
+    ht->count--;
+
+    // Leave plenty of slack, so that we're not resizing back and forth
+    if (ht->num_buckets > HASH_TABLE_MIN_BUCKETS && ht->count < ht->num_buckets / 8)
+        hash_table_resize(ht, ht->num_buckets / 2);
+}
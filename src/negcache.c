@@ -0,0 +1,132 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Negative lookup cache. Build systems and virus scanners look for a lot of files which don't
+// exist, usually the same ones over and over again. When find_file_in_dir doesn't find a name,
+// we remember it on the directory, so that next time we can say so straight away - without
+// upcasing it, and without going anywhere near the tree if the directory's only partly loaded.
+//
+// The cache is direct-mapped on the hash of the name exactly as it was given, so checking it is
+// a single probe, and a directory never has more than NEG_CACHE_SIZE entries. Case-sensitive and
+// case-insensitive misses are kept apart, as a name which doesn't match case-sensitively might
+// still match case-insensitively.
+//
+// Lookups and additions are done with dir_children_lock held at least shared, and anything which
+// adds a name to a directory holds it exclusively and calls neg_cache_invalidate, so an entry
+// can't go stale between the lookup failing and it being added. The mutex is only there for
+// lookups racing each other.
+
+#define NEG_CACHE_SIZE 32 // must be a power of two
+
+_Requires_lock_held_(fcb->nonpaged->dir_children_lock)
+bool neg_cache_lookup(_In_ fcb* fcb, _In_ PUNICODE_STRING name, _In_ uint32_t hash, _In_ bool case_sensitive) {
+    neg_cache_entry* nce;
+    bool found = false;
+
+    InterlockedIncrement64(&fcb->Vcb->neg_cache_stats.lookups);
+
+    if (!fcb->neg_cache)
+        return false;
+
+    ExAcquireFastMutex(&fcb->nonpaged->neg_cache_mutex);
+
+    nce = &fcb->neg_cache[hash & (NEG_CACHE_SIZE - 1)];
+
+    if (nce->name.Buffer && nce->hash == hash && nce->case_sensitive == case_sensitive && nce->name.Length == name->Length &&
+        RtlCompareMemory(nce->name.Buffer, name->Buffer, name->Length) == name->Length) {
+        found = true;
+    }
+
+    ExReleaseFastMutex(&fcb->nonpaged->neg_cache_mutex);
+
+    if (found)
+        InterlockedIncrement64(&fcb->Vcb->neg_cache_stats.hits);
+
+    return found;
+}
+
+_Requires_lock_held_(fcb->nonpaged->dir_children_lock)
+void neg_cache_add(_In_ fcb* fcb, _In_ PUNICODE_STRING name, _In_ uint32_t hash, _In_ bool case_sensitive) {
+    neg_cache_entry* nce;
+    WCHAR* buf;
+
+    // not fatal if we run out of memory - we'll just have to do the lookup properly next time
+
+    buf = ExAllocatePoolWithTag(PagedPool, name->Length, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    RtlCopyMemory(buf, name->Buffer, name->Length);
+
+    ExAcquireFastMutex(&fcb->nonpaged->neg_cache_mutex);
+
+    if (!fcb->neg_cache) {
+        fcb->neg_cache = ExAllocatePoolWithTag(PagedPool, sizeof(neg_cache_entry) * NEG_CACHE_SIZE, ALLOC_TAG);
+        if (!fcb->neg_cache) {
+            ERR("out of memory\n");
+            ExReleaseFastMutex(&fcb->nonpaged->neg_cache_mutex);
+            ExFreePool(buf);
+            return;
+        }
+
+        RtlZeroMemory(fcb->neg_cache, sizeof(neg_cache_entry) * NEG_CACHE_SIZE);
+    }
+
+    nce = &fcb->neg_cache[hash & (NEG_CACHE_SIZE - 1)];
+
+    if (nce->name.Buffer)
+        ExFreePool(nce->name.Buffer);
+
+    nce->hash = hash;
+    nce->case_sensitive = case_sensitive;
+    nce->name.Buffer = buf;
+    nce->name.Length = nce->name.MaximumLength = name->Length;
+
+    ExReleaseFastMutex(&fcb->nonpaged->neg_cache_mutex);
+
+    InterlockedIncrement64(&fcb->Vcb->neg_cache_stats.added);
+}
+
+void neg_cache_free(_In_ fcb* fcb) {
+    if (!fcb->neg_cache)
+        return;
+
+    for (ULONG i = 0; i < NEG_CACHE_SIZE; i++) {
+        if (fcb->neg_cache[i].name.Buffer)
+            ExFreePool(fcb->neg_cache[i].name.Buffer);
+    }
+
+    ExFreePool(fcb->neg_cache);
+    fcb->neg_cache = NULL;
+}
+
+// called whenever a name is added to the directory
+_Requires_exclusive_lock_held_(fcb->nonpaged->dir_children_lock)
+void neg_cache_invalidate(_In_ fcb* fcb) {
+    if (!fcb->neg_cache)
+        return;
+
+    ExAcquireFastMutex(&fcb->nonpaged->neg_cache_mutex);
+    neg_cache_free(fcb);
+    ExReleaseFastMutex(&fcb->nonpaged->neg_cache_mutex);
+
+    InterlockedIncrement64(&fcb->Vcb->neg_cache_stats.invalidations);
+}
@@ -0,0 +1,327 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Intrusive red-black tree. As with Linux's rbtree, the caller does its own descent to find
+// where a new node goes, so there are no comparison callbacks - see space_index_insert in
+// free-space.c for an example.
+//
+// If tree->augment is set, it's called whenever a node's children change, so that nodes can
+// cache something about their subtree - see the range locks in btrfs.c.
+
+static void rb_replace_child(rb_tree* tree, rb_node* parent, rb_node* old, rb_node* new) {
+    if (!parent)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+// recompute the cached data of node and all its ancestors
+static void rb_propagate(rb_tree* tree, rb_node* node) {
+    if (!tree->augment)
+        return;
+
+    while (node) {
+        tree->augment(node);
+        node = node->parent;
+    }
+}
+
+static void rb_rotate_left(rb_tree* tree, rb_node* x) {
+    rb_node* y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    rb_replace_child(tree, x->parent, x, y);
+
+    y->left = x;
+    x->parent = y;
+
+    // y's subtree is the same as x's used to be, so only these two need updating
+    if (tree->augment) {
+        tree->augment(x);
+        tree->augment(y);
+    }
+}
+
+static void rb_rotate_right(rb_tree* tree, rb_node* x) {
+    rb_node* y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    rb_replace_child(tree, x->parent, x, y);
+
+    y->right = x;
+    x->parent = y;
+
+    if (tree->augment) {
+        tree->augment(x);
+        tree->augment(y);
+    }
+}
+
+// link is &parent->left or &parent->right, or &tree->root if parent is NULL
+void rb_insert(rb_tree* tree, rb_node* parent, rb_node** link, rb_node* node) {
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+
+    *link = node;
+
+    rb_propagate(tree, node);
+
+    while (node->parent && node->parent->red) {
+        rb_node* p = node->parent;
+        rb_node* g = p->parent; // p is red, so can't be the root
+
+        if (p == g->left) {
+            rb_node* u = g->right;
+
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+            } else {
+                if (node == p->right) {
+                    node = p;
+                    rb_rotate_left(tree, node);
+                    p = node->parent;
+                }
+
+                p->red = false;
+                g->red = true;
+                rb_rotate_right(tree, g);
+            }
+        } else {
+            rb_node* u = g->left;
+
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+            } else {
+                if (node == p->left) {
+                    node = p;
+                    rb_rotate_right(tree, node);
+                    p = node->parent;
+                }
+
+                p->red = false;
+                g->red = true;
+                rb_rotate_left(tree, g);
+            }
+        }
+    }
+
+    tree->root->red = false;
+}
+
+static void rb_remove_fixup(rb_tree* tree, rb_node* x, rb_node* parent) {
+    // x may be NULL, which is why we have to track its parent separately
+    while (x != tree->root && (!x || !x->red)) {
+        if (x == parent->left) {
+            rb_node* w = parent->right;
+
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_left(tree, parent);
+                w = parent->right;
+            }
+
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->right || !w->right->red) {
+                    w->left->red = false;
+                    w->red = true;
+                    rb_rotate_right(tree, w);
+                    w = parent->right;
+                }
+
+                w->red = parent->red;
+                parent->red = false;
+                if (w->right)
+                    w->right->red = false;
+
+                rb_rotate_left(tree, parent);
+                x = tree->root;
+            }
+        } else {
+            rb_node* w = parent->left;
+
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_right(tree, parent);
+                w = parent->left;
+            }
+
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->left || !w->left->red) {
+                    w->right->red = false;
+                    w->red = true;
+                    rb_rotate_left(tree, w);
+                    w = parent->left;
+                }
+
+                w->red = parent->red;
+                parent->red = false;
+                if (w->left)
+                    w->left->red = false;
+
+                rb_rotate_right(tree, parent);
+                x = tree->root;
+            }
+        }
+    }
+
+    if (x)
+        x->red = false;
+}
+
+void rb_remove(rb_tree* tree, rb_node* node) {
+    rb_node *x, *parent;
+    bool was_red;
+
+    if (!node->left || !node->right) {
+        x = node->left ? node->left : node->right;
+        parent = node->parent;
+        was_red = node->red;
+
+        if (x)
+            x->parent = parent;
+
+        rb_replace_child(tree, parent, node, x);
+    } else {
+        rb_node* y = node->right;
+
+        // swap in our successor, which has no left child
+        while (y->left) {
+            y = y->left;
+        }
+
+        was_red = y->red;
+        x = y->right;
+
+        if (y->parent == node)
+            parent = y;
+        else {
+            parent = y->parent;
+
+            parent->left = x;
+            if (x)
+                x->parent = parent;
+
+            y->right = node->right;
+            y->right->parent = y;
+        }
+
+        rb_replace_child(tree, node->parent, node, y);
+        y->parent = node->parent;
+
+        y->left = node->left;
+        y->left->parent = y;
+
+        y->red = node->red;
+    }
+
+    // everything whose subtree changed is on the path up from parent
+    rb_propagate(tree, parent);
+
+    if (!was_red)
+        rb_remove_fixup(tree, x, parent);
+}
+
+rb_node* rb_first(rb_tree* tree) {
+    rb_node* n = tree->root;
+
+    if (!n)
+        return NULL;
+
+    while (n->left) {
+        n = n->left;
+    }
+
+    return n;
+}
+
+rb_node* rb_last(rb_tree* tree) {
+    rb_node* n = tree->root;
+
+    if (!n)
+        return NULL;
+
+    while (n->right) {
+        n = n->right;
+    }
+
+    return n;
+}
+
+rb_node* rb_next(rb_node* node) {
+    if (node->right) {
+        node = node->right;
+
+        while (node->left) {
+            node = node->left;
+        }
+
+        return node;
+    }
+
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+rb_node* rb_prev(rb_node* node) {
+    if (node->left) {
+        node = node->left;
+
+        while (node->right) {
+            node = node->right;
+        }
+
+        return node;
+    }
+
+    while (node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
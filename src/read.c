@@ -3293,6 +3293,10 @@ nextitem:
         ExFreePool(ccj);
     }
 
+    // data written back by the cache manager which isn't on the disk yet
+    if (!IsListEmpty(&fcb->delalloc))
+        delalloc_read(fcb, data, start, bytes_read);
+
     if (pbr)
         *pbr = bytes_read;
 
@@ -19,7 +19,6 @@
 #include "zstd/zstd.h"
 
 extern UNICODE_STRING log_device, log_file, registry_path;
-extern LIST_ENTRY uid_map_list, gid_map_list;
 extern ERESOURCE mapping_lock;
 
 #ifdef _DEBUG
@@ -38,7 +37,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
                    maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus,
-                   norootdirus, nodatacowus;
+                   norootdirus, nodatacowus, zstdadaptiveus, zstdminlevelus, zstdmaxlevelus, discardus,
+                   flushfcbthresholdus, flushtreethresholdus, flushextentthresholdus, fcbcachesizeus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -51,11 +51,19 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->readonly = mount_readonly;
     options->zlib_level = mount_zlib_level;
     options->zstd_level = mount_zstd_level;
+    options->zstd_adaptive = mount_zstd_adaptive;
+    options->zstd_min_level = mount_zstd_min_level;
+    options->zstd_max_level = mount_zstd_max_level;
     options->flush_interval = mount_flush_interval;
+    options->flush_fcb_threshold = mount_flush_fcb_threshold;
+    options->flush_tree_threshold = mount_flush_tree_threshold;
+    options->flush_extent_threshold = mount_flush_extent_threshold;
+    options->fcb_cache_size = mount_fcb_cache_size;
     options->max_inline = min(mount_max_inline, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node) - sizeof(EXTENT_DATA) + 1);
     options->skip_balance = mount_skip_balance;
     options->no_barrier = mount_no_barrier;
-    options->no_trim = mount_no_trim;
+    options->discard = mount_no_trim ? DISCARD_MODE_OFF : mount_discard;
+    options->no_trim = options->discard == DISCARD_MODE_OFF;
     options->clear_cache = mount_clear_cache;
     options->allow_degraded = mount_allow_degraded;
     options->subvol_id = 0;
@@ -126,6 +134,14 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
     RtlInitUnicodeString(&norootdirus, L"NoRootDir");
     RtlInitUnicodeString(&nodatacowus, L"NoDataCOW");
+    RtlInitUnicodeString(&zstdadaptiveus, L"ZstdAdaptive");
+    RtlInitUnicodeString(&zstdminlevelus, L"ZstdMinLevel");
+    RtlInitUnicodeString(&zstdmaxlevelus, L"ZstdMaxLevel");
+    RtlInitUnicodeString(&discardus, L"Discard");
+    RtlInitUnicodeString(&flushfcbthresholdus, L"FlushFcbThreshold");
+    RtlInitUnicodeString(&flushtreethresholdus, L"FlushTreeThreshold");
+    RtlInitUnicodeString(&flushextentthresholdus, L"FlushExtentThreshold");
+    RtlInitUnicodeString(&fcbcachesizeus, L"FcbCacheSize");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -185,7 +201,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
             } else if (FsRtlAreNamesEqual(&notrimus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
-                options->no_trim = *val;
+                if (*val != 0)
+                    options->discard = DISCARD_MODE_OFF;
             } else if (FsRtlAreNamesEqual(&clearcacheus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
@@ -206,6 +223,38 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
                 options->nodatacow = *val;
+            } else if (FsRtlAreNamesEqual(&zstdadaptiveus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->zstd_adaptive = *val != 0 ? true : false;
+            } else if (FsRtlAreNamesEqual(&zstdminlevelus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->zstd_min_level = *val;
+            } else if (FsRtlAreNamesEqual(&zstdmaxlevelus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->zstd_max_level = *val;
+            } else if (FsRtlAreNamesEqual(&discardus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->discard = *val > DISCARD_MODE_ASYNC ? DISCARD_MODE_SYNC : *val;
+            } else if (FsRtlAreNamesEqual(&flushfcbthresholdus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->flush_fcb_threshold = *val;
+            } else if (FsRtlAreNamesEqual(&flushtreethresholdus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->flush_tree_threshold = *val;
+            } else if (FsRtlAreNamesEqual(&flushextentthresholdus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->flush_extent_threshold = *val;
+            } else if (FsRtlAreNamesEqual(&fcbcachesizeus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->fcb_cache_size = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08lx\n", Status);
@@ -222,9 +271,21 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     if (options->zstd_level > (uint32_t)ZSTD_maxCLevel())
         options->zstd_level = ZSTD_maxCLevel();
 
+    if (options->zstd_max_level > (uint32_t)ZSTD_maxCLevel())
+        options->zstd_max_level = ZSTD_maxCLevel();
+
+    if (options->zstd_min_level == 0)
+        options->zstd_min_level = 1;
+
+    if (options->zstd_min_level > options->zstd_max_level)
+        options->zstd_adaptive = false;
+
     if (options->flush_interval == 0)
         options->flush_interval = mount_flush_interval;
 
+    // NoTrim predates Discard, and is the same as setting it to 0
+    options->no_trim = options->discard == DISCARD_MODE_OFF;
+
     Status = STATUS_SUCCESS;
 
 end2:
@@ -551,12 +612,7 @@ static void read_mappings(PUNICODE_STRING regpath) {
 
     static const WCHAR mappings[] = L"\\Mappings";
 
-    while (!IsListEmpty(&uid_map_list)) {
-        uid_map* um = CONTAINING_RECORD(RemoveHeadList(&uid_map_list), uid_map, listentry);
-
-        if (um->sid) ExFreePool(um->sid);
-        ExFreePool(um);
-    }
+    clear_user_mappings();
 
     path = ExAllocatePoolWithTag(PagedPool, regpath->Length + sizeof(mappings) - sizeof(WCHAR), ALLOC_TAG);
     if (!path) {
@@ -629,12 +685,7 @@ static void read_group_mappings(PUNICODE_STRING regpath) {
 
     static const WCHAR mappings[] = L"\\GroupMappings";
 
-    while (!IsListEmpty(&gid_map_list)) {
-        gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
-
-        if (gm->sid) ExFreePool(gm->sid);
-        ExFreePool(gm);
-    }
+    clear_group_mappings();
 
     path = ExAllocatePoolWithTag(PagedPool, regpath->Length + sizeof(mappings) - sizeof(WCHAR), ALLOC_TAG);
     if (!path) {
@@ -811,14 +862,22 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
     get_registry_value(h, L"CompressType", REG_DWORD, &mount_compress_type, sizeof(mount_compress_type));
     get_registry_value(h, L"ZlibLevel", REG_DWORD, &mount_zlib_level, sizeof(mount_zlib_level));
     get_registry_value(h, L"FlushInterval", REG_DWORD, &mount_flush_interval, sizeof(mount_flush_interval));
+    get_registry_value(h, L"FlushFcbThreshold", REG_DWORD, &mount_flush_fcb_threshold, sizeof(mount_flush_fcb_threshold));
+    get_registry_value(h, L"FlushTreeThreshold", REG_DWORD, &mount_flush_tree_threshold, sizeof(mount_flush_tree_threshold));
+    get_registry_value(h, L"FlushExtentThreshold", REG_DWORD, &mount_flush_extent_threshold, sizeof(mount_flush_extent_threshold));
+    get_registry_value(h, L"FcbCacheSize", REG_DWORD, &mount_fcb_cache_size, sizeof(mount_fcb_cache_size));
     get_registry_value(h, L"MaxInline", REG_DWORD, &mount_max_inline, sizeof(mount_max_inline));
     get_registry_value(h, L"SkipBalance", REG_DWORD, &mount_skip_balance, sizeof(mount_skip_balance));
     get_registry_value(h, L"NoBarrier", REG_DWORD, &mount_no_barrier, sizeof(mount_no_barrier));
     get_registry_value(h, L"NoTrim", REG_DWORD, &mount_no_trim, sizeof(mount_no_trim));
+    get_registry_value(h, L"Discard", REG_DWORD, &mount_discard, sizeof(mount_discard));
     get_registry_value(h, L"ClearCache", REG_DWORD, &mount_clear_cache, sizeof(mount_clear_cache));
     get_registry_value(h, L"AllowDegraded", REG_DWORD, &mount_allow_degraded, sizeof(mount_allow_degraded));
     get_registry_value(h, L"Readonly", REG_DWORD, &mount_readonly, sizeof(mount_readonly));
     get_registry_value(h, L"ZstdLevel", REG_DWORD, &mount_zstd_level, sizeof(mount_zstd_level));
+    get_registry_value(h, L"ZstdAdaptive", REG_DWORD, &mount_zstd_adaptive, sizeof(mount_zstd_adaptive));
+    get_registry_value(h, L"ZstdMinLevel", REG_DWORD, &mount_zstd_min_level, sizeof(mount_zstd_min_level));
+    get_registry_value(h, L"ZstdMaxLevel", REG_DWORD, &mount_zstd_max_level, sizeof(mount_zstd_max_level));
     get_registry_value(h, L"NoRootDir", REG_DWORD, &mount_no_root_dir, sizeof(mount_no_root_dir));
     get_registry_value(h, L"NoDataCOW", REG_DWORD, &mount_nodatacow, sizeof(mount_nodatacow));
 
@@ -828,6 +887,9 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
     if (mount_flush_interval == 0)
         mount_flush_interval = 1;
 
+    if (mount_discard > DISCARD_MODE_ASYNC)
+        mount_discard = DISCARD_MODE_SYNC;
+
 #ifdef _DEBUG
     get_registry_value(h, L"DebugLogLevel", REG_DWORD, &debug_log_level, sizeof(debug_log_level));
 
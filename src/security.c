@@ -53,6 +53,138 @@ static dacl def_dacls[] = {
 extern LIST_ENTRY uid_map_list, gid_map_list;
 extern ERESOURCE mapping_lock;
 
+// The registry mappings are kept in lists in the order they were read, with hash tables on top so
+// that we're not walking thousands of entries on every create. Entries keep their order within a
+// bucket, so if there's more than one mapping for the same uid or SID, the first one still wins.
+// Everything here is protected by mapping_lock.
+
+static hash_table uid_map_hash, uid_map_sid_hash, gid_map_sid_hash;
+
+static uint32_t uid_map_get_hash(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, uid_map, list_entry_uid)->uid;
+}
+
+static uint32_t uid_map_get_sid_hash(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, uid_map, list_entry_sid)->sid_hash;
+}
+
+static uint32_t gid_map_get_sid_hash(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, gid_map, list_entry_sid)->sid_hash;
+}
+
+static __inline uint32_t calc_sid_hash(PSID sid) {
+    return calc_crc32c(0xffffffff, (uint8_t*)sid, RtlLengthSid(sid));
+}
+
+NTSTATUS init_mapping_tables() {
+    NTSTATUS Status;
+
+    hash_table_init(&uid_map_hash, uid_map_get_hash);
+    hash_table_init(&uid_map_sid_hash, uid_map_get_sid_hash);
+    hash_table_init(&gid_map_sid_hash, gid_map_get_sid_hash);
+
+    Status = hash_table_alloc(&uid_map_hash);
+    if (!NT_SUCCESS(Status))
+        goto end;
+
+    Status = hash_table_alloc(&uid_map_sid_hash);
+    if (!NT_SUCCESS(Status))
+        goto end;
+
+    Status = hash_table_alloc(&gid_map_sid_hash);
+
+end:
+    if (!NT_SUCCESS(Status))
+        free_mapping_tables();
+
+    return Status;
+}
+
+void free_mapping_tables() {
+    clear_user_mappings();
+    clear_group_mappings();
+
+    hash_table_free(&uid_map_hash);
+    hash_table_free(&uid_map_sid_hash);
+    hash_table_free(&gid_map_sid_hash);
+}
+
+void clear_user_mappings() {
+    while (!IsListEmpty(&uid_map_list)) {
+        uid_map* um = CONTAINING_RECORD(RemoveHeadList(&uid_map_list), uid_map, listentry);
+
+        hash_table_remove(&uid_map_hash, &um->list_entry_uid);
+        hash_table_remove(&uid_map_sid_hash, &um->list_entry_sid);
+
+        ExFreePool(um->sid);
+        ExFreePool(um);
+    }
+}
+
+void clear_group_mappings() {
+    while (!IsListEmpty(&gid_map_list)) {
+        gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
+
+        hash_table_remove(&gid_map_sid_hash, &gm->list_entry_sid);
+
+        ExFreePool(gm->sid);
+        ExFreePool(gm);
+    }
+}
+
+static uid_map* find_uid_map(uint32_t uid) {
+    LIST_ENTRY* bucket = hash_table_bucket(&uid_map_hash, uid);
+    LIST_ENTRY* le;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        uid_map* um = CONTAINING_RECORD(le, uid_map, list_entry_uid);
+
+        if (um->uid == uid)
+            return um;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static uid_map* find_uid_map_sid(PSID sid) {
+    uint32_t hash = calc_sid_hash(sid);
+    LIST_ENTRY* bucket = hash_table_bucket(&uid_map_sid_hash, hash);
+    LIST_ENTRY* le;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        uid_map* um = CONTAINING_RECORD(le, uid_map, list_entry_sid);
+
+        if (um->sid_hash == hash && RtlEqualSid(sid, um->sid))
+            return um;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static gid_map* find_gid_map_sid(PSID sid) {
+    uint32_t hash = calc_sid_hash(sid);
+    LIST_ENTRY* bucket = hash_table_bucket(&gid_map_sid_hash, hash);
+    LIST_ENTRY* le;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        gid_map* gm = CONTAINING_RECORD(le, gid_map, list_entry_sid);
+
+        if (gm->sid_hash == hash && RtlEqualSid(sid, gm->sid))
+            return gm;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t uid) {
     unsigned int i, np;
     uint8_t numdashes;
@@ -137,9 +269,12 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t uid) {
     }
 
     um->sid = sid;
+    um->sid_hash = calc_sid_hash(sid);
     um->uid = uid;
 
     InsertTailList(&uid_map_list, &um->listentry);
+    hash_table_insert(&uid_map_hash, &um->list_entry_uid);
+    hash_table_insert(&uid_map_sid_hash, &um->list_entry_sid);
 }
 
 void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t gid) {
@@ -221,36 +356,33 @@ void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t gid) {
     }
 
     gm->sid = sid;
+    gm->sid_hash = calc_sid_hash(sid);
     gm->gid = gid;
 
     InsertTailList(&gid_map_list, &gm->listentry);
+    hash_table_insert(&gid_map_sid_hash, &gm->list_entry_sid);
 }
 
 NTSTATUS uid_to_sid(uint32_t uid, PSID* sid) {
-    LIST_ENTRY* le;
+    uid_map* um;
     sid_header* sh;
     UCHAR els;
 
     ExAcquireResourceSharedLite(&mapping_lock, true);
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    um = find_uid_map(uid);
 
-        if (um->uid == uid) {
-            *sid = ExAllocatePoolWithTag(PagedPool, RtlLengthSid(um->sid), ALLOC_TAG);
-            if (!*sid) {
-                ERR("out of memory\n");
-                ExReleaseResourceLite(&mapping_lock);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
-
-            RtlCopyMemory(*sid, um->sid, RtlLengthSid(um->sid));
+    if (um) {
+        *sid = ExAllocatePoolWithTag(PagedPool, RtlLengthSid(um->sid), ALLOC_TAG);
+        if (!*sid) {
+            ERR("out of memory\n");
             ExReleaseResourceLite(&mapping_lock);
-            return STATUS_SUCCESS;
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        le = le->Flink;
+        RtlCopyMemory(*sid, um->sid, RtlLengthSid(um->sid));
+        ExReleaseResourceLite(&mapping_lock);
+        return STATUS_SUCCESS;
     }
 
     ExReleaseResourceLite(&mapping_lock);
@@ -308,21 +440,18 @@ NTSTATUS uid_to_sid(uint32_t uid, PSID* sid) {
 }
 
 uint32_t sid_to_uid(PSID sid) {
-    LIST_ENTRY* le;
+    uid_map* um;
     sid_header* sh = sid;
 
     ExAcquireResourceSharedLite(&mapping_lock, true);
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    um = find_uid_map_sid(sid);
 
-        if (RtlEqualSid(sid, um->sid)) {
-            ExReleaseResourceLite(&mapping_lock);
-            return um->uid;
-        }
+    if (um) {
+        uint32_t uid = um->uid;
 
-        le = le->Flink;
+        ExReleaseResourceLite(&mapping_lock);
+        return uid;
     }
 
     ExReleaseResourceLite(&mapping_lock);
@@ -412,6 +541,167 @@ static ACL* load_default_acl() {
     return acl;
 }
 
+// Most files on a volume have one of a handful of security descriptors, so rather than each fcb
+// having its own copy, identical descriptors are shared. fcb->sd still points to an ordinary
+// self-relative descriptor, so nothing that only reads it needs to care - but anything which sets
+// it should pass it through share_sd, and anything which gets rid of it has to use release_sd.
+//
+// Shared descriptors are looked up by the CRC32C of their contents, and must never be modified in
+// place. If we run out of memory, the fcb just keeps its own private copy; release_sd tells the
+// two apart by looking for the pointer in the cache.
+
+typedef struct {
+    LIST_ENTRY list_entry;
+    uint32_t hash;
+    ULONG length;
+    LONG refcount;
+    uint8_t data[1];
+} shared_sd;
+
+static uint32_t shared_sd_get_hash(LIST_ENTRY* le) {
+    return CONTAINING_RECORD(le, shared_sd, list_entry)->hash;
+}
+
+NTSTATUS init_sd_cache(_In_ device_extension* Vcb) {
+    ExInitializeFastMutex(&Vcb->sd_cache_mutex);
+    hash_table_init(&Vcb->sd_cache, shared_sd_get_hash);
+
+    return hash_table_alloc(&Vcb->sd_cache);
+}
+
+void free_sd_cache(_In_ device_extension* Vcb) {
+    if (!Vcb->sd_cache.buckets)
+        return;
+
+    // everything should have been released by reap_fcb by now
+    for (ULONG i = 0; i < Vcb->sd_cache.num_buckets; i++) {
+        while (!IsListEmpty(&Vcb->sd_cache.buckets[i])) {
+            shared_sd* ssd = CONTAINING_RECORD(RemoveHeadList(&Vcb->sd_cache.buckets[i]), shared_sd, list_entry);
+
+            WARN("shared SD %p still had refcount of %li\n", ssd->data, ssd->refcount);
+            ExFreePool(ssd);
+        }
+    }
+
+    hash_table_free(&Vcb->sd_cache);
+}
+
+_Requires_lock_held_(Vcb->sd_cache_mutex)
+static shared_sd* find_shared_sd(device_extension* Vcb, SECURITY_DESCRIPTOR* sd, ULONG len, uint32_t hash) {
+    LIST_ENTRY* bucket = hash_table_bucket(&Vcb->sd_cache, hash);
+    LIST_ENTRY* le;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        shared_sd* ssd = CONTAINING_RECORD(le, shared_sd, list_entry);
+
+        if (ssd->hash == hash && ssd->length == len && ((SECURITY_DESCRIPTOR*)ssd->data == sd || RtlCompareMemory(ssd->data, sd, len) == len))
+            return ssd;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+// Swaps the private descriptor in *sd, which was allocated from pool, for a shared one.
+void share_sd(_In_ device_extension* Vcb, _Inout_ SECURITY_DESCRIPTOR** sd) {
+    ULONG len = RtlLengthSecurityDescriptor(*sd);
+    uint32_t hash = calc_crc32c(0xffffffff, (uint8_t*)*sd, len);
+    shared_sd* ssd;
+
+    ExAcquireFastMutex(&Vcb->sd_cache_mutex);
+
+    ssd = find_shared_sd(Vcb, *sd, len, hash);
+
+    if (ssd) {
+        if ((SECURITY_DESCRIPTOR*)ssd->data == *sd) { // already shared
+            ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+            return;
+        }
+
+        ssd->refcount++;
+    } else {
+        ssd = ExAllocatePoolWithTag(PagedPool, offsetof(shared_sd, data[0]) + len, ALLOC_TAG);
+        if (!ssd) {
+            WARN("out of memory\n");
+            ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+            return;
+        }
+
+        ssd->hash = hash;
+        ssd->length = len;
+        ssd->refcount = 1;
+        RtlCopyMemory(ssd->data, *sd, len);
+
+        hash_table_insert(&Vcb->sd_cache, &ssd->list_entry);
+    }
+
+    ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+
+    ExFreePool(*sd);
+    *sd = (SECURITY_DESCRIPTOR*)ssd->data;
+}
+
+// Returns a new reference to sd, or a private copy if it isn't shared.
+SECURITY_DESCRIPTOR* dup_sd(_In_ device_extension* Vcb, _In_ SECURITY_DESCRIPTOR* sd) {
+    ULONG len = RtlLengthSecurityDescriptor(sd);
+    uint32_t hash = calc_crc32c(0xffffffff, (uint8_t*)sd, len);
+    shared_sd* ssd;
+    SECURITY_DESCRIPTOR* newsd;
+
+    ExAcquireFastMutex(&Vcb->sd_cache_mutex);
+
+    ssd = find_shared_sd(Vcb, sd, len, hash);
+    if (ssd && (SECURITY_DESCRIPTOR*)ssd->data == sd) {
+        ssd->refcount++;
+        ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+        return sd;
+    }
+
+    ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+
+    newsd = ExAllocatePoolWithTag(PagedPool, len, ALLOC_TAG);
+    if (!newsd) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    RtlCopyMemory(newsd, sd, len);
+
+    share_sd(Vcb, &newsd);
+
+    return newsd;
+}
+
+void release_sd(_In_ device_extension* Vcb, _In_ SECURITY_DESCRIPTOR* sd) {
+    ULONG len = RtlLengthSecurityDescriptor(sd);
+    uint32_t hash = calc_crc32c(0xffffffff, (uint8_t*)sd, len);
+    shared_sd* ssd;
+
+    ExAcquireFastMutex(&Vcb->sd_cache_mutex);
+
+    ssd = find_shared_sd(Vcb, sd, len, hash);
+
+    if (!ssd || (SECURITY_DESCRIPTOR*)ssd->data != sd) { // private copy
+        ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+        ExFreePool(sd);
+        return;
+    }
+
+    ssd->refcount--;
+
+    if (ssd->refcount == 0)
+        hash_table_remove(&Vcb->sd_cache, &ssd->list_entry);
+    else
+        ssd = NULL;
+
+    ExReleaseFastMutex(&Vcb->sd_cache_mutex);
+
+    if (ssd)
+        ExFreePool(ssd);
+}
+
 static void get_top_level_sd(fcb* fcb) {
     NTSTATUS Status;
     SECURITY_DESCRIPTOR sd;
@@ -508,7 +798,7 @@ end:
         ExFreePool(groupsid);
 }
 
-void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp) {
+static void fcb_get_sd2(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp) {
     NTSTATUS Status;
     PSID usersid = NULL, groupsid = NULL;
     SECURITY_SUBJECT_CONTEXT subjcont;
@@ -633,6 +923,13 @@ void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp) {
     ExFreePool(buf);
 }
 
+void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp) {
+    fcb_get_sd2(fcb, parent, look_for_xattr, Irp);
+
+    if (fcb->sd)
+        share_sd(fcb->Vcb, &fcb->sd);
+}
+
 static NTSTATUS get_file_security(PFILE_OBJECT FileObject, SECURITY_DESCRIPTOR* relsd, ULONG* buflen, SECURITY_INFORMATION flags) {
     NTSTATUS Status;
     fcb* fcb = FileObject->FsContext;
@@ -795,7 +1092,8 @@ static NTSTATUS set_file_security(device_extension* Vcb, PFILE_OBJECT FileObject
         goto end;
     }
 
-    ExFreePool(oldsd);
+    release_sd(Vcb, oldsd);
+    share_sd(Vcb, &fcb->sd);
 
     KeQuerySystemTime(&time);
     win_time_to_unix(time, &now);
@@ -904,21 +1202,13 @@ end:
 }
 
 static bool search_for_gid(fcb* fcb, PSID sid) {
-    LIST_ENTRY* le;
+    gid_map* gm = find_gid_map_sid(sid);
 
-    le = gid_map_list.Flink;
-    while (le != &gid_map_list) {
-        gid_map* gm = CONTAINING_RECORD(le, gid_map, listentry);
-
-        if (RtlEqualSid(sid, gm->sid)) {
-            fcb->inode_item.st_gid = gm->gid;
-            return true;
-        }
+    if (!gm)
+        return false;
 
-        le = le->Flink;
-    }
-
-    return false;
+    fcb->inode_item.st_gid = gm->gid;
+    return true;
 }
 
 void find_gid(struct _fcb* fcb, struct _fcb* parfcb, PSECURITY_SUBJECT_CONTEXT subjcont) {
@@ -998,6 +1288,8 @@ NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as) {
         return Status;
     }
 
+    share_sd(fcb->Vcb, &fcb->sd);
+
     Status = RtlGetOwnerSecurityDescriptor(fcb->sd, &owner, &defaulted);
     if (!NT_SUCCESS(Status)) {
         ERR("RtlGetOwnerSecurityDescriptor returned %08lx\n", Status);
@@ -597,6 +597,72 @@ extern "C" void CALLBACK CreateSnapshotW(HWND, HINSTANCE, LPWSTR lpszCmdLine, in
         create_snapshot2(args[0], args[1]);
 }
 
+static void defrag(const wstring& fn, const btrfs_defrag& bd) {
+    BY_HANDLE_FILE_INFORMATION bhfi;
+    IO_STATUS_BLOCK iosb;
+
+    {
+        win_handle h = CreateFileW(fn.c_str(), FILE_READ_DATA | FILE_WRITE_DATA | FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+
+        if (h == INVALID_HANDLE_VALUE)
+            return;
+
+        if (!GetFileInformationByHandle(h, &bhfi))
+            return;
+
+        if (!(bhfi.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_DEFRAGMENT, (void*)&bd, sizeof(btrfs_defrag), nullptr, 0);
+            return;
+        }
+    }
+
+    // don't follow junctions or directory symlinks
+    if (bhfi.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+        return;
+
+    WIN32_FIND_DATAW ffd;
+
+    fff_handle h = FindFirstFileW((fn + L"\\*"s).c_str(), &ffd);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        if (ffd.cFileName[0] != '.' || ((ffd.cFileName[1] != 0) && (ffd.cFileName[1] != '.' || ffd.cFileName[2] != 0)))
+            defrag(fn + L"\\"s + ffd.cFileName, bd);
+    } while (FindNextFileW(h, &ffd));
+}
+
+extern "C" void CALLBACK DefragW(HWND, HINSTANCE, LPWSTR lpszCmdLine, int) {
+    vector<wstring> args;
+    btrfs_defrag bd;
+
+    command_line_to_args(lpszCmdLine, args);
+
+    memset(&bd, 0, sizeof(btrfs_defrag));
+
+    for (unsigned int i = 0; i < args.size(); i++) {
+        if (args[i][0] == '-' && args[i].length() == 2) {
+            if (args[i][1] == 'c' && i < args.size() - 1) {
+                i++;
+
+                if (args[i] == L"zlib")
+                    bd.compression_type = BTRFS_COMPRESSION_ZLIB;
+                else if (args[i] == L"lzo")
+                    bd.compression_type = BTRFS_COMPRESSION_LZO;
+                else if (args[i] == L"zstd")
+                    bd.compression_type = BTRFS_COMPRESSION_ZSTD;
+                else
+                    return;
+
+                bd.flags |= BTRFS_DEFRAG_COMPRESS;
+            } else if (args[i][1] == 's')
+                bd.flags |= BTRFS_DEFRAG_SKIP_SHARED;
+        } else
+            defrag(args[i], bd);
+    }
+}
+
 void command_line_to_args(LPWSTR cmdline, vector<wstring>& args) {
     LPWSTR* l;
     int num_args;
@@ -0,0 +1,420 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Fragmentation stress test and benchmark for the free-space code in free-space.c.
+//
+// The free space of a 1 GB chunk is cut into tens of thousands of holes, and then repeatedly
+// allocated from, best-fit, and freed again at random, as writeback on an old filesystem would.
+// This is done both with a space_index, as for chunks, and without one, as for device space
+// lists, which take the same linear path that chunks did before they were indexed. After each
+// run the list and the index are checked against a bitmap of which blocks ought to be free, and
+// a batch of operations is rolled back to check that the list returns to how it was.
+
+#include "btrfs_drv.h"
+#include <time.h>
+
+#define CHUNK_SIZE 0x40000000ull
+#define BLOCK_SIZE 0x1000ull
+#define NUM_BLOCKS (CHUNK_SIZE / BLOCK_SIZE)
+
+typedef struct {
+    uint64_t address;
+    uint64_t length;
+} used_extent;
+
+typedef struct {
+    LIST_ENTRY list;
+    space_index index;
+    space_index* idx;
+    uint8_t* free_map;
+    used_extent* extents;
+    unsigned int num_extents;
+} alloc_state;
+
+static uint32_t rand_state;
+
+static uint32_t next_rand(void) {
+    // xorshift32
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+
+    return rand_state;
+}
+
+// free-space.c records its rollback entries through this, which lives in treefuncs.c
+void add_rollback(LIST_ENTRY* rollback, enum rollback_type type, void* ptr) {
+    rollback_item* ri;
+
+    ri = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_item), ALLOC_TAG);
+    if (!ri) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    ri->type = type;
+    ri->ptr = ptr;
+    InsertTailList(rollback, &ri->list_entry);
+}
+
+// the space-list part of do_rollback
+static void undo_rollback(LIST_ENTRY* rollback) {
+    while (!IsListEmpty(rollback)) {
+        LIST_ENTRY* le = RemoveTailList(rollback);
+        rollback_item* ri = CONTAINING_RECORD(le, rollback_item, list_entry);
+        rollback_space* rs = ri->ptr;
+
+        if (ri->type == ROLLBACK_ADD_SPACE)
+            space_list_subtract2(rs->list, rs->index, rs->address, rs->length, NULL, NULL);
+        else
+            space_list_add2(rs->list, rs->index, rs->address, rs->length, NULL, NULL);
+
+        ExFreePool(rs);
+        ExFreePool(ri);
+    }
+}
+
+static void mark(alloc_state* st, uint64_t address, uint64_t length, uint8_t free) {
+    memset(&st->free_map[address / BLOCK_SIZE], free, (size_t)(length / BLOCK_SIZE));
+}
+
+// Cuts the chunk into alternating used and free runs of one to eight blocks each.
+static void init_state(alloc_state* st, bool indexed, uint32_t seed) {
+    uint64_t address = 0;
+
+    InitializeListHead(&st->list);
+    space_index_init(&st->index);
+    st->idx = indexed ? &st->index : NULL;
+    st->free_map = calloc(NUM_BLOCKS, 1);
+    st->extents = malloc(sizeof(used_extent) * (NUM_BLOCKS / 2));
+    st->num_extents = 0;
+
+    rand_state = seed;
+
+    while (address < CHUNK_SIZE) {
+        uint64_t used = min(BLOCK_SIZE * (1 + (next_rand() % 8)), CHUNK_SIZE - address);
+        uint64_t hole;
+
+        st->extents[st->num_extents].address = address;
+        st->extents[st->num_extents].length = used;
+        st->num_extents++;
+        address += used;
+
+        if (address == CHUNK_SIZE)
+            break;
+
+        hole = min(BLOCK_SIZE * (1 + (next_rand() % 8)), CHUNK_SIZE - address);
+
+        add_space_entry(&st->list, st->idx, address, hole);
+        mark(st, address, hole, 1);
+        address += hole;
+    }
+}
+
+static void free_state(alloc_state* st) {
+    while (!IsListEmpty(&st->list)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(&st->list), space, list_entry);
+
+        ExFreePool(s);
+    }
+
+    free(st->extents);
+    free(st->free_map);
+}
+
+static unsigned int count_holes(alloc_state* st) {
+    unsigned int n = 0;
+
+    for (LIST_ENTRY* le = st->list.Flink; le != &st->list; le = le->Flink) {
+        n++;
+    }
+
+    return n;
+}
+
+// Without an index, the best fit can only be found by looking at every entry.
+static space* best_fit(alloc_state* st, uint64_t length) {
+    space* ret = NULL;
+
+    if (st->idx)
+        return space_index_best_fit(st->idx, length);
+
+    for (LIST_ENTRY* le = st->list.Flink; le != &st->list; le = le->Flink) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+
+        if (s->size >= length && (!ret || s->size < ret->size)) {
+            ret = s;
+
+            if (s->size == length)
+                break;
+        }
+    }
+
+    return ret;
+}
+
+static bool do_alloc(alloc_state* st, LIST_ENTRY* rollback) {
+    uint64_t length = BLOCK_SIZE * (1 + (next_rand() % 16));
+    space* s = best_fit(st, length);
+    uint64_t address;
+
+    if (!s)
+        return false;
+
+    address = s->address;
+
+    space_list_subtract2(&st->list, st->idx, address, length, NULL, rollback);
+    mark(st, address, length, 0);
+
+    st->extents[st->num_extents].address = address;
+    st->extents[st->num_extents].length = length;
+    st->num_extents++;
+
+    return true;
+}
+
+static void do_free(alloc_state* st, LIST_ENTRY* rollback) {
+    unsigned int i = next_rand() % st->num_extents;
+    used_extent e = st->extents[i];
+
+    st->extents[i] = st->extents[st->num_extents - 1];
+    st->num_extents--;
+
+    space_list_add2(&st->list, st->idx, e.address, e.length, NULL, rollback);
+    mark(st, e.address, e.length, 1);
+}
+
+static unsigned int check_rb(rb_node* n, rb_node* parent, bool* ok) {
+    unsigned int l, r;
+
+    if (!n)
+        return 1;
+
+    if (n->parent != parent || (n->red && ((n->left && n->left->red) || (n->right && n->right->red))))
+        *ok = false;
+
+    l = check_rb(n->left, n, ok);
+    r = check_rb(n->right, n, ok);
+
+    if (l != r)
+        *ok = false;
+
+    return l + (n->red ? 0 : 1);
+}
+
+// Checks that the list is sorted and merged, that it covers exactly the free blocks, and that
+// the index agrees with it.
+static bool check_state(alloc_state* st, const char* name) {
+    uint64_t last_end = 0, last_size = 0;
+    unsigned int n = 0, n2 = 0;
+    rb_node* an = st->idx ? rb_first(&st->idx->by_address) : NULL;
+    uint8_t* covered = calloc(NUM_BLOCKS, 1);
+    bool ok = true;
+
+    for (LIST_ENTRY* le = st->list.Flink; le != &st->list; le = le->Flink) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+
+        if (s->size == 0 || (n > 0 && s->address <= last_end) || s->address + s->size > CHUNK_SIZE) {
+            printf("%s: bad entry %llx, %llx after %llx\n", name, (unsigned long long)s->address, (unsigned long long)s->size, (unsigned long long)last_end);
+            ok = false;
+            break;
+        }
+
+        memset(&covered[s->address / BLOCK_SIZE], 1, (size_t)(s->size / BLOCK_SIZE));
+        last_end = s->address + s->size;
+
+        if (st->idx) {
+            if (an != &s->node_address) {
+                printf("%s: address tree doesn't match list\n", name);
+                ok = false;
+                break;
+            }
+
+            an = rb_next(an);
+        }
+
+        n++;
+    }
+
+    if (ok && memcmp(covered, st->free_map, NUM_BLOCKS)) {
+        printf("%s: free space doesn't match model\n", name);
+        ok = false;
+    }
+
+    free(covered);
+
+    if (!ok || !st->idx)
+        return ok;
+
+    if (an) {
+        printf("%s: address tree has extra entries\n", name);
+        return false;
+    }
+
+    for (rb_node* sn = rb_first(&st->idx->by_size); sn; sn = rb_next(sn)) {
+        space* s = CONTAINING_RECORD(sn, space, node_size);
+
+        if (s->size < last_size) {
+            printf("%s: size tree out of order\n", name);
+            return false;
+        }
+
+        last_size = s->size;
+        n2++;
+    }
+
+    if (n2 != n) {
+        printf("%s: size tree has %u entries, list has %u\n", name, n2, n);
+        return false;
+    }
+
+    check_rb(st->idx->by_address.root, NULL, &ok);
+    check_rb(st->idx->by_size.root, NULL, &ok);
+
+    if (!ok)
+        printf("%s: red-black invariants broken\n", name);
+
+    return ok;
+}
+
+// Runs a batch of operations with a rollback list, undoes them, and checks that the list is
+// back to how it started.
+static bool test_rollback(alloc_state* st, const char* name) {
+    LIST_ENTRY rollback;
+    uint8_t* saved_map = malloc(NUM_BLOCKS);
+    used_extent* saved_extents = malloc(sizeof(used_extent) * (NUM_BLOCKS / 2));
+    unsigned int saved_num_extents = st->num_extents;
+    bool ret;
+
+    memcpy(saved_map, st->free_map, NUM_BLOCKS);
+    memcpy(saved_extents, st->extents, sizeof(used_extent) * st->num_extents);
+
+    InitializeListHead(&rollback);
+
+    for (unsigned int i = 0; i < 1000; i++) {
+        if (next_rand() % 2 == 0)
+            do_alloc(st, &rollback);
+        else
+            do_free(st, &rollback);
+    }
+
+    undo_rollback(&rollback);
+
+    memcpy(st->free_map, saved_map, NUM_BLOCKS);
+    memcpy(st->extents, saved_extents, sizeof(used_extent) * saved_num_extents);
+    st->num_extents = saved_num_extents;
+
+    ret = check_state(st, name);
+
+    free(saved_extents);
+    free(saved_map);
+
+    return ret;
+}
+
+static double elapsed(struct timespec* start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(end.tv_sec - start->tv_sec) + ((double)(end.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+// Allocates and frees in batches of 1000. Best-fit allocation and merging frees gradually
+// defragment the chunk, so the default run is short enough that tens of thousands of holes remain.
+static bool run(bool indexed, unsigned int ops, bool report) {
+    const char* name = indexed ? "indexed" : "list";
+    alloc_state st;
+    unsigned int holes, allocs = 0, frees = 0;
+    double alloc_time = 0, free_time = 0;
+    bool ret;
+
+    init_state(&st, indexed, 1);
+
+    holes = count_holes(&st);
+
+    ret = check_state(&st, name);
+
+    for (unsigned int done = 0; ret && done < ops; done += 1000) {
+        struct timespec start;
+        unsigned int batch = min(1000, ops - done);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned int i = 0; i < batch; i++) {
+            if (do_alloc(&st, NULL))
+                allocs++;
+        }
+
+        alloc_time += elapsed(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned int i = 0; i < batch; i++) {
+            do_free(&st, NULL);
+            frees++;
+        }
+
+        free_time += elapsed(&start);
+    }
+
+    if (ret)
+        ret = check_state(&st, name);
+
+    if (ret)
+        ret = test_rollback(&st, name);
+
+    if (ret && report) {
+        printf("%-8s %8u %8u %14.2f %14.2f\n", name, holes, count_holes(&st),
+               alloc_time * 1000000.0 / allocs, free_time * 1000000.0 / frees);
+    }
+
+    free_state(&st);
+
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned int failures = 0, ops = 5000;
+
+    if (argc > 1)
+        ops = (unsigned int)strtoul(argv[1], NULL, 10);
+
+    // a short run of each to check them, then the benchmark proper
+
+    if (!run(true, 2000, false))
+        failures++;
+
+    if (!run(false, 2000, false))
+        failures++;
+
+    if (failures > 0) {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+
+    printf("stress: OK\n");
+
+    if (ops > 0) {
+        printf("%-8s %8s %8s %14s %14s\n", "", "holes", "after", "alloc us/op", "free us/op");
+
+        if (!run(true, ops, true) || !run(false, ops, true))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Round-trip and throughput test for the LZO code in compress.c.
+//
+// Every kind of test data is compressed with lzo_compress and decompressed again with
+// lzo_decompress, at each extent size from one page up to COMPRESSED_EXTENT_SIZE, both in full
+// and as a short read. The decompressor is also given a fixed stream in the format Linux writes
+// and truncated or corrupted copies of real ones, which it has to reject or decode without going
+// out of bounds - build with SANITIZE=1 to have ASan check that. Finally the throughput of both
+// directions is reported for each kind of data.
+
+#include "btrfs_drv.h"
+#include <time.h>
+
+#define LZO_PAGE_SIZE 4096
+
+enum data_kind {
+    data_random,
+    data_text,
+    data_runs,
+    data_pattern,
+    data_sparse,
+    data_zero,
+    NUM_DATA_KINDS
+};
+
+static const char* kind_names[] = { "random", "text", "runs", "pattern", "sparse", "zero" };
+
+static uint32_t rand_state;
+
+static uint32_t next_rand(void) {
+    // xorshift32
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+
+    return rand_state;
+}
+
+static void fill_data(uint8_t* buf, uint32_t len, enum data_kind kind, uint32_t seed) {
+    static const char* words[] = { "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "the ", "lazy ", "dog.\n",
+                                   "btrfs ", "subvolume ", "extent ", "compression " };
+    uint32_t i = 0;
+
+    rand_state = seed | 1;
+
+    while (i < len) {
+        switch (kind) {
+            case data_random:
+                buf[i++] = (uint8_t)next_rand();
+                break;
+
+            case data_text: {
+                const char* w = words[next_rand() % (sizeof(words) / sizeof(words[0]))];
+
+                while (*w && i < len) {
+                    buf[i++] = *w++;
+                }
+
+                break;
+            }
+
+            case data_runs: {
+                uint8_t c = (uint8_t)next_rand();
+                uint32_t run = 1 + (next_rand() % 300);
+
+                while (run > 0 && i < len) {
+                    buf[i++] = c;
+                    run--;
+                }
+
+                break;
+            }
+
+            case data_pattern:
+                buf[i] = (uint8_t)(i % 7);
+                i++;
+                break;
+
+            case data_sparse:
+                buf[i++] = next_rand() % 50 == 0 ? (uint8_t)next_rand() : 0;
+                break;
+
+            default:
+                buf[i++] = 0;
+                break;
+        }
+    }
+}
+
+// A hand-assembled page in the btrfs LZO format: the total length, the length of the segment,
+// then the LZO1X stream - a literal run of "btrfs", a match at distance 5 repeated to fill the
+// rest of the page, and the end-of-stream marker. The match length takes 15 extension bytes,
+// which the compressor only produces for long runs.
+static bool test_fixed_stream(void) {
+    static const uint8_t lzo_data[] = {
+        0x24, 0x00, 0x00, 0x00,                             // total length
+        0x1c, 0x00, 0x00, 0x00,                             // segment length
+        0x16, 'b', 't', 'r', 'f', 's',                      // 5-byte literal run
+        0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,     // M3 match, 31 + (15 * 255) + 233 + 2 = 4091 bytes...
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0xe9,
+        0x10, 0x00,                                         // ...at distance 5
+        0x11, 0x00, 0x00                                    // end of stream
+    };
+    uint8_t* buf = malloc(LZO_PAGE_SIZE);
+    NTSTATUS Status;
+    bool ret = true;
+
+    Status = lzo_decompress((uint8_t*)lzo_data + sizeof(uint32_t), sizeof(lzo_data) - sizeof(uint32_t), buf, LZO_PAGE_SIZE, sizeof(uint32_t));
+
+    if (!NT_SUCCESS(Status)) {
+        printf("fixed stream: lzo_decompress returned %08x\n", Status);
+        ret = false;
+    } else {
+        for (unsigned int i = 0; i < LZO_PAGE_SIZE; i++) {
+            if (buf[i] != "btrfs"[i % 5]) {
+                printf("fixed stream: mismatch at offset %x\n", i);
+                ret = false;
+                break;
+            }
+        }
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+// Compresses buf, returning the length of the compressed data, or 0 if it didn't shrink.
+static uint32_t compress(uint8_t* in, uint32_t len, uint8_t* comp) {
+    unsigned int space_left;
+    NTSTATUS Status;
+
+    Status = lzo_compress(in, len, comp, len, &space_left);
+    if (!NT_SUCCESS(Status)) {
+        printf("lzo_compress returned %08x\n", Status);
+        return 0;
+    }
+
+    return space_left == 0 ? 0 : len - space_left;
+}
+
+static bool decompress(uint8_t* comp, uint32_t comp_len, uint8_t* out, uint32_t out_len) {
+    NTSTATUS Status;
+
+    // skip the four-byte total length, as read_file does
+    Status = lzo_decompress(comp + sizeof(uint32_t), comp_len - sizeof(uint32_t), out, out_len, sizeof(uint32_t));
+
+    return NT_SUCCESS(Status);
+}
+
+static unsigned int test_round_trip(void) {
+    unsigned int failures = 0;
+    uint8_t* in = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* comp = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* out = malloc(COMPRESSED_EXTENT_SIZE);
+
+    for (unsigned int kind = 0; kind < NUM_DATA_KINDS; kind++) {
+        for (uint32_t seed = 1; seed <= 20; seed++) {
+            for (uint32_t len = LZO_PAGE_SIZE; len <= COMPRESSED_EXTENT_SIZE; len *= 2) {
+                uint32_t comp_len;
+
+                fill_data(in, len, kind, seed);
+
+                comp_len = compress(in, len, comp);
+
+                if (comp_len == 0) {
+                    if (kind != data_random) {
+                        printf("%s, seed %u, length %x: didn't compress\n", kind_names[kind], seed, len);
+                        failures++;
+                    }
+
+                    continue;
+                }
+
+                memset(out, 0xcc, len);
+
+                if (!decompress(comp, comp_len, out, len) || memcmp(in, out, len)) {
+                    printf("%s, seed %u, length %x: round trip failed\n", kind_names[kind], seed, len);
+                    failures++;
+                    continue;
+                }
+
+                // a read which stops short of the end of the extent
+
+                memset(out, 0xcc, len);
+
+                if (!decompress(comp, comp_len, out, len - 1000) || memcmp(in, out, len - 1000)) {
+                    printf("%s, seed %u, length %x: short read failed\n", kind_names[kind], seed, len);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    free(out);
+    free(comp);
+    free(in);
+
+    return failures;
+}
+
+// Truncated and corrupted streams mustn't crash the decompressor - whether it gets an error or
+// rubbish out doesn't matter.
+static void test_corrupt(void) {
+    uint8_t* in = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* comp = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* bad = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* out = malloc(COMPRESSED_EXTENT_SIZE);
+
+    for (unsigned int kind = data_text; kind < NUM_DATA_KINDS; kind++) {
+        uint32_t comp_len;
+
+        fill_data(in, COMPRESSED_EXTENT_SIZE, kind, 1);
+
+        comp_len = compress(in, COMPRESSED_EXTENT_SIZE, comp);
+        if (comp_len == 0)
+            continue;
+
+        for (unsigned int i = 0; i < 2000; i++) {
+            uint32_t bad_len = comp_len;
+
+            memcpy(bad, comp, comp_len);
+
+            if (i % 2 == 0)
+                bad_len = sizeof(uint32_t) + 1 + (next_rand() % (comp_len - sizeof(uint32_t)));
+            else {
+                for (unsigned int j = 0; j < 4; j++) {
+                    // leave the segment lengths alone, as they're checked by lzo_decompress itself
+                    bad[(2 * sizeof(uint32_t)) + (next_rand() % (comp_len - (2 * sizeof(uint32_t))))] ^= (uint8_t)(1 + (next_rand() % 255));
+                }
+            }
+
+            // copy the stream to the end of the buffer, so that ASan catches reads past it
+            memmove(bad + COMPRESSED_EXTENT_SIZE - bad_len, bad, bad_len);
+
+            decompress(bad + COMPRESSED_EXTENT_SIZE - bad_len, bad_len, out, COMPRESSED_EXTENT_SIZE);
+        }
+    }
+
+    free(out);
+    free(bad);
+    free(comp);
+    free(in);
+}
+
+static double elapsed(struct timespec* start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(end.tv_sec - start->tv_sec) + ((double)(end.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+static void benchmark(unsigned int iterations) {
+    uint8_t* in = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* comp = malloc(COMPRESSED_EXTENT_SIZE);
+    uint8_t* out = malloc(COMPRESSED_EXTENT_SIZE);
+
+    printf("%-8s %8s %12s %12s\n", "data", "ratio", "comp MB/s", "decomp MB/s");
+
+    for (unsigned int kind = 0; kind < NUM_DATA_KINDS; kind++) {
+        struct timespec start;
+        uint32_t comp_len = 0;
+        double comp_time, decomp_time = 0, mb;
+
+        fill_data(in, COMPRESSED_EXTENT_SIZE, kind, 1);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned int i = 0; i < iterations; i++) {
+            comp_len = compress(in, COMPRESSED_EXTENT_SIZE, comp);
+        }
+
+        comp_time = elapsed(&start);
+
+        if (comp_len != 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (unsigned int i = 0; i < iterations; i++) {
+                decompress(comp, comp_len, out, COMPRESSED_EXTENT_SIZE);
+            }
+
+            decomp_time = elapsed(&start);
+        }
+
+        mb = (double)iterations * COMPRESSED_EXTENT_SIZE / 1048576.0;
+
+        if (comp_len == 0)
+            printf("%-8s %8s %12.1f %12s\n", kind_names[kind], "-", mb / comp_time, "-");
+        else {
+            printf("%-8s %8.3f %12.1f %12.1f\n", kind_names[kind], (double)comp_len / COMPRESSED_EXTENT_SIZE,
+                   mb / comp_time, mb / decomp_time);
+        }
+    }
+
+    free(out);
+    free(comp);
+    free(in);
+}
+
+int main(int argc, char* argv[]) {
+    unsigned int failures = 0, iterations = 2000;
+
+    if (argc > 1)
+        iterations = (unsigned int)strtoul(argv[1], NULL, 10);
+
+    if (!test_fixed_stream())
+        failures++;
+
+    failures += test_round_trip();
+
+    test_corrupt();
+
+    if (failures > 0) {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+
+    printf("round trip: OK\n");
+
+    if (iterations > 0)
+        benchmark(iterations);
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// everything is in ntifs.h
+#include <ntifs.h>
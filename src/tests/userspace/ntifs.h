@@ -0,0 +1,366 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+// Just enough of the kernel headers for btrfs_drv.h to compile in userspace, so that the
+// self-contained parts of the driver - the compression codecs, the free-space code, the name
+// conversion - can be built into the test programs in this directory as they are. Locks are
+// no-ops, as the tests are single-threaded, and pool allocations come from malloc.
+//
+// Anything the driver calls which isn't here is left undeclared, and the tests are linked with
+// --gc-sections, so that only what they actually use needs to exist.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// SAL annotations
+
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _In_reads_bytes_(a)
+#define _In_reads_bytes_opt_(a)
+#define _Inout_
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_bytes_(a)
+#define _Out_writes_bytes_opt_(a)
+#define _Ret_maybenull_
+#define _Success_(a)
+#define _When_(a,b)
+#define _Post_satisfies_(a)
+#define _Function_class_(a)
+#define _Curr_
+#define _Create_lock_level_(a)
+#define _Has_lock_level_(a)
+#define _Requires_lock_held_(a)
+#define _Requires_lock_not_held_(a)
+#define _Requires_exclusive_lock_held_(a)
+#define _Acquires_exclusive_lock_(a)
+#define _Acquires_shared_lock_(a)
+#define _Releases_lock_(a)
+#define _Releases_exclusive_lock_(a)
+#define IN
+#define OUT
+#define NTAPI
+#define __stdcall
+#define __inline inline
+
+// basic types - Windows is LLP64, so long is 32 bits there
+
+typedef uint8_t UCHAR, BYTE, BOOLEAN, *PUCHAR;
+typedef char CHAR, *PCHAR;
+typedef uint16_t USHORT, WORD;
+typedef int16_t CSHORT;
+typedef int32_t LONG, NTSTATUS, BOOL;
+typedef uint32_t ULONG, DWORD, ACCESS_MASK, *PULONG;
+typedef int64_t LONG64, LONGLONG;
+typedef uint64_t ULONG64, ULONGLONG;
+typedef uintptr_t ULONG_PTR, KSPIN_LOCK, EX_PUSH_LOCK;
+typedef void VOID, *PVOID, *HANDLE, *PSID, *POPLOCK, *OPLOCK, *PKTHREAD, *PETHREAD, *PEPROCESS, *PMDL;
+typedef uint8_t KIRQL, KPROCESSOR_MODE;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR; // build with -fshort-wchar
+
+_Static_assert(sizeof(WCHAR) == 2, "WCHAR needs to be 16-bit - build with -fshort-wchar");
+
+typedef union {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct {
+    USHORT Length;
+    USHORT MaximumLength;
+    WCHAR* Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef struct {
+    USHORT Length;
+    USHORT MaximumLength;
+    char* Buffer;
+} ANSI_STRING, *PANSI_STRING;
+
+typedef struct {
+    ULONG SizeOfBitMap;
+    ULONG* Buffer;
+} RTL_BITMAP, *PRTL_BITMAP;
+
+typedef struct { LONG State; } KEVENT, *PKEVENT;
+typedef struct { LONG Count; } FAST_MUTEX, *PFAST_MUTEX;
+typedef struct { LONG ActiveCount; } ERESOURCE, *PERESOURCE;
+typedef struct { PVOID DataSectionObject, SharedCacheMap, ImageSectionObject; } SECTION_OBJECT_POINTERS, *PSECTION_OBJECT_POINTERS;
+typedef struct { ULONG OpenCount, Readers, Writers, Deleters, SharedRead, SharedWrite, SharedDelete; } SHARE_ACCESS;
+typedef struct { PVOID LockInformation; } FILE_LOCK, *PFILE_LOCK;
+typedef struct { PVOID Dummy; } SECURITY_DESCRIPTOR, *PSECURITY_DESCRIPTOR, ACCESS_STATE, *PACCESS_STATE;
+typedef struct { PVOID Dummy; } SECURITY_SUBJECT_CONTEXT, *PSECURITY_SUBJECT_CONTEXT;
+typedef struct { PVOID Dummy[32]; } FAST_IO_DISPATCH, CACHE_MANAGER_CALLBACKS;
+typedef struct { ULONG ReparseTag; USHORT ReparseDataLength, Reserved; UCHAR DataBuffer[1]; } REPARSE_DATA_BUFFER, *PREPARSE_DATA_BUFFER;
+
+#define POINTER_32
+
+typedef struct { ULONG Data1; USHORT Data2, Data3; UCHAR Data4[8]; } GUID, *LPGUID;
+typedef struct { LONG State; } KTIMER, *PKTHREAD_TIMER;
+typedef struct { PVOID Dummy[16]; } PAGED_LOOKASIDE_LIST, NPAGED_LOOKASIDE_LIST;
+typedef struct { NTSTATUS Status; ULONG_PTR Information; } IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+typedef struct { LARGE_INTEGER AllocationSize, FileSize, ValidDataLength; } CC_FILE_SIZES, *PCC_FILE_SIZES;
+typedef PVOID PNOTIFY_SYNC, PECP_LIST;
+
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _FILE_OBJECT FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IRP {
+    PMDL MdlAddress;
+    PVOID UserBuffer;
+    KPROCESSOR_MODE RequestorMode;
+    IO_STATUS_BLOCK IoStatus;
+} IRP, *PIRP;
+
+#define KernelMode 0
+#define UserMode 1
+
+typedef enum { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum { Executive } KWAIT_REASON;
+typedef enum { LowPagePriority, NormalPagePriority = 16, HighPagePriority = 32 } MM_PAGE_PRIORITY;
+
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+// These are declared so that the code calling them compiles - the tests don't call them.
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER freq);
+ULONGLONG KeQueryInterruptTime(void);
+
+#define PsGetCurrentProcess() NULL
+#define MmGetSystemAddressForMdlSafe(m,p) NULL
+
+typedef struct _VPB VPB, *PVPB;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef enum {
+    FastIoIsNotPossible,
+    FastIoIsPossible,
+    FastIoIsQuestionable
+} FAST_IO_POSSIBLE;
+
+typedef enum {
+    NonPagedPool,
+    PagedPool
+} POOL_TYPE;
+
+typedef struct {
+    CSHORT NodeTypeCode;
+    CSHORT NodeByteSize;
+    UCHAR Flags;
+    UCHAR IsFastIoPossible;
+    UCHAR Flags2;
+    UCHAR Reserved;
+    PERESOURCE Resource;
+    PERESOURCE PagingIoResource;
+    LARGE_INTEGER AllocationSize;
+    LARGE_INTEGER FileSize;
+    LARGE_INTEGER ValidDataLength;
+} FSRTL_COMMON_FCB_HEADER;
+
+typedef struct {
+    FSRTL_COMMON_FCB_HEADER;
+    PFAST_MUTEX FastMutex;
+    UCHAR Version;
+    LIST_ENTRY FilterContexts;
+    EX_PUSH_LOCK PushLock;
+    PVOID* FileContextSupportPointer;
+    PVOID Oplock;
+} FSRTL_ADVANCED_FCB_HEADER;
+
+#define FSRTL_FLAG2_IS_PAGING_FILE 0x04
+#define FSRTL_FCB_HEADER_V2 2
+
+#define FILE_ATTRIBUTE_READONLY 0x00000001
+#define FILE_ATTRIBUTE_HIDDEN 0x00000002
+#define FILE_ATTRIBUTE_SYSTEM 0x00000004
+#define FILE_ATTRIBUTE_DIRECTORY 0x00000010
+#define FILE_ATTRIBUTE_ARCHIVE 0x00000020
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_ATTRIBUTE_SPARSE_FILE 0x00000200
+#define FILE_ATTRIBUTE_REPARSE_POINT 0x00000400
+#define FILE_ATTRIBUTE_COMPRESSED 0x00000800
+
+// status codes
+
+#define NT_SUCCESS(s) ((NTSTATUS)(s) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_SOME_NOT_MAPPED          ((NTSTATUS)0x00000107)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS)0xC0000002)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000D)
+#define STATUS_END_OF_FILE              ((NTSTATUS)0xC0000011)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009A)
+#define STATUS_DISK_FULL                ((NTSTATUS)0xC000007F)
+#define STATUS_INTERNAL_ERROR           ((NTSTATUS)0xC00000E5)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023)
+#define STATUS_NOT_FOUND                ((NTSTATUS)0xC0000225)
+
+// CTL_CODE, for btrfsioctl.h
+
+#define CTL_CODE(t,f,m,a) (((t) << 16) | ((a) << 14) | ((f) << 2) | (m))
+#define METHOD_BUFFERED 0
+#define METHOD_IN_DIRECT 1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER 3
+#define FILE_ANY_ACCESS 0
+#define FILE_READ_ACCESS 1
+#define FILE_WRITE_ACCESS 2
+#define FILE_READ_DATA 1
+#define FILE_WRITE_DATA 2
+#define FILE_DEVICE_FILE_SYSTEM 0x09
+
+// lists
+
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+
+static inline void InitializeListHead(PLIST_ENTRY head) {
+    head->Flink = head->Blink = head;
+}
+
+static inline bool IsListEmpty(const LIST_ENTRY* head) {
+    return head->Flink == head;
+}
+
+static inline bool RemoveEntryList(PLIST_ENTRY entry) {
+    PLIST_ENTRY prev = entry->Blink, next = entry->Flink;
+
+    prev->Flink = next;
+    next->Blink = prev;
+
+    return prev == next;
+}
+
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY head) {
+    PLIST_ENTRY entry = head->Flink;
+
+    RemoveEntryList(entry);
+
+    return entry;
+}
+
+static inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY head) {
+    PLIST_ENTRY entry = head->Blink;
+
+    RemoveEntryList(entry);
+
+    return entry;
+}
+
+static inline void InsertHeadList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+    entry->Flink = head->Flink;
+    entry->Blink = head;
+    head->Flink->Blink = entry;
+    head->Flink = entry;
+}
+
+static inline void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+    entry->Flink = head;
+    entry->Blink = head->Blink;
+    head->Blink->Flink = entry;
+    head->Blink = entry;
+}
+
+// memory
+
+#define RtlCopyMemory(d,s,l) memcpy((d),(s),(l))
+#define RtlMoveMemory(d,s,l) memmove((d),(s),(l))
+#define RtlZeroMemory(d,l) memset((d),0,(l))
+#define RtlFillMemory(d,l,f) memset((d),(f),(l))
+#define RtlCompareMemory(a,b,l) rtl_compare_memory((a),(b),(l))
+
+static inline size_t rtl_compare_memory(const void* a, const void* b, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (((const uint8_t*)a)[i] != ((const uint8_t*)b)[i])
+            break;
+    }
+
+    return i;
+}
+
+#define ExAllocatePoolWithTag(type,size,tag) malloc(size)
+#define ExFreePool(p) free(p)
+
+// locks - the tests are single-threaded
+
+#define ExAcquireResourceExclusiveLite(r,w) true
+#define ExAcquireResourceSharedLite(r,w) true
+#define ExReleaseResourceLite(r) ((void)(r))
+#define ExIsResourceAcquiredExclusiveLite(r) true
+#define ExIsResourceAcquiredSharedLite(r) true
+#define ExIsResourceAcquiredExclusive(r) true
+#define ExInitializeResourceLite(r) ((void)(r), STATUS_SUCCESS)
+#define ExDeleteResourceLite(r) ((void)(r), STATUS_SUCCESS)
+#define ExAcquireFastMutex(m) ((void)(m))
+#define ExReleaseFastMutex(m) ((void)(m))
+#define ExInitializeFastMutex(m) ((void)(m))
+#define KeInitializeSpinLock(l) ((void)(l))
+#define KeAcquireSpinLock(l,i) ((void)(l), (void)(i))
+#define KeReleaseSpinLock(l,i) ((void)(l), (void)(i))
+
+// interlocked operations
+
+#define InterlockedIncrement(a) __sync_add_and_fetch(a, 1)
+#define InterlockedDecrement(a) __sync_sub_and_fetch(a, 1)
+#define InterlockedIncrement64(a) __sync_add_and_fetch(a, 1)
+#define InterlockedDecrement64(a) __sync_sub_and_fetch(a, 1)
+#define InterlockedExchangeAdd(a,b) __sync_fetch_and_add(a, b)
+#define InterlockedExchangeAdd64(a,b) __sync_fetch_and_add(a, b)
+#define InterlockedCompareExchange(a,b,c) __sync_val_compare_and_swap(a, c, b)
+#define InterlockedCompareExchange64(a,b,c) __sync_val_compare_and_swap(a, c, b)
+
+// logging - the driver's ERR messages only go to stderr if VERBOSE is set, as some tests
+// provoke them on purpose
+
+#include <stdarg.h>
+
+static inline void DbgPrint(const char* fmt, ...) {
+    va_list ap;
+
+    if (!getenv("VERBOSE"))
+        return;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
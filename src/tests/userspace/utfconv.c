@@ -0,0 +1,477 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Differential fuzzer and benchmark for utf8_to_utf16 and utf16_to_utf8 in utf.c.
+//
+// Random strings - mostly ASCII, with a mixture of valid and invalid multi-byte sequences and
+// surrogates - are converted both by the functions in utf.c and by the straightforward versions
+// below, which handle one code point at a time, and the results have to be identical: the
+// status, the length, and every byte of the output. Output buffers are given random sizes,
+// including ones too small, and the input and output are placed at the ends of their
+// allocations so that ASan catches any access past them (build with SANITIZE=1). Finally both
+// are timed on typical file names.
+
+#include "btrfs_drv.h"
+#include <time.h>
+
+#define MAX_LEN 100
+
+static uint32_t rand_state;
+
+static uint32_t next_rand(void) {
+    // xorshift32
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+
+    return rand_state;
+}
+
+// The reference versions, which don't have the ASCII fast path. The bounds checks on three- and
+// four-byte sequences are fixed, as otherwise they read past the end of short input.
+
+static NTSTATUS ref_utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint8_t* in = (uint8_t*)src;
+    uint16_t* out = (uint16_t*)dest;
+    ULONG needed = 0, left = dest_max / sizeof(uint16_t);
+
+    for (ULONG i = 0; i < src_len; i++) {
+        uint32_t cp;
+
+        if (!(in[i] & 0x80))
+            cp = in[i];
+        else if ((in[i] & 0xe0) == 0xc0) {
+            if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0x1f) << 6) | (in[i+1] & 0x3f);
+                i++;
+            }
+        } else if ((in[i] & 0xf0) == 0xe0) {
+            if (src_len - i < 3 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0xf) << 12) | ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
+                i += 2;
+            }
+        } else if ((in[i] & 0xf8) == 0xf0) {
+            if (src_len - i < 4 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80 || (in[i+3] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0x7) << 18) | ((in[i+1] & 0x3f) << 12) | ((in[i+2] & 0x3f) << 6) | (in[i+3] & 0x3f);
+                i += 3;
+            }
+        } else {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (cp > 0x10ffff) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (dest) {
+            if (cp <= 0xffff) {
+                if (left < 1)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = (uint16_t)cp;
+                out++;
+
+                left--;
+            } else {
+                if (left < 2)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                cp -= 0x10000;
+
+                *out = 0xd800 | ((cp & 0xffc00) >> 10);
+                out++;
+
+                *out = 0xdc00 | (cp & 0x3ff);
+                out++;
+
+                left -= 2;
+            }
+        }
+
+        if (cp <= 0xffff)
+            needed += sizeof(uint16_t);
+        else
+            needed += 2 * sizeof(uint16_t);
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
+
+static NTSTATUS ref_utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint16_t* in = (uint16_t*)src;
+    uint8_t* out = (uint8_t*)dest;
+    ULONG in_len = src_len / sizeof(uint16_t);
+    ULONG needed = 0, left = dest_max;
+
+    for (ULONG i = 0; i < in_len; i++) {
+        uint32_t cp = *in;
+        in++;
+
+        if ((cp & 0xfc00) == 0xd800) {
+            if (i == in_len - 1 || (*in & 0xfc00) != 0xdc00) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = (cp & 0x3ff) << 10;
+                cp |= *in & 0x3ff;
+                cp += 0x10000;
+
+                in++;
+                i++;
+            }
+        } else if ((cp & 0xfc00) == 0xdc00) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (cp > 0x10ffff) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (dest) {
+            if (cp < 0x80) {
+                if (left < 1)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = (uint8_t)cp;
+                out++;
+
+                left--;
+            } else if (cp < 0x800) {
+                if (left < 2)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xc0 | ((cp & 0x7c0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 2;
+            } else if (cp < 0x10000) {
+                if (left < 3)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xe0 | ((cp & 0xf000) >> 12);
+                out++;
+
+                *out = 0x80 | ((cp & 0xfc0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 3;
+            } else {
+                if (left < 4)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xf0 | ((cp & 0x1c0000) >> 18);
+                out++;
+
+                *out = 0x80 | ((cp & 0x3f000) >> 12);
+                out++;
+
+                *out = 0x80 | ((cp & 0xfc0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 4;
+            }
+        }
+
+        if (cp < 0x80)
+            needed++;
+        else if (cp < 0x800)
+            needed += 2;
+        else if (cp < 0x10000)
+            needed += 3;
+        else
+            needed += 4;
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
+
+static uint8_t random_utf8_byte(void) {
+    switch (next_rand() % 10) {
+        case 0:
+            return 0x80 | (next_rand() % 0x40); // continuation
+
+        case 1:
+            return 0xc0 | (next_rand() % 0x20); // lead byte of two
+
+        case 2:
+            return 0xe0 | (next_rand() % 0x10); // lead byte of three
+
+        case 3:
+            return (uint8_t)next_rand();
+
+        default:
+            return 0x20 + (next_rand() % 0x5f);
+    }
+}
+
+static uint16_t random_utf16_char(void) {
+    switch (next_rand() % 10) {
+        case 0:
+            return 0xd800 | (next_rand() % 0x400); // high surrogate
+
+        case 1:
+            return 0xdc00 | (next_rand() % 0x400); // low surrogate
+
+        case 2:
+            return (uint16_t)next_rand();
+
+        default:
+            return 0x20 + (next_rand() % 0x5f);
+    }
+}
+
+// Fills in a random string. A third are pure ASCII, half of those with one character changed,
+// so that the fast path and the switches between it and the slow path get plenty of exercise.
+static void random_string(uint8_t* s8, uint16_t* s16, ULONG len) {
+    if (next_rand() % 3 == 0) {
+        for (ULONG i = 0; i < len; i++) {
+            s8[i] = 0x20 + (next_rand() % 0x5f);
+            s16[i] = s8[i];
+        }
+
+        if (len > 0 && next_rand() % 2 == 0) {
+            s8[next_rand() % len] = random_utf8_byte() | 0x80;
+            s16[next_rand() % len] = random_utf16_char() | 0x80;
+        }
+    } else {
+        for (ULONG i = 0; i < len; i++) {
+            s8[i] = random_utf8_byte();
+            s16[i] = random_utf16_char();
+        }
+    }
+}
+
+static ULONG random_dest_max(ULONG full) {
+    switch (next_rand() % 4) {
+        case 0:
+            return next_rand() % (full + 1); // probably too small
+
+        case 1:
+            return full / 2;
+
+        default:
+            return full;
+    }
+}
+
+static bool fuzz_one(unsigned int n) {
+    uint8_t* s8 = malloc(MAX_LEN);
+    uint16_t* s16 = malloc(MAX_LEN * sizeof(uint16_t));
+    uint8_t *out1 = NULL, *out2 = NULL;
+    ULONG len = next_rand() % (MAX_LEN + 1), dest_max, len1 = 0xcccccccc, len2 = 0xcccccccc;
+    bool null_dest = next_rand() % 8 == 0, null_len = next_rand() % 16 == 0;
+    NTSTATUS Status1, Status2;
+    bool ret = true;
+
+    random_string(s8 + MAX_LEN - len, s16 + MAX_LEN - len, len);
+
+    // UTF-8 to UTF-16
+
+    dest_max = null_dest ? 0 : random_dest_max(len * sizeof(uint16_t) * 2);
+
+    if (!null_dest) {
+        out1 = malloc(dest_max + 1);
+        out2 = malloc(dest_max + 1);
+        memset(out1, 0xcc, dest_max);
+        memset(out2, 0xcc, dest_max);
+    }
+
+    Status1 = ref_utf8_to_utf16((WCHAR*)out1, dest_max, null_len ? NULL : &len1, (char*)s8 + MAX_LEN - len, len);
+    Status2 = utf8_to_utf16((WCHAR*)out2, dest_max, null_len ? NULL : &len2, (char*)s8 + MAX_LEN - len, len);
+
+    if (Status1 != Status2 || len1 != len2 || (!null_dest && memcmp(out1, out2, dest_max))) {
+        printf("utf8_to_utf16 differs on input %u (length %u, dest_max %u): status %08x / %08x, length %x / %x\n",
+               n, len, dest_max, Status1, Status2, len1, len2);
+        ret = false;
+    }
+
+    free(out2);
+    free(out1);
+
+    // UTF-16 to UTF-8
+
+    len1 = len2 = 0xcccccccc;
+    out1 = out2 = NULL;
+
+    dest_max = null_dest ? 0 : random_dest_max(len * 3);
+
+    if (!null_dest) {
+        out1 = malloc(dest_max + 1);
+        out2 = malloc(dest_max + 1);
+        memset(out1, 0xcc, dest_max);
+        memset(out2, 0xcc, dest_max);
+    }
+
+    Status1 = ref_utf16_to_utf8((char*)out1, dest_max, null_len ? NULL : &len1, (WCHAR*)(s16 + MAX_LEN - len), len * sizeof(uint16_t));
+    Status2 = utf16_to_utf8((char*)out2, dest_max, null_len ? NULL : &len2, (WCHAR*)(s16 + MAX_LEN - len), len * sizeof(uint16_t));
+
+    if (Status1 != Status2 || len1 != len2 || (!null_dest && memcmp(out1, out2, dest_max))) {
+        printf("utf16_to_utf8 differs on input %u (length %u, dest_max %u): status %08x / %08x, length %x / %x\n",
+               n, len, dest_max, Status1, Status2, len1, len2);
+        ret = false;
+    }
+
+    free(out2);
+    free(out1);
+    free(s16);
+    free(s8);
+
+    return ret;
+}
+
+static double elapsed(struct timespec* start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(end.tv_sec - start->tv_sec) + ((double)(end.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+typedef NTSTATUS (*utf8_func)(WCHAR*, ULONG, ULONG*, char*, ULONG);
+typedef NTSTATUS (*utf16_func)(char*, ULONG, ULONG*, WCHAR*, ULONG);
+
+#define BENCH_ROUNDS 5
+
+// Returns nanoseconds per call, taking the best of BENCH_ROUNDS rounds so that other load on the
+// machine doesn't skew the comparison.
+static double time_utf8(utf8_func f, const char* s, unsigned int iterations) {
+    WCHAR out[256];
+    ULONG len;
+    double best = 0;
+
+    for (unsigned int r = 0; r < BENCH_ROUNDS; r++) {
+        struct timespec start;
+        double t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned int i = 0; i < iterations / BENCH_ROUNDS; i++) {
+            f(out, sizeof(out), &len, (char*)s, (ULONG)strlen(s));
+        }
+
+        t = elapsed(&start) * 1000000000.0 / (iterations / BENCH_ROUNDS);
+
+        if (r == 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+static double time_utf16(utf16_func f, const char* s, unsigned int iterations) {
+    WCHAR in[256];
+    char out[768];
+    ULONG in_len, len;
+    double best = 0;
+
+    ref_utf8_to_utf16(in, sizeof(in), &in_len, (char*)s, (ULONG)strlen(s));
+
+    for (unsigned int r = 0; r < BENCH_ROUNDS; r++) {
+        struct timespec start;
+        double t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned int i = 0; i < iterations / BENCH_ROUNDS; i++) {
+            f(out, sizeof(out), &len, in, in_len);
+        }
+
+        t = elapsed(&start) * 1000000000.0 / (iterations / BENCH_ROUNDS);
+
+        if (r == 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+static void benchmark(unsigned int iterations) {
+    static const struct {
+        const char* name;
+        const char* s;
+    } names[] = {
+        { "short", "README.md" },
+        { "medium", "libboost_filesystem-mt-x64.dll" },
+        { "long", "Screenshot from 2026-10-19 14-02-33 (copy of the original upload, 2).png" },
+        { "accented", "Caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9" "e recette.txt" },
+        { "cjk", "\xe6\x96\x87\xe6\x9b\xb8\xe3\x81\xae\xe4\xb8\x80\xe8\xa6\xa7.docx" },
+    };
+
+    printf("%-9s %4s %14s %14s %14s %14s\n", "name", "len", "8->16 ref ns", "8->16 ns", "16->8 ref ns", "16->8 ns");
+
+    for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        printf("%-9s %4u %14.1f %14.1f %14.1f %14.1f\n", names[i].name, (unsigned int)strlen(names[i].s),
+               time_utf8(ref_utf8_to_utf16, names[i].s, iterations), time_utf8(utf8_to_utf16, names[i].s, iterations),
+               time_utf16(ref_utf16_to_utf8, names[i].s, iterations), time_utf16(utf16_to_utf8, names[i].s, iterations));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    unsigned int failures = 0, iterations = 1000000;
+
+    if (argc > 1)
+        iterations = (unsigned int)strtoul(argv[1], NULL, 10);
+
+    rand_state = 1;
+
+    for (unsigned int n = 0; n < 500000 && failures < 10; n++) {
+        if (!fuzz_one(n))
+            failures++;
+    }
+
+    if (failures > 0) {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+
+    printf("fuzz: OK\n");
+
+    if (iterations >= BENCH_ROUNDS)
+        benchmark(iterations);
+
+    return 0;
+}
@@ -142,6 +142,7 @@ NTSTATUS load_tree(device_extension* Vcb, uint64_t addr, uint8_t* buf, root* r,
     ExAcquireFastMutex(&Vcb->trees_list_mutex);
 
     InsertTailList(&Vcb->trees, &t->list_entry);
+    InterlockedIncrement(&Vcb->tree_count);
 
     h = t->hash >> 24;
 
@@ -288,6 +289,7 @@ void free_tree(tree* t) {
     }
 
     RemoveEntryList(&t->list_entry);
+    InterlockedDecrement(&t->Vcb->tree_count);
 
     if (r)
         r->treeholder.tree = NULL;
@@ -849,8 +851,7 @@ void free_trees(device_extension* Vcb) {
             break;
     }
 
-    reap_filerefs(Vcb, Vcb->root_fileref);
-    reap_fcbs(Vcb);
+    trim_fileref_cache(Vcb);
 }
 
 #ifdef _MSC_VER
@@ -1061,6 +1062,10 @@ void clear_rollback(LIST_ENTRY* rollback) {
                 ExFreePool(ri->ptr);
                 break;
 
+            case ROLLBACK_DELALLOC:
+                free_written_delalloc(ri->ptr);
+                break;
+
             default:
                 break;
         }
@@ -1164,9 +1169,9 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
                     acquire_chunk_lock(rs->chunk, Vcb);
 
                 if (ri->type == ROLLBACK_ADD_SPACE)
-                    space_list_subtract2(rs->list, rs->list_size, rs->address, rs->length, NULL, NULL);
+                    space_list_subtract2(rs->list, rs->index, rs->address, rs->length, NULL, NULL);
                 else
-                    space_list_add2(rs->list, rs->list_size, rs->address, rs->length, NULL, NULL);
+                    space_list_add2(rs->list, rs->index, rs->address, rs->length, NULL, NULL);
 
                 if (rs->chunk) {
                     if (ri->type == ROLLBACK_ADD_SPACE)
@@ -1187,10 +1192,10 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
 
                             if (rs2->chunk == rs->chunk) {
                                 if (ri2->type == ROLLBACK_ADD_SPACE) {
-                                    space_list_subtract2(rs2->list, rs2->list_size, rs2->address, rs2->length, NULL, NULL);
+                                    space_list_subtract2(rs2->list, rs2->index, rs2->address, rs2->length, NULL, NULL);
                                     rs->chunk->used += rs2->length;
                                 } else {
-                                    space_list_add2(rs2->list, rs2->list_size, rs2->address, rs2->length, NULL, NULL);
+                                    space_list_add2(rs2->list, rs2->index, rs2->address, rs2->length, NULL, NULL);
                                     rs->chunk->used -= rs2->length;
                                 }
 
@@ -1210,6 +1215,10 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
 
                 break;
             }
+
+            case ROLLBACK_DELALLOC:
+                requeue_delalloc(ri->ptr);
+                break;
         }
 
         ExFreePool(ri);
@@ -0,0 +1,116 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Case-insensitive lookups used to mean upcasing the name into a newly-allocated buffer with
+// RtlUpcaseUnicodeString, just so we could hash it and compare it. Instead we upcase a character
+// at a time as we go. This gives exactly the same results as RtlUpcaseUnicodeString, which also
+// works one WCHAR at a time, so the hashes in dir_children_hash_uc don't change.
+//
+// Most names are plain ASCII, so we deal with that ourselves and only call RtlUpcaseUnicodeChar,
+// which reads the system's upcase table, for anything else.
+
+#define UPCASE_CHUNK 64
+
+static __inline WCHAR upcase_char(WCHAR c) {
+    if (c < 0x80)
+        return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+
+    return RtlUpcaseUnicodeChar(c);
+}
+
+// Returns the same as calc_crc32c(0xffffffff, ...) would on the upcased name.
+uint32_t calc_crc32c_uc(_In_ PUNICODE_STRING name) {
+    WCHAR buf[UPCASE_CHUNK];
+    uint32_t hash = 0xffffffff;
+    WCHAR* s = name->Buffer;
+    ULONG len = name->Length / sizeof(WCHAR);
+
+    while (len > 0) {
+        ULONG n = min(len, UPCASE_CHUNK);
+
+        for (ULONG i = 0; i < n; i++) {
+            buf[i] = upcase_char(s[i]);
+        }
+
+        hash = calc_crc32c(hash, (uint8_t*)buf, n * sizeof(WCHAR));
+
+        s += n;
+        len -= n;
+    }
+
+    return hash;
+}
+
+// Compares name_uc, which has already been upcased, with name, which hasn't.
+bool name_equal_uc(_In_ PUNICODE_STRING name_uc, _In_ PUNICODE_STRING name) {
+    ULONG len = name->Length / sizeof(WCHAR);
+
+    if (name_uc->Length != name->Length)
+        return false;
+
+    for (ULONG i = 0; i < len; i++) {
+        if (name_uc->Buffer[i] != upcase_char(name->Buffer[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// Sets name_uc and hash_uc from name. If the name is already in upper case, name_uc shares its
+// buffer rather than having a copy of its own - use free_dir_child_name_uc to free it.
+NTSTATUS set_dir_child_name_uc(_Inout_ dir_child* dc) {
+    ULONG len = dc->name.Length / sizeof(WCHAR);
+    ULONG i;
+
+    for (i = 0; i < len; i++) {
+        if (upcase_char(dc->name.Buffer[i]) != dc->name.Buffer[i])
+            break;
+    }
+
+    if (i == len)
+        dc->name_uc = dc->name;
+    else {
+        dc->name_uc.Buffer = ExAllocatePoolWithTag(PagedPool, dc->name.Length, ALLOC_TAG);
+        if (!dc->name_uc.Buffer) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        dc->name_uc.Length = dc->name_uc.MaximumLength = dc->name.Length;
+
+        RtlCopyMemory(dc->name_uc.Buffer, dc->name.Buffer, i * sizeof(WCHAR));
+
+        for (; i < len; i++) {
+            dc->name_uc.Buffer[i] = upcase_char(dc->name.Buffer[i]);
+        }
+    }
+
+    dc->hash_uc = calc_crc32c(0xffffffff, (uint8_t*)dc->name_uc.Buffer, dc->name_uc.Length);
+
+    return STATUS_SUCCESS;
+}
+
+// Has to be called before name is freed.
+void free_dir_child_name_uc(_Inout_ dir_child* dc) {
+    if (dc->name_uc.Buffer && dc->name_uc.Buffer != dc->name.Buffer)
+        ExFreePool(dc->name_uc.Buffer);
+
+    dc->name_uc.Buffer = NULL;
+    dc->name_uc.Length = dc->name_uc.MaximumLength = 0;
+}
@@ -0,0 +1,326 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Nearly all names are plain ASCII, so both conversion functions below start by converting
+// whatever ASCII they begin with ASCII_RUN characters at a time, testing and converting them a
+// uint64_t at a time. The rest goes through the code which handles one code point at a time.
+// This is only tried at the start, as trying again later on slows down the loop for the names
+// which aren't ASCII.
+
+#define ASCII_RUN 16
+
+__inline static uint64_t load_uint64(const void* p) {
+    uint64_t v;
+
+    RtlCopyMemory(&v, p, sizeof(uint64_t));
+
+    return v;
+}
+
+__inline static void store_uint64(void* p, uint64_t v) {
+    RtlCopyMemory(p, &v, sizeof(uint64_t));
+}
+
+// turns the bottom four bytes of v into four little-endian WCHARs
+__inline static uint64_t widen_ascii(uint64_t v) {
+    v &= 0xffffffff;
+    v = (v | (v << 16)) & 0x0000ffff0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff00ff00ff;
+
+    return v;
+}
+
+// the reverse of widen_ascii
+__inline static uint32_t narrow_ascii(uint64_t v) {
+    v = (v | (v >> 8)) & 0x0000ffff0000ffff;
+    v = (v | (v >> 16)) & 0xffffffff;
+
+    return (uint32_t)v;
+}
+
+static bool utf8_is_ascii(uint8_t* in) {
+    uint64_t v = 0;
+
+    for (unsigned int i = 0; i < ASCII_RUN; i += sizeof(uint64_t)) {
+        v |= load_uint64(&in[i]);
+    }
+
+    return !(v & 0x8080808080808080);
+}
+
+static bool utf16_is_ascii(uint16_t* in) {
+    uint64_t v = 0;
+
+    for (unsigned int i = 0; i < ASCII_RUN; i += 4) {
+        v |= load_uint64(&in[i]);
+    }
+
+    return !(v & 0xff80ff80ff80ff80);
+}
+
+static void utf8_to_utf16_ascii(uint16_t* out, uint8_t* in) {
+    for (unsigned int i = 0; i < ASCII_RUN; i += sizeof(uint64_t)) {
+        uint64_t v = load_uint64(&in[i]);
+
+        store_uint64(&out[i], widen_ascii(v));
+        store_uint64(&out[i + 4], widen_ascii(v >> 32));
+    }
+}
+
+static void utf16_to_utf8_ascii(uint8_t* out, uint16_t* in) {
+    for (unsigned int i = 0; i < ASCII_RUN; i += 4) {
+        uint32_t v = narrow_ascii(load_uint64(&in[i]));
+
+        RtlCopyMemory(&out[i], &v, sizeof(uint32_t));
+    }
+}
+
+// Converts the runs of ASCII at the start of in, stopping at the first which isn't all ASCII or
+// doesn't fit in out. out is NULL if we're only counting. Returns the number of characters done.
+static ULONG utf8_to_utf16_ascii_prefix(uint16_t* out, ULONG out_len, uint8_t* in, ULONG in_len) {
+    ULONG done = 0;
+
+    while (in_len - done >= ASCII_RUN && (!out || out_len - done >= ASCII_RUN) && utf8_is_ascii(&in[done])) {
+        if (out)
+            utf8_to_utf16_ascii(&out[done], &in[done]);
+
+        done += ASCII_RUN;
+    }
+
+    return done;
+}
+
+static ULONG utf16_to_utf8_ascii_prefix(uint8_t* out, ULONG out_len, uint16_t* in, ULONG in_len) {
+    ULONG done = 0;
+
+    while (in_len - done >= ASCII_RUN && (!out || out_len - done >= ASCII_RUN) && utf16_is_ascii(&in[done])) {
+        if (out)
+            utf16_to_utf8_ascii(&out[done], &in[done]);
+
+        done += ASCII_RUN;
+    }
+
+    return done;
+}
+
+// version of RtlUTF8ToUnicodeN for Vista and below
+NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint8_t* in = (uint8_t*)src;
+    uint16_t* out = (uint16_t*)dest;
+    ULONG needed, left = dest_max / sizeof(uint16_t), i;
+
+    i = utf8_to_utf16_ascii_prefix(out, left, in, src_len);
+
+    if (dest) {
+        out += i;
+        left -= i;
+    }
+
+    needed = i * sizeof(uint16_t);
+
+    for (; i < src_len; i++) {
+        uint32_t cp;
+
+        if (!(in[i] & 0x80))
+            cp = in[i];
+        else if ((in[i] & 0xe0) == 0xc0) {
+            if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0x1f) << 6) | (in[i+1] & 0x3f);
+                i++;
+            }
+        } else if ((in[i] & 0xf0) == 0xe0) {
+            if (src_len - i < 3 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0xf) << 12) | ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
+                i += 2;
+            }
+        } else if ((in[i] & 0xf8) == 0xf0) {
+            if (src_len - i < 4 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80 || (in[i+3] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0x7) << 18) | ((in[i+1] & 0x3f) << 12) | ((in[i+2] & 0x3f) << 6) | (in[i+3] & 0x3f);
+                i += 3;
+            }
+        } else {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (cp > 0x10ffff) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (dest) {
+            if (cp <= 0xffff) {
+                if (left < 1)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = (uint16_t)cp;
+                out++;
+
+                left--;
+            } else {
+                if (left < 2)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                cp -= 0x10000;
+
+                *out = 0xd800 | ((cp & 0xffc00) >> 10);
+                out++;
+
+                *out = 0xdc00 | (cp & 0x3ff);
+                out++;
+
+                left -= 2;
+            }
+        }
+
+        if (cp <= 0xffff)
+            needed += sizeof(uint16_t);
+        else
+            needed += 2 * sizeof(uint16_t);
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
+
+// version of RtlUnicodeToUTF8N for Vista and below
+NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint16_t* in = (uint16_t*)src;
+    uint8_t* out = (uint8_t*)dest;
+    ULONG in_len = src_len / sizeof(uint16_t);
+    ULONG needed, left = dest_max, i;
+
+    i = utf16_to_utf8_ascii_prefix(out, left, in, in_len);
+
+    if (dest) {
+        out += i;
+        left -= i;
+    }
+
+    in += i;
+    needed = i;
+
+    for (; i < in_len; i++) {
+        uint32_t cp = *in;
+        in++;
+
+        if ((cp & 0xfc00) == 0xd800) {
+            if (i == in_len - 1 || (*in & 0xfc00) != 0xdc00) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = (cp & 0x3ff) << 10;
+                cp |= *in & 0x3ff;
+                cp += 0x10000;
+
+                in++;
+                i++;
+            }
+        } else if ((cp & 0xfc00) == 0xdc00) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (cp > 0x10ffff) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (dest) {
+            if (cp < 0x80) {
+                if (left < 1)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = (uint8_t)cp;
+                out++;
+
+                left--;
+            } else if (cp < 0x800) {
+                if (left < 2)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xc0 | ((cp & 0x7c0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 2;
+            } else if (cp < 0x10000) {
+                if (left < 3)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xe0 | ((cp & 0xf000) >> 12);
+                out++;
+
+                *out = 0x80 | ((cp & 0xfc0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 3;
+            } else {
+                if (left < 4)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xf0 | ((cp & 0x1c0000) >> 18);
+                out++;
+
+                *out = 0x80 | ((cp & 0x3f000) >> 12);
+                out++;
+
+                *out = 0x80 | ((cp & 0xfc0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 4;
+            }
+        }
+
+        if (cp < 0x80)
+            needed++;
+        else if (cp < 0x800)
+            needed += 2;
+        else if (cp < 0x10000)
+            needed += 3;
+        else
+            needed += 4;
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
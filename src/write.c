@@ -37,7 +37,6 @@ extern bool diskacc;
 
 __attribute__((nonnull(1, 2, 4)))
 bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length, uint64_t* address) {
-    LIST_ENTRY* le;
     space* s;
 
     TRACE("(%p, %I64x, %I64x, %p)\n", Vcb, c->offset, length, address);
@@ -54,60 +53,77 @@ bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length
         }
     }
 
-    if (IsListEmpty(&c->space_size))
+    s = space_index_best_fit(&c->space_index, length);
+
+    if (!s)
         return false;
 
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
+    *address = s->address;
 
-        if (s->size == length) {
-            *address = s->address;
-            return true;
-        } else if (s->size < length) {
-            if (le == c->space_size.Flink)
-                return false;
+    return true;
+}
 
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
+// Vcb->chunks_by_address mirrors Vcb->chunks, keyed by logical address; both are protected by chunk_lock
 
-            *address = s->address;
-            return true;
-        }
+__attribute__((nonnull(1,2)))
+void chunk_index_insert(device_extension* Vcb, chunk* c) {
+    rb_node* parent = NULL;
+    rb_node** link = &Vcb->chunks_by_address.root;
+    rb_node* next;
 
-        le = le->Flink;
-    }
+    while (*link) {
+        chunk* c2 = CONTAINING_RECORD(*link, chunk, node_address);
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+        parent = *link;
 
-    if (s->size > length) {
-        *address = s->address;
-        return true;
+        if (c->offset < c2->offset)
+            link = &parent->left;
+        else
+            link = &parent->right;
     }
 
-    return false;
+    rb_insert(&Vcb->chunks_by_address, parent, link, &c->node_address);
+
+    // keep Vcb->chunks in address order too
+
+    next = rb_next(&c->node_address);
+
+    if (next)
+        InsertHeadList(CONTAINING_RECORD(next, chunk, node_address)->list_entry.Blink, &c->list_entry);
+    else
+        InsertTailList(&Vcb->chunks, &c->list_entry);
+}
+
+__attribute__((nonnull(1,2)))
+void chunk_index_remove(device_extension* Vcb, chunk* c) {
+    rb_remove(&Vcb->chunks_by_address, &c->node_address);
+    RemoveEntryList(&c->list_entry);
 }
 
 __attribute__((nonnull(1)))
 chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) {
-    LIST_ENTRY* le2;
+    rb_node* n;
+    chunk* ret = NULL;
 
     ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
 
-    le2 = Vcb->chunks.Flink;
-    while (le2 != &Vcb->chunks) {
-        chunk* c = CONTAINING_RECORD(le2, chunk, list_entry);
+    n = Vcb->chunks_by_address.root;
+    while (n) {
+        chunk* c = CONTAINING_RECORD(n, chunk, node_address);
 
-        if (address >= c->offset && address < c->offset + c->chunk_item->size) {
-            ExReleaseResourceLite(&Vcb->chunk_lock);
-            return c;
+        if (address < c->offset)
+            n = n->left;
+        else if (address >= c->offset + c->chunk_item->size)
+            n = n->right;
+        else {
+            ret = c;
+            break;
         }
-
-        le2 = le2->Flink;
     }
 
     ExReleaseResourceLite(&Vcb->chunk_lock);
 
-    return NULL;
+    return ret;
 }
 
 typedef struct {
@@ -624,13 +640,13 @@ NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool ful
     c->balance_num = 0;
 
     InitializeListHead(&c->space);
-    InitializeListHead(&c->space_size);
+    space_index_init(&c->space_index);
     InitializeListHead(&c->deleting);
     InitializeListHead(&c->changed_extents);
 
-    InitializeListHead(&c->range_locks);
-    ExInitializeResourceLite(&c->range_locks_lock);
-    KeInitializeEvent(&c->range_locks_event, NotificationEvent, false);
+    init_chunk_range_locks(c);
+    init_chunk_discards(c);
+    init_chunk_unique_cache(c);
 
     InitializeListHead(&c->partial_stripes);
     ExInitializeResourceLite(&c->partial_stripes_lock);
@@ -648,7 +664,7 @@ NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool ful
     s->address = c->offset;
     s->size = c->chunk_item->size;
     InsertTailList(&c->space, &s->list_entry);
-    InsertTailList(&c->space_size, &s->list_entry_size);
+    space_index_insert(&c->space_index, s);
 
     protect_superblocks(c);
 
@@ -680,23 +696,7 @@ end:
 
         if (s) ExFreePool(s);
     } else {
-        bool done = false;
-
-        le = Vcb->chunks.Flink;
-        while (le != &Vcb->chunks) {
-            chunk* c2 = CONTAINING_RECORD(le, chunk, list_entry);
-
-            if (c2->offset > c->offset) {
-                InsertHeadList(le->Blink, &c->list_entry);
-                done = true;
-                break;
-            }
-
-            le = le->Flink;
-        }
-
-        if (!done)
-            InsertTailList(&Vcb->chunks, &c->list_entry);
+        chunk_index_insert(Vcb, c);
 
         c->created = true;
         c->changed = true;
@@ -2313,8 +2313,10 @@ static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIR
     }
 
 end:
-    if (InterlockedDecrement(&context->stripes_left) == 0)
+    if (InterlockedDecrement(&context->stripes_left) == 0) {
+        context->end_time = KeQueryPerformanceCounter(NULL);
         KeSetEvent(&context->Event, 0, false);
+    }
 
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
@@ -2403,6 +2405,15 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
     NTSTATUS Status;
     LIST_ENTRY* le;
 
+    // whatever's replacing this range is newer than any delayed data we're holding for it
+    if (!IsListEmpty(&fcb->delalloc)) {
+        Status = delalloc_drop(fcb, start_data, end_data);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_drop returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
     le = fcb->extents.Flink;
 
     while (le != &fcb->extents) {
@@ -2818,6 +2829,19 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
     }
 }
 
+// Starts checksumming data on the calc threads, so that it overlaps with the device writes.
+// If the job can't be queued we do it synchronously instead, and return NULL.
+static calc_job* start_csum_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum) {
+    calc_job* cj;
+
+    if (!NT_SUCCESS(add_calc_job_csum(Vcb, data, sectors, csum, &cj))) {
+        do_calc_job(Vcb, data, sectors, csum);
+        return NULL;
+    }
+
+    return cj;
+}
+
 _Requires_lock_held_(c->lock)
 _When_(return != 0, _Releases_lock_(c->lock))
 __attribute__((nonnull(1,2,3,9)))
@@ -2829,6 +2853,7 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     EXTENT_DATA2* ed2;
     uint16_t edsize = (uint16_t)(offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
     void* csum = NULL;
+    calc_job* cj = NULL;
 
     TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %I64x, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
 
@@ -2865,12 +2890,18 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
             return false;
         }
 
-        do_calc_job(Vcb, data, sl, csum);
+        cj = start_csum_job(Vcb, data, sl, csum);
     }
 
+    // The checksums aren't needed until the flush thread inserts them into the csum tree, but
+    // data belongs to our caller, so we join the job before returning. Unlike the nocow path,
+    // it's fine for the job to fill in the new extent's csum directly: nothing is on disk there
+    // yet, and the extent can't be seen by anyone else until our caller drops the fcb lock.
+
     Status = add_extent_to_fcb(fcb, start_data, ed, edsize, true, csum, rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("add_extent_to_fcb returned %08lx\n", Status);
+        if (cj) finish_calc_job(Vcb, cj);
         if (csum) ExFreePool(csum);
         ExFreePool(ed);
         return false;
@@ -2889,7 +2920,7 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
     ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
 
-    add_changed_extent_ref(c, address, length, fcb->subvol->id, fcb->inode, start_data, 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
+    add_changed_extent_ref(Vcb, c, address, length, fcb->subvol->id, fcb->inode, start_data, 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
 
     ExReleaseResourceLite(&c->changed_extents_lock);
 
@@ -2902,6 +2933,9 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
             ERR("write_data_complete returned %08lx\n", Status);
     }
 
+    if (cj)
+        finish_calc_job(Vcb, cj);
+
     return true;
 }
 
@@ -2914,6 +2948,7 @@ static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data
     chunk* c;
     LIST_ENTRY* le;
     extent* ext = NULL;
+    space* s;
 
     le = fcb->extents.Flink;
 
@@ -2972,25 +3007,19 @@ static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data
         }
     }
 
-    le = c->space.Flink;
-    while (le != &c->space) {
-        space* s = CONTAINING_RECORD(le, space, list_entry);
-
-        if (s->address == ed2->address + ed2->size) {
-            uint64_t newlen = min(min(s->size, length), MAX_EXTENT_SIZE);
+    s = space_index_find(&c->space_index, ed2->address + ed2->size);
 
-            success = insert_extent_chunk(Vcb, fcb, c, start_data, newlen, false, data, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen, file_write, irp_offset);
+    if (s && s->address == ed2->address + ed2->size) {
+        uint64_t newlen = min(min(s->size, length), MAX_EXTENT_SIZE);
 
-            if (success)
-                *written += newlen;
-            else
-                release_chunk_lock(c, Vcb);
+        success = insert_extent_chunk(Vcb, fcb, c, start_data, newlen, false, data, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen, file_write, irp_offset);
 
-            return success;
-        } else if (s->address > ed2->address + ed2->size)
-            break;
+        if (success)
+            *written += newlen;
+        else
+            release_chunk_lock(c, Vcb);
 
-        le = le->Flink;
+        return success;
     }
 
     release_chunk_lock(c, Vcb);
@@ -3027,8 +3056,8 @@ static NTSTATUS insert_chunk_fragmented(fcb* fcb, uint64_t start, uint64_t lengt
             acquire_chunk_lock(c, fcb->Vcb);
 
             if (c->chunk_item->type == flags) {
-                while (!IsListEmpty(&c->space_size) && length > 0) {
-                    space* s = CONTAINING_RECORD(c->space_size.Flink, space, list_entry_size);
+                while (!IsListEmpty(&c->space) && length > 0) {
+                    space* s = space_index_largest(&c->space_index);
                     uint64_t extlen = min(length, s->size);
 
                     if (insert_extent_chunk(fcb->Vcb, fcb, c, start, extlen, prealloc && !page_file, data, NULL, rollback, BTRFS_COMPRESSION_NONE, extlen, false, 0)) {
@@ -3129,6 +3158,151 @@ end:
     return Status;
 }
 
+// Returns the end of the file's last extent. This can be beyond EOF, if there's preallocated
+// space there.
+uint64_t get_extents_end(fcb* fcb) {
+    LIST_ENTRY* le;
+    uint64_t end = sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size);
+
+    le = fcb->extents.Blink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            EXTENT_DATA* ed = &ext->extent_data;
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+            uint64_t ext_end = ext->offset + (ed->type == EXTENT_TYPE_INLINE ? ed->decoded_size : ed2->num_bytes);
+
+            return max(end, ext_end);
+        }
+
+        le = le->Blink;
+    }
+
+    return end;
+}
+
+bool valid_extent_size_hint(device_extension* Vcb, uint64_t hint) {
+    return hint <= MAX_EXTENT_SIZE && (hint & (Vcb->superblock.sector_size - 1)) == 0;
+}
+
+// The btrfs.extsize property is the hint in bytes, as a decimal string. Returns false if
+// it's not a number, or not a valid hint for this volume.
+bool parse_prop_extsize(device_extension* Vcb, const char* val, uint16_t len, uint32_t* hint) {
+    uint64_t val64 = 0;
+
+    if (len == 0)
+        return false;
+
+    for (uint16_t i = 0; i < len; i++) {
+        if (val[i] < '0' || val[i] > '9')
+            return false;
+
+        val64 = (val64 * 10) + val[i] - '0';
+
+        if (val64 > MAX_EXTENT_SIZE)
+            return false;
+    }
+
+    if (!valid_extent_size_hint(Vcb, val64))
+        return false;
+
+    *hint = (uint32_t)val64;
+
+    return true;
+}
+
+uint16_t get_prop_extsize_string(uint32_t hint, char* buf) {
+    char tmp[10];
+    uint16_t len = 0, i;
+
+    do {
+        tmp[len] = '0' + (hint % 10);
+        len++;
+        hint /= 10;
+    } while (hint > 0);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = tmp[len - i - 1];
+    }
+
+    return len;
+}
+
+// Files which are appended to a bit at a time, such as logs and downloads, would otherwise end
+// up with a separate extent for every commit, scattered across the disk. When a write extends
+// a file, we preallocate some space beyond EOF for later writes to go into in place - either up
+// to the next multiple of the file's extent size hint, or speculatively, up to twice the file's
+// size. Anything which doesn't get used is given back by trim_speculative_prealloc when the file
+// is closed.
+
+#define SPEC_PREALLOC_MIN   0x100000    // 1 MB
+#define SPEC_PREALLOC_MAX   0x1000000   // 16 MB
+
+_Requires_exclusive_lock_held_(fcb->Header.Resource)
+static void speculative_prealloc(fcb* fcb, uint64_t end, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    uint64_t alloc_end = get_extents_end(fcb), target;
+
+    // wait until what we allocated last time has been used up
+    if (alloc_end > sector_align(end, fcb->Vcb->superblock.sector_size))
+        return;
+
+    if (fcb->extent_size_hint != 0)
+        target = ((end + fcb->extent_size_hint - 1) / fcb->extent_size_hint) * fcb->extent_size_hint;
+    else {
+        if (end < SPEC_PREALLOC_MIN)
+            return;
+
+        target = sector_align(end + min(end, SPEC_PREALLOC_MAX), SPEC_PREALLOC_MIN);
+    }
+
+    if (target <= alloc_end)
+        return;
+
+    Status = insert_prealloc_extent(fcb, alloc_end, target - alloc_end, rollback);
+    if (!NT_SUCCESS(Status)) {
+        // not fatal - the data will just get written somewhere else
+        if (Status != STATUS_DISK_FULL)
+            WARN("insert_prealloc_extent returned %08lx\n", Status);
+
+        return;
+    }
+
+    TRACE("preallocated %I64x-%I64x of inode %I64x\n", alloc_end, target, fcb->inode);
+
+    fcb->spec_prealloc = true;
+    fcb->extents_changed = true;
+    mark_fcb_dirty(fcb);
+}
+
+_Requires_exclusive_lock_held_(fcb->Header.Resource)
+void trim_speculative_prealloc(fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY rollback;
+    uint64_t start = sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size);
+    uint64_t end = get_extents_end(fcb);
+
+    fcb->spec_prealloc = false;
+
+    if (end <= start)
+        return;
+
+    InitializeListHead(&rollback);
+
+    Status = excise_extents(fcb->Vcb, fcb, start, end, Irp, &rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08lx\n", Status);
+        do_rollback(fcb->Vcb, &rollback);
+        return;
+    }
+
+    clear_rollback(&rollback);
+
+    fcb->extents_changed = true;
+    mark_fcb_dirty(fcb);
+}
+
 __attribute__((nonnull(1,2,5,9)))
 static NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t length, void* data,
                               PIRP Irp, bool file_write, uint64_t irp_offset, LIST_ENTRY* rollback) {
@@ -3312,13 +3486,15 @@ NTSTATUS truncate_file(fcb* fcb, uint64_t end, PIRP Irp, LIST_ENTRY* rollback) {
         return STATUS_SUCCESS;
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, sector_align(end, fcb->Vcb->superblock.sector_size),
-                            sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size), Irp, rollback);
+    // this includes anything we've preallocated past EOF
+    Status = excise_extents(fcb->Vcb, fcb, sector_align(end, fcb->Vcb->superblock.sector_size), get_extents_end(fcb), Irp, rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("excise_extents returned %08lx\n", Status);
         return Status;
     }
 
+    fcb->spec_prealloc = false;
+
     fcb->inode_item.st_size = end;
     fcb->inode_item_changed = true;
     TRACE("setting st_size to %I64x\n", end);
@@ -3574,6 +3750,8 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
     EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
     NTSTATUS Status;
     chunk* c = NULL;
+    void* csum = NULL;
+    calc_job* cj = NULL;
 
     if (start_data <= ext->offset && end_data >= ext->offset + ed2->num_bytes) { // replace all
         extent* newext;
@@ -3588,28 +3766,33 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
 
         newext->extent_data.type = EXTENT_TYPE_REGULAR;
 
-        Status = write_data_complete(fcb->Vcb, ed2->address + ed2->offset, (uint8_t*)data + ext->offset - start_data, (uint32_t)ed2->num_bytes, Irp,
-                                     NULL, file_write, irp_offset + ext->offset - start_data, priority);
-        if (!NT_SUCCESS(Status)) {
-            ERR("write_data_complete returned %08lx\n", Status);
-            return Status;
-        }
-
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)(ed2->num_bytes >> fcb->Vcb->sector_shift);
-            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
+            csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
             if (!csum) {
                 ERR("out of memory\n");
                 ExFreePool(newext);
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            do_calc_job(fcb->Vcb, (uint8_t*)data + ext->offset - start_data, sl, csum);
+            cj = start_csum_job(fcb->Vcb, (uint8_t*)data + ext->offset - start_data, sl, csum);
+        }
+
+        Status = write_data_complete(fcb->Vcb, ed2->address + ed2->offset, (uint8_t*)data + ext->offset - start_data, (uint32_t)ed2->num_bytes, Irp,
+                                     NULL, file_write, irp_offset + ext->offset - start_data, priority);
 
-            newext->csum = csum;
-        } else
-            newext->csum = NULL;
+        if (cj)
+            finish_calc_job(fcb->Vcb, cj);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_data_complete returned %08lx\n", Status);
+            if (csum) ExFreePool(csum);
+            ExFreePool(newext);
+            return Status;
+        }
+
+        newext->csum = csum;
 
         *written = ed2->num_bytes;
 
@@ -3652,19 +3835,10 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         ned2->offset += end_data - ext->offset;
         ned2->num_bytes -= end_data - ext->offset;
 
-        Status = write_data_complete(fcb->Vcb, ed2->address + ed2->offset, (uint8_t*)data + ext->offset - start_data, (uint32_t)(end_data - ext->offset),
-                                     Irp, NULL, file_write, irp_offset + ext->offset - start_data, priority);
-        if (!NT_SUCCESS(Status)) {
-            ERR("write_data_complete returned %08lx\n", Status);
-            ExFreePool(newext1);
-            ExFreePool(newext2);
-            return Status;
-        }
-
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)((end_data - ext->offset) >> fcb->Vcb->sector_shift);
-            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
+            csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
             if (!csum) {
                 ERR("out of memory\n");
                 ExFreePool(newext1);
@@ -3672,11 +3846,24 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            do_calc_job(fcb->Vcb, (uint8_t*)data + ext->offset - start_data, sl, csum);
+            cj = start_csum_job(fcb->Vcb, (uint8_t*)data + ext->offset - start_data, sl, csum);
+        }
+
+        Status = write_data_complete(fcb->Vcb, ed2->address + ed2->offset, (uint8_t*)data + ext->offset - start_data, (uint32_t)(end_data - ext->offset),
+                                     Irp, NULL, file_write, irp_offset + ext->offset - start_data, priority);
 
-            newext1->csum = csum;
-        } else
-            newext1->csum = NULL;
+        if (cj)
+            finish_calc_job(fcb->Vcb, cj);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_data_complete returned %08lx\n", Status);
+            if (csum) ExFreePool(csum);
+            ExFreePool(newext1);
+            ExFreePool(newext2);
+            return Status;
+        }
+
+        newext1->csum = csum;
 
         *written = end_data - ext->offset;
 
@@ -3743,18 +3930,10 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         ned2->offset += start_data - ext->offset;
         ned2->num_bytes = ext->offset + ed2->num_bytes - start_data;
 
-        Status = write_data_complete(fcb->Vcb, ed2->address + ned2->offset, data, (uint32_t)ned2->num_bytes, Irp, NULL, file_write, irp_offset, priority);
-        if (!NT_SUCCESS(Status)) {
-            ERR("write_data_complete returned %08lx\n", Status);
-            ExFreePool(newext1);
-            ExFreePool(newext2);
-            return Status;
-        }
-
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)(ned2->num_bytes >> fcb->Vcb->sector_shift);
-            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
+            csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
             if (!csum) {
                 ERR("out of memory\n");
                 ExFreePool(newext1);
@@ -3762,11 +3941,23 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            do_calc_job(fcb->Vcb, data, sl, csum);
+            cj = start_csum_job(fcb->Vcb, data, sl, csum);
+        }
 
-            newext2->csum = csum;
-        } else
-            newext2->csum = NULL;
+        Status = write_data_complete(fcb->Vcb, ed2->address + ned2->offset, data, (uint32_t)ned2->num_bytes, Irp, NULL, file_write, irp_offset, priority);
+
+        if (cj)
+            finish_calc_job(fcb->Vcb, cj);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_data_complete returned %08lx\n", Status);
+            if (csum) ExFreePool(csum);
+            ExFreePool(newext1);
+            ExFreePool(newext2);
+            return Status;
+        }
+
+        newext2->csum = csum;
 
         *written = ned2->num_bytes;
 
@@ -3845,20 +4036,10 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         ned2->offset += end_data - ext->offset;
         ned2->num_bytes -= end_data - ext->offset;
 
-        ned2 = (EXTENT_DATA2*)newext2->extent_data.data;
-        Status = write_data_complete(fcb->Vcb, ed2->address + ned2->offset, data, (uint32_t)(end_data - start_data), Irp, NULL, file_write, irp_offset, priority);
-        if (!NT_SUCCESS(Status)) {
-            ERR("write_data_complete returned %08lx\n", Status);
-            ExFreePool(newext1);
-            ExFreePool(newext2);
-            ExFreePool(newext3);
-            return Status;
-        }
-
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)((end_data - start_data) >> fcb->Vcb->sector_shift);
-            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
+            csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
             if (!csum) {
                 ERR("out of memory\n");
                 ExFreePool(newext1);
@@ -3867,11 +4048,25 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            do_calc_job(fcb->Vcb, data, sl, csum);
+            cj = start_csum_job(fcb->Vcb, data, sl, csum);
+        }
 
-            newext2->csum = csum;
-        } else
-            newext2->csum = NULL;
+        ned2 = (EXTENT_DATA2*)newext2->extent_data.data;
+        Status = write_data_complete(fcb->Vcb, ed2->address + ned2->offset, data, (uint32_t)(end_data - start_data), Irp, NULL, file_write, irp_offset, priority);
+
+        if (cj)
+            finish_calc_job(fcb->Vcb, cj);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_data_complete returned %08lx\n", Status);
+            if (csum) ExFreePool(csum);
+            ExFreePool(newext1);
+            ExFreePool(newext2);
+            ExFreePool(newext3);
+            return Status;
+        }
+
+        newext2->csum = csum;
 
         *written = end_data - start_data;
 
@@ -3939,6 +4134,16 @@ NTSTATUS do_write_file(fcb* fcb, uint64_t start, uint64_t end_data, void* data,
 #endif
     bool extents_changed = false;
 
+    // Drop any delayed data for this range first - the prealloc and nocow paths below
+    // overwrite extents in place, so we won't necessarily go through excise_extents.
+    if (!IsListEmpty(&fcb->delalloc)) {
+        Status = delalloc_drop(fcb, start, end_data);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delalloc_drop returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
     last_cow_start = 0;
 
     le = fcb->extents.Flink;
@@ -3993,11 +4198,34 @@ NTSTATUS do_write_file(fcb* fcb, uint64_t start, uint64_t end_data, void* data,
                     uint64_t write_len = min(len, length);
                     chunk* c;
 
+                    void* csum = NULL;
+                    calc_job* cj = NULL;
+
                     TRACE("doing non-COW write to %I64x\n", writeaddr);
 
+                    // This shouldn't ever get called - nocow files should always also be nosum.
+                    // ext->csum still describes what's on disk until the write succeeds, so we
+                    // checksum into a buffer of our own and only copy it over afterwards.
+                    if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+                        ULONG sl = (ULONG)(write_len >> fcb->Vcb->sector_shift);
+
+                        csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
+                        if (!csum) {
+                            ERR("out of memory\n");
+                            return STATUS_INSUFFICIENT_RESOURCES;
+                        }
+
+                        cj = start_csum_job(fcb->Vcb, (uint8_t*)data + written, sl, csum);
+                    }
+
                     Status = write_data_complete(fcb->Vcb, writeaddr, (uint8_t*)data + written, (uint32_t)write_len, Irp, NULL, file_write, irp_offset + written, priority);
+
+                    if (cj)
+                        finish_calc_job(fcb->Vcb, cj);
+
                     if (!NT_SUCCESS(Status)) {
                         ERR("write_data_complete returned %08lx\n", Status);
+                        if (csum) ExFreePool(csum);
                         return Status;
                     }
 
@@ -4005,10 +4233,10 @@ NTSTATUS do_write_file(fcb* fcb, uint64_t start, uint64_t end_data, void* data,
                     if (c)
                         c->changed = true;
 
-                    // This shouldn't ever get called - nocow files should always also be nosum.
-                    if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
-                        do_calc_job(fcb->Vcb, (uint8_t*)data + written, (uint32_t)(write_len >> fcb->Vcb->sector_shift),
-                                    (uint8_t*)ext->csum + (((start + written - ext->offset) * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift));
+                    if (csum) {
+                        RtlCopyMemory((uint8_t*)ext->csum + (((start + written - ext->offset) * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift),
+                                      csum, (ULONG)((write_len * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift));
+                        ExFreePool(csum);
 
                         ext->inserted = true;
                         extents_changed = true;
@@ -4105,7 +4333,7 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
     uint32_t bufhead;
     bool make_inline;
     INODE_ITEM* origii;
-    bool changed_length = false;
+    bool changed_length = false, appending = false;
     NTSTATUS Status;
     LARGE_INTEGER time;
     BTRFS_TIME now;
@@ -4219,6 +4447,7 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
 
             *length = (ULONG)(newlength - off64);
         } else {
+            appending = off64 <= newlength;
             newlength = off64 + *length;
             changed_length = true;
 
@@ -4249,6 +4478,9 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
                 ERR("extend_file returned %08lx\n", Status);
                 goto end;
             }
+
+            if (appending && !make_inline && !fcb->ads && !pagefile && !write_fcb_compressed(fcb))
+                speculative_prealloc(fcb, newlength, rollback);
         } else if (!fcb->ads)
             fcb->inode_item.st_size = newlength;
 
@@ -4360,14 +4592,19 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
         if (fileref)
             mark_fileref_dirty(fileref);
     } else {
-        bool compress = write_fcb_compressed(fcb), no_buf = false;
+        bool compress = write_fcb_compressed(fcb), no_buf = false, delalloc, buffered = false;
         uint8_t* data;
 
+        // Writeback from the cache manager gets held until the next commit, so that it can be
+        // allocated along with the writes next to it - see delalloc.c. Compressed data gets
+        // split into 128 KB extents at that point, so we don't need to align it here.
+        delalloc = paging_io && !pagefile && !make_inline && !fcb_is_inline(fcb) && !(fcb->inode_item.flags & BTRFS_INODE_NODATACOW);
+
         if (make_inline) {
             start_data = 0;
             end_data = sector_align(newlength, fcb->Vcb->superblock.sector_size);
             bufhead = sizeof(EXTENT_DATA) - 1;
-        } else if (compress) {
+        } else if (compress && !delalloc) {
             start_data = off64 & ~(uint64_t)(COMPRESSED_EXTENT_SIZE - 1);
             end_data = min(sector_align(off64 + *length, COMPRESSED_EXTENT_SIZE),
                            sector_align(newlength, fcb->Vcb->superblock.sector_size));
@@ -4384,7 +4621,7 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
         fcb->Header.ValidDataLength.QuadPart = newlength;
         TRACE("fcb %p FileSize = %I64x\n", fcb, fcb->Header.FileSize.QuadPart);
 
-        if (!make_inline && !compress && off64 == start_data && off64 + *length == end_data) {
+        if (!make_inline && (!compress || delalloc) && off64 == start_data && off64 + *length == end_data) {
             data = buf;
             no_buf = true;
         } else {
@@ -4419,7 +4656,23 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             RtlCopyMemory(data + bufhead + off64 - start_data, buf, *length);
         }
 
-        if (make_inline) {
+        if (delalloc) {
+            try {
+                Status = delalloc_write(fcb, start_data, end_data - start_data, data, &buffered, Irp, rollback);
+            } except (EXCEPTION_EXECUTE_HANDLER) {
+                Status = GetExceptionCode();
+            }
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("delalloc_write returned %08lx\n", Status);
+                if (!no_buf) ExFreePool(data);
+                goto end;
+            }
+        }
+
+        if (buffered)
+            TRACE("holding %I64x bytes at %I64x for delayed allocation\n", end_data - start_data, start_data);
+        else if (make_inline) {
             Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
             if (!NT_SUCCESS(Status)) {
                 ERR("error - excise_extents returned %08lx\n", Status);
@@ -4448,7 +4701,7 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
 
             if (!NT_SUCCESS(Status)) {
                 ERR("write_compressed returned %08lx\n", Status);
-                ExFreePool(data);
+                if (!no_buf) ExFreePool(data);
                 goto end;
             }
         } else {
@@ -4728,6 +4981,11 @@ NTSTATUS __stdcall drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
         goto end;
     }
 
+    // Don't let writers get too far ahead of the flush thread. Paging IO is left alone,
+    // as the commit may be what's waiting for it.
+    if (top_level && wait && !(Irp->Flags & IRP_PAGING_IO) && !(IrpSp->MinorFunction & IRP_MN_COMPLETE))
+        throttle_writer(Vcb);
+
     try {
         if (IrpSp->MinorFunction & IRP_MN_COMPLETE) {
             CcMdlWriteComplete(IrpSp->FileObject, &IrpSp->Parameters.Write.ByteOffset, Irp->MdlAddress);